@@ -0,0 +1,78 @@
+/*
+ * mini_msd.h - RAM disk mass storage media for workstation simulation
+ * included by msc_bot_scsi.c only
+ * LUN 0 - RAM disk, LUN 1 - small read-only volume
+ */
+
+#ifndef INC_MINI_MSD_H_
+#define INC_MINI_MSD_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define SECSIZE	512u
+#define SECCOUNT	256u	// 128 KiB
+#define ROMCOUNT	32u	// read-only volume, 16 KiB
+#define ROMSIG	0x524f4d00u	// "\0MOR" - ORed with block number in read-only volume blocks
+
+static uint8_t ramdisk[SECCOUNT][SECSIZE];
+uint32_t ramdisk_badblk = SECCOUNT;	// reading this block fails, set by the virtual host
+uint32_t ramdisk_writes;	// blocks written, checked by the virtual host
+uint32_t ramdisk_discards;	// blocks discarded by UNMAP
+
+static bool media_write(uint8_t lun, uint32_t blk, const uint8_t *buf)
+{
+	memcpy(ramdisk[blk], buf, SECSIZE);
+	++ramdisk_writes;
+	return 0;
+}
+
+static bool media_read(uint8_t lun, uint32_t blk, uint8_t *buf)
+{
+	if (blk == ramdisk_badblk)
+		return 1;
+	memcpy(buf, ramdisk[blk], SECSIZE);
+	return 0;
+}
+
+// discarded blocks read as zeros
+static bool media_discard(uint8_t lun, uint32_t blk, uint32_t nblocks)
+{
+	memset(ramdisk[blk], 0, nblocks * SECSIZE);
+	ramdisk_discards += nblocks;
+	return 0;
+}
+
+// fill each block with its number so that reads can be verified by the host
+static void media_init(uint8_t lun)
+{
+	for (uint32_t blk = 0; blk < SECCOUNT; blk++)
+		for (uint16_t i = 0; i < SECSIZE; i += 4)
+			memcpy(&ramdisk[blk][i], &blk, 4);
+}
+
+// read-only volume contents generated on the fly
+static bool rom_read(uint8_t lun, uint32_t blk, uint8_t *buf)
+{
+	uint32_t v = ROMSIG | blk;
+	for (uint16_t i = 0; i < SECSIZE; i += 4)
+		memcpy(&buf[i], &v, 4);
+	return 0;
+}
+
+static bool rom_write(uint8_t lun, uint32_t blk, const uint8_t *buf)
+{
+	return 1;
+}
+
+const struct msc_media_ msc_media[MSC_LUNS] = {
+	{.nblocks = SECCOUNT, .blksize = SECSIZE, .Init = media_init, .Read = media_read, .Write = media_write,
+		.Discard = media_discard},
+#if MSC_LUNS > 1
+	{.nblocks = ROMCOUNT, .blksize = SECSIZE, .readonly = 1, .product = "Read-only Volume",
+		.Read = rom_read, .Write = rom_write},
+#endif
+};
+
+#endif /* INC_MINI_MSD_H_ */
@@ -0,0 +1,165 @@
+/*
+ * USB device configuration for workstation simulation - all functions enabled
+ * gbm 11'2022
+ */
+
+#ifndef USB_DEV_CONFIG_H_
+#define USB_DEV_CONFIG_H_
+
+#define USBD_MSC 1
+#define USBD_CDC_CHANNELS	3
+#define USBD_PRINTER	1
+#define USBD_HID	1
+#define USBD_NCM	1	// CDC NCM network function, see cdc_ncm.c
+
+// synthesize PID from device config
+#define USBD_CFG_PID	((USBD_MSC << 3) | USBD_CDC_CHANNELS << 0 \
+	| (USBD_PRINTER) << 4 | (USBD_HID) << 2 | (USBD_NCM) << 5)
+
+// Vendor and product ID
+#define	USB_VID	0x6666
+#define USB_PID	(USBD_CFG_PID)
+
+// endpoint sizes
+#define USBD_CTRL_EP_SIZE	64u
+#define MSC_BOT_EP_SIZE	64u
+#define CDC_DATA_EP_SIZE	64u
+#define CDC_INT_EP_SIZE	10u	// serial state notification size is 10 bytes
+#define PRN_DATA_EP_SIZE	64u
+#define NCM_DATA_EP_SIZE	64u
+#define NCM_NOTIF_EP_SIZE	16u	// connection speed change notification is 16 bytes
+
+#if USBD_HID
+#ifdef HID_PWR
+#define HID_IN_EP_SIZE	8u	// 8 bytes for keyboard report (flags, reserved, 6 keys)
+#define HID_IN_REPORT_SIZE 	1u
+#else
+#define HID_IN_EP_SIZE	8u	// 8 bytes for keyboard report (flags, reserved, 6 keys)
+#define HID_IN_REPORT_SIZE 	8u
+#endif
+#define HID_OUT_REPORT_SIZE	8u
+
+#define HID_POLLING_INTERVAL	20u	// ms
+#define HID_DEFAULT_IDLE	(500u / 4)	// in 4 ms units
+
+#endif	// USBD_HID
+
+#define USE_COMMON_CDC_INT_IN_EP	// 3 channels with MSC, printer, HID and NCM in 10 endpoint pairs
+#define CDC_INT_POLLING_INTERVAL	10u	// ms
+#define CDC_RX_BUF_SIZE	4096u	// per channel Rx ring, bytes, power of 2
+#define CDC_TX_BUF_SIZE	4096u	// per channel Tx ring, bytes, power of 2
+#define VCOM_MUX_CHANNELS	2	// logical channels multiplexed over one CDC channel, see Tools/vcom_demux.c
+#define VCOM_MUX_CARRIER	2	// CDC channel carrying the mux, not available to the application
+#define VCOM_UART_BRIDGE	(1u << 1)	// channels bridged to UARTs, see vcom_uart.h; simulated in usbsim_host.c
+#define MSC_READ_AHEAD	3u	// MSC READ10 block buffers
+#define MSC_LUNS	2u	// RAM disk and read-only volume, see mini_msd.h
+
+// buffer for control Out data stages longer than USBD_CTRL_EP_SIZE, 0 - none
+#define USBD_CTRL_OUT_BUF_SIZE	256u
+
+// In transfer queue length per endpoint for USBdev_QueueData(), 0 - no queue
+#define USBD_XFER_QUEUE_LEN	4u
+
+// binary event trace, see usb_log.h
+#define USBLOG
+#define USBLOG_SIZE	1024u	// entries, power of 2
+
+// packet capture for pcap export, see usb_log.h
+#define USBCAP
+#define USBCAP_SIZE	65536u	// bytes, power of 2
+
+// endpoint pairs used by CDC channels - notification In and data In/Out pair per channel,
+// or a single notification In shared by all channels
+#ifdef USE_COMMON_CDC_INT_IN_EP
+#define CDC_NUM_EPPAIRS	(USBD_CDC_CHANNELS + 1)
+#define CDC_INT_EPIDX(ch)	0
+#define CDC_DATA_EPIDX(ch)	((ch) + 1)
+#else
+#define CDC_NUM_EPPAIRS	(2 * USBD_CDC_CHANNELS)
+#define CDC_INT_EPIDX(ch)	(2 * (ch))
+#define CDC_DATA_EPIDX(ch)	(2 * (ch) + 1)
+#endif
+
+// interface numbers - start at 0
+enum usbd_ifnum_ {
+#if USBD_MSC
+	IFNUM_MSC,
+#endif
+
+#if USBD_CDC_CHANNELS
+	IFNUM_CDC_FIRST,	// control and data interface of each channel, see IFNUM_CDC_CONTROL()
+	IFNUM_CDC_LAST = IFNUM_CDC_FIRST + 2 * USBD_CDC_CHANNELS - 1,
+#endif	// USBD_CDC_CHANNELS
+
+#if USBD_PRINTER
+	IFNUM_PRN,
+#endif
+#if USBD_HID
+	IFNUM_HID,
+#endif
+#if USBD_NCM
+	IFNUM_NCM_CONTROL,	// CDC NCM network function, see cdc_ncm.c
+	IFNUM_NCM_DATA,
+#endif
+	USBD_NUM_INTERFACES	// number of interfaces
+};
+
+// endpoint addresses - start at 0 for OUT eps, 0x80 for IN eps
+enum usbd_epaddr_ {
+// Out endpoints
+	CTRL_OUT_EP,	// Control OUT ep
+#if USBD_MSC
+	MSC_BOT_OUT_EP,
+#endif
+
+#if USBD_CDC_CHANNELS
+	CDC_FIRST_OUT_EP,	// Out of notification ep pair unused, see CDC_DATA_OUT_EP()
+	CDC_LAST_OUT_EP = CDC_FIRST_OUT_EP + CDC_NUM_EPPAIRS - 1,
+#endif	// USBD_CDC_CHANNELS
+
+#if USBD_PRINTER
+	PRN_DATA_OUT_EP,
+#endif
+#if USBD_HID	// && defined(HID_OUT_EP_SIZE)
+	HID_OUT_EP,
+#endif
+#if USBD_NCM
+	NCM_NOTIF_OUT_EP,	// Out of notification ep pair unused
+	NCM_DATA_OUT_EP,
+#endif
+	USBD_OUT_EPS,	// no. of Out endpoints
+	
+// In endpoints
+	CTRL_IN_EP = 0x80,	// Control IN ep
+#if USBD_MSC
+	MSC_BOT_IN_EP,
+#endif
+
+#if USBD_CDC_CHANNELS
+	CDC_FIRST_IN_EP,	// see CDC_INT_IN_EP(), CDC_DATA_IN_EP()
+	CDC_LAST_IN_EP = CDC_FIRST_IN_EP + CDC_NUM_EPPAIRS - 1,
+#endif	// USBD_CDC_CHANNELS
+#if USBD_PRINTER
+	PRN_DATA_IN_EP,
+#endif
+#if USBD_HID
+	HID_IN_EP,
+#endif
+#if USBD_NCM
+	NCM_NOTIF_IN_EP,
+	NCM_DATA_IN_EP,
+#endif
+	USBD_IN_EPS	// no. of In endpoints
+};
+
+// no of endpoint pairs used in the application
+#define USBD_NUM_EPPAIRS	((USBD_IN_EPS & 0xf) > USBD_OUT_EPS ? (USBD_IN_EPS & 0xf) : USBD_OUT_EPS) 
+
+// CDC channel ch interfaces and endpoints
+#define IFNUM_CDC_CONTROL(ch)	(IFNUM_CDC_FIRST + 2 * (ch))
+#define IFNUM_CDC_DATA(ch)	(IFNUM_CDC_CONTROL(ch) + 1)
+#define CDC_INT_IN_EP(ch)	(CDC_FIRST_IN_EP + CDC_INT_EPIDX(ch))
+#define CDC_DATA_IN_EP(ch)	(CDC_FIRST_IN_EP + CDC_DATA_EPIDX(ch))
+#define CDC_DATA_OUT_EP(ch)	(CDC_FIRST_OUT_EP + CDC_DATA_EPIDX(ch))
+
+#endif
@@ -0,0 +1,32 @@
+/*
+ * usbdev_binding.h
+ *
+ *  Created: 2024
+ *   Author:
+ */
+
+#ifndef INC_USBDEV_BINDING_H_
+#define INC_USBDEV_BINDING_H_
+
+// binding for workstation simulation - software interrupts of usbsim_mcu.h
+
+#define USB_IRQ_PRI	12
+
+#define VCOM_rx_IRQn	SIM_SW0_IRQn
+#define VCOM_rx_IRQHandler	SIM_SW0_IRQHandler
+
+#define VCOM_tx_IRQn	SIM_SW1_IRQn
+#define VCOM_tx_IRQHandler	SIM_SW1_IRQHandler
+
+#define PRN_rx_IRQn	SIM_SW6_IRQn
+#define PRN_rx_IRQHandler	SIM_SW6_IRQHandler
+
+// MSC READ10 read-ahead, optional - runs at USB interrupt level if not defined
+#define MSC_media_IRQn	SIM_SW2_IRQn
+#define MSC_media_IRQHandler	SIM_SW2_IRQHandler
+
+// UART model of CDC-UART bridge in usbsim_host.c
+#define UARTSIM_IRQn	SIM_SW7_IRQn
+#define UARTSIM_IRQHandler	SIM_SW7_IRQHandler
+
+#endif /* INC_USBDEV_BINDING_H_ */
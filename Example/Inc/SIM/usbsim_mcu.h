@@ -0,0 +1,66 @@
+/*
+ * lightweight USB device stack by gbm
+ * usbsim_mcu.h - MCU core definitions for running the stack on a workstation
+ * Copyright (c) 2024 gbm
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef INC_USBSIM_MCU_H_
+#define INC_USBSIM_MCU_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * NVIC emulation, implemented in usb_hw_sim.c
+ * Interrupt handlers run synchronously, in the context of the call which made them
+ * runnable (set pending, enable, unmask), with Cortex-M priority and preemption rules.
+ * The virtual host runs at thread level.
+ */
+typedef enum {
+	SIM_USB_IRQn,
+	SIM_SW0_IRQn, SIM_SW1_IRQn, SIM_SW2_IRQn, SIM_SW3_IRQn,
+	SIM_SW4_IRQn, SIM_SW5_IRQn, SIM_SW6_IRQn, SIM_SW7_IRQn,
+	SIM_NUM_IRQS
+} IRQn_Type;
+
+void NVIC_EnableIRQ(IRQn_Type irqn);
+void NVIC_DisableIRQ(IRQn_Type irqn);
+uint32_t NVIC_GetEnableIRQ(IRQn_Type irqn);
+void NVIC_SetPendingIRQ(IRQn_Type irqn);
+void NVIC_ClearPendingIRQ(IRQn_Type irqn);
+uint32_t NVIC_GetPendingIRQ(IRQn_Type irqn);
+void NVIC_SetPriority(IRQn_Type irqn, uint32_t priority);
+
+void __disable_irq(void);
+void __enable_irq(void);
+uint32_t __get_PRIMASK(void);
+void __set_PRIMASK(uint32_t primask);
+
+// handlers, weak by default
+void SIM_USB_IRQHandler(void);
+void SIM_SW0_IRQHandler(void);
+void SIM_SW1_IRQHandler(void);
+void SIM_SW2_IRQHandler(void);
+void SIM_SW3_IRQHandler(void);
+void SIM_SW4_IRQHandler(void);
+void SIM_SW5_IRQHandler(void);
+void SIM_SW6_IRQHandler(void);
+void SIM_SW7_IRQHandler(void);
+
+// USB peripheral
+struct usbsim_periph_;
+extern struct usbsim_periph_ usbsim_periph;
+
+#endif /* INC_USBSIM_MCU_H_ */
@@ -12,6 +12,7 @@
 #define USBD_CDC_CHANNELS	1
 #define USBD_PRINTER	0
 #define USBD_HID	1	// new, tested on U545 and F401
+#define USBD_NCM	0	// CDC NCM network function, see cdc_ncm.c
 
 #else	// simple CDC
 
@@ -19,12 +20,13 @@
 #define USBD_CDC_CHANNELS	1
 #define USBD_PRINTER	0
 #define USBD_HID	0	// new, tested on U545
+#define USBD_NCM	0
 
 #endif	// SIMPLE_CDC
 
 // synthesize PID from device config
 #define USBD_CFG_PID	((USBD_MSC) | USBD_CDC_CHANNELS << 1 \
-	| (USBD_PRINTER) << 3 | (USBD_HID) << 4 )
+	| (USBD_PRINTER) << 3 | (USBD_HID) << 4 | (USBD_NCM) << 5)
 
 // Vendor and product ID
 #define	USB_VID	0x25AE
@@ -36,6 +38,8 @@
 #define CDC_DATA_EP_SIZE	64u
 #define CDC_INT_EP_SIZE	10u	// serial state notification size is 10 bytes
 #define PRN_DATA_EP_SIZE	64u
+#define NCM_DATA_EP_SIZE	64u
+#define NCM_NOTIF_EP_SIZE	16u	// connection speed change notification is 16 bytes
 #define HID_IN_EP_SIZE	8u	// 8 bytes for keyboard report (flags, reserved, 6 keys)
 //#define HID_OUT_EP_SIZE	8u	// min. size
 
@@ -47,6 +51,21 @@
 
 //#define USE_COMMON_CDC_INT_IN_EP
 #define CDC_INT_POLLING_INTERVAL	10u	// ms
+//#define VCOM_MUX_CHANNELS	4	// logical channels multiplexed over one CDC channel, see Tools/vcom_demux.c
+//#define VCOM_MUX_CARRIER	0	// CDC channel carrying the mux, not available to the application
+//#define VCOM_UART_BRIDGE	(1u << 0)	// channels bridged to UARTs with DMA, see vcom_uart.h
+
+// endpoint pairs used by CDC channels - notification In and data In/Out pair per channel,
+// or a single notification In shared by all channels
+#ifdef USE_COMMON_CDC_INT_IN_EP
+#define CDC_NUM_EPPAIRS	(USBD_CDC_CHANNELS + 1)
+#define CDC_INT_EPIDX(ch)	0
+#define CDC_DATA_EPIDX(ch)	((ch) + 1)
+#else
+#define CDC_NUM_EPPAIRS	(2 * USBD_CDC_CHANNELS)
+#define CDC_INT_EPIDX(ch)	(2 * (ch))
+#define CDC_DATA_EPIDX(ch)	(2 * (ch) + 1)
+#endif
 
 // interface numbers - start at 0
 enum usbd_ifnum_ {
@@ -55,13 +74,8 @@ enum usbd_ifnum_ {
 #endif
 
 #if USBD_CDC_CHANNELS
-	IFNUM_CDC0_CONTROL, IFNUM_CDC0_DATA,
-#if USBD_CDC_CHANNELS > 1
-	IFNUM_CDC1_CONTROL, IFNUM_CDC1_DATA,
-#if USBD_CDC_CHANNELS > 2
-	IFNUM_CDC2_CONTROL, IFNUM_CDC2_DATA,
-#endif	// USBD_CDC_CHANNELS > 2
-#endif	// USBD_CDC_CHANNELS > 1
+	IFNUM_CDC_FIRST,	// control and data interface of each channel, see IFNUM_CDC_CONTROL()
+	IFNUM_CDC_LAST = IFNUM_CDC_FIRST + 2 * USBD_CDC_CHANNELS - 1,
 #endif	// USBD_CDC_CHANNELS
 
 #if USBD_PRINTER
@@ -69,6 +83,10 @@ enum usbd_ifnum_ {
 #endif
 #if USBD_HID
 	IFNUM_HID,
+#endif
+#if USBD_NCM
+	IFNUM_NCM_CONTROL,	// CDC NCM network function, see cdc_ncm.c
+	IFNUM_NCM_DATA,
 #endif
 	USBD_NUM_INTERFACES	// number of interfaces
 };
@@ -82,20 +100,8 @@ enum usbd_epaddr_ {
 #endif
 
 #if USBD_CDC_CHANNELS
-	EMPTY0_EP,
-	CDC0_DATA_OUT_EP,
-#if USBD_CDC_CHANNELS > 1
-#ifndef USE_COMMON_CDC_INT_IN_EP
-	EMPTY1_EP,
-#endif
-	CDC1_DATA_OUT_EP,
-#if USBD_CDC_CHANNELS > 2
-#ifndef USE_COMMON_CDC_INT_IN_EP
-	EMPTY2_EP,
-#endif
-	CDC2_DATA_OUT_EP,
-#endif	// USBD_CDC_CHANNELS > 2
-#endif	// USBD_CDC_CHANNELS > 1
+	CDC_FIRST_OUT_EP,	// Out of notification ep pair unused, see CDC_DATA_OUT_EP()
+	CDC_LAST_OUT_EP = CDC_FIRST_OUT_EP + CDC_NUM_EPPAIRS - 1,
 #endif	// USBD_CDC_CHANNELS
 
 #if USBD_PRINTER
@@ -103,6 +109,10 @@ enum usbd_epaddr_ {
 #endif
 #if USBD_HID
 	HID_OUT_EP,
+#endif
+#if USBD_NCM
+	NCM_NOTIF_OUT_EP,	// Out of notification ep pair unused
+	NCM_DATA_OUT_EP,
 #endif
 	USBD_OUT_EPS,	// no. of Out endpoints
 	
@@ -113,26 +123,18 @@ enum usbd_epaddr_ {
 #endif
 
 #if USBD_CDC_CHANNELS
-	CDC0_INT_IN_EP,
-	CDC0_DATA_IN_EP,
-#if USBD_CDC_CHANNELS > 1
-#ifndef USE_COMMON_CDC_INT_IN_EP
-	CDC1_INT_IN_EP,
-#endif
-	CDC1_DATA_IN_EP,
-#if USBD_CDC_CHANNELS > 2
-#ifndef USE_COMMON_CDC_INT_IN_EP
-	CDC2_INT_IN_EP,
-#endif
-	CDC2_DATA_IN_EP,
-#endif	// USBD_CDC_CHANNELS > 2
-#endif	// USBD_CDC_CHANNELS > 1
+	CDC_FIRST_IN_EP,	// see CDC_INT_IN_EP(), CDC_DATA_IN_EP()
+	CDC_LAST_IN_EP = CDC_FIRST_IN_EP + CDC_NUM_EPPAIRS - 1,
 #endif	// USBD_CDC_CHANNELS
 #if USBD_PRINTER
 	PRN_DATA_IN_EP,
 #endif
 #if USBD_HID
 	HID_IN_EP,
+#endif
+#if USBD_NCM
+	NCM_NOTIF_IN_EP,
+	NCM_DATA_IN_EP,
 #endif
 	USBD_IN_EPS	// no. of In endpoints
 };
@@ -140,9 +142,11 @@ enum usbd_epaddr_ {
 // no of endpoint pairs used in the application
 #define USBD_NUM_EPPAIRS	((USBD_IN_EPS & 0xf) > USBD_OUT_EPS ? (USBD_IN_EPS & 0xf) : USBD_OUT_EPS) 
 
-#ifdef USE_COMMON_CDC_INT_IN_EP
-#define	CDC1_INT_IN_EP CDC0_INT_IN_EP
-#define	CDC2_INT_IN_EP CDC0_INT_IN_EP
-#endif
+// CDC channel ch interfaces and endpoints
+#define IFNUM_CDC_CONTROL(ch)	(IFNUM_CDC_FIRST + 2 * (ch))
+#define IFNUM_CDC_DATA(ch)	(IFNUM_CDC_CONTROL(ch) + 1)
+#define CDC_INT_IN_EP(ch)	(CDC_FIRST_IN_EP + CDC_INT_EPIDX(ch))
+#define CDC_DATA_IN_EP(ch)	(CDC_FIRST_IN_EP + CDC_DATA_EPIDX(ch))
+#define CDC_DATA_OUT_EP(ch)	(CDC_FIRST_OUT_EP + CDC_DATA_EPIDX(ch))
 
 #endif
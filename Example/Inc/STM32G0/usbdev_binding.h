@@ -11,25 +11,14 @@
 // binding for G0B1
 
 #define USB_IRQ_PRI	2
-//#define VCOM_TX_IRQn	I2C1_ER_IRQn
-//#define VCOM_TX_IRQHandler	I2C1_ER_IRQHandler
-//#define VCOM_RX_IRQn	I2C1_EV_IRQn
-//#define VCOM_RX_IRQHandler	I2C1_EV_IRQHandler
 
 #if USBD_CDC_CHANNELS
-#define VCOM0_rx_IRQn	RCC_CRS_IRQn
-#define VCOM0_rx_IRQHandler	RCC_CRS_IRQHandler
+#define VCOM_rx_IRQn	RCC_CRS_IRQn
+#define VCOM_rx_IRQHandler	RCC_CRS_IRQHandler
 
-#define VCOM0_tx_IRQn	CEC_IRQn
-#define VCOM0_tx_IRQHandler	CEC_IRQHandler
+#define VCOM_tx_IRQn	CEC_IRQn
+#define VCOM_tx_IRQHandler	CEC_IRQHandler
 
-#if USBD_CDC_CHANNELS > 1
-#define VCOM1_rx_IRQn	TIM16_FDCAN_IT0_IRQn
-#define VCOM1_rx_IRQHandler	TIM16_FDCAN_IT0_IRQHandler
-
-#define VCOM1_tx_IRQn	TIM17_FDCAN_IT1_IRQn
-#define VCOM1_tx_IRQHandler	TIM17_FDCAN_IT1_IRQHandler
-#endif	// > 1
 #endif
 
 #if USBD_PRINTER
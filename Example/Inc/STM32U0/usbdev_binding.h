@@ -13,19 +13,12 @@
 #define USB_IRQ_PRI	2
 
 #if USBD_CDC_CHANNELS
-#define VCOM0_rx_IRQn	RCC_CRS_IRQn
-#define VCOM0_rx_IRQHandler	RCC_CRS_IRQHandler
+#define VCOM_rx_IRQn	RCC_CRS_IRQn
+#define VCOM_rx_IRQHandler	RCC_CRS_IRQHandler
 
-#define VCOM0_tx_IRQn	PVD_PVM_IRQn
-#define VCOM0_tx_IRQHandler	PVD_PVM_IRQHandler
+#define VCOM_tx_IRQn	PVD_PVM_IRQn
+#define VCOM_tx_IRQHandler	PVD_PVM_IRQHandler
 
-#if USBD_CDC_CHANNELS > 1
-#define VCOM1_rx_IRQn	RTC_TAMP_IRQn
-#define VCOM1_rx_IRQHandler	RTC_TAMP_IRQHandler
-
-#define VCOM1_tx_IRQn	RNG_CRYP_IRQn
-#define VCOM1_tx_IRQHandler	RNG_CRYP_IRQHandler
-#endif	// > 1
 #endif
 
 #if USBD_PRINTER
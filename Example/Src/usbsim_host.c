@@ -0,0 +1,1674 @@
+/**
+  ******************************************************************************
+  * @file           : usbsim_host.c
+  * @brief          : gbmUSBdevice workstation simulation - scripted virtual host
+  * gbm 2024
+  ******************************************************************************
+  *
+  * Runs the unmodified device stack against the simulated controller (usb_hw_sim.c).
+  * Time advances only in the host's frame loop: every frame starts with SOF (1 ms tick
+  * for the device) and carries a limited number of transactions, so runs are repeatable.
+  *
+  * Device interrupts run synchronously within host transactions, so device code spinning
+  * at thread or interrupt level waiting for the host would never return. The script drains
+  * In endpoints before sending more Out data which could be echoed, and it never lets the
+  * echo buffer fill up.
+  *
+  * Build and run from the repository root:
+  * gcc -std=gnu11 -O2 -DUSBD_SIM -IExample/Inc/SIM -IUSBdev/Inc USBdev/Src/usb*.c USBdev/Src/msc_bot_scsi.c USBdev/Src/cdc_ncm.c Example/Src/usbsim_host.c -o usbsim
+  * ./usbsim [-t trace_file] [-d device_capture_file] [-c host_capture_file]
+ * Capture files are converted to pcap by Tools/usbcap2pcap.c; host capture timestamps are in us.
+  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>	// getopt()
+#include "usb_hw.h"
+#include "usb_dev_config.h"
+#include "usb_std_def.h"
+#include "usb_dev.h"
+#include "usb_hw_if.h"
+#include "usb_class_cdc.h"
+#include "usb_class_prn.h"
+#include "usb_class_hid.h"
+#include "usb_class_msc_scsi.h"
+#include "usb_class_ncm.h"
+#include "usb_log.h"
+#include "usb_hw_sim.h"
+#include "usb_app.h"
+#include "usbdev_binding.h"
+#include "vcom_uart.h"
+
+#define VH_ADDR	5u	// address assigned to device
+#define VH_SLOTS	19u	// transactions per frame - FS bulk max. is 19 x 64 B
+#define VH_TOUT	500u	// transaction retry timeout in frames
+
+static uint32_t frame;	// frame counter
+static uint8_t slots;	// transactions left in the current frame
+static uint8_t devaddr;
+static uint8_t ep0size;
+static unsigned failures;
+
+static void check(bool ok, const char *what)
+{
+	printf("%s %s\n", ok ? "PASS" : "FAIL", what);
+	if (!ok)
+		++failures;
+}
+
+//========================================================================
+// device side hooks - override weak defaults in usb_app.c
+
+static bool echo_sink;	// consume CDC data without echoing
+static uint32_t sunk, prn_sunk;
+static bool button, led;
+
+static unsigned readable, writable;
+
+uint8_t vcom_process_rx(uint8_t ch)
+{
+	static uint8_t rx[CDC_RX_BUF_SIZE];
+	uint16_t n = vcom_try_read(ch, rx, sizeof(rx));
+	if (echo_sink)
+		sunk += n;
+	else
+		vcom_write(ch, (const char *)rx, n);
+	return 0;
+}
+
+void VCP_Readable(uint8_t ch)
+{
+	++readable;
+}
+
+void VCP_Writable(uint8_t ch)
+{
+	++writable;
+}
+
+uint8_t prn_process_input(uint8_t c)
+{
+	++prn_sunk;
+	return 0;
+}
+
+bool BtnGet(void)
+{
+	return button;
+}
+
+void LED_Set(bool on)
+{
+	led = on;
+}
+
+#if VCOM_UART_BRIDGE
+//========================================================================
+// UART of the first bridged CDC channel - line time advances with frames,
+// the peer's data is set by the test, data sent by the device is captured
+
+#define UARTSIM_CH	__builtin_ctz(VCOM_UART_BRIDGE)
+
+static struct {
+	uint8_t *rxbuf;
+	uint16_t rxsize, rxpos;	// circular Rx DMA
+	const uint8_t *txdata;
+	uint16_t txleft;	// Tx DMA
+	struct cdc_linecoding_ lc;
+	uint16_t ctl;
+	bool on, brk;
+	uint32_t acc;	// line time not used yet, in half bit times / 1000
+	const uint8_t *peertx;	// data to be sent by the peer
+	uint32_t peertxlen;
+	uint8_t peerrx[65536];	// data received by the peer
+	uint32_t peerrxlen;
+	bool rxevt, txdone;	// pending interrupt events
+	uint16_t err;
+} uartsim;
+
+static void uartsim_start(uint8_t ch, uint8_t *rxbuf, uint16_t rxsize)
+{
+	uartsim.rxbuf = rxbuf;
+	uartsim.rxsize = rxsize;
+	uartsim.rxpos = 0;
+	uartsim.txleft = 0;
+	uartsim.txdone = 0;
+	uartsim.on = rxbuf != 0;
+}
+
+static uint16_t uartsim_rxpos(uint8_t ch)
+{
+	return uartsim.rxpos;
+}
+
+static void uartsim_txstart(uint8_t ch, const uint8_t *data, uint16_t length)
+{
+	uartsim.txdata = data;
+	uartsim.txleft = length;
+}
+
+static void uartsim_setlinecoding(uint8_t ch, const struct cdc_linecoding_ *lc)
+{
+	uartsim.lc = *lc;
+}
+
+static void uartsim_setbreak(uint8_t ch, bool on)
+{
+	uartsim.brk = on;
+}
+
+static void uartsim_setcontrollines(uint8_t ch, uint16_t state)
+{
+	uartsim.ctl = state;
+}
+
+const struct vcom_uart_ vcom_uart_hw = {
+	.Start = uartsim_start,
+	.RxPos = uartsim_rxpos,
+	.TxStart = uartsim_txstart,
+	.SetLineCoding = uartsim_setlinecoding,
+	.SetBreak = uartsim_setbreak,
+	.SetControlLines = uartsim_setcontrollines
+};
+
+void UARTSIM_IRQHandler(void)
+{
+	if (uartsim.err)
+	{
+		uint16_t err = uartsim.err;
+		uartsim.err = 0;
+		vcom_uart_error(UARTSIM_CH, err);
+	}
+	if (uartsim.rxevt)
+	{
+		uartsim.rxevt = 0;
+		vcom_uart_rx_event(UARTSIM_CH);
+	}
+	if (uartsim.txdone)
+	{
+		uartsim.txdone = 0;
+		vcom_uart_tx_done(UARTSIM_CH);
+	}
+}
+
+// one frame of line time in both directions; character is start, data, parity and 1, 1.5 or 2 stop bits
+static void uartsim_frame(void)
+{
+	if (!uartsim.on)
+		return;
+	uint32_t hbits = 2u * (1 + uartsim.lc.bDataBits + (uartsim.lc.bParityType != 0)) + 2 + uartsim.lc.bCharFormat;
+	uartsim.acc += 2 * uartsim.lc.dwDTERate;
+	uint32_t n = uartsim.acc / (hbits * 1000u);
+	uartsim.acc -= n * hbits * 1000u;
+
+	uint32_t m = MIN(n, uartsim.txleft);
+	if (m && !uartsim.brk)	// line held low during break
+	{
+		uint32_t keep = MIN(m, sizeof(uartsim.peerrx) - uartsim.peerrxlen);
+		memcpy(uartsim.peerrx + uartsim.peerrxlen, uartsim.txdata, keep);
+		uartsim.peerrxlen += keep;
+		uartsim.txdata += m;
+		uartsim.txleft -= m;
+		if (uartsim.txleft == 0)
+			uartsim.txdone = 1;
+	}
+	m = MIN(n, uartsim.peertxlen);
+	for (uint32_t i = 0; i < m; i++)
+	{
+		uartsim.rxbuf[uartsim.rxpos] = *uartsim.peertx++;
+		uartsim.rxpos = (uartsim.rxpos + 1) & (uartsim.rxsize - 1);
+		if ((uartsim.rxpos & (uartsim.rxsize / 2 - 1)) == 0)
+			uartsim.rxevt = 1;	// half or full transfer
+	}
+	uartsim.peertxlen -= m;
+	if (m && m < n)
+		uartsim.rxevt = 1;	// line idle
+	if (uartsim.rxevt || uartsim.txdone || uartsim.err)
+		NVIC_SetPendingIRQ(UARTSIM_IRQn);
+}
+#else
+#define uartsim_frame()
+#endif
+
+//========================================================================
+// frames and transactions
+
+#ifdef USBLOG
+static FILE *tracef;
+
+// stream device event trace to file, as an application would send it to a host
+static void vh_trace(void)
+{
+	uint8_t buf[64 * sizeof(struct usblog_entry_)];
+	uint16_t n;
+	while (tracef && (n = USBlog_drain(buf, sizeof(buf))))
+		fwrite(buf, 1, n, tracef);
+}
+#else
+#define vh_trace()
+#endif
+
+#ifdef USBCAP
+static FILE *devcapf;
+
+// stream device packet capture to file
+static void vh_devcap(void)
+{
+	uint8_t buf[1024];
+	uint16_t n;
+	while (devcapf && (n = USBcap_drain(buf, sizeof(buf))))
+		fwrite(buf, 1, n, devcapf);
+}
+#else
+#define vh_devcap()
+#endif
+
+static void vh_frame(void)
+{
+	vh_trace();
+	vh_devcap();
+	++frame;
+	slots = VH_SLOTS;
+	uartsim_frame();
+	usbsim_sof();
+}
+
+static void vh_idle(uint16_t frames)
+{
+	while (frames--)
+		vh_frame();
+}
+
+static void vh_slot(void)
+{
+	if (slots == 0)
+		vh_frame();
+	--slots;
+}
+
+// Out packet, NAKed transaction retried until timeout
+static enum usbsim_hs_ vh_out(uint8_t epn, const uint8_t *data, uint16_t length)
+{
+	uint32_t tout = frame + VH_TOUT;
+	enum usbsim_hs_ hs;
+	do {
+		vh_slot();
+		hs = usbsim_out(devaddr, epn, data, length);
+	} while (hs == USBSIM_NAK && frame != tout);
+	return hs;
+}
+
+// In packet, NAKed transaction retried until timeout
+static enum usbsim_hs_ vh_in(uint8_t epn, uint8_t *data, uint16_t *length)
+{
+	uint32_t tout = frame + VH_TOUT;
+	enum usbsim_hs_ hs;
+	do {
+		vh_slot();
+		hs = usbsim_in(devaddr, epn, data, length);
+	} while (hs == USBSIM_NAK && frame != tout);
+	return hs;
+}
+
+// control transfer, return no. of data stage bytes or -1 on error
+static int vh_control(uint8_t rqtype, uint8_t rq, uint16_t value, uint16_t index, uint16_t length, uint8_t *data)
+{
+	const uint8_t setup[8] = {rqtype, rq, value, value >> 8, index, index >> 8, length, length >> 8};
+	uint8_t pkt[64];
+	uint16_t count = 0, n;
+
+	vh_slot();
+	if (usbsim_setup(devaddr, setup) != USBSIM_ACK)
+		return -1;
+	if (rqtype & 0x80)
+	{
+		while (count < length)
+		{
+			if (vh_in(0, pkt, &n) != USBSIM_ACK)
+				return -1;
+			memcpy(data + count, pkt, MIN(n, length - count));
+			count += MIN(n, length - count);
+			if (n < ep0size)
+				break;
+		}
+		return vh_out(0, 0, 0) == USBSIM_ACK ? count : -1;
+	}
+	while (count < length)
+	{
+		n = MIN(ep0size, length - count);
+		if (vh_out(0, data + count, n) != USBSIM_ACK)
+			return -1;
+		count += n;
+	}
+	return vh_in(0, pkt, &n) == USBSIM_ACK && n == 0 ? count : -1;
+}
+
+// bulk Out transfer with ZLP if length is a multiple of packet size
+static bool vh_bulk_out(uint8_t epn, uint16_t epsize, const uint8_t *data, uint32_t length, bool zlp)
+{
+	uint16_t n;
+	do {
+		n = length < epsize ? length : epsize;
+		if (vh_out(epn, data, n) != USBSIM_ACK)
+			return 0;
+		data += n;
+		length -= n;
+	} while (length);
+	return !zlp || n < epsize || vh_out(epn, data, 0) == USBSIM_ACK;
+}
+
+// bulk In transfer, ends with short packet or when length is reached, return no. of bytes or -1 on stall
+static int32_t vh_bulk_in(uint8_t epn, uint16_t epsize, uint8_t *data, uint32_t length)
+{
+	uint32_t count = 0;
+	uint16_t n;
+	uint8_t pkt[64];
+
+	while (count < length)
+	{
+		enum usbsim_hs_ hs = vh_in(epn, pkt, &n);
+		if (hs == USBSIM_STALL)
+			return -1;
+		if (hs != USBSIM_ACK)
+			break;
+		memcpy(data + count, pkt, MIN(n, length - count));
+		count += MIN(n, length - count);
+		if (n < epsize)
+			break;
+	}
+	return count;
+}
+
+// poll In endpoint once per frame, collect data until the endpoint stays quiet
+static uint32_t vh_collect(uint8_t epn, uint8_t *data, uint32_t size, uint16_t quiet)
+{
+	uint32_t count = 0;
+	uint8_t pkt[64];
+	uint16_t n;
+
+	for (uint16_t idle = 0; idle < quiet; )
+	{
+		vh_slot();
+		if (usbsim_in(devaddr, epn, pkt, &n) == USBSIM_ACK)
+		{
+			idle = 0;
+			memcpy(data + count, pkt, MIN(n, size - count));
+			count += MIN(n, size - count);
+		}
+		else
+		{
+			++idle;
+			vh_frame();
+		}
+	}
+	return count;
+}
+
+//========================================================================
+// enumeration
+
+struct vh_if_ {
+	uint8_t ifclass, subclass, protocol;
+	uint8_t alts;	// highest alternate setting
+	uint8_t epin, epout;
+	uint16_t insize, outsize;
+	uint8_t interval;
+};
+
+static struct vh_if_ ifs[16];
+static uint8_t nifs;
+
+static void parse_config(const uint8_t *d, uint16_t length)
+{
+	struct vh_if_ *cur = 0;
+
+	for (uint16_t i = 0; i + 1 < length && d[i]; i += d[i])
+	{
+		const uint8_t *desc = &d[i];
+		if (desc[1] == USB_DESCTYPE_INTERFACE)
+		{
+			// endpoints of alternate settings are recorded with the interface
+			cur = desc[2] < sizeof(ifs) / sizeof(ifs[0]) ? &ifs[desc[2]] : 0;
+			if (cur && desc[3] == 0)
+			{
+				*cur = (struct vh_if_){.ifclass = desc[5], .subclass = desc[6], .protocol = desc[7]};
+				if (desc[2] >= nifs)
+					nifs = desc[2] + 1;
+			}
+			else if (cur)
+				cur->alts = desc[3];
+		}
+		else if (desc[1] == USB_DESCTYPE_ENDPOINT && cur)
+		{
+			uint16_t size = desc[4] | desc[5] << 8;
+			if (desc[2] & 0x80)
+			{
+				cur->epin = desc[2] & 0xf;
+				cur->insize = size;
+				cur->interval = desc[6];
+			}
+			else
+			{
+				cur->epout = desc[2];
+				cur->outsize = size;
+			}
+		}
+	}
+}
+
+static void print_string(uint8_t idx, const char *what)
+{
+	uint8_t buf[255];
+	int len = idx ? vh_control(0x80, USB_STDRQ_GET_DESCRIPTOR, USB_DESCTYPE_STRING << 8 | idx, 0x409, sizeof(buf), buf) : -1;
+	printf("  %-13s", what);
+	for (int i = 2; i < len; i += 2)
+		putchar(buf[i]);
+	putchar('\n');
+}
+
+static bool vh_enumerate(void)
+{
+	uint8_t buf[512];
+
+	devaddr = 0;
+	ep0size = 64;	// until known, short packet ends data stage
+	usbsim_bus_reset();
+	vh_idle(10);
+	// Windows-style: ask for 64 bytes, take bMaxPacketSize0 from the short response
+	if (vh_control(0x80, USB_STDRQ_GET_DESCRIPTOR, USB_DESCTYPE_DEVICE << 8, 0, 64, buf) < 8)
+		return 0;
+	ep0size = buf[7];
+	usbsim_bus_reset();
+	vh_idle(10);
+	if (vh_control(0, USB_STDRQ_SET_ADDRESS, VH_ADDR, 0, 0, 0) < 0)
+		return 0;
+	devaddr = VH_ADDR;
+	vh_idle(2);
+	if (vh_control(0x80, USB_STDRQ_GET_DESCRIPTOR, USB_DESCTYPE_DEVICE << 8, 0, 18, buf) != 18)
+		return 0;
+	uint8_t istr[3] = {buf[14], buf[15], buf[16]};
+	printf("device %04x:%04x, ep0 %u B, frame %u\n", buf[8] | buf[9] << 8, buf[10] | buf[11] << 8, ep0size, (unsigned)frame);
+	if (vh_control(0x80, USB_STDRQ_GET_DESCRIPTOR, USB_DESCTYPE_CONFIGURATION << 8, 0, 9, buf) != 9)
+		return 0;
+	uint16_t total = buf[2] | buf[3] << 8;
+	if (total > sizeof(buf) || vh_control(0x80, USB_STDRQ_GET_DESCRIPTOR, USB_DESCTYPE_CONFIGURATION << 8, 0, total, buf) != total)
+		return 0;
+	uint8_t cfgval = buf[5];
+	parse_config(buf, total);
+	print_string(istr[0], "manufacturer");
+	print_string(istr[1], "product");
+	print_string(istr[2], "serial");
+	for (uint8_t i = 0; i < nifs; i++)
+		printf("  if %u: class %02x/%02x/%02x in %u/%u out %u/%u\n", i, ifs[i].ifclass, ifs[i].subclass, ifs[i].protocol,
+			ifs[i].epin, ifs[i].insize, ifs[i].epout, ifs[i].outsize);
+	return vh_control(0, USB_STDRQ_SET_CONFIGURATION, cfgval, 0, 0, 0) == 0;
+}
+
+static const struct vh_if_ *find_if(uint8_t ifclass, uint8_t *ifnum)
+{
+	for (uint8_t i = 0; i < nifs; i++)
+		if (ifs[i].ifclass == ifclass)
+		{
+			*ifnum = i;
+			return &ifs[i];
+		}
+	return 0;
+}
+
+// data interface of CDC ACM function - NCM data interface has the same class
+static bool acm_data_if(uint8_t i)
+{
+	return i && ifs[i].ifclass == CDC_DATA_INTERFACE_CLASS && ifs[i - 1].subclass == CDC_ABSTRACT_CONTROL_MODEL;
+}
+
+//========================================================================
+// function tests
+
+static void test_cdc(void)
+{
+	uint8_t ifnum;
+	const struct vh_if_ *data = find_if(CDC_DATA_INTERFACE_CLASS, &ifnum);
+	if (!data || (VCOM_MUX_CHANNELS && VCOM_MUX_CARRIER == 0) || VCOM_UART_BRIDGE & 1u)
+		return;
+	uint8_t comm = ifnum - 1;	// communication interface precedes data interface
+	static uint8_t buf[65536];
+
+	const uint8_t lc[7] = {0x00, 0xc2, 0x01, 0x00, 0, 0, 8};	// 115200 8N1
+	uint8_t lcr[7];
+	check(vh_control(0x21, CDCRQ_SET_LINE_CODING, 0, comm, sizeof(lc), (uint8_t *)lc) == sizeof(lc)
+		&& vh_control(0xa1, CDCRQ_GET_LINE_CODING, 0, comm, sizeof(lcr), lcr) == sizeof(lcr)
+		&& memcmp(lc, lcr, sizeof(lc)) == 0, "CDC line coding");
+
+	check(vh_control(0x21, CDCRQ_SET_CONTROL_LINE_STATE, CDC_CTL_DTR | CDC_CTL_RTS, comm, 0, 0) == 0, "CDC DTR/RTS");
+	uint32_t n = vh_collect(data->epin, buf, sizeof(buf) - 1, 100);
+	buf[n] = 0;
+	check(strstr((char *)buf, "ready") && buf[n - 1] == '>', "CDC signon");
+
+	// echo, one packet at a time
+	uint32_t errors = 0;
+	for (uint16_t len = 1; len <= CDC_DATA_EP_SIZE; len += 9)
+	{
+		uint8_t pkt[CDC_DATA_EP_SIZE];
+		for (uint16_t i = 0; i < len; i++)
+			pkt[i] = 'a' + (len + i) % 26;
+		if (vh_out(data->epout, pkt, len) != USBSIM_ACK
+			|| vh_collect(data->epin, buf, sizeof(buf), 10) != len
+			|| memcmp(pkt, buf, len))
+			++errors;
+	}
+	check(errors == 0, "CDC echo");
+
+	// In from Tx ring - whole packets sent at once, the rest after Tx timeout; a transfer ending
+	// with a full packet is terminated by ZLP; 3000 + 2000 wraps around the ring
+	static const uint16_t txlen[] = {CDC_TX_BUF_SIZE, 3000, 2000};
+	static uint8_t tx[CDC_TX_BUF_SIZE];
+	errors = 0;
+	for (uint8_t t = 0; t < sizeof(txlen) / sizeof(txlen[0]); t++)
+	{
+		for (uint16_t i = 0; i < txlen[t]; i++)
+			tx[i] = 'A' + (t + i) % 26;
+		uint32_t start = frame;
+		vcom_write(0, (const char *)tx, txlen[t]);
+		int32_t rn = vh_bulk_in(data->epin, data->insize, buf, sizeof(buf));
+		printf("  In %u B in %u ms\n", (unsigned)rn, (unsigned)(frame - start));
+		if (rn != txlen[t] || memcmp(buf, tx, txlen[t]))
+			++errors;
+	}
+	check(errors == 0, "CDC In from Tx ring");
+
+	// non-blocking write - accepts what fits; ring space is freed on transfer completion,
+	// then the writable callback fires
+	writable = 0;
+	uint16_t acc = vcom_try_write(0, tx, sizeof(tx));
+	uint16_t acc2 = vcom_try_write(0, tx, 100);
+	int32_t rn = vh_bulk_in(data->epin, data->insize, buf, sizeof(buf));	// up to ZLP
+	bool wr = writable == 1;
+	acc2 += vcom_try_write(0, tx, 100);
+	rn += vh_bulk_in(data->epin, data->insize, buf, sizeof(buf));
+	check(acc == sizeof(tx) && acc2 == 100 && wr && rn == sizeof(tx) + 100, "CDC non-blocking write");
+
+	// Tx policy - timed mode holds a partial packet up to its latency unless flushed,
+	// adaptive mode sends it at once when idle
+	uint8_t pkt[CDC_DATA_EP_SIZE];
+	uint16_t pn;
+	vcom_set_txmode(0, VCOM_TX_TIMED, 20);
+	vcom_write(0, "0123456789", 10);
+	uint32_t t0 = frame;
+	vh_idle(10);
+	vh_slot();
+	bool held = usbsim_in(devaddr, data->epin, pkt, &pn) == USBSIM_NAK;
+	bool bound = vh_bulk_in(data->epin, data->insize, buf, sizeof(buf)) == 10 && frame - t0 <= 21;
+	vcom_write(0, "0123456789", 10);
+	vcom_flush(0);
+	vh_slot();
+	bool flushed = usbsim_in(devaddr, data->epin, pkt, &pn) == USBSIM_ACK && pn == 10;
+	vcom_set_txmode(0, VCOM_TX_ADAPTIVE, 0);
+	vcom_write(0, "0123456789", 10);
+	vh_slot();
+	bool adaptive = usbsim_in(devaddr, data->epin, pkt, &pn) == USBSIM_ACK && pn == 10;
+	check(held && bound && flushed && adaptive, "CDC Tx policy");
+
+	// non-blocking read, readable callback on every packet
+	uint8_t rxb[8];
+	readable = 0;
+	NVIC_DisableIRQ(VCOM_rx_IRQn);
+	uint16_t rn0 = vcom_try_read(0, rxb, sizeof(rxb));
+	bool rok = vh_out(data->epout, (const uint8_t *)"abc", 3) == USBSIM_ACK && vh_out(data->epout, (const uint8_t *)"de", 2) == USBSIM_ACK;
+	uint16_t rn1 = vcom_try_read(0, rxb, sizeof(rxb));
+	NVIC_EnableIRQ(VCOM_rx_IRQn);
+	check(rok && rn0 == 0 && rn1 == 5 && memcmp(rxb, "abcde", 5) == 0 && readable == 2, "CDC non-blocking read");
+
+	// Out throughput, data consumed by device
+	echo_sink = 1;
+	memset(buf, 'x', sizeof(buf));
+	uint32_t start = frame;
+	bool ok = vh_bulk_out(data->epout, data->outsize, buf, 65535, 0);
+	vh_idle(2);
+	printf("  Out 65535 B in %u ms\n", (unsigned)(frame - start));
+	check(ok && sunk == 65535, "CDC Out throughput");
+
+	// Rx ring flow control - with the consumer stopped, the endpoint NAKs once the ring has no room for a packet
+	NVIC_DisableIRQ(VCOM_rx_IRQn);
+	uint16_t accepted = 0;
+	while (accepted <= CDC_RX_BUF_SIZE / CDC_DATA_EP_SIZE)
+	{
+		vh_slot();
+		if (usbsim_out(devaddr, data->epout, buf, CDC_DATA_EP_SIZE) != USBSIM_ACK)
+			break;
+		++accepted;
+	}
+	sunk = 0;
+	NVIC_EnableIRQ(VCOM_rx_IRQn);
+	ok = vh_out(data->epout, buf, CDC_DATA_EP_SIZE) == USBSIM_ACK;
+	vh_idle(2);
+	check(accepted == CDC_RX_BUF_SIZE / CDC_DATA_EP_SIZE && ok && sunk == CDC_RX_BUF_SIZE + CDC_DATA_EP_SIZE,
+		"CDC Rx ring flow control");
+	echo_sink = 0;
+}
+
+// all channels - signon on each, then data interleaved over the channels; all channels are
+// serviced by the shared VCOM interrupts
+static void test_cdc_channels(void)
+{
+	uint8_t ch = 0, dataif[16];
+	for (uint8_t i = 0; i < nifs; i++)
+		if (acm_data_if(i))
+			dataif[ch++] = i;
+	if (ch < 2)
+		return;
+
+	uint32_t errors = 0;
+	for (uint8_t c = 1; c < ch; c++)
+	{
+		char buf[64], signon[16];
+		const struct vh_if_ *data = &ifs[dataif[c]];
+		snprintf(signon, sizeof(signon), "VCOM%u ready", c);
+		vh_control(0x21, CDCRQ_SET_CONTROL_LINE_STATE, CDC_CTL_DTR | CDC_CTL_RTS, dataif[c] - 1, 0, 0);
+		if ((VCOM_MUX_CHANNELS && c == VCOM_MUX_CARRIER) || VCOM_UART_BRIDGE >> c & 1u)
+			continue;	// framed data, see test_cdc_mux(); UART, see test_cdc_uart()
+		uint32_t n = vh_collect(data->epin, (uint8_t *)buf, sizeof(buf) - 1, 100);
+		buf[n] = 0;
+		if (!strstr(buf, signon))
+			++errors;
+	}
+	check(errors == 0, "CDC signon on all channels");
+
+	uint8_t pkt[CDC_DATA_EP_SIZE], rx[CDC_DATA_EP_SIZE];
+	errors = 0;
+	for (uint8_t round = 0; round < 4; round++)
+	{
+		for (uint8_t c = 0; c < ch; c++)
+		{
+			if ((VCOM_MUX_CHANNELS && c == VCOM_MUX_CARRIER) || VCOM_UART_BRIDGE >> c & 1u)
+				continue;
+			memset(pkt, 'a' + c, sizeof(pkt));
+			if (vh_out(ifs[dataif[c]].epout, pkt, 10 + round + c) != USBSIM_ACK)
+				++errors;
+		}
+		for (uint8_t c = 0; c < ch; c++)
+		{
+			if ((VCOM_MUX_CHANNELS && c == VCOM_MUX_CARRIER) || VCOM_UART_BRIDGE >> c & 1u)
+				continue;
+			memset(pkt, 'a' + c, sizeof(pkt));
+			if (vh_collect(ifs[dataif[c]].epin, rx, sizeof(rx), 10) != 10u + round + c || memcmp(pkt, rx, 10 + round + c))
+				++errors;
+		}
+	}
+	check(errors == 0, "CDC echo on all channels");
+
+	// serial state notifications - one at a time on shared endpoint, changes coalesced per channel
+	static const uint16_t cs = CDC_SERIAL_STATE_TX_CARRIER | CDC_SERIAL_STATE_RX_CARRIER;
+	uint16_t expect[16][2] = {{cs | CDC_SERIAL_STATE_BREAK, cs | CDC_SERIAL_STATE_OVERRUN}};
+	uint8_t got[16] = {0}, want[16] = {2};
+	bool shared = ifs[dataif[1] - 1].epin == ifs[dataif[0] - 1].epin;
+	struct cdc_SerialStateNotif_ notif;
+	uint16_t pn;
+
+	vh_idle(20);	// carrier notifications sent meanwhile
+	for (uint8_t c = 0; c < ch; c++)
+		while (usbsim_in(devaddr, ifs[dataif[c] - 1].epin, (uint8_t *)&notif, &pn) == USBSIM_ACK)
+			;
+	vcom_set_serial_state(0, cs | CDC_SERIAL_STATE_BREAK);	// sent at once
+	vcom_set_serial_state(0, cs | CDC_SERIAL_STATE_OVERRUN);
+	for (uint8_t c = 1; c < ch; c++)
+	{
+		vcom_set_serial_state(c, cs | CDC_SERIAL_STATE_PARITY);
+		vcom_set_serial_state(c, cs | CDC_SERIAL_STATE_FRAMING);
+		// coalesced while channel 0 holds the shared endpoint, sent separately on own endpoint
+		want[c] = shared ? 1 : 2;
+		expect[c][0] = shared ? cs | CDC_SERIAL_STATE_PARITY | CDC_SERIAL_STATE_FRAMING : cs | CDC_SERIAL_STATE_PARITY;
+		expect[c][1] = cs | CDC_SERIAL_STATE_FRAMING;
+	}
+	errors = 0;
+	for (uint8_t t = 0; t < 20; t++)
+	{
+		vh_frame();
+		for (uint8_t c = 0; c < ch; c++)
+			while (usbsim_in(devaddr, ifs[dataif[c] - 1].epin, (uint8_t *)&notif, &pn) == USBSIM_ACK)
+			{
+				uint8_t n = 0;
+				while (n < ch && notif.wIndex != dataif[n] - 1u)
+					++n;
+				if (pn != sizeof(notif) || notif.bNotification != CDC_NOTIFICATION_SERIAL_STATE || n == ch
+					|| got[n] >= 2 || notif.wSerialState != expect[n][got[n]++])
+					++errors;
+			}
+	}
+	for (uint8_t c = 0; c < ch; c++)
+		if (got[c] != want[c])
+			++errors;
+	check(errors == 0, "CDC serial state notifications");
+}
+
+#if VCOM_MUX_CHANNELS
+// mux logical channels as seen by the host, see Tools/vcom_demux.c
+static struct {
+	uint8_t data[512];
+	uint16_t len;
+	uint16_t credit;	// granted by the device
+} vmux[VCOM_MUX_CHANNELS];
+static uint32_t vmux_errors;
+
+// read and parse frames from the carrier for some time
+static void vh_mux_collect(uint8_t epin, uint16_t frames)
+{
+	static uint8_t hdr[VCOM_MUX_HDR_SIZE], hcount, idx;
+	static uint16_t left;
+	uint8_t pkt[CDC_DATA_EP_SIZE];
+	uint16_t n;
+
+	for (uint32_t t = frame + frames; frame != t; )
+	{
+		vh_slot();
+		if (usbsim_in(devaddr, epin, pkt, &n) != USBSIM_ACK)
+			continue;
+		for (uint16_t i = 0; i < n; i++)
+		{
+			if (left)
+			{
+				--left;
+				if (idx < VCOM_MUX_CHANNELS && vmux[idx].len < sizeof(vmux[idx].data))
+					vmux[idx].data[vmux[idx].len++] = pkt[i];
+				else
+					++vmux_errors;
+				continue;
+			}
+			hdr[hcount++] = pkt[i];
+			if (hcount < VCOM_MUX_HDR_SIZE)
+				continue;
+			hcount = 0;
+			idx = hdr[0] & VCOM_MUX_CHMSK;
+			if (hdr[0] & VCOM_MUX_CREDIT)
+			{
+				if (idx < VCOM_MUX_CHANNELS)
+					vmux[idx].credit += hdr[1] | hdr[2] << 8;
+				else
+					++vmux_errors;
+			}
+			else
+				left = hdr[1] | hdr[2] << 8;
+		}
+	}
+}
+
+static void vh_mux_send(uint8_t epout, uint8_t hdr, uint16_t value, const void *data)
+{
+	uint8_t pkt[CDC_DATA_EP_SIZE];
+	uint16_t len = hdr & VCOM_MUX_CREDIT ? 0 : value;
+
+	pkt[0] = hdr;
+	pkt[1] = value & 0xff;
+	pkt[2] = value >> 8;
+	if (len)
+		memcpy(&pkt[VCOM_MUX_HDR_SIZE], data, len);
+	if (vh_out(epout, pkt, VCOM_MUX_HDR_SIZE + len) != USBSIM_ACK)
+		++vmux_errors;
+}
+
+static void test_cdc_mux(void)
+{
+	const struct vh_if_ *car = 0;
+	uint8_t c = 0, carif = 0;
+	for (uint8_t i = 0; i < nifs && !car; i++)
+		if (acm_data_if(i) && c++ == VCOM_MUX_CARRIER)
+			car = &ifs[carif = i];
+	if (!car)
+		return;
+
+	// device grants its Rx rings on connection, sends data after host credit
+	bool ok = 1;
+	vh_control(0x21, CDCRQ_SET_CONTROL_LINE_STATE, CDC_CTL_DTR | CDC_CTL_RTS, carif - 1, 0, 0);
+	vh_mux_collect(car->epin, 80);	// past connection start delay
+	for (c = 0; c < VCOM_MUX_CHANNELS; c++)
+		ok &= vmux[c].credit == CDC_RX_BUF_SIZE && vmux[c].len == 0;
+	check(ok && vmux_errors == 0, "mux initial credit");
+
+	for (c = 0; c < VCOM_MUX_CHANNELS; c++)
+		vh_mux_send(car->epout, VCOM_MUX_CREDIT | c, 32, 0);
+	vh_mux_collect(car->epin, 20);
+	ok = 1;
+	for (c = 0; c < VCOM_MUX_CHANNELS; c++)
+	{
+		char signon[16];
+		snprintf(signon, sizeof(signon), "VCOM%u ready", VCOM_MUX_CH(c));
+		vmux[c].data[vmux[c].len] = 0;
+		ok &= strstr((char *)vmux[c].data, signon) != 0;
+	}
+	check(ok && vmux_errors == 0, "mux signon");
+
+	// echo; data read by the device is credited back
+	uint8_t pkt[10];
+	uint16_t used = vmux[0].len + sizeof(pkt);
+	for (c = 0; c < VCOM_MUX_CHANNELS; c++)
+	{
+		vmux[c].len = vmux[c].credit = 0;
+		memset(pkt, 'a' + c, sizeof(pkt));
+		vh_mux_send(car->epout, c, sizeof(pkt), pkt);
+	}
+	vh_mux_collect(car->epin, 20);
+	ok = 1;
+	for (c = 0; c < VCOM_MUX_CHANNELS; c++)
+	{
+		memset(pkt, 'a' + c, sizeof(pkt));
+		ok &= vmux[c].len == sizeof(pkt) && memcmp(vmux[c].data, pkt, sizeof(pkt)) == 0 && vmux[c].credit == sizeof(pkt);
+	}
+	check(ok && vmux_errors == 0, "mux echo and credit return");
+
+	// device sends no more than host credit, the rest when more credit is granted
+	static uint8_t tx[100];
+	memset(tx, 'X', sizeof(tx));
+	vmux[0].len = 0;
+	ok = vcom_try_write(VCOM_MUX_CH(0), tx, sizeof(tx)) == sizeof(tx);
+	vh_mux_collect(car->epin, 20);
+	ok &= vmux[0].len == 32 - used;
+	vh_mux_send(car->epout, VCOM_MUX_CREDIT, sizeof(tx), 0);
+	vh_mux_collect(car->epin, 20);
+	check(ok && vmux[0].len == sizeof(tx) && memcmp(vmux[0].data, tx, sizeof(tx)) == 0 && vmux_errors == 0,
+		"mux credit flow control");
+}
+#endif
+
+#if VCOM_UART_BRIDGE
+// SERIAL_STATE notifications for an interface received within some frames, ORed
+static uint16_t vh_serial_state(uint8_t comm, uint16_t frames)
+{
+	struct cdc_SerialStateNotif_ notif;
+	uint16_t n, state = 0;
+
+	while (frames--)
+	{
+		vh_frame();
+		while (usbsim_in(devaddr, ifs[comm].epin, (uint8_t *)&notif, &n) == USBSIM_ACK)
+			if (n == sizeof(notif) && notif.wIndex == comm)
+				state |= notif.wSerialState;
+	}
+	return state;
+}
+
+static void test_cdc_uart(void)
+{
+	uint8_t c = 0, dif = 0;
+	for (uint8_t i = 0; i < nifs && !dif; i++)
+		if (acm_data_if(i) && c++ == UARTSIM_CH)
+			dif = i;
+	if (!dif)
+		return;
+	const struct vh_if_ *data = &ifs[dif];
+	uint8_t comm = dif - 1;
+
+	static const uint8_t lc8e2[7] = {0xc0, 0xc6, 0x2d, 0x00, 2, 2, 8};	// 3 Mbaud 8E2
+	check(vh_control(0x21, CDCRQ_SET_LINE_CODING, 0, comm, sizeof(lc8e2), (uint8_t *)lc8e2) == sizeof(lc8e2)
+		&& uartsim.lc.dwDTERate == 3000000 && uartsim.lc.bCharFormat == 2 && uartsim.lc.bParityType == 2
+		&& uartsim.lc.bDataBits == 8, "UART line coding");
+
+	bool ok = vh_control(0x21, CDCRQ_SEND_BREAK, 20, comm, 0, 0) == 0 && uartsim.brk;
+	vh_idle(15);
+	ok &= uartsim.brk;
+	vh_idle(10);
+	check(ok && !uartsim.brk, "UART break");
+
+	// full duplex at 3 Mbaud 8N1 - 300 characters per ms each way
+	enum {LEN = 60000};
+	static uint8_t a[LEN], b[LEN], rx[LEN];
+	static const uint8_t lc8n1[7] = {0xc0, 0xc6, 0x2d, 0x00, 0, 0, 8};
+	vh_control(0x21, CDCRQ_SET_LINE_CODING, 0, comm, sizeof(lc8n1), (uint8_t *)lc8n1);
+	vh_control(0x21, CDCRQ_SET_CONTROL_LINE_STATE, CDC_CTL_DTR | CDC_CTL_RTS, comm, 0, 0);
+	vh_serial_state(comm, 5);
+	for (uint32_t i = 0; i < LEN; i++)
+	{
+		a[i] = i * 7 + (i >> 8);
+		b[i] = i * 13 ^ (i >> 9);
+	}
+	uartsim.peertx = a;
+	uartsim.peertxlen = LEN;
+	uartsim.peerrxlen = 0;
+	uint32_t t0 = frame, out = 0, in = 0;
+	while ((out < LEN || in < LEN || uartsim.peerrxlen < LEN) && frame - t0 < 2 * LEN / 300)
+	{
+		uint8_t pkt[CDC_DATA_EP_SIZE];
+		uint16_t n = MIN(CDC_DATA_EP_SIZE, LEN - out);
+		vh_slot();
+		if (out < LEN && usbsim_out(devaddr, data->epout, b + out, n) == USBSIM_ACK)
+			out += n;
+		vh_slot();
+		if (usbsim_in(devaddr, data->epin, pkt, &n) == USBSIM_ACK)
+		{
+			memcpy(rx + in, pkt, MIN(n, LEN - in));
+			in += MIN(n, LEN - in);
+		}
+	}
+	check(in == LEN && memcmp(rx, a, LEN) == 0 && uartsim.peerrxlen == LEN && memcmp(uartsim.peerrx, b, LEN) == 0
+		&& frame - t0 <= LEN / 300 * 11 / 10 + 5 && (vh_serial_state(comm, 5) & CDC_SERIAL_STATE_OVERRUN) == 0,
+		"UART full duplex at line rate");
+	check(uartsim.ctl == (CDC_CTL_DTR | CDC_CTL_RTS), "UART control lines");
+
+	// receive errors reported with SERIAL_STATE notification
+	uartsim.err = CDC_SERIAL_STATE_FRAMING | CDC_SERIAL_STATE_PARITY;
+	NVIC_SetPendingIRQ(UARTSIM_IRQn);
+	check((vh_serial_state(comm, 5) & (CDC_SERIAL_STATE_FRAMING | CDC_SERIAL_STATE_PARITY))
+		== (CDC_SERIAL_STATE_FRAMING | CDC_SERIAL_STATE_PARITY), "UART errors reported");
+
+	// host not reading - Tx ring overwritten by UART Rx DMA
+	uartsim.peertx = a;
+	uartsim.peertxlen = 2 * CDC_TX_BUF_SIZE;
+	ok = vh_serial_state(comm, 2 * CDC_TX_BUF_SIZE / 300 + 5) & CDC_SERIAL_STATE_OVERRUN;
+	uint32_t n = vh_collect(data->epin, rx, LEN, 5);
+	check(ok && n >= CDC_TX_BUF_SIZE - CDC_DATA_EP_SIZE && n <= CDC_TX_BUF_SIZE + CDC_DATA_EP_SIZE, "UART Rx overrun reported");
+}
+#endif
+
+static void test_printer(void)
+{
+	uint8_t ifnum, buf[256];
+	const struct vh_if_ *prn = find_if(USB_CLASS_PRINTER, &ifnum);
+	if (!prn)
+		return;
+	// longer than single ep0 packet
+	int n = vh_control(0xa1, PRNRQ_GET_DEVICE_ID, 0, ifnum << 8, sizeof(buf), buf);
+	check(n > 64 && n == (buf[0] << 8 | buf[1]) && memcmp(buf + 2, "MFG:", 4) == 0, "printer device ID");
+	check(vh_control(0xa1, PRNRQ_GET_PORT_STATUS, 0, ifnum, 1, buf) == 1, "printer port status");
+	static uint8_t data[1000];
+	memset(data, '.', sizeof(data));
+	check(vh_bulk_out(prn->epout, prn->outsize, data, sizeof(data), 0) && (vh_idle(2), prn_sunk == sizeof(data)), "printer data");
+}
+
+static void test_hid(void)
+{
+	uint8_t ifnum, buf[8];
+	const struct vh_if_ *hid = find_if(USB_CLASS_HID, &ifnum);
+	if (!hid)
+		return;
+	uint8_t leds = HIDKB_MSK_SCROLLLOCK;
+	check(vh_control(0x21, HIDRQ_SET_REPORT, 2 << 8, ifnum, 1, &leds) == 1 && (vh_idle(1), led), "HID output report");
+
+	// poll interrupt In at its interval, expect report with keypad * while the button is pressed
+	button = 1;
+	bool pressed = 0;
+	for (uint16_t i = 0; i < 100 && !pressed; i++)
+	{
+		uint16_t n;
+		vh_idle(hid->interval);
+		vh_slot();
+		if (usbsim_in(devaddr, hid->epin, buf, &n) == USBSIM_ACK && n == sizeof(buf))
+			pressed = buf[2] == HIDKB_KPADSTAR;
+	}
+	button = 0;
+	check(pressed, "HID input report");
+}
+
+//========================================================================
+// mass storage Bulk-Only Transport
+
+static const struct vh_if_ *msc;
+static uint32_t bot_residue;	// from the last CSW
+static uint8_t vh_lun;	// LUN addressed by vh_bot()
+extern uint32_t ramdisk_badblk, ramdisk_writes, ramdisk_discards;	// mini_msd.h
+
+static void put32le(uint8_t *p, uint32_t v)
+{
+	p[0] = v, p[1] = v >> 8, p[2] = v >> 16, p[3] = v >> 24;
+}
+
+static uint32_t get32le(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// execute SCSI command, return CSW status or -1 on transport error
+static int vh_bot(const uint8_t *cdb, uint8_t cdblen, bool in, uint8_t *data, uint32_t length)
+{
+	static uint32_t tag;
+	uint8_t cbw[31] = {0}, csw[13];
+
+	put32le(cbw, CBW_SIG);
+	put32le(cbw + 4, ++tag);
+	put32le(cbw + 8, length);
+	cbw[12] = in ? 0x80 : 0;
+	cbw[13] = vh_lun;
+	cbw[14] = cdblen;
+	memcpy(cbw + 15, cdb, cdblen);
+	if (vh_out(msc->epout, cbw, sizeof(cbw)) != USBSIM_ACK)
+		return -1;
+	if (length)
+	{
+		bool stalled = in
+			? vh_bulk_in(msc->epin, msc->insize, data, length) < 0
+			: !vh_bulk_out(msc->epout, msc->outsize, data, length, 0);
+		if (stalled)
+			vh_control(0x02, USB_STDRQ_CLEAR_FEATURE, USB_FEATSEL_ENDPOINT_HALT, in ? msc->epin | 0x80 : msc->epout, 0, 0);
+	}
+	int32_t n = vh_bulk_in(msc->epin, msc->insize, csw, sizeof(csw));
+	if (n < 0)
+	{
+		// In stalled on failed command, retry once after clearing the halt as hosts do
+		vh_control(0x02, USB_STDRQ_CLEAR_FEATURE, USB_FEATSEL_ENDPOINT_HALT, msc->epin | 0x80, 0, 0);
+		n = vh_bulk_in(msc->epin, msc->insize, csw, sizeof(csw));
+	}
+	if (n != sizeof(csw) || get32le(csw) != CSW_SIG || get32le(csw + 4) != tag)
+		return -1;
+	bot_residue = get32le(csw + 8);
+	return csw[12];
+}
+
+static int scsi_rw(uint8_t op, uint32_t lba, uint16_t nblk, uint8_t *data, uint32_t blksize)
+{
+	const uint8_t cdb[10] = {op, 0, lba >> 24, lba >> 16, lba >> 8, lba, 0, nblk >> 8, nblk};
+	return vh_bot(cdb, sizeof(cdb), op == SCSI_READ10, data, nblk * blksize);
+}
+
+static void test_msc(void)
+{
+	uint8_t ifnum, buf[512];
+	static uint8_t data[16384];
+	if (!(msc = find_if(USB_CLASS_STORAGE, &ifnum)))
+		return;
+
+	const uint8_t tur[6] = {SCSI_TEST_UNIT_READY};
+	check(vh_bot(tur, sizeof(tur), 0, 0, 0) == 0, "MSC test unit ready");
+	const uint8_t inq[6] = {SCSI_INQUIRY, 0, 0, 0, 36};
+	check(vh_bot(inq, sizeof(inq), 1, buf, 36) == 0 && (buf[0] & 0x1f) == 0, "MSC inquiry");
+	printf("  %.8s %.16s\n", buf + 8, buf + 16);
+
+	const uint8_t rcap[10] = {SCSI_READ_CAPACITY10};
+	bool ok = vh_bot(rcap, sizeof(rcap), 1, buf, 8) == 0;
+	uint32_t nblocks = (buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3]) + 1;
+	uint32_t blksize = buf[4] << 24 | buf[5] << 16 | buf[6] << 8 | buf[7];
+	printf("  %u blocks of %u B\n", (unsigned)nblocks, (unsigned)blksize);
+	check(ok && blksize == 512, "MSC read capacity");
+
+	// read whole medium, blocks are initialized with their numbers
+	uint32_t errors = 0, start = frame;
+	uint16_t nblk = sizeof(data) / blksize;
+	for (uint32_t lba = 0; lba + nblk <= nblocks; lba += nblk)
+	{
+		if (scsi_rw(SCSI_READ10, lba, nblk, data, blksize) != 0 || bot_residue)
+			++errors;
+		for (uint32_t i = 0; i < nblk * blksize; i += 4)
+			errors += get32le(data + i) != lba + i / blksize;
+	}
+	printf("  In %u B in %u ms\n", (unsigned)(nblocks * blksize), (unsigned)(frame - start));
+	check(errors == 0, "MSC read");
+
+	// transfers shorter and longer than the read-ahead ring
+	for (uint16_t n = 1; n <= MSC_READ_AHEAD + 1; n++)
+	{
+		errors += scsi_rw(SCSI_READ10, nblocks - n, n, data, blksize) != 0 || bot_residue;
+		for (uint32_t i = 0; i < n * blksize; i += 4)
+			errors += get32le(data + i) != nblocks - n + i / blksize;
+	}
+	check(errors == 0, "MSC read-ahead");
+
+	// media error - blocks before the bad one are sent, then In is stalled and the CSW reports failure
+	const uint8_t rs[6] = {SCSI_REQUEST_SENSE, 0, 0, 0, 18};
+	ramdisk_badblk = 5;
+	ok = scsi_rw(SCSI_READ10, 0, 8, data, blksize) == 1 && bot_residue == 3 * blksize
+		&& vh_bot(rs, sizeof(rs), 1, buf, 18) == 0 && (buf[2] & 0xf) == SKEY_MEDIUM_ERROR && buf[12] == ASC_UNRECOVERED_READ_ERROR;
+	ramdisk_badblk = nblocks;
+	check(ok && scsi_rw(SCSI_READ10, 0, 8, data, blksize) == 0 && get32le(data + 5 * blksize) == 5, "MSC media read error");
+
+	for (uint32_t i = 0; i < nblk * blksize; i++)
+		data[i] = i * 7 + 3;
+	start = frame;
+	uint32_t wr = ramdisk_writes;
+	ok = scsi_rw(SCSI_WRITE10, 8, nblk, data, blksize) == 0;
+	printf("  Out %u B in %u ms\n", (unsigned)(nblk * blksize), (unsigned)(frame - start));
+	memset(data, 0, sizeof(data));
+	ok = ok && scsi_rw(SCSI_READ10, 8, nblk, data, blksize) == 0;
+	for (uint32_t i = 0; i < nblk * blksize; i++)
+		ok = ok && data[i] == (uint8_t)(i * 7 + 3);
+	const uint8_t sync[10] = {SCSI_SYNCHRONIZE_CACHE10};
+	ok = ok && vh_bot(sync, sizeof(sync), 0, 0, 0) == 0 && ramdisk_writes - wr == nblk;
+	check(ok, "MSC write and read back");
+
+	// write-back cache - rewrites of a block reach the medium once, reads see cached data
+	const uint8_t ms6[6] = {SCSI_MODE_SENSE6, 0, MODE_PAGE_CACHING, 0, 255};
+	const uint8_t ms10[10] = {SCSI_MODE_SENSE10, 0, MODE_PAGE_ALL, 0, 0, 0, 0, 0, 255};
+	const uint8_t msbad[6] = {SCSI_MODE_SENSE6, 0, 0x1c, 0, 255};
+	check(vh_bot(ms6, sizeof(ms6), 1, buf, 24) == 0 && buf[0] == 23 && buf[3] == 0
+		&& buf[4] == MODE_PAGE_CACHING && buf[6] & MODE_CACHING_WCE
+		&& vh_bot(ms10, sizeof(ms10), 1, buf, 28) == 0 && buf[1] == 26 && buf[8] == MODE_PAGE_CACHING
+		&& vh_bot(msbad, sizeof(msbad), 1, buf, 24) == 1, "MSC caching mode page");
+
+	const bool defer = MSC_WRITE_CACHE >= MSC_ERASE_BLOCKS + 5;	// room for the test blocks without flushing
+	uint32_t w0 = ramdisk_writes;
+	ok = 1;
+	for (uint8_t k = 0; k < 6; k++)
+	{
+		memset(data, k, 4 * blksize);
+		ok = ok && scsi_rw(SCSI_WRITE10, 48, 4, data, blksize) == 0 && bot_residue == 0;
+	}
+	memset(data, 0xff, 4 * blksize);
+	ok = ok && (!defer || ramdisk_writes == w0) && scsi_rw(SCSI_READ10, 47, 4, data, blksize) == 0
+		&& get32le(data) == 47 && data[blksize] == 5 && data[4 * blksize - 1] == 5;
+	ok = ok && vh_bot(sync, sizeof(sync), 0, 0, 0) == 0 && (defer ? ramdisk_writes == w0 + 4 : ramdisk_writes >= w0 + 4);
+	check(ok, "MSC write-back cache and SYNCHRONIZE CACHE");
+
+	w0 = ramdisk_writes;
+	ok = scsi_rw(SCSI_WRITE10, 60, 1, data, blksize) == 0 && (!defer || ramdisk_writes == w0);
+	vh_idle(MSC_FLUSH_DELAY + 2);
+	check(ok && ramdisk_writes == w0 + 1, "MSC cache flush when idle");
+
+	// out of range read must fail with sense data set
+	check(scsi_rw(SCSI_READ10, nblocks, 1, data, blksize) == 1
+		&& vh_bot(rs, sizeof(rs), 1, buf, 18) == 0 && (buf[2] & 0xf) == 5, "MSC invalid read");
+
+	// provisioning information needed by the host to send UNMAP
+	const uint8_t vpd00[6] = {SCSI_INQUIRY, 1, VPD_SUPPORTED_PAGES, 0, 255};
+	const uint8_t vpdb0[6] = {SCSI_INQUIRY, 1, VPD_BLOCK_LIMITS, 0, 64};
+	const uint8_t vpdb2[6] = {SCSI_INQUIRY, 1, VPD_LB_PROVISIONING, 0, 255};
+	const uint8_t vpdbad[6] = {SCSI_INQUIRY, 1, 0x83, 0, 255};
+	const uint8_t rc16[16] = {SCSI_READ_CAPACITY16, SAI_READ_CAPACITY16, [13] = 32};
+	ok = vh_bot(vpd00, sizeof(vpd00), 1, buf, 255) == 0 && bot_residue == 255 - 7 && buf[1] == VPD_SUPPORTED_PAGES
+		&& buf[3] == 3 && buf[5] == VPD_BLOCK_LIMITS && buf[6] == VPD_LB_PROVISIONING;
+	ok = ok && vh_bot(vpdb0, sizeof(vpdb0), 1, buf, 64) == 0 && bot_residue == 0 && buf[1] == VPD_BLOCK_LIMITS
+		&& buf[3] == 0x3c && get32le(buf + 20) == UINT32_MAX && buf[27] == MSC_UNMAP_DESCRIPTORS && buf[31] == MSC_ERASE_BLOCKS;
+	ok = ok && vh_bot(vpdb2, sizeof(vpdb2), 1, buf, 255) == 0 && buf[1] == VPD_LB_PROVISIONING
+		&& buf[5] & VPD_LBPU && (buf[6] & 7) == VPD_PROV_THIN;
+	ok = ok && vh_bot(rc16, sizeof(rc16), 1, buf, 32) == 0 && get32le(buf) == 0 && buf[7] == nblocks - 1
+		&& (uint32_t)buf[10] << 8 == blksize && buf[14] & RC16_LBPME;
+	check(ok && vh_bot(vpdbad, sizeof(vpdbad), 1, buf, 255) == 1
+		&& vh_bot(rs, sizeof(rs), 1, buf, 18) == 0 && buf[12] == ASC_INVALID_FIELD_IN_CDB, "MSC VPD pages and READ CAPACITY(16)");
+
+	// UNMAP - cached writes of unmapped blocks are dropped, discarded blocks read as zeros (mini_msd.h)
+	const uint8_t nd = MSC_UNMAP_DESCRIPTORS < 2 ? 1 : 2;	// blocks 100..103, 120
+	uint8_t ul[8 + 16 * 2] = {0, 6 + 16 * nd, 0, 16 * nd, [8 + 4] = 0, 0, 0, 100, [8 + 8 + 3] = 4, [24 + 4 + 3] = 120, [24 + 8 + 3] = 1};
+	const uint8_t unmap[10] = {SCSI_UNMAP, [8] = 8 + 16 * nd};
+	memset(data, 0x5a, blksize);
+	w0 = ramdisk_writes;
+	uint32_t d0 = ramdisk_discards;
+	ok = scsi_rw(SCSI_WRITE10, 101, 1, data, blksize) == 0 && vh_bot(unmap, sizeof(unmap), 0, ul, unmap[8]) == 0
+		&& ramdisk_discards == d0 + 3 + nd;
+	ok = ok && scsi_rw(SCSI_READ10, 99, 3, data, blksize) == 0 && get32le(data) == 99
+		&& get32le(data + blksize) == 0 && get32le(data + 3 * blksize - 4) == 0
+		&& scsi_rw(SCSI_READ10, 120, 1, data, blksize) == 0 && get32le(data + 100) == (nd < 2 ? 120 : 0);
+	ok = ok && vh_bot(sync, sizeof(sync), 0, 0, 0) == 0 && (!defer || ramdisk_writes == w0);
+	check(ok, "MSC UNMAP");
+
+	ul[8 + 7] = nblocks - 2;	// 4 blocks from the end
+	ok = vh_bot(unmap, sizeof(unmap), 0, ul, unmap[8]) == 1 && ramdisk_discards == d0 + 3 + nd
+		&& vh_bot(rs, sizeof(rs), 1, buf, 18) == 0 && (buf[2] & 0xf) == SKEY_ILLEGAL_REQUEST && buf[12] == ASC_LBA_OUT_OF_RANGE;
+	check(ok, "MSC UNMAP out of range");
+
+	uint8_t maxlun = 0xff;
+	check(vh_control(0xa1, BOTRQ_GET_MAX_LUN, 0, ifnum, 1, &maxlun) == 1 && maxlun == MSC_LUNS - 1, "MSC get max LUN");
+#if MSC_LUNS > 1
+	// LUN 1 - read-only volume, blocks filled with ROMSIG | block number (mini_msd.h)
+	const uint32_t romsig = 0x524f4d00u;
+	vh_lun = 1;
+	ok = vh_bot(inq, sizeof(inq), 1, buf, 36) == 0 && memcmp(buf + 16, "Read-only Volume", 16) == 0
+		&& vh_bot(rcap, sizeof(rcap), 1, buf, 8) == 0 && get32le(buf) == 0x1f000000 && get32le(buf + 4) == 0x20000;
+	ok = ok && scsi_rw(SCSI_READ10, 0, 32, data, blksize) == 0 && bot_residue == 0;
+	for (uint32_t i = 0; i < 32 * blksize; i += 4)
+		ok = ok && get32le(data + i) == (romsig | i / blksize);
+	check(ok, "MSC second LUN capacity and read");
+
+	w0 = ramdisk_writes;
+	ok = vh_bot(ms6, sizeof(ms6), 1, buf, 24) == 0 && buf[2] & MODE_DEVPARM_WP
+		&& scsi_rw(SCSI_WRITE10, 3, 1, data, blksize) == 1 && vh_bot(rs, sizeof(rs), 1, buf, 18) == 0
+		&& (buf[2] & 0xf) == SKEY_DATA_PROTECT && buf[12] == ASC_WRITE_PROTECTED;
+	vh_lun = 0;
+	ok = ok && vh_bot(ms6, sizeof(ms6), 1, buf, 24) == 0 && buf[2] == 0
+		&& vh_bot(rs, sizeof(rs), 1, buf, 18) == 0 && (buf[2] & 0xf) == SKEY_NO_SENSE;
+	vh_lun = 1;
+	ok = ok && vh_bot(rc16, sizeof(rc16), 1, buf, 32) == 0 && !(buf[14] & RC16_LBPME)
+		&& vh_bot(unmap, sizeof(unmap), 0, ul, unmap[8]) == 1;
+	vh_lun = 0;
+	vh_idle(MSC_FLUSH_DELAY + 2);
+	check(ok && ramdisk_writes == w0, "MSC write-protected LUN");
+
+	// cached block of LUN 0 must not be seen on LUN 1
+	memset(data, 0xa5, blksize);
+	ok = scsi_rw(SCSI_WRITE10, 3, 1, data, blksize) == 0;
+	vh_lun = 1;
+	ok = ok && scsi_rw(SCSI_READ10, 3, 1, data, blksize) == 0 && get32le(data) == (romsig | 3);
+	vh_lun = 0;
+	ok = ok && scsi_rw(SCSI_READ10, 3, 1, data, blksize) == 0 && get32le(data) == 0xa5a5a5a5
+		&& vh_bot(sync, sizeof(sync), 0, 0, 0) == 0;
+	check(ok, "MSC cache per LUN");
+#endif
+	vh_lun = MSC_LUNS;
+	ok = vh_bot(tur, sizeof(tur), 0, 0, 0) == 1;
+	vh_lun = 0;
+	check(ok && vh_bot(tur, sizeof(tur), 0, 0, 0) == 0, "MSC nonexistent LUN");
+}
+
+#if USBD_NCM
+//========================================================================
+// CDC NCM - the device side network stack echoes frames with MAC addresses swapped
+
+static const uint8_t vh_mac[6] = {0x02, 0x00, 0x47, 0x42, 0x4d, 0x01};	// NCM_MAC_STRING
+static const uint8_t dev_mac[6] = {0x02, 0x00, 0x47, 0x42, 0x4d, 0x02};
+static bool ncm_echo;
+static unsigned ncm_writables;
+
+static void ncm_echo_frames(void)
+{
+	const uint8_t *rx;
+	uint8_t *tx;
+	uint16_t len;
+
+	while (ncm_echo && (rx = ncm_recv(&len)) && (tx = ncm_frame_alloc()))
+	{
+		memcpy(tx, rx + 6, 6);
+		memcpy(tx + 6, rx, 6);
+		memcpy(tx + 12, rx + 12, len - 12);
+		ncm_recv_done();
+		ncm_send(tx, len);
+	}
+}
+
+void ncm_readable(void)
+{
+	ncm_echo_frames();
+}
+
+void ncm_writable(void)
+{
+	++ncm_writables;
+	ncm_echo_frames();
+}
+
+// Ethernet frame with local experimental EtherType and payload depending on tag
+static void vh_eth_fill(uint8_t *f, uint16_t len, uint16_t tag, bool to_host)
+{
+	memcpy(f, to_host ? vh_mac : dev_mac, 6);
+	memcpy(f + 6, to_host ? dev_mac : vh_mac, 6);
+	f[12] = 0x88;
+	f[13] = 0xb5;
+	for (uint16_t i = 14; i < len; i++)
+		f[i] = tag + i;
+}
+
+static bool vh_eth_check(const uint8_t *f, uint16_t len, uint16_t tag, bool to_host)
+{
+	uint8_t ref[NCM_MAX_FRAME];
+	vh_eth_fill(ref, len, tag, to_host);
+	return memcmp(f, ref, len) == 0;
+}
+
+// build Out NTB16 with one NDP16 following the header, return block length
+static uint16_t vh_ntb_build(uint8_t *ntb, uint16_t seq, const uint16_t *lens, uint8_t n, uint16_t tag)
+{
+	struct ncm_nth16_ nth = {NCM_NTH16_SIGNATURE, sizeof(nth), seq, 0, sizeof(nth)};
+	struct ncm_ndp16_ ndp = {NCM_NDP16_NOCRC_SIGNATURE, sizeof(ndp) + 4u * (n + 1u), 0};
+	struct ncm_dpe16_ dpe[8] = {{0}};
+	uint16_t off = sizeof(nth) + ndp.wLength;
+
+	memset(ntb, 0, NCM_NTB_OUT_SIZE);
+	for (uint8_t i = 0; i < n; i++)
+	{
+		dpe[i] = (struct ncm_dpe16_){off, lens[i]};
+		vh_eth_fill(ntb + off, lens[i], tag + i, 0);
+		off = (off + lens[i] + 3u) & ~3u;
+	}
+	nth.wBlockLength = off;
+	memcpy(ntb, &nth, sizeof(nth));
+	memcpy(ntb + sizeof(nth), &ndp, sizeof(ndp));
+	memcpy(ntb + sizeof(nth) + sizeof(ndp), dpe, 4u * (n + 1u));
+	return off;
+}
+
+struct vh_dgram_ {
+	const uint8_t *data;
+	uint16_t len;
+};
+
+// parse In NTB16, return no. of datagrams or -1 if malformed
+static int vh_ntb_parse(const uint8_t *ntb, int32_t len, struct vh_dgram_ *dg, int max)
+{
+	struct ncm_nth16_ nth;
+	struct ncm_ndp16_ ndp;
+	struct ncm_dpe16_ dpe;
+
+	if (len < (int32_t)sizeof(nth))
+		return -1;
+	memcpy(&nth, ntb, sizeof(nth));
+	if (nth.dwSignature != NCM_NTH16_SIGNATURE || nth.wHeaderLength != sizeof(nth) || nth.wBlockLength != len
+		|| nth.wNdpIndex % 4u || nth.wNdpIndex + sizeof(ndp) > (uint32_t)len)
+		return -1;
+	memcpy(&ndp, ntb + nth.wNdpIndex, sizeof(ndp));
+	if (ndp.dwSignature != NCM_NDP16_NOCRC_SIGNATURE || nth.wNdpIndex + ndp.wLength > len)
+		return -1;
+	for (int n = 0, i = nth.wNdpIndex + sizeof(ndp); n <= max && i + 4 <= nth.wNdpIndex + ndp.wLength; n++, i += 4)
+	{
+		memcpy(&dpe, ntb + i, sizeof(dpe));
+		if (dpe.wDatagramIndex == 0 || dpe.wDatagramLength == 0)
+			return n;
+		if (n == max || dpe.wDatagramIndex % 4u || dpe.wDatagramIndex + dpe.wDatagramLength > len)
+			break;
+		dg[n] = (struct vh_dgram_){ntb + dpe.wDatagramIndex, dpe.wDatagramLength};
+	}
+	return -1;	// no null entry
+}
+
+static void test_ncm(void)
+{
+	uint8_t ifnum = 0;
+	const struct vh_if_ *comm = 0, *data;
+
+	for (uint8_t i = 0; i + 1 < nifs && !comm; i++)
+		if (ifs[i].ifclass == CDC_COMMUNICATION_INTERFACE_CLASS && ifs[i].subclass == CDC_NETWORK_CONTROL_MODEL)
+			comm = &ifs[ifnum = i];
+	if (!comm)
+		return;
+	data = &ifs[ifnum + 1];
+
+	static uint8_t ntb[NCM_NTB_IN_SIZE], ntbout[NCM_NTB_OUT_SIZE];
+	struct ncm_ntb_parameters_ par;
+	struct vh_dgram_ dg[8];
+	uint8_t alt = 0xff;
+	bool ok;
+
+	check(data->alts == 1 && data->epin && data->epout && comm->epin
+		&& vh_control(0xa1, NCMRQ_GET_NTB_PARAMETERS, 0, ifnum, sizeof(par), (uint8_t *)&par) == sizeof(par)
+		&& par.wLength == sizeof(par) && par.bmNtbFormatsSupported & NCM_NTB16_SUPPORTED
+		&& par.dwNtbOutMaxSize == NCM_NTB_OUT_SIZE && par.dwNtbInMaxSize == NCM_NTB_IN_SIZE, "NCM NTB parameters");
+	uint32_t insize = 4096, tiny = 100;
+	check(vh_control(0x21, NCMRQ_SET_NTB_INPUT_SIZE, 0, ifnum, 4, (uint8_t *)&tiny) < 0
+		&& vh_control(0x21, NCMRQ_SET_NTB_INPUT_SIZE, 0, ifnum, 4, (uint8_t *)&insize) == 4, "NCM NTB input size");
+	check(vh_control(0x81, USB_STDRQ_GET_INTERFACE, 0, ifnum + 1, 1, &alt) == 1 && alt == 0 && !ncm_link_up()
+		&& vh_control(0x01, USB_STDRQ_SET_INTERFACE, 2, ifnum + 1, 0, 0) < 0
+		&& vh_control(0x01, USB_STDRQ_SET_INTERFACE, 0, 0, 0, 0) == 0, "NCM alternate setting 0");
+	check(vh_control(0x01, USB_STDRQ_SET_INTERFACE, 1, ifnum + 1, 0, 0) == 0
+		&& vh_control(0x81, USB_STDRQ_GET_INTERFACE, 0, ifnum + 1, 1, &alt) == 1 && alt == 1 && ncm_link_up(),
+		"NCM data interface enabled");
+
+	struct ncm_notif_ nt[2];
+	uint16_t n0 = 0, n1 = 0;
+	check(vh_in(comm->epin, (uint8_t *)&nt[0], &n0) == USBSIM_ACK && n0 == 16
+		&& nt[0].bNotification == CDC_CONNECTION_SPEED_CHANGE && nt[0].dwDLBitRate == NCM_LINK_SPEED
+		&& vh_in(comm->epin, (uint8_t *)&nt[1], &n1) == USBSIM_ACK && n1 == 8
+		&& nt[1].bNotification == CDC_NOTIFICATION_NETWORK_CONNECTION && nt[1].wValue == 1, "NCM connection notifications");
+
+	// echo - the first frame is sent at once, the rest are aggregated while it is on the bus
+	static const uint16_t lens[] = {60, 590, 1200};
+	uint16_t len = vh_ntb_build(ntbout, 1, lens, 3, 0x100);
+	unsigned got = 0, ntbs = 0, errors = 0;
+	ncm_echo = 1;
+	check(vh_bulk_out(data->epout, data->outsize, ntbout, len, len < NCM_NTB_OUT_SIZE), "NCM Out NTB");
+	while (got < 3 && ntbs < 3 && !errors)
+	{
+		int nd = vh_ntb_parse(ntb, vh_bulk_in(data->epin, data->insize, ntb, insize), dg, 8);
+		errors += nd <= 0;
+		++ntbs;
+		for (int i = 0; i < nd; i++, got++)
+			errors += got >= 3 || dg[i].len != lens[got] || !vh_eth_check(dg[i].data, dg[i].len, 0x100 + got, 1);
+	}
+	check(errors == 0 && got == 3 && ntbs == 2, "NCM echo aggregated into In NTBs");
+	ncm_echo = 0;
+
+	// frame pool exhaustion; frames freed by the first NTB make the pool writable
+	uint8_t *f[NCM_TX_FRAMES];
+	unsigned wr = ncm_writables;
+	ok = 1;
+	for (unsigned i = 0; i < NCM_TX_FRAMES; i++)
+		if ((ok = ok && (f[i] = ncm_frame_alloc())))
+			vh_eth_fill(f[i], 100 + i, 0x200 + i, 1);
+	ok = ok && ncm_frame_alloc() == 0;
+	for (unsigned i = 0; ok && i < NCM_TX_FRAMES; i++)
+		ok = ncm_send(f[i], 100 + i) == 0;
+	got = 0;
+	for (int k = 0; ok && k < 2; k++)
+	{
+		int nd = vh_ntb_parse(ntb, vh_bulk_in(data->epin, data->insize, ntb, insize), dg, 8);
+		ok = nd == (k ? (int)NCM_TX_FRAMES - 1 : 1);
+		for (int i = 0; ok && i < nd; i++, got++)
+			ok = dg[i].len == 100 + got && vh_eth_check(dg[i].data, dg[i].len, 0x200 + got, 1);
+	}
+	check(ok && ncm_writables > wr, "NCM frame pool exhaustion");
+
+	// Out flow control - two NTBs held by the network stack, the third one NAKed until one is released
+	const uint8_t *rx;
+	uint16_t rxlen = 0;
+	ok = 1;
+	for (uint16_t k = 0; k < 2; k++)
+	{
+		len = vh_ntb_build(ntbout, 2 + k, lens, 1, 0x300 + k);
+		ok = ok && vh_bulk_out(data->epout, data->outsize, ntbout, len, 0);
+	}
+	len = vh_ntb_build(ntbout, 4, lens, 1, 0x302);
+	vh_slot();
+	ok = ok && usbsim_out(devaddr, data->epout, ntbout, data->outsize) == USBSIM_NAK;
+	ok = ok && (rx = ncm_recv(&rxlen)) && rxlen == lens[0] && vh_eth_check(rx, rxlen, 0x300, 0);
+	ncm_recv_done();
+	ok = ok && vh_bulk_out(data->epout, data->outsize, ntbout, len, 0);
+	for (uint16_t k = 1; ok && k < 3; k++)
+	{
+		ok = (rx = ncm_recv(&rxlen)) && rxlen == lens[0] && vh_eth_check(rx, rxlen, 0x300 + k, 0);
+		ncm_recv_done();
+	}
+	check(ok && ncm_recv(&rxlen) == 0, "NCM Out flow control");
+
+	// malformed NTB is dropped
+	len = vh_ntb_build(ntbout, 5, lens, 2, 0x400);
+	ntbout[0] ^= 0xff;
+	ok = vh_bulk_out(data->epout, data->outsize, ntbout, len, 0);
+	len = vh_ntb_build(ntbout, 6, lens + 1, 1, 0x500);
+	ok = ok && vh_bulk_out(data->epout, data->outsize, ntbout, len, 0);
+	ok = ok && (rx = ncm_recv(&rxlen)) && rxlen == lens[1] && vh_eth_check(rx, rxlen, 0x500, 0);
+	ncm_recv_done();
+	check(ok && ncm_recv(&rxlen) == 0, "NCM malformed NTB");
+
+	// interface reselected while an NTB is being sent - transfer aborted, frames back in the pool
+	uint16_t n;
+	ok = (f[0] = ncm_frame_alloc()) != 0;
+	if (ok)
+		vh_eth_fill(f[0], 100, 0x600, 1);
+	ok = ok && ncm_send(f[0], 100) == 0 && vh_control(0x01, USB_STDRQ_SET_INTERFACE, 1, ifnum + 1, 0, 0) == 0
+		&& (vh_slot(), usbsim_in(devaddr, data->epin, ntb, &n) == USBSIM_NAK);
+	for (unsigned i = 0; ok && i < NCM_TX_FRAMES; i++)
+		ok = (f[i] = ncm_frame_alloc()) != 0;
+	for (unsigned i = 0; ok && i < NCM_TX_FRAMES; i++)
+		ncm_frame_free(f[i]);
+	ok = ok && (f[0] = ncm_frame_alloc()) != 0;
+	if (ok)
+		vh_eth_fill(f[0], 120, 0x601, 1);
+	ok = ok && ncm_send(f[0], 120) == 0
+		&& vh_ntb_parse(ntb, vh_bulk_in(data->epin, data->insize, ntb, insize), dg, 8) == 1
+		&& dg[0].len == 120 && vh_eth_check(dg[0].data, dg[0].len, 0x601, 1);
+	check(ok, "NCM NTB aborted by SetInterface");
+
+	// link down - nothing sent, all frames back in the pool
+	ok = vh_control(0x01, USB_STDRQ_SET_INTERFACE, 0, ifnum + 1, 0, 0) == 0 && !ncm_link_up()
+		&& (f[0] = ncm_frame_alloc()) && ncm_send(f[0], 100) != 0;
+	for (unsigned i = 0; ok && i < NCM_TX_FRAMES; i++)
+		ok = (f[i] = ncm_frame_alloc()) != 0;
+	for (unsigned i = 0; ok && i < NCM_TX_FRAMES; i++)
+		ncm_frame_free(f[i]);
+	check(ok, "NCM link down");
+}
+#endif
+
+//========================================================================
+// endpoint counters vendor request
+
+static void test_epstats(void)
+{
+	struct epstats_ st[2][USBD_NUM_EPPAIRS];
+	uint8_t dummy;
+
+	check(vh_control(0xc0, USBD_VENDOR_RQ_GET_EPSTATS, 0, 0, sizeof(st), (uint8_t *)st) == sizeof(st), "endpoint counters");
+	printf("ep   packets     bytes transfers  zlps stalls  busy\n");
+	for (uint8_t i = 0; i < USBD_NUM_EPPAIRS * 2; i++)
+	{
+		const struct epstats_ *e = &st[i / USBD_NUM_EPPAIRS][i % USBD_NUM_EPPAIRS];
+		if (e->packets)
+			printf("%02x %9u %9u %9u %5u %6u %5u\n", i % USBD_NUM_EPPAIRS | (i >= USBD_NUM_EPPAIRS) << 7,
+				(unsigned)e->packets, (unsigned)e->bytes, (unsigned)e->transfers, e->zlps, e->stalls, e->busy);
+	}
+	if (msc)
+	{
+		const struct epstats_ *e = &st[1][msc->epin & EPNUMMSK];
+		check(e->transfers && e->bytes && e->packets >= e->transfers && e->stalls, "MSC In counters");
+	}
+	check(vh_control(0x40, USBD_VENDOR_RQ_CLEAR_EPSTATS, 0, 0, 0, 0) == 0
+		&& vh_control(0xc0, USBD_VENDOR_RQ_GET_EPSTATS, 0, 0, sizeof(st), (uint8_t *)st) == sizeof(st)
+		&& (!msc || st[1][msc->epin & EPNUMMSK].packets == 0) && st[1][0].transfers == 1, "endpoint counters cleared");
+	check(vh_control(0xc0, 0x55, 0, 0, 1, &dummy) < 0, "unknown vendor request stalled");
+}
+
+//========================================================================
+// In transfer queue, filled from device side on CDC channel 0 data In endpoint
+
+#if USBD_XFER_QUEUE_LEN
+extern const struct usbdevice_ usbdev;	// usb_app.c
+
+static const uint16_t xq_len[] = {100, 64, 10, 5};	// short packet end, ZLP end, single packets
+static uint8_t xq_data[256];
+static struct {
+	uint8_t n;	// no. of callbacks
+	uint8_t epaddr;
+	uint16_t count[USBD_XFER_QUEUE_LEN];
+	enum usbxfer_status_ status[USBD_XFER_QUEUE_LEN];
+} xqdone;
+
+static void xq_done(const struct usbdevice_ *usbd, uint8_t epaddr, uint16_t count, enum usbxfer_status_ status)
+{
+	if (xqdone.n < USBD_XFER_QUEUE_LEN)
+	{
+		xqdone.count[xqdone.n] = count;
+		xqdone.status[xqdone.n] = status;
+	}
+	xqdone.epaddr = epaddr;
+	++xqdone.n;
+}
+
+// queue n transfers, return no. of transfers accepted
+static uint8_t xq_submit(uint8_t epn, uint8_t n)
+{
+	uint8_t accepted = 0;
+	xqdone.n = 0;
+	for (uint8_t i = 0; i < n; i++)
+	{
+		const struct usbxfer_ x = {.data = xq_data + i, .length = xq_len[i % 4], .zlp = 1, .done = xq_done};
+		accepted += USBdev_QueueData(&usbdev, epn, &x) == 0;
+	}
+	return accepted;
+}
+
+// read transfer i of xq_submit() without retries - NAK means the device is not ready
+static bool xq_read(uint8_t epn, uint8_t i)
+{
+	uint8_t buf[CDC_DATA_EP_SIZE * 3];
+	uint16_t count = 0, n = CDC_DATA_EP_SIZE;
+	while (n == CDC_DATA_EP_SIZE && count < sizeof(buf) - CDC_DATA_EP_SIZE)
+	{
+		vh_slot();
+		if (usbsim_in(devaddr, epn, buf + count, &n) != USBSIM_ACK)
+			return 0;
+		count += n;
+	}
+	return count == xq_len[i % 4] && memcmp(buf, xq_data + i, count) == 0;
+}
+
+static bool xq_aborted(uint8_t n)
+{
+	bool ok = xqdone.n == n;
+	for (uint8_t i = 0; ok && i < n; i++)
+		ok = xqdone.status[i] == USBXFER_ABORTED && xqdone.count[i] < xq_len[i % 4] && (i == 0 || xqdone.count[i] == 0);
+	return ok;
+}
+
+static void test_xfer_queue(void)
+{
+	uint8_t epn = CDC_DATA_IN_EP(0) & EPNUMMSK, buf[CDC_DATA_EP_SIZE];
+	uint16_t n;
+	bool ok;
+
+	for (uint16_t i = 0; i < sizeof(xq_data); i++)
+		xq_data[i] = i * 7;
+	check(xq_submit(epn, USBD_XFER_QUEUE_LEN + 1) == USBD_XFER_QUEUE_LEN, "transfer queue full");
+	ok = 1;
+	for (uint8_t i = 0; ok && i < USBD_XFER_QUEUE_LEN; i++)
+		ok = xq_read(epn, i);
+	check(ok && (vh_slot(), usbsim_in(devaddr, epn, buf, &n) == USBSIM_NAK), "queued transfers sent back to back");
+	ok = xqdone.n == USBD_XFER_QUEUE_LEN && xqdone.epaddr == (epn | EP_IS_IN);
+	for (uint8_t i = 0; ok && i < USBD_XFER_QUEUE_LEN; i++)
+		ok = xqdone.status[i] == USBXFER_DONE && xqdone.count[i] == xq_len[i % 4];
+	check(ok, "queued transfer callbacks");
+
+	xq_submit(epn, 2);
+	check(vh_control(0x02, USB_STDRQ_CLEAR_FEATURE, USB_FEATSEL_ENDPOINT_HALT, epn | EP_IS_IN, 0, 0) == 0 && xq_aborted(2)
+		&& (vh_slot(), usbsim_in(devaddr, epn, buf, &n) == USBSIM_NAK), "queued transfers aborted by ClearFeature");
+	check(xq_submit(epn, 1) == 1 && xq_read(epn, 0) && xqdone.n == 1 && xqdone.status[0] == USBXFER_DONE, "queue restarted after abort");
+
+	xq_submit(epn, 2);
+	usbsim_bus_reset();
+	check(xq_aborted(2), "queued transfers aborted by bus reset");
+	check(vh_enumerate(), "re-enumeration after bus reset");
+}
+#endif
+
+//========================================================================
+static FILE *vh_open(const char *name)
+{
+	FILE *f = fopen(name, "wb");
+	if (!f)
+	{
+		perror(name);
+		exit(2);
+	}
+	return f;
+}
+
+// options: -t event trace file, -d device side capture file, -c host side capture file
+int main(int argc, char **argv)
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "t:d:c:")) != -1)
+	{
+		switch (opt)
+		{
+#ifdef USBLOG
+		case 't':
+			tracef = vh_open(optarg);
+			break;
+#endif
+#ifdef USBCAP
+		case 'd':
+			devcapf = vh_open(optarg);
+			break;
+#endif
+		case 'c':
+			usbsim_capture(vh_open(optarg));
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t trace_file] [-d device_capture_file] [-c host_capture_file]\n", argv[0]);
+			return 2;
+		}
+	}
+#if VCOM_UART_BRIDGE
+	NVIC_SetPriority(UARTSIM_IRQn, USB_IRQ_PRI);
+	NVIC_EnableIRQ(UARTSIM_IRQn);
+#endif
+	USBapp_Init();
+	check(usbsim_attached(), "attach");
+	check(vh_enumerate(), "enumeration");
+	test_cdc();
+	test_cdc_channels();
+#if VCOM_MUX_CHANNELS
+	test_cdc_mux();
+#endif
+#if VCOM_UART_BRIDGE
+	test_cdc_uart();
+#endif
+	test_printer();
+	test_hid();
+	test_msc();
+#if USBD_NCM
+	test_ncm();
+#endif
+	test_epstats();
+#if USBD_XFER_QUEUE_LEN
+	test_xfer_queue();
+#endif
+
+	usbsim_suspend();
+	usbsim_resume();
+	check(vh_enumerate(), "re-enumeration after suspend");
+	vh_trace();
+	vh_devcap();
+	printf("%u failure(s), %u frames\n", failures, (unsigned)frame);
+	return failures != 0;
+}
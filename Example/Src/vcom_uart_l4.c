@@ -0,0 +1,187 @@
+/*
+ * lightweight USB device stack by gbm
+ * vcom_uart_l4.c - STM32L4 USART with DMA for CDC-UART bridge, see vcom_uart.h
+ * Copyright (c) 2024 gbm
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The first channel in VCOM_UART_BRIDGE is bridged to USART2 on PA2/PA3 - ST-LINK virtual COM port
+ * of Nucleo-64 boards. Rx - DMA1 channel 6, Tx - DMA1 channel 7, both with request 2.
+ * USART2 is clocked from PCLK1 = HCLK_FREQ (APB1 prescaler 1 set by ClockSetup()), so 80 MHz HCLK
+ * allows for up to 5 Mbaud.
+ * Break is sent by switching the Tx pin to GPIO output low.
+ * L4+ series (with DMAMUX instead of DMA1_CSELR) is not supported.
+ */
+
+#include "mcu_hw.h"
+#include "usb_dev.h"
+#include "usb_class_cdc.h"
+#include "vcom_uart.h"
+#include "usbdev_binding.h"
+
+#if VCOM_UART_BRIDGE && defined(DMA1_CSELR) && defined(RCC_APB1ENR1_USART2EN)
+
+#define UART_CH	__builtin_ctz(VCOM_UART_BRIDGE)
+#define UART	USART2
+#define UART_IRQn	USART2_IRQn
+#define UART_IRQHandler	USART2_IRQHandler
+#define UART_TX_PIN	2u
+#define UART_RX_PIN	3u
+#define UART_AFN	7u
+
+#define RXDMA	DMA1_Channel6
+#define RXDMA_IRQn	DMA1_Channel6_IRQn
+#define RXDMA_IRQHandler	DMA1_Channel6_IRQHandler
+#define RXDMA_CGIF	DMA_IFCR_CGIF6
+
+#define TXDMA	DMA1_Channel7
+#define TXDMA_IRQn	DMA1_Channel7_IRQn
+#define TXDMA_IRQHandler	DMA1_Channel7_IRQHandler
+#define TXDMA_CGIF	DMA_IFCR_CGIF7
+
+static uint16_t rxsize;
+
+// on first use - line coding is set before start
+static void uart_setup(void)
+{
+	if (RCC->APB1ENR1 & RCC_APB1ENR1_USART2EN)
+		return;
+	RCC->APB1ENR1 |= RCC_APB1ENR1_USART2EN;
+	RCC->AHB1ENR |= RCC_AHB1ENR_DMA1EN;
+	RCC->AHB2ENR |= RCC_AHB2ENR_GPIOAEN;
+
+	GPIOA->BSRR = 1u << (UART_TX_PIN + 16);	// low during break
+	AFRF(GPIOA, UART_TX_PIN) = UART_AFN;
+	AFRF(GPIOA, UART_RX_PIN) = UART_AFN;
+	BF2F(GPIOA->MODER, UART_TX_PIN) = GPIO_MODER_AF;
+	BF2F(GPIOA->MODER, UART_RX_PIN) = GPIO_MODER_AF;
+
+	DMA1_CSELR->CSELR = (DMA1_CSELR->CSELR & ~(DMA_CSELR_C6S | DMA_CSELR_C7S))
+		| 2u << DMA_CSELR_C6S_Pos | 2u << DMA_CSELR_C7S_Pos;
+	RXDMA->CPAR = (uint32_t)&UART->RDR;
+	TXDMA->CPAR = (uint32_t)&UART->TDR;
+	UART->CR3 = USART_CR3_DMAR | USART_CR3_DMAT | USART_CR3_EIE;
+
+	// vcom_uart_ handlers must run at USB interrupt priority
+	NVIC_SetPriority(UART_IRQn, USB_IRQ_PRI);
+	NVIC_SetPriority(RXDMA_IRQn, USB_IRQ_PRI);
+	NVIC_SetPriority(TXDMA_IRQn, USB_IRQ_PRI);
+	NVIC_EnableIRQ(UART_IRQn);
+	NVIC_EnableIRQ(RXDMA_IRQn);
+	NVIC_EnableIRQ(TXDMA_IRQn);
+}
+
+static void uart_start(uint8_t ch, uint8_t *rxbuf, uint16_t size)
+{
+	if (ch != UART_CH)
+		return;
+	uart_setup();
+	UART->CR1 &= ~(USART_CR1_RE | USART_CR1_TE);
+	RXDMA->CCR = 0;
+	TXDMA->CCR = 0;
+	DMA1->IFCR = RXDMA_CGIF | TXDMA_CGIF;
+	if (rxbuf)
+	{
+		rxsize = size;
+		RXDMA->CMAR = (uint32_t)rxbuf;
+		RXDMA->CNDTR = size;
+		RXDMA->CCR = DMA_CCR_MINC | DMA_CCR_CIRC | DMA_CCR_HTIE | DMA_CCR_TCIE | DMA_CCR_EN;
+		UART->ICR = USART_ICR_ORECF | USART_ICR_PECF | USART_ICR_FECF | USART_ICR_IDLECF;
+		UART->CR1 |= USART_CR1_IDLEIE | USART_CR1_PEIE | USART_CR1_RE | USART_CR1_TE | USART_CR1_UE;
+	}
+}
+
+static uint16_t uart_rxpos(uint8_t ch)
+{
+	return (rxsize - RXDMA->CNDTR) & (rxsize - 1u);
+}
+
+static void uart_txstart(uint8_t ch, const uint8_t *data, uint16_t length)
+{
+	TXDMA->CCR = 0;
+	TXDMA->CMAR = (uint32_t)data;
+	TXDMA->CNDTR = length;
+	TXDMA->CCR = DMA_CCR_MINC | DMA_CCR_DIR | DMA_CCR_TCIE | DMA_CCR_EN;
+}
+
+// 7, 8 or 9 bits including parity; mark and space parity not supported
+static void uart_setlinecoding(uint8_t ch, const struct cdc_linecoding_ *lc)
+{
+	static const uint8_t stop[] = {0, 3, 2};	// 1, 1.5, 2 stop bits
+	uint8_t bits = lc->bDataBits + (lc->bParityType != 0);
+
+	if (ch != UART_CH || bits < 7 || bits > 9 || lc->bParityType > 2 || lc->bCharFormat > 2
+		|| lc->dwDTERate == 0 || lc->dwDTERate > HCLK_FREQ / 16u)
+		return;
+	uart_setup();
+	uint32_t cr1 = UART->CR1 & ~(USART_CR1_M0 | USART_CR1_M1 | USART_CR1_PCE | USART_CR1_PS | USART_CR1_UE);
+	if (bits == 7)
+		cr1 |= USART_CR1_M1;
+	else if (bits == 9)
+		cr1 |= USART_CR1_M0;
+	if (lc->bParityType)
+		cr1 |= USART_CR1_PCE | (lc->bParityType == 1 ? USART_CR1_PS : 0);
+	UART->CR1 = cr1;	// UE = 0 while changing format
+	UART->CR2 = (uint32_t)stop[lc->bCharFormat] << USART_CR2_STOP_Pos;
+	UART->BRR = (HCLK_FREQ + lc->dwDTERate / 2) / lc->dwDTERate;
+	UART->CR1 = cr1 | USART_CR1_UE;
+}
+
+static void uart_setbreak(uint8_t ch, bool on)
+{
+	if (ch == UART_CH)
+		BF2F(GPIOA->MODER, UART_TX_PIN) = on ? GPIO_MODER_OUT : GPIO_MODER_AF;
+}
+
+const struct vcom_uart_ vcom_uart_hw = {
+	.Start = uart_start,
+	.RxPos = uart_rxpos,
+	.TxStart = uart_txstart,
+	.SetLineCoding = uart_setlinecoding,
+	.SetBreak = uart_setbreak,
+	// no modem control lines on ST-LINK VCP
+};
+
+// Rx errors and Rx line idle
+void UART_IRQHandler(void)
+{
+	uint32_t isr = UART->ISR;
+	uint16_t err = (isr & USART_ISR_ORE ? CDC_SERIAL_STATE_OVERRUN : 0)
+		| (isr & USART_ISR_PE ? CDC_SERIAL_STATE_PARITY : 0)
+		| (isr & USART_ISR_FE ? CDC_SERIAL_STATE_FRAMING : 0);
+
+	UART->ICR = USART_ICR_ORECF | USART_ICR_PECF | USART_ICR_FECF | USART_ICR_IDLECF;
+	if (err)
+		vcom_uart_error(UART_CH, err);
+	if (isr & USART_ISR_IDLE)
+		vcom_uart_rx_event(UART_CH);
+}
+
+// Rx half and full transfer
+void RXDMA_IRQHandler(void)
+{
+	DMA1->IFCR = RXDMA_CGIF;
+	vcom_uart_rx_event(UART_CH);
+}
+
+// last Tx byte passed to UART; the DMA buffer may be reused
+void TXDMA_IRQHandler(void)
+{
+	DMA1->IFCR = TXDMA_CGIF;
+	TXDMA->CCR = 0;
+	vcom_uart_tx_done(UART_CH);
+}
+
+#endif	// VCOM_UART_BRIDGE
@@ -0,0 +1,333 @@
+/*
+ * lightweight USB device stack by gbm
+ * usbcap2pcap.c - converter of USB packet capture to pcap, Linux usbmon format
+ * Copyright (c) 2024 gbm
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Build: gcc -O2 Tools/usbcap2pcap.c -o usbcap2pcap
+ * Usage: usbcap2pcap [-f timestamp_Hz] [-b bus] [capture_file [pcap_file]]
+ * Reads stdin and writes stdout if no files are given, so the output may be piped to Wireshark:
+ * usbcap2pcap capture.bin | wireshark -k -i -
+ * Default timestamp frequency is 1000 Hz (usbdev_msec); use -f 1000000 for simulated host capture.
+ *
+ * Device side records (USBcap_drain() output) are transfer events; they are assembled into
+ * usbmon URBs: submission (S) and completion (C) pairs, control requests as a single URB.
+ * Simulated host records are single transactions; each one becomes an URB, with NAK, STALL
+ * and no response reported in completion status as -EAGAIN, -EPIPE and -ETIME.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// record layout - struct usbcap_rec_ in usb_log.h, little endian
+#define REC_SIZE	16u
+
+enum usbcap_evt_ {UCE_SETUP, UCE_SUBMIT, UCE_COMPLETE, UCE_STALL, UCE_DROP, UCE_TRANSACTION};
+enum usbcap_status_ {UCS_ACK, UCS_NAK, UCS_STALL, UCS_NORESP};
+
+#define ADDR_UNKNOWN	0xffu
+#define LINKTYPE_USB_LINUX_MMAPPED	220u
+#define MAXDATA	65536u
+
+// usbmon status codes
+#define EINPROGRESS	115
+#define EAGAIN	11
+#define EPIPE	32
+#define ETIME	62
+
+struct rec_ {
+	uint32_t ts;
+	uint16_t frame, len, caplen;
+	uint8_t ep, evt, xfer, addr, status;
+	uint8_t data[MAXDATA];
+};
+
+// URB being assembled
+struct urb_ {
+	uint64_t id;
+	uint32_t ts;
+	uint16_t frame;
+	uint8_t xfer;
+	uint8_t setup[8];
+	bool pending, submitted;
+	uint32_t length;	// control Out data received
+	uint32_t caplen;
+	uint8_t data[MAXDATA];
+};
+
+static struct {
+	FILE *out;
+	double hz;
+	uint16_t bus;
+	uint8_t devnum;
+	uint64_t nextid;
+	struct urb_ ctrl;	// control request
+	struct urb_ in[16];	// In transfers submitted, by ep number
+	unsigned long packets, dropped;
+} cv = {.hz = 1000, .bus = 1};
+
+static uint16_t get16(const uint8_t *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+static void put64(uint8_t *p, uint64_t v)
+{
+	put32(p, v);
+	put32(p + 4, v >> 32);
+}
+
+static void pcap_header(void)
+{
+	uint8_t h[24] = {0};
+	put32(h, 0xa1b2c3d4);
+	put16(h + 4, 2);
+	put16(h + 6, 4);
+	put32(h + 16, MAXDATA + 64);	// snaplen
+	put32(h + 20, LINKTYPE_USB_LINUX_MMAPPED);
+	fwrite(h, sizeof(h), 1, cv.out);
+}
+
+// write usbmon event; setup - 8 bytes or null, xfer - descriptor bmAttributes type
+static void usbmon(char type, uint64_t id, uint32_t ts, uint16_t frame, uint8_t xfer, uint8_t ep, uint8_t devnum,
+	int32_t status, uint32_t length, const uint8_t *setup, const uint8_t *data, uint32_t caplen)
+{
+	static const uint8_t usbmon_xfer[4] = {2, 0, 3, 1};	// ctrl, iso, bulk, int
+	double t = ts / cv.hz;
+	uint32_t sec = t;
+	uint32_t usec = (t - sec) * 1e6;
+	uint8_t rh[16], h[64] = {0};
+
+	put32(rh, sec);
+	put32(rh + 4, usec);
+	put32(rh + 8, sizeof(h) + caplen);
+	put32(rh + 12, sizeof(h) + (type == 'S' && ep & 0x80 ? 0 : length));
+	put64(h, id);
+	h[8] = type;
+	h[9] = usbmon_xfer[xfer & 3];
+	h[10] = ep;
+	h[11] = devnum;
+	put16(h + 12, cv.bus);
+	h[14] = setup ? 0 : '-';
+	h[15] = caplen ? 0 : type == 'S' ? '<' : '>';
+	put64(h + 16, sec);
+	put32(h + 24, usec);
+	put32(h + 28, status);
+	put32(h + 32, length);
+	put32(h + 36, caplen);
+	if (setup)
+		memcpy(h + 40, setup, 8);
+	put32(h + 52, frame);
+	fwrite(rh, sizeof(rh), 1, cv.out);
+	fwrite(h, sizeof(h), 1, cv.out);
+	fwrite(data, 1, caplen, cv.out);
+	++cv.packets;
+}
+
+// host side: each transaction is a separate URB
+static void host_transaction(const struct rec_ *r)
+{
+	static const int32_t hsstatus[4] = {0, -EAGAIN, -EPIPE, -ETIME};
+	uint64_t id = ++cv.nextid;
+	bool setup = r->evt == UCE_SETUP;
+	bool in = r->ep & 0x80;
+	uint8_t ep = setup ? r->data[0] & 0x80 : r->ep;
+
+	usbmon('S', id, r->ts, r->frame, r->xfer, ep, r->addr, -EINPROGRESS, setup ? get16(r->data + 6) : r->len,
+		setup ? r->data : 0, in || setup ? 0 : r->data, in || setup ? 0 : r->caplen);
+	usbmon('C', id, r->ts, r->frame, r->xfer, ep, r->addr, hsstatus[r->status & 3], in ? r->len : 0,
+		0, in ? r->data : 0, in ? r->caplen : 0);
+}
+
+// device side control request - submission is written when Out data stage is complete
+static void ctrl_submit(void)
+{
+	struct urb_ *u = &cv.ctrl;
+	bool in = u->setup[0] & 0x80;
+	if (!u->submitted)
+		usbmon('S', u->id, u->ts, u->frame, 0, u->setup[0] & 0x80, cv.devnum, -EINPROGRESS, get16(u->setup + 6),
+			u->setup, in ? 0 : u->data, in ? 0 : u->caplen);
+	u->submitted = 1;
+}
+
+static void ctrl_complete(const struct rec_ *r, int32_t status)
+{
+	struct urb_ *u = &cv.ctrl;
+	bool in = u->setup[0] & 0x80;
+	ctrl_submit();
+	usbmon('C', u->id, r->ts, r->frame, 0, u->setup[0] & 0x80, cv.devnum, status, in ? r->len : u->length,
+		0, in ? u->data : 0, in ? u->caplen : 0);
+	u->pending = 0;
+	if (status == 0 && u->setup[0] == 0 && u->setup[1] == 5)	// Set_Address
+		cv.devnum = get16(u->setup + 2);
+}
+
+static void device_event(const struct rec_ *r)
+{
+	uint8_t epn = r->ep & 0xf;
+	bool in = r->ep & 0x80;
+	struct urb_ *u;
+
+	switch (r->evt)
+	{
+	case UCE_SETUP:
+		if (cv.ctrl.pending)
+			ctrl_complete(r, -EPIPE);	// not completed - cancelled by the host
+		u = &cv.ctrl;
+		*u = (struct urb_){.id = ++cv.nextid, .ts = r->ts, .frame = r->frame, .pending = 1};
+		memcpy(u->setup, r->data, 8);
+		if (u->setup[0] & 0x80 || get16(u->setup + 6) == 0)
+			ctrl_submit();
+		break;
+	case UCE_STALL:
+		if (cv.ctrl.pending)
+			ctrl_complete(r, -EPIPE);
+		break;
+	case UCE_SUBMIT:
+		if (epn == 0)
+		{
+			// control In data, or status stage of Out request
+			if (cv.ctrl.pending && cv.ctrl.setup[0] & 0x80)
+			{
+				memcpy(cv.ctrl.data, r->data, r->caplen);
+				cv.ctrl.caplen = r->caplen;
+			}
+			break;
+		}
+		u = &cv.in[epn];
+		*u = (struct urb_){.id = ++cv.nextid, .ts = r->ts, .frame = r->frame, .xfer = r->xfer, .pending = 1,
+			.caplen = r->caplen};
+		memcpy(u->data, r->data, r->caplen);
+		usbmon('S', u->id, r->ts, r->frame, r->xfer, r->ep, cv.devnum, -EINPROGRESS, r->len, 0, 0, 0);
+		break;
+	case UCE_COMPLETE:
+		if (epn == 0)
+		{
+			if (in && cv.ctrl.pending)
+				ctrl_complete(r, 0);
+			else if (!in && cv.ctrl.pending && !cv.ctrl.submitted)
+			{
+				// control Out data stage packet
+				uint32_t n = r->caplen;
+				if (cv.ctrl.caplen + n > get16(cv.ctrl.setup + 6))
+					n = get16(cv.ctrl.setup + 6) - cv.ctrl.caplen;
+				memcpy(cv.ctrl.data + cv.ctrl.caplen, r->data, n);
+				cv.ctrl.caplen += n;
+				cv.ctrl.length += r->len;
+			}
+			break;
+		}
+		if (in)
+		{
+			u = &cv.in[epn];
+			if (!u->pending)
+				*u = (struct urb_){.id = ++cv.nextid};
+			usbmon('C', u->id, r->ts, r->frame, r->xfer, r->ep, cv.devnum, 0, r->len, 0, u->data, u->caplen);
+			u->pending = 0;
+		}
+		else
+		{
+			uint64_t id = ++cv.nextid;
+			usbmon('S', id, r->ts, r->frame, r->xfer, r->ep, cv.devnum, -EINPROGRESS, r->len, 0, r->data, r->caplen);
+			usbmon('C', id, r->ts, r->frame, r->xfer, r->ep, cv.devnum, 0, r->len, 0, 0, 0);
+		}
+		break;
+	case UCE_DROP:
+		cv.dropped += r->len;
+		fprintf(stderr, "%u records dropped at %.3f s\n", r->len, r->ts / cv.hz);
+		break;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	FILE *in = stdin;
+	int files = 0;
+
+	cv.out = stdout;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+			cv.hz = atof(argv[++i]);
+		else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+			cv.bus = atoi(argv[++i]);
+		else if (files < 2)
+		{
+			FILE *f = fopen(argv[i], files++ ? "wb" : "rb");
+			if (!f)
+			{
+				perror(argv[i]);
+				return 1;
+			}
+			*(files == 1 ? &in : &cv.out) = f;
+		}
+		else
+			files = 3;
+	}
+	if (cv.hz <= 0 || files > 2)
+	{
+		fprintf(stderr, "usage: %s [-f timestamp_Hz] [-b bus] [capture_file [pcap_file]]\n", argv[0]);
+		return 1;
+	}
+
+	static struct rec_ r;
+	uint8_t h[REC_SIZE];
+	pcap_header();
+	while (fread(h, REC_SIZE, 1, in) == 1)
+	{
+		r.ts = get32(h);
+		r.frame = get16(h + 4);
+		r.len = get16(h + 6);
+		r.caplen = get16(h + 8);
+		r.ep = h[10];
+		r.evt = h[11];
+		r.xfer = h[12];
+		r.addr = h[13];
+		r.status = h[14];
+		if (fread(r.data, 1, (r.caplen + 3u) & ~3u, in) != ((r.caplen + 3u) & ~3u))
+		{
+			fprintf(stderr, "truncated record\n");
+			break;
+		}
+		if (r.addr == ADDR_UNKNOWN || r.evt == UCE_DROP)
+			device_event(&r);
+		else if (r.evt == UCE_SETUP || r.evt == UCE_TRANSACTION)
+			host_transaction(&r);
+	}
+	fprintf(stderr, "%lu packets written", cv.packets);
+	if (cv.dropped)
+		fprintf(stderr, ", %lu records dropped", cv.dropped);
+	fputc('\n', stderr);
+	return 0;
+}
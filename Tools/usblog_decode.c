@@ -0,0 +1,139 @@
+/*
+ * lightweight USB device stack by gbm
+ * usblog_decode.c - host-side decoder of the binary event trace produced by USBlog_drain()
+ * Copyright (c) 2024 gbm
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Build: gcc -O2 Tools/usblog_decode.c -o usblog_decode
+ * Usage: usblog_decode [-f timestamp_Hz] [trace_file]
+ * Reads stdin if no file is given. Default timestamp frequency is 1000 Hz (usbdev_msec).
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// entry layout - struct usblog_entry_ in usb_log.h, little endian
+#define ENTRY_SIZE	16u
+
+enum usblog_evt_ {
+	ULE_LOST,
+	ULE_RESET, ULE_SUSPEND, ULE_RESUME,
+	ULE_SETUP,
+	ULE_CTRL_IN,
+	ULE_CTRL_STALL,
+	ULE_ADDRESS,
+	ULE_OUT,
+	ULE_IN,
+	ULE_APP = 0x80
+};
+
+static const char *const evtname[] = {
+	[ULE_LOST] = "LOST", [ULE_RESET] = "RESET", [ULE_SUSPEND] = "SUSPEND", [ULE_RESUME] = "RESUME",
+	[ULE_SETUP] = "SETUP", [ULE_CTRL_IN] = "CTRL_IN", [ULE_CTRL_STALL] = "STALL", [ULE_ADDRESS] = "ADDRESS",
+	[ULE_OUT] = "OUT", [ULE_IN] = "IN",
+};
+
+static const char *const stdrqname[] = {
+	"GET_STATUS", "CLEAR_FEATURE", 0, "SET_FEATURE", 0, "SET_ADDRESS", "GET_DESCRIPTOR", "SET_DESCRIPTOR",
+	"GET_CONFIGURATION", "SET_CONFIGURATION", "GET_INTERFACE", "SET_INTERFACE", "SYNCH_FRAME"
+};
+
+static uint16_t get16(const uint8_t *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void print_setup(const uint8_t *r)
+{
+	static const char *const rqtype[] = {"std", "class", "vendor", "rsvd"};
+	static const char *const recipient[] = {"dev", "if", "ep", "other"};
+	uint8_t type = r[0] >> 5 & 3;
+
+	printf("%02x %02x %04x %04x %04x  %s %s %s", r[0], r[1], get16(r + 2), get16(r + 4), get16(r + 6),
+		r[0] & 0x80 ? "in" : "out", rqtype[type], (r[0] & 0x1f) < 4 ? recipient[r[0] & 0x1f] : "?");
+	if (type == 0 && r[1] < sizeof(stdrqname) / sizeof(stdrqname[0]) && stdrqname[r[1]])
+		printf(" %s", stdrqname[r[1]]);
+}
+
+int main(int argc, char **argv)
+{
+	double hz = 1000;
+	FILE *f = stdin;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+			hz = atof(argv[++i]);
+		else if (!(f = fopen(argv[i], "rb")))
+		{
+			perror(argv[i]);
+			return 1;
+		}
+	}
+	if (hz <= 0)
+	{
+		fprintf(stderr, "usage: %s [-f timestamp_Hz] [trace_file]\n", argv[0]);
+		return 1;
+	}
+
+	uint8_t e[ENTRY_SIZE];
+	uint32_t ts0 = 0, prev = 0;
+	unsigned long n = 0;
+
+	printf("    time [ms]   delta [ms]  event     ep    len\n");
+	while (fread(e, ENTRY_SIZE, 1, f) == 1)
+	{
+		uint32_t ts = get32(e);
+		uint8_t evt = e[4];
+		if (n++ == 0)
+			ts0 = prev = ts;
+		printf("%13.3f %+12.3f  ", (uint32_t)(ts - ts0) * 1000 / hz, (uint32_t)(ts - prev) * 1000 / hz);
+		prev = ts;
+		if (evt >= ULE_APP)
+			printf("APP+%-4u  ", evt - ULE_APP);
+		else
+			printf("%-8s  ", evt < sizeof(evtname) / sizeof(evtname[0]) && evtname[evt] ? evtname[evt] : "?");
+		switch (evt)
+		{
+		case ULE_SETUP:
+			printf("%02x %6u  ", e[5], get16(e + 6));
+			print_setup(e + 8);
+			break;
+		case ULE_LOST:
+			printf("          %u entries overwritten", get32(e + 8));
+			break;
+		case ULE_ADDRESS:
+			printf("          %u", get32(e + 8));
+			break;
+		case ULE_RESET:
+		case ULE_SUSPEND:
+		case ULE_RESUME:
+			break;
+		default:
+			printf("%02x %6u", e[5], get16(e + 6));
+			if (evt >= ULE_APP)
+				printf("  %08x %08x", get32(e + 8), get32(e + 12));
+		}
+		putchar('\n');
+	}
+	printf("%lu entries\n", n);
+	return 0;
+}
@@ -0,0 +1,293 @@
+/*
+ * lightweight USB device stack by gbm
+ * vcom_demux.c - host-side demultiplexer of VCOM mux logical channels, presents each channel as a pseudo-terminal
+ * Copyright (c) 2024 gbm
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Build: gcc -O2 Tools/vcom_demux.c -o vcom_demux
+ * Usage: vcom_demux [-n channels] [-l link_prefix] tty_device
+ * e.g. vcom_demux -n 4 -l /tmp/vcom /dev/ttyACM0 creates /tmp/vcom0 .. /tmp/vcom3 linked to the ptys.
+ * Channel count must match VCOM_MUX_CHANNELS of the device (default 4). Opening the device sets DTR,
+ * which starts the mux on the device; data from the device is accepted up to WINDOW bytes per channel
+ * not yet read from the pty, data to the device is sent as the device grants credit.
+ */
+
+#define _XOPEN_SOURCE	600
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <unistd.h>
+
+// frame layout - VCOM_MUX_ definitions in usb_class_cdc.h
+#define HDR_SIZE	3u
+#define MUX_CREDIT	0x80u
+#define MUX_CHMSK	0x7fu
+#define MAX_CHANNELS	(MUX_CHMSK + 1)
+
+#define WINDOW	4096u	// data bytes from the device buffered per channel
+#define FRAME_MAX	1024u	// data bytes per frame sent to the device
+#define GRANT_MIN	64u	// credit returned in chunks or when the buffer is empty
+
+struct chan_ {
+	int master, slave;	// slave kept open so the master does not hang up while no program uses the pty
+	uint8_t buf[WINDOW];	// data from the device not written to the pty yet
+	uint16_t len;
+	uint32_t freed;	// buffer space not granted to the device yet
+	uint32_t credit;	// data bytes the device can accept
+	char link[256];
+};
+
+static struct chan_ chan[MAX_CHANNELS];
+static unsigned nchan = 4;
+static int tty;
+static volatile sig_atomic_t quit;
+
+static void on_signal(int sig)
+{
+	quit = 1;
+}
+
+static void set_raw(int fd)
+{
+	struct termios t;
+	if (tcgetattr(fd, &t) == 0)
+	{
+		cfmakeraw(&t);
+		tcsetattr(fd, TCSANOW, &t);
+	}
+}
+
+static void send_frame(uint8_t hdr, uint16_t value, const uint8_t *data)
+{
+	uint8_t frame[HDR_SIZE + FRAME_MAX];
+	uint16_t len = hdr & MUX_CREDIT ? 0 : value;
+	size_t off = 0;
+
+	frame[0] = hdr;
+	frame[1] = value & 0xff;
+	frame[2] = value >> 8;
+	if (len)
+		memcpy(&frame[HDR_SIZE], data, len);
+	while (off < HDR_SIZE + len)
+	{
+		ssize_t n = write(tty, frame + off, HDR_SIZE + len - off);
+		if (n < 0 && errno != EINTR)
+		{
+			perror("device write");
+			quit = 1;
+			return;
+		}
+		if (n > 0)
+			off += n;
+	}
+}
+
+// write buffered device data to the pty, grant space freed to the device
+static void flush_chan(unsigned c)
+{
+	struct chan_ *cp = &chan[c];
+
+	if (cp->len)
+	{
+		ssize_t n = write(cp->master, cp->buf, cp->len);
+		if (n > 0)
+		{
+			memmove(cp->buf, cp->buf + n, cp->len - n);
+			cp->len -= n;
+			cp->freed += n;
+		}
+	}
+	if (cp->freed && (cp->freed >= GRANT_MIN || cp->len == 0))
+	{
+		send_frame(MUX_CREDIT | c, cp->freed, 0);
+		cp->freed = 0;
+	}
+}
+
+// parse frames received from the device
+static void demux(const uint8_t *data, size_t count)
+{
+	static uint8_t hdr[HDR_SIZE], hcount, idx;
+	static uint16_t left;
+	static unsigned long dropped;
+
+	for (size_t i = 0; i < count; )
+	{
+		if (left)
+		{
+			size_t len = left < count - i ? left : count - i;
+			left -= len;
+			if (idx < nchan)
+			{
+				struct chan_ *cp = &chan[idx];
+				size_t room = WINDOW - cp->len;
+				size_t n = len < room ? len : room;
+				memcpy(cp->buf + cp->len, data + i, n);
+				cp->len += n;
+				len -= n;
+				i += n;
+			}
+			if (len)
+			{
+				dropped += len;
+				fprintf(stderr, "channel %u: %lu bytes beyond window or channel count dropped\n", idx, dropped);
+				i += len;
+			}
+			continue;
+		}
+		hdr[hcount++] = data[i++];
+		if (hcount < HDR_SIZE)
+			continue;
+		hcount = 0;
+		idx = hdr[0] & MUX_CHMSK;
+		uint16_t value = hdr[1] | hdr[2] << 8;
+		if (hdr[0] & MUX_CREDIT)
+		{
+			if (idx < nchan)
+				chan[idx].credit += value;
+		}
+		else
+			left = value;
+	}
+}
+
+static void cleanup(void)
+{
+	for (unsigned c = 0; c < nchan; c++)
+		if (chan[c].link[0])
+			unlink(chan[c].link);
+}
+
+int main(int argc, char **argv)
+{
+	const char *prefix = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:l:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			nchan = strtoul(optarg, 0, 0);
+			break;
+		case 'l':
+			prefix = optarg;
+			break;
+		default:
+			nchan = 0;
+		}
+	}
+	if (optind != argc - 1 || nchan == 0 || nchan > MAX_CHANNELS)
+	{
+		fprintf(stderr, "usage: %s [-n channels] [-l link_prefix] tty_device\n", argv[0]);
+		return 1;
+	}
+
+	tty = open(argv[optind], O_RDWR | O_NOCTTY);
+	if (tty < 0)
+	{
+		perror(argv[optind]);
+		return 1;
+	}
+	set_raw(tty);
+	tcflush(tty, TCIOFLUSH);
+
+	atexit(cleanup);
+	for (unsigned c = 0; c < nchan; c++)
+	{
+		struct chan_ *cp = &chan[c];
+		const char *name;
+
+		cp->master = posix_openpt(O_RDWR | O_NOCTTY);
+		if (cp->master < 0 || grantpt(cp->master) || unlockpt(cp->master) || !(name = ptsname(cp->master))
+			|| (cp->slave = open(name, O_RDWR | O_NOCTTY)) < 0)
+		{
+			perror("pty");
+			return 1;
+		}
+		set_raw(cp->slave);
+		fcntl(cp->master, F_SETFL, O_NONBLOCK);
+		if (prefix)
+		{
+			snprintf(cp->link, sizeof(cp->link), "%s%u", prefix, c);
+			unlink(cp->link);
+			if (symlink(name, cp->link))
+			{
+				perror(cp->link);
+				cp->link[0] = 0;
+			}
+		}
+		printf("channel %u: %s%s%s\n", c, name, cp->link[0] ? " <- " : "", cp->link);
+	}
+	fflush(stdout);
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	for (unsigned c = 0; c < nchan; c++)
+		send_frame(MUX_CREDIT | c, WINDOW, 0);
+
+	struct pollfd pfd[MAX_CHANNELS + 1];
+	while (!quit)
+	{
+		pfd[0] = (struct pollfd){.fd = tty, .events = POLLIN};
+		for (unsigned c = 0; c < nchan; c++)
+			pfd[c + 1] = (struct pollfd){.fd = chan[c].master,
+				.events = (chan[c].credit ? POLLIN : 0) | (chan[c].len ? POLLOUT : 0)};
+		if (poll(pfd, nchan + 1, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+		if (pfd[0].revents)
+		{
+			uint8_t buf[4096];
+			ssize_t n = read(tty, buf, sizeof(buf));
+			if (n <= 0)
+			{
+				if (n < 0 && errno == EINTR)
+					continue;
+				fprintf(stderr, "device closed\n");
+				break;
+			}
+			demux(buf, n);
+		}
+		for (unsigned c = 0; c < nchan; c++)
+		{
+			struct chan_ *cp = &chan[c];
+
+			flush_chan(c);
+			if (pfd[c + 1].revents & POLLIN && cp->credit)
+			{
+				uint8_t buf[FRAME_MAX];
+				ssize_t n = read(cp->master, buf, cp->credit < sizeof(buf) ? cp->credit : sizeof(buf));
+				if (n > 0)
+				{
+					send_frame(c, n, buf);
+					cp->credit -= n;
+				}
+			}
+		}
+	}
+	return 0;
+}
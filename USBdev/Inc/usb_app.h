@@ -22,8 +22,25 @@ void vcom_write(uint8_t ch, const char *buf, uint16_t size);
 void vcom_putchar(uint8_t ch, char c);
 void vcom_putstring(uint8_t ch, const char *s);
 void vcom_prompt_request(uint8_t ch);
-
-uint8_t vcom_process_input(uint8_t ch, uint8_t c);	// defined as weak in usb_app.c, redefine for real use
+uint16_t vcom_read(uint8_t ch, void *buf, uint16_t size);
+uint16_t vcom_rx_count(uint8_t ch);
+uint16_t vcom_try_read(uint8_t ch, void *buf, uint16_t size);
+uint16_t vcom_try_write(uint8_t ch, const void *buf, uint16_t size);
+void vcom_flush(uint8_t ch);
+void vcom_set_serial_state(uint8_t ch, uint16_t state);
+
+// Tx coalescing policy
+enum vcom_txmode_ {
+	VCOM_TX_ADAPTIVE,	// send at once if idle, batch data written while a transfer is in progress (default)
+	VCOM_TX_TIMED	// send whole packets at once, partial packet after latency
+};
+void vcom_set_txmode(uint8_t ch, enum vcom_txmode_ mode, uint8_t latency);
+
+// readiness notifications, called from USB interrupt; defined as weak in usb_app.c
+void VCP_Readable(uint8_t ch);
+void VCP_Writable(uint8_t ch);
+
+uint8_t vcom_process_rx(uint8_t ch);	// defined as weak in usb_app.c, redefine for real use
 
 #define PIRET_PROMPTRQ	1u
 #define PIRET_AUTONUL	0x10
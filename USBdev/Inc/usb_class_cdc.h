@@ -18,6 +18,7 @@
 #define CDC_CAPI_CONTROL_MODEL                  0x05
 #define CDC_ETHERNET_NETWORKING_CONTROL_MODEL   0x06
 #define CDC_ATM_NETWORKING_CONTROL_MODEL        0x07
+#define CDC_NETWORK_CONTROL_MODEL               0x0D  // NCM10 4.2
 
 // Communication interface class control protocol codes
 // (usbcdc11.pdf, 4.4, Table 17)
@@ -41,6 +42,7 @@
 #define CDC_PROTOCOL_CAPI                       0x93
 #define CDC_PROTOCOL_HOST_BASED_DRIVER          0xFD
 #define CDC_PROTOCOL_DESCRIBED_IN_PUFD          0xFE
+#define CDC_PROTOCOL_NCM_DATA                   0x01  // NCM10 4.7
 
 // Type values for bDescriptorType field of functional descriptors
 // (usbcdc11.pdf, 5.2.3, Table 24)
@@ -66,6 +68,7 @@
 #define CDC_CAPI_CONTROL_MANAGEMENT             0x0E
 #define CDC_ETHERNET_NETWORKING                 0x0F
 #define CDC_ATM_NETWORKING                      0x10
+#define CDC_NCM                                 0x1A  // NCM10 5.2.1
 
 // CDC class-specific request codes
 // (usbcdc11.pdf, 6.2, Table 46)
@@ -191,6 +194,36 @@ struct cdc_SerialStateNotif_ {
 
 // application-specific CDC channel data
 
+// Rx and Tx ring size per channel, power of 2, up to 32 KiB
+#ifndef CDC_RX_BUF_SIZE
+#define CDC_RX_BUF_SIZE	(4 * CDC_DATA_EP_SIZE)
+#endif
+#ifndef CDC_TX_BUF_SIZE
+#define CDC_TX_BUF_SIZE	(4 * CDC_DATA_EP_SIZE)
+#endif
+
+// VCOM multiplexer - VCOM_MUX_CHANNELS logical channels carried over the data pipe of VCOM_MUX_CARRIER,
+// numbered from USBD_CDC_CHANNELS and served with the same vcom_ API; host side in Tools/vcom_demux.c
+#ifndef VCOM_MUX_CHANNELS
+#define VCOM_MUX_CHANNELS	0
+#endif
+#ifndef VCOM_MUX_CARRIER
+#define VCOM_MUX_CARRIER	0
+#endif
+#define VCOM_MUX_CH(n)	(USBD_CDC_CHANNELS + (n))	// channel no. of logical channel n
+#define VCOM_CHANNELS	(USBD_CDC_CHANNELS + VCOM_MUX_CHANNELS)
+
+// mux frame: header byte, 16-bit little endian value; header bit 7 clear - data frame, value bytes
+// of data follow; bit 7 set - credit frame, sender grants value more data bytes; bits 6..0 - logical channel
+#define VCOM_MUX_HDR_SIZE	3u
+#define VCOM_MUX_CREDIT	0x80u
+#define VCOM_MUX_CHMSK	0x7fu
+
+// CDC channels bridged to UARTs, bit n - channel n, see vcom_uart.h
+#ifndef VCOM_UART_BRIDGE
+#define VCOM_UART_BRIDGE	0u
+#endif
+
 // data that should be reset whenever the USB connection is established
 struct cdc_session_ {
 	volatile bool connected;
@@ -199,11 +232,28 @@ struct cdc_session_ {
 	uint8_t connstart_timer;
 	bool autonul;
 	uint8_t autonul_timer;
-	// change Len and Idx members to uint16_t for HS support
-	volatile uint8_t RxLength;
-	volatile uint8_t RxIdx;
-	volatile uint8_t TxLength;
+	// service requests for VCOM interrupts shared by all channels, cleared by the handler before service
+	volatile bool RxRq;
+	volatile bool TxRq;
+	// Rx ring indices, free running
+	volatile uint16_t RxHead;	// advanced on packet reception
+	volatile uint16_t RxTail;	// advanced by reader
+	bool RxWait;	// no room for a packet, Out endpoint not armed
+	// Tx ring indices, free running; TxSent bytes past TxTail are being sent
+	volatile uint16_t TxHead;	// advanced by writer
+	volatile uint16_t TxTail;	// advanced on transfer completion
+	uint16_t TxSent;
+	bool TxBusy;	// transfer in progress, Tx request held until completion
+	bool TxFlush;	// send all data, including partial packet
+	bool TxZlp;	// last transfer ended with full packet, not terminated yet
+	bool TxBlocked;	// writer refused, call VCP_Writable() on completion
 	uint8_t TxTout;
+	// mux logical channel flow control
+	uint16_t TxCredit;	// data bytes the host can accept
+	uint16_t RxGrant;	// Rx ring bytes freed, not granted to the host yet
+	// UART bridge
+	uint16_t UartTxLen;	// Rx ring bytes being sent by UART
+	uint16_t BreakTimer;	// ms, 0xffff - until cleared
 };
 
 // persisent data
@@ -214,14 +264,17 @@ struct cdc_data_ {
 	uint16_t SerialStateSent;	// last SerialState successfully sent
 	bool LineCodingChanged;
 	bool ControlLineStateChanged;
-	uint8_t RxData[CDC_DATA_EP_SIZE];
-	uint8_t TxData[CDC_DATA_EP_SIZE];
+	uint8_t RxData[CDC_RX_BUF_SIZE + CDC_DATA_EP_SIZE];	// Rx ring, packet received past its end is moved to start
+	uint8_t TxMode;	// enum vcom_txmode_, see usb_app.h
+	uint8_t TxLatency;	// ms, VCOM_TX_TIMED
+	uint8_t TxData[CDC_TX_BUF_SIZE];	// Tx ring
 	struct cdc_session_ session;
 };
 
 struct cdc_services_ {
 	void (*SetLineCoding)(const struct usbdevice_ *usbd, uint8_t idx);
 	void (*SetControlLineState)(const struct usbdevice_ *usbd, uint8_t idx);
+	void (*SendBreak)(const struct usbdevice_ *usbd, uint8_t idx, uint16_t duration);	// ms, 0xffff - until 0
 };
 
 //========================================================================
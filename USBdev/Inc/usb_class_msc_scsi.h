@@ -67,6 +67,7 @@
 #define SCSI_READ10                                 0x28	// used
 #define SCSI_WRITE10                                0x2A	// used
 #define SCSI_VERIFY10                               0x2F
+#define SCSI_SYNCHRONIZE_CACHE10                    0x35
 
 #define SCSI_MODE_SELECT10                          0x55
 #define SCSI_MODE_SENSE10                           0x5A
@@ -74,7 +75,8 @@
 #define SCSI_READ16                                 0x88
 #define SCSI_VERIFY16                               0x8F
 #define SCSI_WRITE16                                0x8A
-#define SCSI_READ_CAPACITY16                        0x9E
+#define SCSI_READ_CAPACITY16                        0x9E	// SERVICE ACTION IN(16)
+#define SAI_READ_CAPACITY16	0x10	// service action
 
 #define SCSI_READ12                                 0xA8
 #define SCSI_WRITE12                                0xAA
@@ -86,11 +88,11 @@
 #define SKEY_NO_SENSE                        0
 //#define RECOVERED_ERROR                             1
 #define SKEY_NOT_READY                                   2
-//#define MEDIUM_ERROR                                3
+#define SKEY_MEDIUM_ERROR                                3
 //#define HARDWARE_ERROR                              4
 #define SKEY_ILLEGAL_REQUEST                             5
 //#define UNIT_ATTENTION                              6
-//#define DATA_PROTECT                                7
+#define SKEY_DATA_PROTECT                                7
 //#define BLANK_CHECK                                 8
 //#define VENDOR_SPECIFIC                             9
 //#define COPY_ABORTED                                10
@@ -120,12 +122,60 @@
 #define STANDARD_INQUIRY_DATA_LEN                   0x24
 #define BLKVFY                                      0x04
 
+// mode pages (SPC-4 7.5)
+#define MODE_PAGE_CACHING	0x08
+#define MODE_PAGE_ALL	0x3F
+#define MODE_CACHING_WCE	0x04	// write cache enable, byte 2 of caching page
+#define MODE_DEVPARM_WP	0x80	// write protect, device-specific parameter in mode parameter header
+
+// VPD pages (SPC-4 7.8, SBC-3 6.5)
+#define VPD_SUPPORTED_PAGES	0x00
+#define VPD_BLOCK_LIMITS	0xB0
+#define VPD_LB_PROVISIONING	0xB2
+#define VPD_LBPU	0x80	// UNMAP supported, byte 5 of LB provisioning page
+#define VPD_PROV_THIN	0x02	// provisioning type, byte 6 of LB provisioning page
+#define RC16_LBPME	0x80	// logical block provisioning enabled, byte 14 of READ CAPACITY(16) data
+
 // BOT layer defs by gbm =================================================
 
 #define	BOTRQ_RESET	0xff
 #define BOTRQ_GET_MAX_LUN	0xfe
 
-#define MSC_DATA_BUF_SIZE	512u	// implementation-specific!
+// max. block size of all LUNs
+#ifndef MSC_DATA_BUF_SIZE
+#define MSC_DATA_BUF_SIZE	512u
+#endif
+
+// logical units, each with its own medium
+#ifndef MSC_LUNS
+#define MSC_LUNS	1u
+#endif
+_Static_assert(MSC_LUNS >= 1 && MSC_LUNS <= 16, "MSC_LUNS out of range");
+
+// READ10 block buffers, min. 2; the next blocks are read while one is sent
+#ifndef MSC_READ_AHEAD
+#define MSC_READ_AHEAD	2u
+#endif
+
+// write-back cache blocks, min. 2; should hold two erase sectors
+#ifndef MSC_WRITE_CACHE
+#define MSC_WRITE_CACHE	16u
+#endif
+
+// blocks in media erase sector - cached blocks of a sector are written together
+#ifndef MSC_ERASE_BLOCKS
+#define MSC_ERASE_BLOCKS	8u
+#endif
+
+// cache flushed after no writes for this time, ms
+#ifndef MSC_FLUSH_DELAY
+#define MSC_FLUSH_DELAY	200u
+#endif
+
+// max. UNMAP block descriptors in a parameter list
+#ifndef MSC_UNMAP_DESCRIPTORS
+#define MSC_UNMAP_DESCRIPTORS	4u
+#endif
 
 #define CBW_SIZE	31u
 #define CSW_SIZE	13u
@@ -158,11 +208,47 @@ struct botCSW_ {
 enum botstate_ {BS_CBW,	// waiting for CBW
 	BS_DATAOUT, BS_DATAIN,	// data transfer
 	BS_CSW,	// data In transfer complete, waiting for In ep to send CSW
+	BS_SYNC,	// SYNCHRONIZE CACHE, CSW sent when the cache is flushed
+	BS_UNMAPOUT,	// UNMAP parameter list transfer
+	BS_UNMAP,	// UNMAP, CSW sent when the blocks are discarded
 	BS_INVCBW,
 	BS_RESET	// BOT Reset request received
 };
 
+// READ10 read-ahead ring - filled at media interrupt level, sent by USB interrupt
+struct msc_readahead_ {
+	uint32_t blkaddr;	// next block to read
+	uint32_t toread;	// blocks left to read
+	uint8_t fill, send;	// buffer to read into, buffer being sent
+	uint8_t ready;	// buffers read and not sent yet
+	uint8_t gen;	// command generation - reads for a previous command are dropped
+	uint8_t lun;
+	bool waiting;	// In endpoint idle, waiting for a block
+	bool error;	// media read failed
+};
+
+// write-back cache - blocks received at USB interrupt level, flushed at media interrupt level
+enum msc_linestate_ {MSC_CL_FREE, MSC_CL_RX, MSC_CL_DIRTY, MSC_CL_FLUSH};
+
+struct msc_cacheline_ {
+	uint32_t lba;
+	uint32_t seq;	// write order - the oldest sector is flushed first
+	uint8_t lun, state;
+};
+
+struct msc_wcache_ {
+	struct msc_cacheline_ line[MSC_WRITE_CACHE];
+	uint32_t seq;
+	uint16_t idle;	// ms until the cache is flushed
+	uint8_t rx;	// line being received
+	uint8_t nfree;
+	bool rxwait;	// Out endpoint held until a line is free
+	bool flushall;	// flush the whole cache - idle or SYNCHRONIZE CACHE
+	bool error;	// media write failed since the last SYNCHRONIZE CACHE
+};
+
 struct msc_bot_scsi_data_ {
+	const struct usbdevice_ *usbd;
 	struct botCBW_ cbw;
 	struct botCSW_ csw;
 	enum botstate_ state;
@@ -173,8 +259,9 @@ struct msc_bot_scsi_data_ {
 	uint32_t scsi_nblocks;
 	const uint8_t *txptr;
 	uint8_t *rxptr;
-	uint8_t databuf[MSC_DATA_BUF_SIZE];
 	uint8_t outbuf[MSC_BOT_EP_SIZE];
+	struct msc_readahead_ ra;
+	struct msc_wcache_ wc;
 	uint16_t dbidx;
 	bool prevent_removal;
 	bool in_busy;
@@ -182,12 +269,29 @@ struct msc_bot_scsi_data_ {
 
 extern struct msc_bot_scsi_data_ bsdata;
 
+// LUN medium, msc_media[MSC_LUNS] is defined by the application; callbacks return 0 on success
+// Read and Write are called at media interrupt level, Init from msc_bot_init()
+struct msc_media_ {
+	uint32_t nblocks;
+	uint16_t blksize;	// multiple of MSC_BOT_EP_SIZE, up to MSC_DATA_BUF_SIZE
+	bool readonly;
+	const char *product;	// INQUIRY product ID, up to 16 characters; 0 - default
+	void (*Init)(uint8_t lun);
+	bool (*Read)(uint8_t lun, uint32_t blk, uint8_t *buf);
+	bool (*Write)(uint8_t lun, uint32_t blk, const uint8_t *buf);
+	bool (*Discard)(uint8_t lun, uint32_t blk, uint32_t nblocks);	// UNMAP; 0 - not supported
+};
+
+extern const struct msc_media_ msc_media[MSC_LUNS];
+
 
 void msc_bot_init(const struct usbdevice_ *usbd);
 void msc_bot_reset(void);
 void msc_bot_out(const struct usbdevice_ *usbd, uint8_t epn, uint16_t len);
 void msc_bot_in(const struct usbdevice_ *usbd, uint8_t epn);
 void msc_bot_ClearEPStall(const struct usbdevice_ *usbd, uint8_t epaddr);
+void msc_bot_tick(void);
+void msc_bot_flush(void);
 
 //========================================================================
 
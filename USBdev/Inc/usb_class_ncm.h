@@ -0,0 +1,160 @@
+/*
+ * lightweight USB device stack by gbm
+ * usb_class_ncm.h - CDC NCM network function definitions, see cdc_ncm.c
+ * Copyright (c) 2024 gbm
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef USB_CLASS_NCM_H_
+#define USB_CLASS_NCM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "usb_dev.h"
+
+/*----------------------------------------------------------------------------
+ *      Definitions based on NCM10.pdf (www.usb.org)
+ *---------------------------------------------------------------------------*/
+#define NCM_V1_00	0x0100
+
+// NCM class-specific request codes (NCM10 6.2, Table 6-2)
+#define NCMRQ_GET_NTB_PARAMETERS	0x80
+#define NCMRQ_GET_NET_ADDRESS	0x81
+#define NCMRQ_SET_NET_ADDRESS	0x82
+#define NCMRQ_GET_NTB_FORMAT	0x83
+#define NCMRQ_SET_NTB_FORMAT	0x84
+#define NCMRQ_GET_NTB_INPUT_SIZE	0x85
+#define NCMRQ_SET_NTB_INPUT_SIZE	0x86
+#define NCMRQ_GET_MAX_DATAGRAM_SIZE	0x87
+#define NCMRQ_SET_MAX_DATAGRAM_SIZE	0x88
+#define NCMRQ_GET_CRC_MODE	0x89
+#define NCMRQ_SET_CRC_MODE	0x8A
+
+// NCM Functional Descriptor bmNetworkCapabilities (NCM10 5.2.1, Table 5-2)
+#define NCM_NCAP_ETH_FILTER	(1u << 0)	// SetEthernetPacketFilter
+#define NCM_NCAP_NET_ADDRESS	(1u << 1)	// Get/SetNetAddress
+#define NCM_NCAP_ENCAP_COMMAND	(1u << 2)	// Send/GetEncapsulated...
+#define NCM_NCAP_MAX_DATAGRAM	(1u << 3)	// Get/SetMaxDatagramSize
+#define NCM_NCAP_CRC_MODE	(1u << 4)	// Get/SetCrcMode
+#define NCM_NCAP_NTB_INPUT_SIZE_8	(1u << 5)	// 8-byte GetNtbInputSize/SetNtbInputSize
+
+// NTB parameter structure bmNtbFormatsSupported (NCM10 6.2.1, Table 6-3)
+#define NCM_NTB16_SUPPORTED	(1u << 0)
+#define NCM_NTB32_SUPPORTED	(1u << 1)
+#define NCM_NTB_FORMAT_16	0u	// SetNtbFormat wValue
+
+// NTB16 signatures (NCM10 3.2.1, 3.3.1)
+#define NCM_NTH16_SIGNATURE	0x484D434Eu	// "NCMH"
+#define NCM_NDP16_NOCRC_SIGNATURE	0x304D434Eu	// "NCM0"
+
+// NTB16 header (NCM10 3.2.1)
+struct ncm_nth16_ {
+	uint32_t dwSignature;
+	uint16_t wHeaderLength;	// 12
+	uint16_t wSequence;
+	uint16_t wBlockLength;
+	uint16_t wNdpIndex;	// first NDP16
+};
+
+// NDP16 header, followed by datagram pointer entries terminated with a null entry (NCM10 3.3.1)
+struct ncm_ndp16_ {
+	uint32_t dwSignature;
+	uint16_t wLength;	// including entries, multiple of 4, min. 16
+	uint16_t wNextNdpIndex;
+};
+
+struct ncm_dpe16_ {
+	uint16_t wDatagramIndex;	// offset from NTB start
+	uint16_t wDatagramLength;
+};
+
+// GetNtbParameters response (NCM10 6.2.1, Table 6-3)
+struct ncm_ntb_parameters_ {
+	uint16_t wLength;	// 28
+	uint16_t bmNtbFormatsSupported;
+	uint32_t dwNtbInMaxSize;
+	uint16_t wNdpInDivisor;
+	uint16_t wNdpInPayloadRemainder;
+	uint16_t wNdpInAlignment;
+	uint16_t wReserved;
+	uint32_t dwNtbOutMaxSize;
+	uint16_t wNdpOutDivisor;
+	uint16_t wNdpOutPayloadRemainder;
+	uint16_t wNdpOutAlignment;
+	uint16_t wNtbOutMaxDatagrams;	// 0 - no limit
+};
+
+// NetworkConnection and ConnectionSpeedChange notifications (ECM120 6.3)
+struct ncm_notif_ {
+	USB_RequestType bmRequestType;
+	uint8_t bNotification;
+	uint16_t wValue, wIndex, wLength;
+	uint32_t dwDLBitRate, dwULBitRate;	// ConnectionSpeedChange only
+};
+
+// gbmUSBdevice stuff ====================================================
+// Out NTB buffer size, two buffers are used
+#ifndef NCM_NTB_OUT_SIZE
+#define NCM_NTB_OUT_SIZE	2048u
+#endif
+// max. In NTB size offered to the host; NTBs are gathered from frame buffers, so it costs no memory
+#ifndef NCM_NTB_IN_SIZE
+#define NCM_NTB_IN_SIZE	8192u
+#endif
+// frame pool size - frames being sent or queued for sending
+#ifndef NCM_TX_FRAMES
+#define NCM_TX_FRAMES	4u
+#endif
+// connection speed reported to the host, bit/s
+#ifndef NCM_LINK_SPEED
+#define NCM_LINK_SPEED	12000000u
+#endif
+// host side MAC address, 12 hex digits; the device stack must use a different one
+#ifndef NCM_MAC_STRING
+#define NCM_MAC_STRING	u"020047424D01"
+#endif
+#ifndef NCM_NOTIF_POLLING_INTERVAL
+#define NCM_NOTIF_POLLING_INTERVAL	32u	// ms
+#endif
+
+#define NCM_MAX_FRAME	1514u	// Ethernet frame without FCS
+#define NCM_NCAPS	(NCM_NCAP_ETH_FILTER | NCM_NCAP_MAX_DATAGRAM)
+
+_Static_assert(NCM_TX_FRAMES >= 1 && NCM_TX_FRAMES <= 32, "NCM_TX_FRAMES out of range");
+_Static_assert(NCM_NTB_OUT_SIZE % 4 == 0 && NCM_NTB_IN_SIZE >= 2048 && NCM_NTB_IN_SIZE <= 65535,
+	"NCM NTB size out of range");
+
+// called by usb_class.c and usb_app.c
+void ncm_init(const struct usbdevice_ *usbd);
+void ncm_reset(void);
+void ncm_HandleRequest(const struct usbdevice_ *usbd);
+bool ncm_SetInterface(const struct usbdevice_ *usbd, uint8_t alt);
+uint8_t ncm_GetInterface(void);
+void ncm_out(const struct usbdevice_ *usbd, uint8_t epn);
+void ncm_in(const struct usbdevice_ *usbd, uint8_t epn);
+
+// frame-level API for the network stack; thread or USB interrupt level
+bool ncm_link_up(void);	// host selected the data interface
+const uint8_t *ncm_recv(uint16_t *length);	// frame from the host in place, 0 if none
+void ncm_recv_done(void);	// release the frame returned by ncm_recv()
+uint8_t *ncm_frame_alloc(void);	// NCM_MAX_FRAME bytes from the pool, 0 if exhausted
+bool ncm_send(uint8_t *frame, uint16_t length);	// queue allocated frame, return 0 if queued; frame is freed anyway
+void ncm_frame_free(uint8_t *frame);	// return unsent frame to the pool
+
+// called from USB interrupt, redefine in the application (weak)
+void ncm_readable(void);	// frames received
+void ncm_writable(void);	// frame available after ncm_frame_alloc() failed
+void ncm_link_changed(bool up);
+
+#endif
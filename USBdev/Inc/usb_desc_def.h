@@ -165,6 +165,29 @@ struct USBdesc_union_ {
 		bMasterInterface,
 		bSlaveInterface0;
 };
+// Ethernet Networking Functional Descriptor, ECM120 5.4
+struct USBdesc_CDCeth_ {
+	uint8_t
+		bFunctionLength,	// 13
+		bDescriptorType,
+		bDescriptorSubtype,
+		iMACAddress;
+	uint8_t bmEthernetStatistics[4];
+	usb16	wMaxSegmentSize;
+	usb16	wNumberMCFilters;
+	uint8_t
+		bNumberPowerFilters;
+};
+// NCM Functional Descriptor, NCM10 5.2.1
+struct USBdesc_CDCncm_ {
+	uint8_t
+		bFunctionLength,	// 6
+		bDescriptorType,
+		bDescriptorSubtype;
+	usb16	bcdNcmVersion;
+	uint8_t
+		bmNetworkCapabilities;
+};
 // HID descriptor (follows HID interface desc) ==========================
 struct USBdesc_hid_ {
 	uint8_t
@@ -206,6 +229,21 @@ struct cdc_comp_desc_ {
 	struct cdc_desc_ cdcdesc;
 };
 
+// CDC NCM network function, data interface with alternate settings 0 (no endpoints) and 1
+struct ncm_desc_ {
+	struct USBdesc_IAD_ ncmiad;
+	struct USBdesc_if_ ncmcomifdesc;	// NCM comm interface
+	struct USBdesc_funCDChdr_ ncmhdrfunc;
+	struct USBdesc_union_ ncmudesc;
+	struct USBdesc_CDCeth_ ncmethdesc;
+	struct USBdesc_CDCncm_ ncmdesc;
+	struct USBdesc_ep_ ncmnotif;
+	struct USBdesc_if_ ncmdataif0;	// NCM data interface
+	struct USBdesc_if_ ncmdataif1;
+	struct USBdesc_ep_ ncmin;
+	struct USBdesc_ep_ ncmout;
+};
+
 // MSC device
 struct mscdesc_ {
 	struct USBdesc_if_ mscifdesc;
@@ -293,6 +331,9 @@ struct cfgdesc_msc_ncdc_prn_ {
 #if USBD_HID
 	struct hid_inonly_desc_ hid;
 #endif
+#if USBD_NCM
+	struct ncm_desc_ ncm;
+#endif
 };
 
 #endif /* __USB_DESC_H */
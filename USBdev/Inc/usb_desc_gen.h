@@ -24,6 +24,7 @@
 #include "usb_class_prn.h"
 #include "usb_class_hid.h"
 #include "usb_class_msc_scsi.h"
+#include "usb_class_ncm.h"
 
 // language identifier string descriptor structure
 struct langid_ {uint8_t bLength, type; uint16_t v;};
@@ -34,7 +35,28 @@ struct langid_ {uint8_t bLength, type; uint16_t v;};
 // define a string descriptor - name, string as L"text"
 #define STRINGDESC(n, s) const struct {uint8_t bLength, type; uint16_t str[sizeof(s) / 2 - 1];} \
 	n = {sizeof(s), USB_DESCTYPE_STRING, s};
-	
+
+// expand m(0) m(1) ... m(n - 1) to generate per-function tables and descriptors;
+// n must be a decimal number without suffix, up to 15
+#define USBD_REPEAT(n, m)	USBD_REPEAT_(n, m)
+#define USBD_REPEAT_(n, m)	USBD_REPEAT_##n(m)
+#define USBD_REPEAT_0(m)
+#define USBD_REPEAT_1(m)	m(0)
+#define USBD_REPEAT_2(m)	USBD_REPEAT_1(m) m(1)
+#define USBD_REPEAT_3(m)	USBD_REPEAT_2(m) m(2)
+#define USBD_REPEAT_4(m)	USBD_REPEAT_3(m) m(3)
+#define USBD_REPEAT_5(m)	USBD_REPEAT_4(m) m(4)
+#define USBD_REPEAT_6(m)	USBD_REPEAT_5(m) m(5)
+#define USBD_REPEAT_7(m)	USBD_REPEAT_6(m) m(6)
+#define USBD_REPEAT_8(m)	USBD_REPEAT_7(m) m(7)
+#define USBD_REPEAT_9(m)	USBD_REPEAT_8(m) m(8)
+#define USBD_REPEAT_10(m)	USBD_REPEAT_9(m) m(9)
+#define USBD_REPEAT_11(m)	USBD_REPEAT_10(m) m(10)
+#define USBD_REPEAT_12(m)	USBD_REPEAT_11(m) m(11)
+#define USBD_REPEAT_13(m)	USBD_REPEAT_12(m) m(12)
+#define USBD_REPEAT_14(m)	USBD_REPEAT_13(m) m(13)
+#define USBD_REPEAT_15(m)	USBD_REPEAT_14(m) m(14)
+
 // not parenthesized - watch the arguments! ==============================
 	
 // interface descriptor
@@ -42,6 +64,11 @@ struct langid_ {uint8_t bLength, type; uint16_t v;};
 {sizeof(struct USBdesc_if_), USB_DESCTYPE_INTERFACE, \
 	ifnum, 0, nep, classid, subclass, protocol, sidx}
 
+// interface descriptor, alternate setting
+#define IFDESCALT(ifnum, alt, nep, classid, subclass, protocol, sidx) \
+{sizeof(struct USBdesc_if_), USB_DESCTYPE_INTERFACE, \
+	ifnum, alt, nep, classid, subclass, protocol, sidx}
+
 // endpoint descriptor
 #define EPDESC(addr, type, size, interval) \
 {sizeof(struct USBdesc_ep_), USB_DESCTYPE_ENDPOINT, \
@@ -71,4 +98,21 @@ struct langid_ {uint8_t bLength, type; uint16_t v;};
 #define CDCVCOMIAD(ctrlif, sidx) {sizeof(struct USBdesc_IAD_), USB_DESCTYPE_IAD, \
 	ctrlif, 2, USB_CLASS_COMMUNICATIONS, CDC_ABSTRACT_CONTROL_MODEL, 0, sidx}
 
+// NCM: data interface alternate setting 0 has no endpoints, setting 1 - bulk pair (NCM10 5.3)
+#define CDCNCMDESC(ctrlif, notifinep, datainep, dataoutep, macsidx, sidx) { \
+		.ncmiad = {sizeof(struct USBdesc_IAD_), USB_DESCTYPE_IAD, \
+			ctrlif, 2, USB_CLASS_COMMUNICATIONS, CDC_NETWORK_CONTROL_MODEL, 0, sidx}, \
+		.ncmcomifdesc = IFDESC(ctrlif, 1, CDC_COMMUNICATION_INTERFACE_CLASS, CDC_NETWORK_CONTROL_MODEL, 0, 0), \
+		.ncmhdrfunc = {sizeof(struct USBdesc_funCDChdr_), CDC_CS_INTERFACE, CDC_HEADER, USB16(CDC_V1_10)}, \
+		.ncmudesc = {sizeof(struct USBdesc_union_), CDC_CS_INTERFACE, CDC_UNION, (ctrlif), (ctrlif) + 1}, \
+		.ncmethdesc = {sizeof(struct USBdesc_CDCeth_), CDC_CS_INTERFACE, CDC_ETHERNET_NETWORKING, macsidx, \
+			{0}, USB16(NCM_MAX_FRAME), USB16(0), 0}, \
+		.ncmdesc = {sizeof(struct USBdesc_CDCncm_), CDC_CS_INTERFACE, CDC_NCM, USB16(NCM_V1_00), NCM_NCAPS}, \
+		.ncmnotif = EPDESC(notifinep, USB_EPTYPE_INT, NCM_NOTIF_EP_SIZE, NCM_NOTIF_POLLING_INTERVAL), \
+		.ncmdataif0 = IFDESCALT(ctrlif + 1, 0, 0, CDC_DATA_INTERFACE_CLASS, 0, CDC_PROTOCOL_NCM_DATA, 0), \
+		.ncmdataif1 = IFDESCALT(ctrlif + 1, 1, 2, CDC_DATA_INTERFACE_CLASS, 0, CDC_PROTOCOL_NCM_DATA, 0), \
+		.ncmin = EPDESC(datainep, USB_EPTYPE_BULK, NCM_DATA_EP_SIZE, 0), \
+		.ncmout = EPDESC(dataoutep, USB_EPTYPE_BULK, NCM_DATA_EP_SIZE, 0) \
+	}
+
 #endif
@@ -22,6 +22,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "usb_hw.h"
+#include <usb_dev_config.h>	// from include path - app config dir listed before USBdev/Inc takes precedence
 
 // USB standard definitions ===============================================
 
@@ -62,6 +63,7 @@ struct usbdevice_;
 struct epcfg_ {
 	uint8_t ifidx;
 	void (*handler)(const struct usbdevice_ *usbd, uint8_t epn);
+	bool dblbuf;	// FS drivers: double-buffered bulk ep, other direction of the pair must be unused
 };
 // mapping of interfaces to classes and instance idx 
 struct ifassoc_ {
@@ -73,7 +75,7 @@ struct usbdcfg_ {
 	uint8_t irqn;
 	uint8_t irqpri;
 	uint8_t numeppairs:5;
-	uint8_t numif:3;
+	uint8_t numif;
 	uint8_t nstringdesc;
 	const struct epcfg_ *outepcfg;
 	const struct epcfg_ *inepcfg;
@@ -83,6 +85,8 @@ struct usbdcfg_ {
 	const uint8_t * const *strdesc;
 	const uint8_t hidrepdescsize;
 	const uint8_t * const hidrepdesc;
+	uint8_t *ctrlbuf;	// optional buffer for control Out data stage longer than one packet
+	uint16_t ctrlbufsize;
 };
 
 // EP0 State
@@ -90,6 +94,17 @@ enum usbd_ep0_state_ {USBD_EP0_IDLE, USBD_EP0_SETUP,
 	USBD_EP0_DATA_IN, USBD_EP0_DATA_OUT,
 	USBD_EP0_STATUS_IN, USBD_EP0_STATUS_OUT, USBD_EP0_STALL};
 
+// control In response generator - fills EP0 packets on demand
+typedef void (*usbd_txfill_fn)(const struct usbdevice_ *usbd, uint8_t *buf, uint16_t offset, uint16_t size);
+
+struct usbtxgen_ {
+	usbd_txfill_fn fill;	// called with offset of data to be produced and its size, up to USBD_CTRL_EP_SIZE
+	const struct usbdevice_ *usbd;
+	uint16_t length;	// total response length
+	uint16_t offset;	// no. of bytes produced so far
+	uint8_t buf[USBD_CTRL_EP_SIZE];	// scratch packet buffer
+};
+
 // device status & data - variable
 struct usbdevdata_ {
 	uint8_t devstate;
@@ -99,16 +114,80 @@ struct usbdevdata_ {
 	uint16_t status;	// check in USB doc
 	USB_SetupPacket req;
 //	USB_SetupPacket ep0outpkt;
+	uint8_t *ep0data;	// control Out data stage - packet buffer or buffer assembling multiple packets
+	uint16_t ep0count;	// no. of control Out data bytes received
+	struct usbtxgen_ ep0gen;	// control In response generator state
+};
+
+#ifndef USBD_CTRL_OUT_BUF_SIZE
+#define USBD_CTRL_OUT_BUF_SIZE	0
+#endif
+
+#ifndef USBD_XFER_QUEUE_LEN
+#define USBD_XFER_QUEUE_LEN	0
+#endif
+
+// queued transfer completion status
+enum usbxfer_status_ {USBXFER_DONE, USBXFER_ABORTED};
+
+// queued In transfer descriptor
+struct usbxfer_ {
+	const uint8_t *data;
+	uint16_t length;
+	bool zlp;
+	// completion callback, called from USB interrupt, may be null
+	void (*done)(const struct usbdevice_ *usbd, uint8_t epaddr, uint16_t count, enum usbxfer_status_ status);
+};
+
+// In transfer data segment for scatter-gather send
+struct usbiov_ {
+	const uint8_t *data;
+	uint16_t length;
 };
 
 // endpoint status & data - variable
 struct epdata_ {
 	uint8_t *ptr;	// current address
 	uint16_t count;	// no. of bytes read/left to write
+	uint16_t length;	// Out: requested multi-packet transfer length, 0 for single packet; In: transfer length
+	uint16_t seglen;	// In: bytes left in current segment
+	uint8_t iovcnt;	// In: no. of segments following the current one
+	const struct usbiov_ *iov;	// In: next segment
+	struct usbtxgen_ *gen;	// In: data generator, called when segments are exhausted
+	uint8_t *rxbuf[2];	// Out: ping-pong buffers, see USBdev_RxSwap()
+	uint16_t rxlen[2];	// Out: no. of bytes in buffers owned by consumer
+	volatile uint8_t rxowned;	// Out: bit n set - rxbuf[n] owned by consumer
+	uint8_t rxfill;	// Out: index of buffer being filled
+	bool rxwait;	// Out: both buffers owned by consumer, endpoint not armed
 	bool sendzlp;
 	bool busy;
+#if USBD_XFER_QUEUE_LEN
+	bool xqactive;	// transfer in progress is xq[xqhead]
+	uint8_t xqhead, xqcount;
+	struct usbxfer_ xq[USBD_XFER_QUEUE_LEN];	// In transfer queue
+#endif
+};
+
+// per-endpoint traffic counters, kept over bus reset, read with USBD_VENDOR_RQ_GET_EPSTATS
+struct epstats_ {
+	uint32_t packets;	// data packets written to or read from hw buffer, including ZLPs and setup
+	uint32_t bytes;	// data bytes in completed transfers
+	uint32_t transfers;	// completed transfers
+	uint16_t zlps;	// zero-length packets
+	uint16_t stalls;	// endpoint stalled by device
+	uint16_t busy;	// In: send rejected, ep busy or queue full; Out: reception paused, no free buffer
+	uint16_t resvd;
 };
 
+// vendor requests to device: Get - Out counters for endpoints 0..numeppairs - 1, then In counters
+// Clear - no data; may be redefined in usb_dev_config.h to avoid conflicts with app requests
+#ifndef USBD_VENDOR_RQ_GET_EPSTATS
+#define USBD_VENDOR_RQ_GET_EPSTATS	0xE0u
+#endif
+#ifndef USBD_VENDOR_RQ_CLEAR_EPSTATS
+#define USBD_VENDOR_RQ_CLEAR_EPSTATS	0xE1u
+#endif
+
 // device config and state structure - constant with pointers to variables
 struct usbdevice_ {
 	void *usb;	// USB module address, actually USBh_TypeDef *
@@ -117,6 +196,8 @@ struct usbdevice_ {
 	struct usbdevdata_ *devdata;
 	struct epdata_ *outep;
 	struct epdata_ *inep;
+	struct epstats_ *outstats;
+	struct epstats_ *instats;
 	void (*Reset_Handler)(void);
 	void (*Suspend_Handler)(void);
 	void (*Resume_Handler)(void);
@@ -140,15 +221,81 @@ const struct USBdesc_ep_ *USBdev_GetEPDescriptor(const struct usbdevice_ *usbd,
 void USBdev_SetupEPHandler(const struct usbdevice_ *usbd, uint8_t epn);
 void USBdev_OutEPHandler(const struct usbdevice_ *usbd, uint8_t epn, bool setup);
 void USBdev_InEPHandler(const struct usbdevice_ *usbd, uint8_t epn);
+void USBdev_AbortTransfers(const struct usbdevice_ *usbd);
+
+void USBdev_TxGenerate(struct epdata_ *epd);
+
+static inline struct epstats_ *USBdev_EPStats(const struct usbdevice_ *usbd, uint8_t epaddr)
+{
+	return &(epaddr & 0x80 ? usbd->instats : usbd->outstats)[epaddr & EPNUMMSK];
+}
+
+// called by hw module for every packet written to or read from hw buffer
+static inline void USBdev_CountPacket(const struct usbdevice_ *usbd, uint8_t epaddr, uint16_t size)
+{
+	struct epstats_ *st = USBdev_EPStats(usbd, epaddr);
+	++st->packets;
+	if (size == 0)
+		++st->zlps;
+}
+
+// called by hw module when endpoint is stalled; epaddr may come from host request
+static inline void USBdev_CountStall(const struct usbdevice_ *usbd, uint8_t epaddr)
+{
+	if ((epaddr & EPNUMMSK) < usbd->cfg->numeppairs)
+		++USBdev_EPStats(usbd, epaddr)->stalls;
+}
+
+// In data source for hw module FIFO/PMA writers
+// switch to next non-empty segment or generated packet when the current one is exhausted
+static inline void USBdev_NextTxSegment(struct epdata_ *epd)
+{
+	while (epd->seglen == 0 && epd->iovcnt)
+	{
+		epd->ptr = (uint8_t *)epd->iov->data;
+		epd->seglen = epd->iov->length;
+		++epd->iov;
+		--epd->iovcnt;
+	}
+	if (epd->seglen == 0 && epd->gen)
+		USBdev_TxGenerate(epd);
+}
+
+// get next In data byte - slow path for packets straddling segment boundary
+static inline uint8_t USBdev_TxByte(struct epdata_ *epd)
+{
+	USBdev_NextTxSegment(epd);
+	--epd->seglen;
+	return *epd->ptr++;
+}
+
+// called by usb_dev - class-specific buffer for multi-packet control Out data stage, weak
+uint8_t *USBclass_GetCtrlOutBuf(const struct usbdevice_ *usbd, const USB_SetupPacket *req);
 
 // called by usb_class - request handling
 void USBdev_SendStatus(const struct usbdevice_ *usbd, const uint8_t *data, uint16_t length, bool zlp);
 void USBdev_SendStatusOK(const struct usbdevice_ *usbd);
+void USBdev_SendStatusGen(const struct usbdevice_ *usbd, uint16_t length, usbd_txfill_fn fill);
+bool USBclass_GetDescriptor(const struct usbdevice_ *usbd);	// weak
+bool USBclass_HandleVendorRequest(const struct usbdevice_ *usbd);	// weak
+bool USBclass_SetInterface(const struct usbdevice_ *usbd, uint8_t interface, uint8_t alt);	// weak, 1 if accepted
+uint8_t USBclass_GetInterface(const struct usbdevice_ *usbd, uint8_t interface);	// weak
 void USBdev_CtrlError(const struct usbdevice_ *usbd);
 
 // called by app
 void USBdev_SetRxBuf(const struct usbdevice_ *usbd, uint8_t epn, uint8_t *buf);
 void USBdev_EnableRx(const struct usbdevice_ *usbd, uint8_t epn);
+void USBdev_ReceiveData(const struct usbdevice_ *usbd, uint8_t epn, uint8_t *buf, uint16_t length);
 bool USBdev_SendData(const struct usbdevice_ *usbd, uint8_t epn, const uint8_t *data, uint16_t length, bool zlp);
+// ping-pong reception
+void USBdev_SetRxBufPair(const struct usbdevice_ *usbd, uint8_t epn, uint8_t *buf0, uint8_t *buf1);
+uint8_t *USBdev_RxSwap(const struct usbdevice_ *usbd, uint8_t epn);
+uint8_t *USBdev_RxBuf(const struct usbdevice_ *usbd, uint8_t epn, uint16_t *length);
+void USBdev_RxRelease(const struct usbdevice_ *usbd, uint8_t epn);
+bool USBdev_SendDataV(const struct usbdevice_ *usbd, uint8_t epn, const struct usbiov_ *iov, uint8_t iovcnt, bool zlp);
+void USBdev_AbortIn(const struct usbdevice_ *usbd, uint8_t epn);
+#if USBD_XFER_QUEUE_LEN
+bool USBdev_QueueData(const struct usbdevice_ *usbd, uint8_t epn, const struct usbxfer_ *xfer);
+#endif
 
 #endif
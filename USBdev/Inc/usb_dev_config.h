@@ -9,9 +9,10 @@
 #ifndef SIMPLE_CDC
 
 #define USBD_MSC 0	// not supported yet
-#define USBD_CDC_CHANNELS	2
+#define USBD_CDC_CHANNELS	2	// decimal number, no suffix; limited by USB_NEPPAIRS
 #define USBD_PRINTER	0
 #define USBD_HID	1	// new, tested on U545
+#define USBD_NCM	0	// CDC NCM network function, see cdc_ncm.c
 
 //#define HID_PWR
 
@@ -21,12 +22,13 @@
 #define USBD_CDC_CHANNELS	1
 #define USBD_PRINTER	0
 #define USBD_HID	0	// new, tested on U545
+#define USBD_NCM	0
 
 #endif	// SIMPLE_CDC
 
 // synthesize PID from device config
 #define USBD_CFG_PID	((USBD_MSC << 3) | USBD_CDC_CHANNELS << 0 \
-	| (USBD_PRINTER) << 4 | (USBD_HID) << 2 )
+	| (USBD_PRINTER) << 4 | (USBD_HID) << 2 | (USBD_NCM) << 5)
 
 // Vendor and product ID
 #define	USB_VID	0x6666
@@ -38,6 +40,8 @@
 #define CDC_DATA_EP_SIZE	64u
 #define CDC_INT_EP_SIZE	10u	// serial state notification size is 10 bytes
 #define PRN_DATA_EP_SIZE	64u
+#define NCM_DATA_EP_SIZE	64u
+#define NCM_NOTIF_EP_SIZE	16u	// connection speed change notification is 16 bytes
 
 #if USBD_HID
 #ifdef HID_PWR
@@ -56,6 +60,47 @@
 
 //#define USE_COMMON_CDC_INT_IN_EP
 #define CDC_INT_POLLING_INTERVAL	10u	// ms
+#define CDC_RX_BUF_SIZE	512u	// per channel Rx ring, bytes, power of 2
+#define CDC_TX_BUF_SIZE	1024u	// per channel Tx ring, bytes, power of 2
+//#define VCOM_MUX_CHANNELS	4	// logical channels multiplexed over one CDC channel, see Tools/vcom_demux.c
+//#define VCOM_MUX_CARRIER	0	// CDC channel carrying the mux, not available to the application
+//#define VCOM_UART_BRIDGE	(1u << 0)	// channels bridged to UARTs with DMA, see vcom_uart.h
+//#define MSC_READ_AHEAD	2u	// MSC READ10 block buffers, more for media with uneven access time
+//#define MSC_WRITE_CACHE	16u	// MSC write-back cache blocks, two erase sectors or more
+//#define MSC_ERASE_BLOCKS	8u	// blocks in media erase sector
+//#define MSC_LUNS	1u	// MSC logical units, media defined by the application in msc_media[]
+//#define MSC_UNMAP_DESCRIPTORS	4u	// max. UNMAP block descriptors, for media with Discard callback
+
+// buffer for control Out data stages longer than USBD_CTRL_EP_SIZE, 0 - none
+#define USBD_CTRL_OUT_BUF_SIZE	0u
+
+// In transfer queue length per endpoint for USBdev_QueueData(), 0 - no queue
+#define USBD_XFER_QUEUE_LEN	4u
+
+// binary event trace, see usb_log.h
+//#define USBLOG
+//#define USBLOG_SIZE	64u	// entries, power of 2
+
+// packet capture for pcap export, see usb_log.h
+//#define USBCAP
+//#define USBCAP_SIZE	4096u	// bytes, power of 2
+//#define USBCAP_SNAPLEN	64u	// data bytes per record
+
+// vendor request codes for reading and clearing endpoint counters, see usb_dev.h
+//#define USBD_VENDOR_RQ_GET_EPSTATS	0xE0u
+//#define USBD_VENDOR_RQ_CLEAR_EPSTATS	0xE1u
+
+// endpoint pairs used by CDC channels - notification In and data In/Out pair per channel,
+// or a single notification In shared by all channels
+#ifdef USE_COMMON_CDC_INT_IN_EP
+#define CDC_NUM_EPPAIRS	(USBD_CDC_CHANNELS + 1)
+#define CDC_INT_EPIDX(ch)	0
+#define CDC_DATA_EPIDX(ch)	((ch) + 1)
+#else
+#define CDC_NUM_EPPAIRS	(2 * USBD_CDC_CHANNELS)
+#define CDC_INT_EPIDX(ch)	(2 * (ch))
+#define CDC_DATA_EPIDX(ch)	(2 * (ch) + 1)
+#endif
 
 // interface numbers - start at 0
 enum usbd_ifnum_ {
@@ -64,13 +109,8 @@ enum usbd_ifnum_ {
 #endif
 
 #if USBD_CDC_CHANNELS
-	IFNUM_CDC0_CONTROL, IFNUM_CDC0_DATA,
-#if USBD_CDC_CHANNELS > 1
-	IFNUM_CDC1_CONTROL, IFNUM_CDC1_DATA,
-#if USBD_CDC_CHANNELS > 2
-	IFNUM_CDC2_CONTROL, IFNUM_CDC2_DATA,
-#endif	// USBD_CDC_CHANNELS > 2
-#endif	// USBD_CDC_CHANNELS > 1
+	IFNUM_CDC_FIRST,	// control and data interface of each channel, see IFNUM_CDC_CONTROL()
+	IFNUM_CDC_LAST = IFNUM_CDC_FIRST + 2 * USBD_CDC_CHANNELS - 1,
 #endif	// USBD_CDC_CHANNELS
 
 #if USBD_PRINTER
@@ -78,6 +118,10 @@ enum usbd_ifnum_ {
 #endif
 #if USBD_HID
 	IFNUM_HID,
+#endif
+#if USBD_NCM
+	IFNUM_NCM_CONTROL,	// CDC NCM network function, see cdc_ncm.c
+	IFNUM_NCM_DATA,
 #endif
 	USBD_NUM_INTERFACES	// number of interfaces
 };
@@ -91,20 +135,8 @@ enum usbd_epaddr_ {
 #endif
 
 #if USBD_CDC_CHANNELS
-	EMPTY0_EP,
-	CDC0_DATA_OUT_EP,
-#if USBD_CDC_CHANNELS > 1
-#ifndef USE_COMMON_CDC_INT_IN_EP
-	EMPTY1_EP,
-#endif
-	CDC1_DATA_OUT_EP,
-#if USBD_CDC_CHANNELS > 2
-#ifndef USE_COMMON_CDC_INT_IN_EP
-	EMPTY2_EP,
-#endif
-	CDC2_DATA_OUT_EP,
-#endif	// USBD_CDC_CHANNELS > 2
-#endif	// USBD_CDC_CHANNELS > 1
+	CDC_FIRST_OUT_EP,	// Out of notification ep pair unused, see CDC_DATA_OUT_EP()
+	CDC_LAST_OUT_EP = CDC_FIRST_OUT_EP + CDC_NUM_EPPAIRS - 1,
 #endif	// USBD_CDC_CHANNELS
 
 #if USBD_PRINTER
@@ -112,6 +144,10 @@ enum usbd_epaddr_ {
 #endif
 #if USBD_HID	// && defined(HID_OUT_EP_SIZE)
 	HID_OUT_EP,
+#endif
+#if USBD_NCM
+	NCM_NOTIF_OUT_EP,	// Out of notification ep pair unused
+	NCM_DATA_OUT_EP,
 #endif
 	USBD_OUT_EPS,	// no. of Out endpoints
 	
@@ -122,26 +158,18 @@ enum usbd_epaddr_ {
 #endif
 
 #if USBD_CDC_CHANNELS
-	CDC0_INT_IN_EP,
-	CDC0_DATA_IN_EP,
-#if USBD_CDC_CHANNELS > 1
-#ifndef USE_COMMON_CDC_INT_IN_EP
-	CDC1_INT_IN_EP,
-#endif
-	CDC1_DATA_IN_EP,
-#if USBD_CDC_CHANNELS > 2
-#ifndef USE_COMMON_CDC_INT_IN_EP
-	CDC2_INT_IN_EP,
-#endif
-	CDC2_DATA_IN_EP,
-#endif	// USBD_CDC_CHANNELS > 2
-#endif	// USBD_CDC_CHANNELS > 1
+	CDC_FIRST_IN_EP,	// see CDC_INT_IN_EP(), CDC_DATA_IN_EP()
+	CDC_LAST_IN_EP = CDC_FIRST_IN_EP + CDC_NUM_EPPAIRS - 1,
 #endif	// USBD_CDC_CHANNELS
 #if USBD_PRINTER
 	PRN_DATA_IN_EP,
 #endif
 #if USBD_HID
 	HID_IN_EP,
+#endif
+#if USBD_NCM
+	NCM_NOTIF_IN_EP,
+	NCM_DATA_IN_EP,
 #endif
 	USBD_IN_EPS	// no. of In endpoints
 };
@@ -149,9 +177,11 @@ enum usbd_epaddr_ {
 // no of endpoint pairs used in the application
 #define USBD_NUM_EPPAIRS	((USBD_IN_EPS & 0xf) > USBD_OUT_EPS ? (USBD_IN_EPS & 0xf) : USBD_OUT_EPS) 
 
-#ifdef USE_COMMON_CDC_INT_IN_EP
-#define	CDC1_INT_IN_EP CDC0_INT_IN_EP
-#define	CDC2_INT_IN_EP CDC0_INT_IN_EP
-#endif
+// CDC channel ch interfaces and endpoints
+#define IFNUM_CDC_CONTROL(ch)	(IFNUM_CDC_FIRST + 2 * (ch))
+#define IFNUM_CDC_DATA(ch)	(IFNUM_CDC_CONTROL(ch) + 1)
+#define CDC_INT_IN_EP(ch)	(CDC_FIRST_IN_EP + CDC_INT_EPIDX(ch))
+#define CDC_DATA_IN_EP(ch)	(CDC_FIRST_IN_EP + CDC_DATA_EPIDX(ch))
+#define CDC_DATA_OUT_EP(ch)	(CDC_FIRST_OUT_EP + CDC_DATA_EPIDX(ch))
 
 #endif
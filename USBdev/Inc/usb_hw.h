@@ -14,7 +14,18 @@ enum usb_epstate_ {USB_EPSTATE_DISABLE, USB_EPSTATE_STALL, USB_EPSTATE_NAK, USB_
 #define USB_IRQHandler	OTG_FS_IRQHandler
 #endif
 
-#if defined(STM32F10X_MD) || defined(STM32F103xB)
+#if defined(USBD_SIM)	// software USB controller for running the stack on a workstation
+#include "usbsim_mcu.h"
+#define USB_NEPPAIRS	16u	// no. of endpoint pairs supported by hardware
+#define EPNUMMSK	0xfu
+extern const struct USBhw_services_ sim_services;
+#define usb_hw_services	sim_services
+
+#define USB_IRQn	SIM_USB_IRQn
+#define USB_IRQHandler	SIM_USB_IRQHandler
+#define USB_BASE	(&usbsim_periph)
+
+#elif defined(STM32F10X_MD) || defined(STM32F103xB)
 //#include "stm32f10x.h"
 #include "stm32f1xx.h"
 #define USB_NEPPAIRS	8u	// no. of endpoint pairs supported by hardware
@@ -30,6 +30,7 @@
 //void USBhw_EnableCtlSetup(const struct usbdevice_ *usbd);
 //void USBhw_EnableRx(const struct usbdevice_ *usbd, uint8_t epn);
 //void USBhw_StartTx(const struct usbdevice_ *usbd, uint8_t epn);
+//void USBhw_AbortTx(const struct usbdevice_ *usbd, uint8_t epn);
 
 struct USBhw_services_ {
 	void (*IRQHandler)(const struct usbdevice_ *usbd);
@@ -37,6 +38,7 @@ struct USBhw_services_ {
 	void (*Init)(const struct usbdevice_ *usbd);
 	void (*DeInit)(const struct usbdevice_ *usbd);
 	uint16_t (*GetInEPSize)(const struct usbdevice_ *usbd, uint8_t epn);
+	uint16_t (*GetFrameNum)(const struct usbdevice_ *usbd);	// last SOF frame number
 
 	void (*SetCfg)(const struct usbdevice_ *usbd);
 	void (*ResetCfg)(const struct usbdevice_ *usbd);
@@ -48,6 +50,7 @@ struct USBhw_services_ {
 	void (*EnableCtlSetup)(const struct usbdevice_ *usbd);
 	void (*EnableRx)(const struct usbdevice_ *usbd, uint8_t epn);
 	void (*StartTx)(const struct usbdevice_ *usbd, uint8_t epn);
+	void (*AbortTx)(const struct usbdevice_ *usbd, uint8_t epn);	// called via USBdev_AbortIn()
 };
 
 #endif
@@ -0,0 +1,44 @@
+/*
+ * lightweight USB device stack by gbm
+ * usb_hw_sim.h - virtual host side of the simulated USB device controller
+ * Copyright (c) 2024 gbm
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef USB_HW_SIM_H_
+#define USB_HW_SIM_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// device handshake for a single transaction
+enum usbsim_hs_ {USBSIM_ACK, USBSIM_NAK, USBSIM_STALL, USBSIM_NORESP};
+
+// bus events - device interrupt runs before return unless masked
+bool usbsim_attached(void);	// device pull-up enabled
+void usbsim_bus_reset(void);
+void usbsim_sof(void);
+void usbsim_suspend(void);
+void usbsim_resume(void);
+
+// transactions addressed to device addr, one packet each
+enum usbsim_hs_ usbsim_setup(uint8_t addr, const uint8_t *pkt);
+enum usbsim_hs_ usbsim_out(uint8_t addr, uint8_t epn, const uint8_t *data, uint16_t length);
+enum usbsim_hs_ usbsim_in(uint8_t addr, uint8_t epn, uint8_t *data, uint16_t *length);
+
+// write a usb_log.h capture record for every transaction to f, 0 - stop
+void usbsim_capture(FILE *f);
+
+#endif
@@ -1,34 +1,142 @@
-/* 
+/*
  * lightweight USB device stack by gbm
- * usb_log.h - request log for USB device debugging
+ * usb_log.h - binary event trace for USB device debugging
  * Copyright (c) 2022 gbm
- * 
- * This program is free software: you can redistribute it and/or modify  
- * it under the terms of the GNU General Public License as published by  
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
  * the Free Software Foundation, version 3.
  *
- * This program is distributed in the hope that it will be useful, but 
- * WITHOUT ANY WARRANTY; without even the implied warranty of 
- * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
  * General Public License for more details.
  *
- * You should have received a copy of the GNU General Public License 
+ * You should have received a copy of the GNU General Public License
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef USB_LOG_H_
+#define USB_LOG_H_
+
 #include <stddef.h>
 #include "usb_std_def.h"
+#include "usb_dev.h"
 
-//#define USBLOG
+//#define USBLOG	// define in usb_dev_config.h
 #ifdef USBLOG
 // Log ===================================================================
-enum stp_rsp_ {RSP_NONE, RSP_ERR, RSP_OK, RSP_STATUS};
-void USBlog_storerq(USB_SetupPacket *pkt);
-void USBlog_storeresp(enum stp_rsp_ resp, uint8_t resplen);
-size_t USBlog_get(char *s);
-void USBlog_recordevt(uint8_t ef);
+/*
+ * Events are appended to a ring of USBLOG_SIZE entries from USB interrupt only (single writer),
+ * overwriting the oldest ones. USBlog_drain() may be called from any other context.
+ * Drained data is a stream of 16-byte entries, little endian, decoded by Tools/usblog_decode.c
+ */
+#ifndef USBLOG_SIZE
+#define USBLOG_SIZE	64u	// no. of entries, power of 2
+#endif
+
+// timestamp source, may be redefined in usb_dev_config.h, e.g. as DWT->CYCCNT
+#ifndef USBLOG_TIMESTAMP
+extern volatile uint32_t usbdev_msec;	// defined in usb_app.c
+#define USBLOG_TIMESTAMP()	usbdev_msec
+#endif
+
+_Static_assert((USBLOG_SIZE & (USBLOG_SIZE - 1)) == 0, "USBLOG_SIZE must be a power of 2");
+
+enum usblog_evt_ {
+	ULE_LOST,	// arg[0]: no. of entries overwritten before being drained
+	ULE_RESET, ULE_SUSPEND, ULE_RESUME,
+	ULE_SETUP,	// req: setup packet
+	ULE_CTRL_IN,	// control In data or status stage started, len: data length
+	ULE_CTRL_STALL,	// control request refused
+	ULE_ADDRESS,	// arg[0]: address assigned
+	ULE_OUT,	// Out packet or transfer received, len: data length
+	ULE_IN,	// In transfer completed, len: data length
+	ULE_APP = 0x80	// application events
+};
+
+struct usblog_entry_ {
+	uint32_t ts;	// USBLOG_TIMESTAMP() value
+	uint8_t evt;	// enum usblog_evt_
+	uint8_t ep;	// endpoint address
+	uint16_t len;
+	union {
+		USB_SetupPacket req;
+		uint32_t arg[2];
+	};
+};
+
+void USBlog_event(uint8_t evt, uint8_t ep, uint16_t len, uint32_t arg);
+void USBlog_setup(const USB_SetupPacket *req);
+uint16_t USBlog_drain(uint8_t *buf, uint16_t size);
+#else
+#define USBlog_event(e, ep, l, a)	((void)0)
+#define USBlog_setup(r)	((void)0)
+#endif
+
+// Packet capture ========================================================
+/*
+ * Capture stream - records of struct usbcap_rec_ followed by caplen data bytes, padded to
+ * a multiple of 4 bytes, little endian; converted to pcap by Tools/usbcap2pcap.c.
+ * Device side records are transfer events, setup packets and stalls; the simulated host
+ * (usb_hw_sim.c) writes a record for every transaction, including the ones NAKed.
+ */
+enum usbcap_evt_ {
+	UCE_SETUP,	// setup packet, 8 bytes of data
+	UCE_SUBMIT,	// In transfer started by device, len: transfer length
+	UCE_COMPLETE,	// Out transfer received, In transfer sent, len: data length
+	UCE_STALL,	// control request refused
+	UCE_DROP,	// len: no. of records dropped on buffer overflow
+	UCE_TRANSACTION	// host side: single Out or In transaction
+};
+
+// handshake, host side only - same as enum usbsim_hs_
+enum usbcap_status_ {UCS_ACK, UCS_NAK, UCS_STALL, UCS_NORESP};
+
+#define USBCAP_ADDR_UNKNOWN	0xffu	// device side - converter tracks Set_Address
+
+struct usbcap_rec_ {
+	uint32_t ts;	// timestamp
+	uint16_t frame;	// USB frame number
+	uint16_t len;	// transfer or packet length
+	uint16_t caplen;	// no. of data bytes following
+	uint8_t ep;	// endpoint address
+	uint8_t evt;	// enum usbcap_evt_
+	uint8_t xfer;	// transfer type, as in endpoint descriptor bmAttributes
+	uint8_t addr;	// device address
+	uint8_t status;	// enum usbcap_status_
+	uint8_t rsvd;
+};
+
+//#define USBCAP	// define in usb_dev_config.h
+#ifdef USBCAP
+/*
+ * Device side capture into a byte ring of USBCAP_SIZE bytes, with up to USBCAP_SNAPLEN data bytes
+ * per record. In data is captured on submission, so it is valid when written. Records are appended
+ * with interrupts disabled, as In transfers may be started at any level; records which do not fit
+ * are dropped and counted. USBcap_drain() may be called from any other context.
+ */
+#ifndef USBCAP_SIZE
+#define USBCAP_SIZE	4096u	// bytes, power of 2
+#endif
+
+#ifndef USBCAP_SNAPLEN
+#define USBCAP_SNAPLEN	64u	// max. no. of data bytes captured per record
+#endif
+
+#ifndef USBCAP_TIMESTAMP
+extern volatile uint32_t usbdev_msec;
+#define USBCAP_TIMESTAMP()	usbdev_msec
+#endif
+
+_Static_assert((USBCAP_SIZE & (USBCAP_SIZE - 1)) == 0, "USBCAP_SIZE must be a power of 2");
+
+void USBcap_data(const struct usbdevice_ *usbd, uint8_t evt, uint8_t ep, const void *data, uint16_t len);
+void USBcap_datav(const struct usbdevice_ *usbd, uint8_t evt, uint8_t ep, const struct usbiov_ *iov, uint8_t iovcnt, uint16_t len);
+uint16_t USBcap_drain(uint8_t *buf, uint16_t size);
 #else
-#define USBlog_storerq(p)
-#define USBlog_storeresp(r,l)
-#define USBlog_recordevt(e)
+#define USBcap_data(u, e, ep, d, l)	((void)0)
+#define USBcap_datav(u, e, ep, v, c, l)	((void)0)
+#endif
+
 #endif
@@ -0,0 +1,50 @@
+/*
+ * lightweight USB device stack by gbm
+ * vcom_uart.h - UART interface for CDC-UART bridge channels
+ * Copyright (c) 2024 gbm
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VCOM_UART_H_
+#define VCOM_UART_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct cdc_linecoding_;	// usb_class_cdc.h
+
+/*
+ * CDC channels in VCOM_UART_BRIDGE mask pass their data to UARTs, with no copying by CPU:
+ * UART Rx DMA writes circularly into the channel Tx ring, UART Tx DMA sends USB Out data
+ * straight from the channel Rx ring. The port provides vcom_uart_hw for all bridged channels
+ * and calls the vcom_uart_ handlers from UART and DMA interrupts of USB interrupt priority.
+ */
+struct vcom_uart_ {
+	// abort transmission, restart circular reception at the start of rxbuf, size is a power of 2;
+	// rxbuf == 0 - stop the UART
+	void (*Start)(uint8_t ch, uint8_t *rxbuf, uint16_t rxsize);
+	uint16_t (*RxPos)(uint8_t ch);	// index in rxbuf of the next byte to be written by Rx DMA
+	void (*TxStart)(uint8_t ch, const uint8_t *data, uint16_t length);	// completion - vcom_uart_tx_done()
+	void (*SetLineCoding)(uint8_t ch, const struct cdc_linecoding_ *lc);	// unsupported settings ignored
+	void (*SetBreak)(uint8_t ch, bool on);
+	void (*SetControlLines)(uint8_t ch, uint16_t state);	// CDC_CTL_DTR, CDC_CTL_RTS; optional
+};
+
+extern const struct vcom_uart_ vcom_uart_hw;
+
+void vcom_uart_rx_event(uint8_t ch);	// Rx DMA half or full transfer, Rx line idle
+void vcom_uart_tx_done(uint8_t ch);
+void vcom_uart_error(uint8_t ch, uint16_t serialstate);	// CDC_SERIAL_STATE_OVERRUN, _PARITY, _FRAMING, _BREAK
+
+#endif /* VCOM_UART_H_ */
@@ -0,0 +1,486 @@
+/*
+ * lightweight USB device stack by gbm
+ * cdc_ncm.c - CDC NCM network function with NTB16 transfer blocks
+ * Copyright (c) 2024 gbm
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Out NTBs are received into two buffers with ping-pong reception, see USBdev_SetRxBufPair().
+ * ncm_recv() returns datagrams in place; a buffer goes back to the endpoint when its last datagram
+ * is released with ncm_recv_done(), so the host is held off only if the network stack falls behind.
+ * Frames to the host are built in place in NCM_TX_FRAMES pool buffers and queued with ncm_send().
+ * Frames queued while an In NTB is on the bus are aggregated into the next one. The NTB is gathered
+ * by USBdev_SendDataV() from the header block and the frames, nothing is copied. Frames return
+ * to the pool when the NTB is sent.
+ * The link is up while the data interface alternate setting 1 is selected.
+ */
+
+#include <string.h>
+#include "usb_dev_config.h"
+#include "usb_std_def.h"
+#include "usb_dev.h"
+#include "usb_hw_if.h"
+#include "usb_class_cdc.h"
+#include "usb_class_ncm.h"
+
+#if USBD_NCM
+
+#define NCM_ALIGN	4u	// datagram alignment in In NTBs, NDP alignment in both directions
+#define NCM_FRAME_BUF	((NCM_MAX_FRAME + NCM_ALIGN - 1) & ~(NCM_ALIGN - 1))
+
+static const struct ncm_ntb_parameters_ ntb_parameters = {
+	.wLength = sizeof(struct ncm_ntb_parameters_),
+	.bmNtbFormatsSupported = NCM_NTB16_SUPPORTED,
+	.dwNtbInMaxSize = NCM_NTB_IN_SIZE,
+	.wNdpInDivisor = NCM_ALIGN,
+	.wNdpInPayloadRemainder = 0,
+	.wNdpInAlignment = NCM_ALIGN,
+	.dwNtbOutMaxSize = NCM_NTB_OUT_SIZE,
+	.wNdpOutDivisor = NCM_ALIGN,
+	.wNdpOutPayloadRemainder = 0,
+	.wNdpOutAlignment = NCM_ALIGN,
+	.wNtbOutMaxDatagrams = 0,
+};
+
+// In NTB header block - NTH16, NDP16 with an entry per frame and the null entry
+struct ncm_txhdr_ {
+	struct ncm_nth16_ nth;
+	struct ncm_ndp16_ ndp;
+	struct ncm_dpe16_ dpe[NCM_TX_FRAMES + 1];
+};
+
+static _Alignas(4) uint8_t rxntb[2][NCM_NTB_OUT_SIZE];
+static _Alignas(4) uint8_t txframe[NCM_TX_FRAMES][NCM_FRAME_BUF];
+static struct ncm_txhdr_ txhdr;
+static struct usbiov_ txiov[1 + 2 * NCM_TX_FRAMES];	// header, then frame and padding for each frame
+static struct ncm_notif_ notif;
+
+enum ncm_notifstate_ {NCM_NOTIF_NONE, NCM_NOTIF_CONNECTION, NCM_NOTIF_SPEED};
+
+static struct ncm_data_ {
+	const struct usbdevice_ *usbd;
+	bool active;	// data interface alternate setting 1
+	uint8_t notif;	// next notification, see ncm_notifstate_
+	// host settings
+	uint32_t ntbinsize;
+	uint16_t maxdgram;
+	uint16_t pktfilter;
+	// reception - consumer side
+	const uint8_t *rxbuf;	// NTB being read, 0 if none
+	uint16_t rxlen;
+	uint16_t rxndp;	// current NDP16
+	uint16_t rxdpe;	// current datagram pointer entry
+	// transmission
+	volatile uint32_t txfree;	// bit n set - txframe[n] in pool
+	uint8_t txq[NCM_TX_FRAMES];	// queued frames, oldest first
+	uint16_t txlen[NCM_TX_FRAMES];
+	uint8_t txqhead, txqcount;
+	uint8_t txsent;	// frames at queue head in NTB being sent
+	bool txblocked;	// ncm_frame_alloc() failed
+	uint16_t txseq;
+} ncm;
+
+__attribute__ ((weak)) void ncm_readable(void)
+{
+}
+
+__attribute__ ((weak)) void ncm_writable(void)
+{
+}
+
+__attribute__ ((weak)) void ncm_link_changed(bool up)
+{
+}
+
+//========================================================================
+// notifications - ConnectionSpeedChange, then NetworkConnection after the data interface is enabled
+static void ncm_notif_send(const struct usbdevice_ *usbd)
+{
+	if (!ncm.active || ncm.notif == NCM_NOTIF_NONE || usbd->inep[NCM_NOTIF_IN_EP & EPNUMMSK].busy)
+		return;
+	notif = (struct ncm_notif_){
+		.bmRequestType = {.Recipient = USB_RQREC_INTERFACE, .Type = USB_RQTYPE_CLASS, .DirIn = 1},
+		.bNotification = ncm.notif == NCM_NOTIF_SPEED ? CDC_CONNECTION_SPEED_CHANGE : CDC_NOTIFICATION_NETWORK_CONNECTION,
+		.wValue = ncm.notif == NCM_NOTIF_CONNECTION,
+		.wIndex = IFNUM_NCM_CONTROL,
+		.wLength = ncm.notif == NCM_NOTIF_SPEED ? 8 : 0,
+		.dwDLBitRate = NCM_LINK_SPEED,
+		.dwULBitRate = NCM_LINK_SPEED
+	};
+	if (USBdev_SendData(usbd, NCM_NOTIF_IN_EP, (const uint8_t *)&notif, 8 + notif.wLength, 0) == 0)
+		--ncm.notif;
+}
+
+//========================================================================
+// transmission
+// send queued frames as single NTB, up to the size set by the host; USB interrupt level or IRQs disabled
+static void ncm_tx_start(const struct usbdevice_ *usbd)
+{
+	static const uint8_t pad[NCM_ALIGN];
+	uint16_t offset = sizeof(struct ncm_nth16_) + sizeof(struct ncm_ndp16_) + sizeof(struct ncm_dpe16_);
+	uint32_t payload = 0;
+	uint8_t n, iovcnt = 1;
+
+	if (!ncm.active || ncm.txsent || ncm.txqcount == 0)
+		return;
+	// header block size depends on the no. of frames, so count them first
+	for (n = 0; n < ncm.txqcount; n++)
+	{
+		uint16_t len = ncm.txlen[ncm.txq[(ncm.txqhead + n) % NCM_TX_FRAMES]];
+		if (offset + sizeof(struct ncm_dpe16_) * (n + 1) + payload + len > ncm.ntbinsize)
+			break;
+		payload += (len + NCM_ALIGN - 1) & ~(NCM_ALIGN - 1);
+	}
+	if (n == 0)
+		n = 1;	// frame longer than the NTB size set by the host - send alone, let the host discard it
+	offset += sizeof(struct ncm_dpe16_) * n;
+	txiov[0] = (struct usbiov_){.data = (const uint8_t *)&txhdr, .length = offset};
+	for (uint8_t i = 0; i < n; i++)
+	{
+		uint8_t f = ncm.txq[(ncm.txqhead + i) % NCM_TX_FRAMES];
+		uint16_t len = ncm.txlen[f];
+		uint16_t padlen = -len & (NCM_ALIGN - 1);
+
+		txhdr.dpe[i] = (struct ncm_dpe16_){.wDatagramIndex = offset, .wDatagramLength = len};
+		txiov[iovcnt++] = (struct usbiov_){.data = txframe[f], .length = len};
+		offset += len;
+		if (padlen && i < n - 1)
+		{
+			txiov[iovcnt++] = (struct usbiov_){.data = pad, .length = padlen};
+			offset += padlen;
+		}
+	}
+	txhdr.dpe[n] = (struct ncm_dpe16_){0};
+	txhdr.nth = (struct ncm_nth16_){
+		.dwSignature = NCM_NTH16_SIGNATURE,
+		.wHeaderLength = sizeof(struct ncm_nth16_),
+		.wSequence = ncm.txseq,
+		.wBlockLength = offset,
+		.wNdpIndex = sizeof(struct ncm_nth16_)
+	};
+	txhdr.ndp = (struct ncm_ndp16_){
+		.dwSignature = NCM_NDP16_NOCRC_SIGNATURE,
+		.wLength = sizeof(struct ncm_ndp16_) + sizeof(struct ncm_dpe16_) * (n + 1),
+		.wNextNdpIndex = 0
+	};
+	// ZLP only if the NTB is shorter than the host buffer
+	if (USBdev_SendDataV(usbd, NCM_DATA_IN_EP, txiov, iovcnt, offset < ncm.ntbinsize) == 0)
+	{
+		ncm.txsent = n;
+		++ncm.txseq;
+	}
+}
+
+// NTB sent - return its frames to the pool
+static void ncm_tx_done(const struct usbdevice_ *usbd)
+{
+	uint32_t freed = 0;
+
+	for (; ncm.txsent; ncm.txsent--, ncm.txqcount--)
+	{
+		freed |= 1u << ncm.txq[ncm.txqhead];
+		ncm.txqhead = (ncm.txqhead + 1) % NCM_TX_FRAMES;
+	}
+	ncm.txfree |= freed;
+	ncm_tx_start(usbd);
+	if (freed && ncm.txblocked)
+	{
+		ncm.txblocked = 0;
+		ncm_writable();
+	}
+}
+
+// drop queued frames and the NTB being sent
+static void ncm_tx_stop(const struct usbdevice_ *usbd)
+{
+	if (ncm.txsent)
+		USBdev_AbortIn(usbd, NCM_DATA_IN_EP);	// hw stops reading the frames before they are freed
+	ncm.txsent = ncm.txqcount;
+	ncm_tx_done(usbd);	// not restarted - inactive
+}
+
+static int8_t frame_index(const uint8_t *frame)
+{
+	uint32_t idx = (frame - txframe[0]) / NCM_FRAME_BUF;
+	return idx < NCM_TX_FRAMES && frame == txframe[idx] ? (int8_t)idx : -1;
+}
+
+uint8_t *ncm_frame_alloc(void)
+{
+	uint8_t *frame = 0;
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	if (ncm.txfree)
+	{
+		uint8_t idx = __builtin_ctz(ncm.txfree);
+		ncm.txfree &= ~(1u << idx);
+		frame = txframe[idx];
+	}
+	else
+		ncm.txblocked = 1;
+	__set_PRIMASK(primask);
+	return frame;
+}
+
+void ncm_frame_free(uint8_t *frame)
+{
+	int8_t idx = frame_index(frame);
+	if (idx >= 0)
+	{
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		ncm.txfree |= 1u << idx;
+		__set_PRIMASK(primask);
+	}
+}
+
+bool ncm_send(uint8_t *frame, uint16_t length)
+{
+	int8_t idx = frame_index(frame);
+	bool err = 1;
+
+	if (idx < 0)
+		return 1;
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	if (ncm.active && length >= 14 && length <= ncm.maxdgram)
+	{
+		ncm.txq[(ncm.txqhead + ncm.txqcount++) % NCM_TX_FRAMES] = idx;
+		ncm.txlen[idx] = length;
+		ncm_tx_start(ncm.usbd);
+		err = 0;
+	}
+	else
+		ncm.txfree |= 1u << idx;
+	__set_PRIMASK(primask);
+	return err;
+}
+
+//========================================================================
+// reception
+// check NDP16 at offset idx of the current NTB
+static bool ncm_ndp_valid(uint16_t idx)
+{
+	const struct ncm_ndp16_ *ndp = (const struct ncm_ndp16_ *)&ncm.rxbuf[idx];
+	return idx >= sizeof(struct ncm_nth16_) && idx % NCM_ALIGN == 0
+		&& idx + sizeof(struct ncm_ndp16_) <= ncm.rxlen
+		&& ndp->dwSignature == NCM_NDP16_NOCRC_SIGNATURE
+		&& ndp->wLength >= sizeof(struct ncm_ndp16_) + 2 * sizeof(struct ncm_dpe16_)
+		&& idx + ndp->wLength <= ncm.rxlen;
+}
+
+// find a valid datagram at or after the current entry; release the NTB if there is none
+static bool ncm_rx_seek(void)
+{
+	while (ncm.rxndp)
+	{
+		const struct ncm_ndp16_ *ndp = (const struct ncm_ndp16_ *)&ncm.rxbuf[ncm.rxndp];
+		for (; ncm.rxdpe + sizeof(struct ncm_dpe16_) <= ncm.rxndp + ndp->wLength; ncm.rxdpe += sizeof(struct ncm_dpe16_))
+		{
+			const struct ncm_dpe16_ *dpe = (const struct ncm_dpe16_ *)&ncm.rxbuf[ncm.rxdpe];
+			if (dpe->wDatagramIndex == 0 || dpe->wDatagramLength == 0)
+				break;	// null entry
+			if (dpe->wDatagramLength >= 14 && dpe->wDatagramLength <= NCM_MAX_FRAME
+				&& dpe->wDatagramIndex + dpe->wDatagramLength <= ncm.rxlen)
+				return 1;
+		}
+		// next NDP16 in chain
+		ncm.rxndp = ndp->wNextNdpIndex > ncm.rxndp && ncm_ndp_valid(ndp->wNextNdpIndex) ? ndp->wNextNdpIndex : 0;
+		ncm.rxdpe = ncm.rxndp + sizeof(struct ncm_ndp16_);
+	}
+	ncm.rxbuf = 0;
+	USBdev_RxRelease(ncm.usbd, NCM_DATA_OUT_EP);
+	return 0;
+}
+
+const uint8_t *ncm_recv(uint16_t *length)
+{
+	while (!ncm.rxbuf)
+	{
+		uint16_t len;
+		const struct ncm_nth16_ *nth = (const struct ncm_nth16_ *)USBdev_RxBuf(ncm.usbd, NCM_DATA_OUT_EP, &len);
+		if (!nth)
+			return 0;
+		ncm.rxbuf = (const uint8_t *)nth;
+		ncm.rxlen = len;
+		ncm.rxndp = 0;
+		if (len >= sizeof(struct ncm_nth16_) && nth->dwSignature == NCM_NTH16_SIGNATURE
+			&& nth->wHeaderLength == sizeof(struct ncm_nth16_) && nth->wBlockLength <= len)
+		{
+			if (nth->wBlockLength)
+				ncm.rxlen = nth->wBlockLength;
+			if (ncm_ndp_valid(nth->wNdpIndex))
+				ncm.rxndp = nth->wNdpIndex;
+		}
+		ncm.rxdpe = ncm.rxndp + sizeof(struct ncm_ndp16_);
+		ncm_rx_seek();
+	}
+	const struct ncm_dpe16_ *dpe = (const struct ncm_dpe16_ *)&ncm.rxbuf[ncm.rxdpe];
+	*length = dpe->wDatagramLength;
+	return &ncm.rxbuf[dpe->wDatagramIndex];
+}
+
+void ncm_recv_done(void)
+{
+	if (ncm.rxbuf)
+	{
+		ncm.rxdpe += sizeof(struct ncm_dpe16_);
+		ncm_rx_seek();
+	}
+}
+
+bool ncm_link_up(void)
+{
+	return ncm.active;
+}
+
+//========================================================================
+// called from usb_app.c
+void ncm_out(const struct usbdevice_ *usbd, uint8_t epn)
+{
+	USBdev_RxSwap(usbd, epn);
+	ncm_readable();
+}
+
+void ncm_in(const struct usbdevice_ *usbd, uint8_t epn)
+{
+	if (epn == NCM_NOTIF_IN_EP)
+		ncm_notif_send(usbd);
+	else
+		ncm_tx_done(usbd);
+}
+
+// take the data interface down, reset host settings to defaults (NCM10 7.2)
+static void ncm_stop(const struct usbdevice_ *usbd)
+{
+	bool was = ncm.active;
+
+	ncm.active = 0;
+	ncm.notif = NCM_NOTIF_NONE;
+	ncm.ntbinsize = NCM_NTB_IN_SIZE;
+	ncm.maxdgram = NCM_MAX_FRAME;
+	ncm_tx_stop(usbd);
+	ncm.rxbuf = 0;
+	if (was)
+		ncm_link_changed(0);
+}
+
+void ncm_init(const struct usbdevice_ *usbd)
+{
+	ncm = (struct ncm_data_){.usbd = usbd, .txfree = (uint32_t)((1ull << NCM_TX_FRAMES) - 1)};
+	ncm_stop(usbd);
+}
+
+// bus reset - Out endpoint left disabled by the next SetConfiguration
+void ncm_reset(void)
+{
+	ncm_stop(ncm.usbd);
+	ncm.pktfilter = 0;
+	USBdev_SetRxBuf(ncm.usbd, NCM_DATA_OUT_EP, 0);
+}
+
+// data interface alternate setting: 0 - no endpoints, 1 - bulk In and Out
+bool ncm_SetInterface(const struct usbdevice_ *usbd, uint8_t alt)
+{
+	if (alt > 1)
+		return 0;
+	ncm_stop(usbd);
+	if (alt)
+	{
+		usbd->hwif->ClrEPStall(usbd, NCM_DATA_IN_EP);	// reset data toggles
+		usbd->hwif->ClrEPStall(usbd, NCM_DATA_OUT_EP);
+		USBdev_SetRxBufPair(usbd, NCM_DATA_OUT_EP, rxntb[0], rxntb[1]);
+		USBdev_ReceiveData(usbd, NCM_DATA_OUT_EP, rxntb[0], NCM_NTB_OUT_SIZE);
+		ncm.active = 1;
+		ncm.notif = NCM_NOTIF_SPEED;
+		ncm_notif_send(usbd);
+		ncm_link_changed(1);
+	}
+	return 1;
+}
+
+uint8_t ncm_GetInterface(void)
+{
+	return ncm.active;
+}
+
+// class requests to communication interface
+void ncm_HandleRequest(const struct usbdevice_ *usbd)
+{
+	USB_SetupPacket *req = &usbd->devdata->req;
+	const uint8_t *data = usbd->devdata->ep0data;
+	static uint32_t value;
+
+	switch (req->bRequest)
+	{
+	case NCMRQ_GET_NTB_PARAMETERS:
+		USBdev_SendStatus(usbd, (const uint8_t *)&ntb_parameters, MIN(req->wLength, sizeof(ntb_parameters)), 0);
+		break;
+
+	case NCMRQ_GET_NTB_INPUT_SIZE:
+		value = ncm.ntbinsize;
+		USBdev_SendStatus(usbd, (const uint8_t *)&value, MIN(req->wLength, 4), 0);
+		break;
+
+	case NCMRQ_SET_NTB_INPUT_SIZE:	// 4-byte form, NCM_NCAP_NTB_INPUT_SIZE_8 not set
+		value = req->wLength >= 4 ? data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24 : 0;
+		if (value >= 2048 && value <= NCM_NTB_IN_SIZE)
+		{
+			ncm.ntbinsize = value;
+			USBdev_SendStatusOK(usbd);
+		}
+		else
+			USBdev_CtrlError(usbd);
+		break;
+
+	case NCMRQ_GET_NTB_FORMAT:
+		value = NCM_NTB_FORMAT_16;
+		USBdev_SendStatus(usbd, (const uint8_t *)&value, MIN(req->wLength, 2), 0);
+		break;
+
+	case NCMRQ_SET_NTB_FORMAT:
+		if (req->wValue.w == NCM_NTB_FORMAT_16)
+			USBdev_SendStatusOK(usbd);
+		else
+			USBdev_CtrlError(usbd);
+		break;
+
+	case NCMRQ_GET_MAX_DATAGRAM_SIZE:
+		value = ncm.maxdgram;
+		USBdev_SendStatus(usbd, (const uint8_t *)&value, MIN(req->wLength, 2), 0);
+		break;
+
+	case NCMRQ_SET_MAX_DATAGRAM_SIZE:
+		value = req->wLength >= 2 ? data[0] | data[1] << 8 : 0;
+		if (value >= 590 && value <= NCM_MAX_FRAME)
+		{
+			ncm.maxdgram = value;
+			USBdev_SendStatusOK(usbd);
+		}
+		else
+			USBdev_CtrlError(usbd);
+		break;
+
+	case CDC_SET_ETHERNET_PACKET_FILTER:	// all frames are passed anyway
+		ncm.pktfilter = req->wValue.w;
+		USBdev_SendStatusOK(usbd);
+		break;
+
+	default:
+		USBdev_CtrlError(usbd);
+	}
+}
+
+#endif	// USBD_NCM
@@ -37,45 +37,39 @@ https://aidanmocke.com/blog/2020/12/30/USB-MSD-1/
 #include "usb_dev_config.h"
 #include "usb_class_msc_scsi.h"
 #include "usb_hw_if.h"
+#include "usbdev_binding.h"
 
 #if USBD_MSC
 #if 1
-// custom implementation of mass storage media
+// custom implementation of mass storage media, defines msc_media[]
 #include "mini_msd.h"
-#define NUM_BLOCKS	SECCOUNT
-#define	LAST_LBA	(NUM_BLOCKS - 1u)
-#define BLK_SIZE	SECSIZE
 
 #else
 // demo - non-formatted mass storage in RAM; must be at least 64 KiB to be recognized by Windows
 #define SECSIZE	512u
 #define SECCOUNT	256u	// Works under Win7 if 16 or above
 
-#define NUM_BLOCKS	SECCOUNT
-#define	LAST_LBA	(NUM_BLOCKS - 1u)
-#define BLK_SIZE	SECSIZE
-
-alignas (uint64_t) static uint8_t media[NUM_BLOCKS][BLK_SIZE];
+alignas (uint64_t) static uint8_t media[SECCOUNT][SECSIZE];
 
 uint32_t blocks_read, blocks_written;
 
 static bool media_write(uint8_t lun, uint32_t blk, const uint8_t *buf)
 {
-	memcpy(media[blk], buf, BLK_SIZE);
+	memcpy(media[blk], buf, SECSIZE);
 	++blocks_written;
 	return 0;
 }
 
 static bool media_read(uint8_t lun, uint32_t blk, uint8_t *buf)
 {
-	memcpy(buf, media[blk], BLK_SIZE);
+	memcpy(buf, media[blk], SECSIZE);
 	++blocks_read;
 	return 0;
 }
 
-static void media_init(void)
-{
-}
+const struct msc_media_ msc_media[MSC_LUNS] = {
+	{.nblocks = SECCOUNT, .blksize = SECSIZE, .Read = media_read, .Write = media_write}
+};
 #endif
 
 #ifdef MSC_LOG
@@ -101,6 +95,21 @@ static void msc_log(uint8_t action, uint8_t rq)
 
 struct msc_bot_scsi_data_ bsdata;
 
+// READ10 read-ahead ring
+static _Alignas(4) uint8_t databuf[MSC_READ_AHEAD][MSC_DATA_BUF_SIZE];
+_Static_assert(MSC_READ_AHEAD >= 2 && MSC_READ_AHEAD <= 255, "MSC_READ_AHEAD out of range");
+
+// write-back cache lines, see struct msc_wcache_
+static _Alignas(4) uint8_t cachebuf[MSC_WRITE_CACHE][MSC_DATA_BUF_SIZE];
+_Static_assert(MSC_WRITE_CACHE >= 2 && MSC_WRITE_CACHE <= 255 && MSC_ERASE_BLOCKS, "MSC write cache size out of range");
+
+// UNMAP parameter list: 8-byte header and 16-byte block descriptors
+static _Alignas(4) uint8_t unmapbuf[8 + 16 * MSC_UNMAP_DESCRIPTORS];
+static uint8_t unmap_count;	// descriptors in unmapbuf
+
+// request read-ahead and cache flush; without a media interrupt in the binding they run at USB interrupt level
+static void msc_media_request(void);
+
 static inline uint16_t getBE16(const uint8_t *p)
 {
 	return p[0] << 8 | p[1];
@@ -111,12 +120,20 @@ static inline uint32_t getBE32(const uint8_t *p)
 	return p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
 }
 
-#define nLUNs 1u
+static inline void putBE32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24, p[1] = v >> 16, p[2] = v >> 8, p[3] = v;
+}
+
+// block size of the addressed LUN
+#define BLK_SIZE	(msc_media[bsdata.cbw.bLUN].blksize)
+// UNMAP supported by the LUN
+#define CAN_UNMAP(m)	((m)->Discard && !(m)->readonly)
 
 static const uint8_t inquiry_data[36] = {
 		0,	// device type: 0x00 - SBC Direct-access, 0x0e - RBC simplified direct access
 		0x00,	// bit 7 set -> removable media (required for formatting under Windows)
-		2,	// ?
+		5,	// version: SPC-3, VPD pages supported
 		2,	// response data format
 		sizeof inquiry_data - 5,	// additional length
 		[5] = 0, 0, 0,	// reserved
@@ -125,43 +142,8 @@ static const uint8_t inquiry_data[36] = {
 		[32] = 'A', '0', '0', '0'	// revision level
 };
 
-#define MODE_SENSE6_LEN			 4
-#define MODE_SENSE10_LEN		 8
-#define LENGTH_INQUIRY_PAGE00		 7
 //#define LENGTH_FORMAT_CAPACITIES    	20
 
-#if 0
-/* USB Mass storage Page 0 Inquiry Data */
-static const uint8_t  MSC_Page00_Inquiry_Data[] = {//7
-	0x00,
-	0x00,
-	0x00,
-	(LENGTH_INQUIRY_PAGE00 - 4),
-	0x00,
-	0x80,
-	0x83
-};
-/* USB Mass storage sense 10  Data */
-static const uint8_t  MSC_Mode_Sense10_data[MODE_SENSE10_LEN] = {
-	0x00,
-	0x06,
-	0x00,
-	0x00,
-	0x00,
-	0x00,
-	0x00,
-	0x00
-};
-#endif
-#ifdef IMPLEMENT_MODE_SENSE6
-/* USB Mass storage sense 6  Data */
-static const uint8_t  MSC_Mode_Sense6_data[MODE_SENSE6_LEN] = {
-	0x03,
-	0x00,
-	0x00,
-	0x00,
-};
-#endif
 struct sense_data_ {
 	uint8_t error_code, segment_number, sense_key,
 		inf[4],	// 3..6
@@ -171,16 +153,8 @@ struct sense_data_ {
 		reserved[4];	// 14..17
 };
 
-static struct sense_data_ sense_data = {
-		0x70, 0,
-		0,
-		.asl = sizeof(struct sense_data_) - 7
-};
-
-static const uint8_t read_capacity_data[8] = {
-		LAST_LBA >> 24, LAST_LBA >> 16 & 0xff, LAST_LBA >> 8 & 0xff, LAST_LBA & 0xff,
-		BLK_SIZE >> 24, BLK_SIZE >> 16 & 0xff, BLK_SIZE >> 8 & 0xff, BLK_SIZE & 0xff
-};
+// per LUN, set by msc_bot_init()
+static struct sense_data_ sense_data[MSC_LUNS];
 
 // https://www.usb.org/sites/default/files/usbmass-ufi10.pdf
 //static const uint8_t read_format_capacity_data[12] = {
@@ -197,22 +171,54 @@ static bool getparm10(void)
 	//bsdata.scsi_lun = bsdata.cbw.CB[1] >> 5;
 	bsdata.scsi_blkaddr = getBE32(&bsdata.cbw.CB[2]);
 	bsdata.scsi_nblocks = getBE16(&bsdata.cbw.CB[7]);
+	uint32_t nblocks = msc_media[bsdata.cbw.bLUN].nblocks;
 	bsdata.devTransferLength = bsdata.scsi_nblocks * BLK_SIZE;
 	bsdata.devDataTransfered = 0;
 	bsdata.dbidx = 0;
 	bsdata.csw.dDataResidue = bsdata.devTransferLength;
 	return bsdata.scsi_nblocks
-			&& bsdata.scsi_blkaddr < NUM_BLOCKS
-			&& bsdata.scsi_blkaddr + bsdata.scsi_nblocks <= NUM_BLOCKS
+			&& bsdata.scsi_blkaddr < nblocks
+			&& bsdata.scsi_blkaddr + bsdata.scsi_nblocks <= nblocks
 			&& bsdata.devTransferLength == bsdata.cbw.dDataTransferLength;
 }
 
 // bitmap for SCSI commands recording
 volatile uint8_t rq[32];
 
+// single packet to outbuf
 static void enable_out_ep(const struct usbdevice_ *usbd)
 {
-	usbd->hwif->EnableRx(usbd, MSC_BOT_OUT_EP);
+	USBdev_ReceiveData(usbd, MSC_BOT_OUT_EP, bsdata.outbuf, 0);
+}
+
+// whole block directly to a free cache line as a single multi-packet transfer;
+// with the cache full the endpoint NAKs until a line is flushed
+static void enable_block_out(const struct usbdevice_ *usbd)
+{
+	struct msc_wcache_ *wc = &bsdata.wc;
+	uint8_t i;
+
+	for (i = 0; i < MSC_WRITE_CACHE && wc->line[i].state != MSC_CL_FREE; i++) ;
+	wc->rxwait = i == MSC_WRITE_CACHE;
+	if (wc->rxwait)
+		return;
+	wc->rx = i;
+	wc->line[i].state = MSC_CL_RX;
+	--wc->nfree;
+	USBdev_ReceiveData(usbd, MSC_BOT_OUT_EP, cachebuf[i], BLK_SIZE);
+}
+
+// WRITE10 data phase ended early - return the line being received
+static void msc_cache_rx_cancel(void)
+{
+	struct msc_wcache_ *wc = &bsdata.wc;
+
+	wc->rxwait = 0;
+	if (wc->line[wc->rx].state == MSC_CL_RX)
+	{
+		wc->line[wc->rx].state = MSC_CL_FREE;
+		++wc->nfree;
+	}
 }
 
 static void prepare_for_cbw(const struct usbdevice_ *usbd)
@@ -223,8 +229,13 @@ static void prepare_for_cbw(const struct usbdevice_ *usbd)
 
 void msc_bot_init(const struct usbdevice_ *usbd)
 {
-	media_init();
-	bsdata = (struct msc_bot_scsi_data_){0};
+	for (uint8_t lun = 0; lun < MSC_LUNS; lun++)
+	{
+		sense_data[lun] = (struct sense_data_){0x70, .asl = sizeof(struct sense_data_) - 7};
+		if (msc_media[lun].Init)
+			msc_media[lun].Init(lun);
+	}
+	bsdata = (struct msc_bot_scsi_data_){.usbd = usbd, .csw.dSignature = CSW_SIG, .wc.nfree = MSC_WRITE_CACHE};
 	enable_out_ep(usbd);
 }
 
@@ -234,13 +245,19 @@ void msc_bot_reset(void)
 	// does not change data toggle nor ep stalls
 //	bsdata.state = BS_CBW;
 	bsdata.state = BS_RESET;
+	msc_cache_rx_cancel();
 	// allow receive
 }
 
+// with transfer queue, CSW may be submitted while the data In transfer is still in progress
 static void bot_send_csw(const struct usbdevice_ *usbd)
 {
 	msc_log(A_CSW, bsdata.csw.bStatus);
+#if USBD_XFER_QUEUE_LEN
+	USBdev_QueueData(usbd, MSC_BOT_IN_EP, &(const struct usbxfer_){.data = (const uint8_t *)&bsdata.csw, .length = CSW_SIZE});
+#else
 	USBdev_SendData(usbd, MSC_BOT_IN_EP, (const uint8_t *)&bsdata.csw, CSW_SIZE, 0);
+#endif
 	prepare_for_cbw(usbd);
 }
 
@@ -285,36 +302,281 @@ static void msc_bot_abort(const struct usbdevice_ *usbd)
 
 static void scsi_error(uint8_t sKey, uint8_t ASC)
 {
-	sense_data.sense_key = sKey;
-	sense_data.asc = ASC;
+	if (bsdata.cbw.bLUN >= MSC_LUNS)
+		return;	// CBW not meaningful - no sense data for nonexistent LUN
+	sense_data[bsdata.cbw.bLUN].sense_key = sKey;
+	sense_data[bsdata.cbw.bLUN].asc = ASC;
+}
+
+// READ10 data phase: blocks are read ahead into the ring at media interrupt level
+// and each one is sent as a single multi-packet transfer, so the bulk pipe keeps
+// running while the next blocks are fetched
+
+// start sending the oldest block read, called at USB interrupt level or with interrupts disabled
+static void scsi_read_next(const struct usbdevice_ *usbd)
+{
+	bsdata.ra.waiting = 0;
+	if (bsdata.ra.ready)
+		USBdev_SendData(usbd, MSC_BOT_IN_EP, databuf[bsdata.ra.send], BLK_SIZE, 0);
+	else if (bsdata.ra.error)
+	{
+		scsi_error(SKEY_MEDIUM_ERROR, ASC_UNRECOVERED_READ_ERROR);
+		bsdata.csw.bStatus = BOT_CMD_FAILED;
+		msc_bot_abort(usbd);	// CSW sent after the host clears the stall
+	}
+	else
+		bsdata.ra.waiting = 1;
 }
 
-// send packet of data read from mass storage device
+static void scsi_read_start(const struct usbdevice_ *usbd)
+{
+	bsdata.state = BS_DATAIN;
+	bsdata.ra = (struct msc_readahead_){
+		.blkaddr = bsdata.scsi_blkaddr,
+		.toread = bsdata.scsi_nblocks,
+		.gen = bsdata.ra.gen + 1,
+		.lun = bsdata.cbw.bLUN,
+		.waiting = 1
+	};
+	msc_media_request();
+}
+
+// block sent - free its buffer
 static void scsi_read_xfer(const struct usbdevice_ *usbd)
 {
-	if (bsdata.dbidx == 0)
+	bsdata.ra.send = (bsdata.ra.send + 1) % MSC_READ_AHEAD;
+	--bsdata.ra.ready;
+	++bsdata.scsi_blkaddr;
+	bsdata.csw.dDataResidue -= BLK_SIZE;
+	if (--bsdata.scsi_nblocks == 0)
+		bot_send_csw(usbd);
+	else
 	{
-		// buffer empty - read from media
-		media_read(bsdata.cbw.bLUN, bsdata.scsi_blkaddr, bsdata.databuf);
+		scsi_read_next(usbd);
+		msc_media_request();
 	}
-	uint16_t txlen = bsdata.devTransferLength < MSC_BOT_EP_SIZE
-			? bsdata.devTransferLength : MSC_BOT_EP_SIZE;
-	USBdev_SendData(usbd, MSC_BOT_IN_EP, &bsdata.databuf[bsdata.dbidx], txlen, 0);
-	bsdata.dbidx += txlen;
-	if (bsdata.dbidx == MSC_DATA_BUF_SIZE)
+}
+
+// cache line holding the block, MSC_WRITE_CACHE if none
+static uint8_t msc_cache_find(uint8_t lun, uint32_t lba)
+{
+	uint8_t i;
+	for (i = 0; i < MSC_WRITE_CACHE; i++)
 	{
-		bsdata.dbidx = 0;
-		++bsdata.scsi_blkaddr;
-		--bsdata.scsi_nblocks;
+		const struct msc_cacheline_ *cl = &bsdata.wc.line[i];
+		if (cl->state == MSC_CL_DIRTY && cl->lba == lba && cl->lun == lun)
+			break;
 	}
-	bsdata.devTransferLength -= txlen;
-	if (bsdata.devTransferLength == 0)
+	return i;
+}
+
+// fill free ring buffers; runs at priority lower than USB, or at USB level
+static void msc_read_ahead(void)
+{
+	for (;;)
 	{
-		bsdata.state = BS_CSW;
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		uint8_t gen = bsdata.ra.gen, fill = bsdata.ra.fill, lun = bsdata.ra.lun;
+		uint32_t blk = bsdata.ra.blkaddr;
+		bool go = bsdata.state == BS_DATAIN && bsdata.ra.toread && bsdata.ra.ready < MSC_READ_AHEAD;
+		__set_PRIMASK(primask);
+		if (!go)
+			break;
+		uint8_t cl = msc_cache_find(lun, blk);
+		bool err = 0;
+		if (cl < MSC_WRITE_CACHE)
+			memcpy(databuf[fill], cachebuf[cl], msc_media[lun].blksize);
+		else
+			err = msc_media[lun].Read(lun, blk, databuf[fill]);
+		__disable_irq();
+		if (gen == bsdata.ra.gen && bsdata.state == BS_DATAIN)
+		{
+			if (err)
+			{
+				bsdata.ra.error = 1;
+				bsdata.ra.toread = 0;
+			}
+			else
+			{
+				++bsdata.ra.blkaddr;
+				--bsdata.ra.toread;
+				bsdata.ra.fill = (fill + 1) % MSC_READ_AHEAD;
+				++bsdata.ra.ready;
+			}
+			if (bsdata.ra.waiting)
+				scsi_read_next(bsdata.usbd);
+		}
+		__set_PRIMASK(primask);
 	}
 }
 
-// send SCSI command response as single packet
+// WRITE10 block received into the cache; replaces older data of the same block
+static void scsi_write_block(void)
+{
+	struct msc_wcache_ *wc = &bsdata.wc;
+
+	for (uint8_t i = 0; i < MSC_WRITE_CACHE; i++)
+	{
+		struct msc_cacheline_ *cl = &wc->line[i];
+		if (cl->state == MSC_CL_DIRTY && cl->lba == bsdata.scsi_blkaddr && cl->lun == bsdata.cbw.bLUN)
+		{
+			cl->state = MSC_CL_FREE;
+			++wc->nfree;
+		}
+	}
+	wc->line[wc->rx] = (struct msc_cacheline_){.lba = bsdata.scsi_blkaddr, .seq = wc->seq++,
+		.lun = bsdata.cbw.bLUN, .state = MSC_CL_DIRTY};
+	wc->idle = MSC_FLUSH_DELAY;
+}
+
+// SYNCHRONIZE CACHE complete, called with interrupts disabled
+static void scsi_sync_done(void)
+{
+	if (bsdata.wc.error)
+	{
+		bsdata.wc.error = 0;
+		scsi_error(SKEY_MEDIUM_ERROR, ASC_WRITE_FAULT);
+		bsdata.csw.bStatus = BOT_CMD_FAILED;
+	}
+	bot_send_csw(bsdata.usbd);
+}
+
+// write all cached blocks of the oldest sector in ascending order, so that the media layer
+// may erase the sector once; return 1 if anything was written
+static bool msc_flush_sector(void)
+{
+	struct msc_wcache_ *wc = &bsdata.wc;
+	uint8_t idx[MSC_WRITE_CACHE], n = 0, oldest = MSC_WRITE_CACHE;
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	for (uint8_t i = 0; i < MSC_WRITE_CACHE; i++)
+		if (wc->line[i].state == MSC_CL_DIRTY
+			&& (oldest == MSC_WRITE_CACHE || (int32_t)(wc->line[i].seq - wc->line[oldest].seq) < 0))
+			oldest = i;
+	if (oldest == MSC_WRITE_CACHE)
+	{
+		// clean
+		wc->flushall = 0;
+		if (bsdata.state == BS_SYNC)
+			scsi_sync_done();
+	}
+	// reads first; otherwise flush when asked to or when there is no room for a sector
+	else if (bsdata.state != BS_DATAIN && (wc->flushall || wc->rxwait || wc->nfree < MSC_ERASE_BLOCKS))
+	{
+		uint32_t sector = wc->line[oldest].lba / MSC_ERASE_BLOCKS;
+		uint8_t lun = wc->line[oldest].lun;
+		for (uint8_t i = 0; i < MSC_WRITE_CACHE; i++)
+		{
+			struct msc_cacheline_ *cl = &wc->line[i];
+			if (cl->state == MSC_CL_DIRTY && cl->lun == lun && cl->lba / MSC_ERASE_BLOCKS == sector)
+			{
+				cl->state = MSC_CL_FLUSH;
+				uint8_t j;
+				for (j = n++; j && wc->line[idx[j - 1]].lba > cl->lba; j--)
+					idx[j] = idx[j - 1];
+				idx[j] = i;
+			}
+		}
+	}
+	__set_PRIMASK(primask);
+	if (n == 0)
+		return 0;
+
+	bool err = 0;
+	for (uint8_t k = 0; k < n; k++)
+	{
+		uint8_t lun = wc->line[idx[k]].lun;
+		err |= msc_media[lun].Write(lun, wc->line[idx[k]].lba, cachebuf[idx[k]]);
+	}
+
+	__disable_irq();
+	for (uint8_t k = 0; k < n; k++)
+		wc->line[idx[k]].state = MSC_CL_FREE;
+	wc->nfree += n;
+	wc->error |= err;
+	if (wc->rxwait && bsdata.state == BS_DATAOUT)
+		enable_block_out(bsdata.usbd);
+	__set_PRIMASK(primask);
+	return 1;
+}
+
+// discard UNMAP blocks; runs after the cache flush in progress, so stale data is not written over them
+static void msc_unmap(void)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	bool go = bsdata.state == BS_UNMAP;
+	uint8_t lun = bsdata.cbw.bLUN, n = unmap_count;
+	__set_PRIMASK(primask);
+	if (!go)
+		return;
+
+	bool err = 0;
+	for (uint8_t i = 0; i < n; i++)
+	{
+		const uint8_t *d = &unmapbuf[8 + 16 * i];
+		uint32_t nblocks = getBE32(d + 8);
+		if (nblocks)
+			err |= msc_media[lun].Discard(lun, getBE32(d + 4), nblocks);
+	}
+
+	__disable_irq();
+	if (bsdata.state == BS_UNMAP)
+	{
+		if (err)
+		{
+			scsi_error(SKEY_MEDIUM_ERROR, ASC_WRITE_FAULT);
+			bsdata.csw.bStatus = BOT_CMD_FAILED;
+		}
+		bot_send_csw(bsdata.usbd);
+	}
+	__set_PRIMASK(primask);
+}
+
+// read-ahead has priority over cache flush
+static void msc_media_service(void)
+{
+	do
+		msc_read_ahead();
+	while (msc_flush_sector());
+	msc_unmap();
+}
+
+#ifdef MSC_media_IRQn
+static void msc_media_request(void)
+{
+	NVIC_SetPendingIRQ(MSC_media_IRQn);
+}
+
+void MSC_media_IRQHandler(void)
+{
+	msc_media_service();
+}
+#else
+static void msc_media_request(void)
+{
+	msc_media_service();
+}
+#endif
+
+// write the whole cache back; no SOF ticks while suspended, so called on suspend
+void msc_bot_flush(void)
+{
+	bsdata.wc.idle = 0;
+	bsdata.wc.flushall = 1;
+	msc_media_request();
+}
+
+// called from USB interrupt at 1 kHz - flush the cache when writes stop
+void msc_bot_tick(void)
+{
+	if (bsdata.wc.idle && --bsdata.wc.idle == 0)
+		msc_bot_flush();
+}
+
+// send SCSI command response; shorter than expected by the host - ended with short packet or ZLP
 static void scsi_resp_xfer(const struct usbdevice_ *usbd, const uint8_t *data, uint16_t len)
 {
 	if (bsdata.cbw.bmFlags.DirIn)
@@ -323,13 +585,14 @@ static void scsi_resp_xfer(const struct usbdevice_ *usbd, const uint8_t *data, u
 		if (bsdata.cbw.dDataTransferLength < len)
 			len = bsdata.cbw.dDataTransferLength;
 		bsdata.devTransferLength = len;
-		// TODO: support response > ep_size
-		uint16_t txlen = bsdata.devTransferLength < MSC_BOT_EP_SIZE
-				? bsdata.devTransferLength : MSC_BOT_EP_SIZE;
-		USBdev_SendData(usbd, MSC_BOT_IN_EP, bsdata.txptr, txlen, 0);
-		msc_log(A_RESP, txlen);
-
+		bsdata.csw.dDataResidue = bsdata.cbw.dDataTransferLength - len;
+		USBdev_SendData(usbd, MSC_BOT_IN_EP, bsdata.txptr, len, bsdata.csw.dDataResidue != 0);
+		msc_log(A_RESP, len);
+#if USBD_XFER_QUEUE_LEN
+		bot_send_csw(usbd);	// chained to the response, no wait for its completion
+#else
 		bsdata.state = BS_CSW;
+#endif
 	}
 	else
 	{
@@ -338,12 +601,208 @@ static void scsi_resp_xfer(const struct usbdevice_ *usbd, const uint8_t *data, u
 	}
 }
 
-static void scsi_bad_command(const struct usbdevice_ *usbd)
+// command failed before data phase - stall and report sense data
+static void scsi_fail(const struct usbdevice_ *usbd, uint8_t sKey, uint8_t ASC)
 {
-	scsi_error(SKEY_ILLEGAL_REQUEST, ASC_INVALID_CDB);
+	scsi_error(sKey, ASC);
+	bsdata.csw.bStatus = BOT_CMD_FAILED;
 	msc_bot_abort(usbd);
 }
 
+static void scsi_bad_command(const struct usbdevice_ *usbd)
+{
+	scsi_fail(usbd, SKEY_ILLEGAL_REQUEST, ASC_INVALID_CDB);
+}
+
+// MODE SENSE(6) and (10) - caching page only, no block descriptors; with write cache enabled
+// the host sends SYNCHRONIZE CACHE before the media is removed
+static void scsi_mode_sense(const struct usbdevice_ *usbd, bool ms10)
+{
+	static uint8_t resp[8 + 20];
+	uint8_t pc = bsdata.cbw.CB[2] >> 6, page = bsdata.cbw.CB[2] & 0x3f;
+	uint8_t hlen = ms10 ? 8 : 4, len = hlen + 20;
+	uint16_t alloc = ms10 ? getBE16(&bsdata.cbw.CB[7]) : bsdata.cbw.CB[4];
+
+	if ((page != MODE_PAGE_CACHING && page != MODE_PAGE_ALL) || pc == 3)	// saved values not supported
+	{
+		scsi_fail(usbd, SKEY_ILLEGAL_REQUEST, ASC_INVALID_FIELD_IN_CDB);
+		return;
+	}
+	memset(resp, 0, sizeof(resp));
+	if (ms10)
+		resp[1] = len - 2;
+	else
+		resp[0] = len - 1;
+	if (msc_media[bsdata.cbw.bLUN].readonly)
+		resp[ms10 ? 3 : 2] = MODE_DEVPARM_WP;
+	resp[hlen] = MODE_PAGE_CACHING;
+	resp[hlen + 1] = 0x12;
+	resp[hlen + 2] = pc == 1 ? 0 : MODE_CACHING_WCE;	// nothing changeable
+	scsi_resp_xfer(usbd, resp, alloc < len ? alloc : len);
+}
+
+// standard INQUIRY data with the product ID of the LUN, or VPD page;
+// Block Limits and LB Provisioning pages tell the host that it may send UNMAP
+static void scsi_inquiry(const struct usbdevice_ *usbd)
+{
+	static const uint8_t vpd_pages[] = {VPD_SUPPORTED_PAGES, VPD_BLOCK_LIMITS, VPD_LB_PROVISIONING};
+	static uint8_t resp[64];
+	const struct msc_media_ *m = &msc_media[bsdata.cbw.bLUN];
+	uint8_t page = bsdata.cbw.CB[2];
+	uint16_t len, alloc = getBE16(&bsdata.cbw.CB[3]);
+
+	memset(resp, 0, sizeof(resp));
+	if ((bsdata.cbw.CB[1] & 1) == 0)
+	{
+		if (page)
+		{
+			scsi_fail(usbd, SKEY_ILLEGAL_REQUEST, ASC_INVALID_FIELD_IN_CDB);
+			return;
+		}
+		const char *product = m->product;
+		memcpy(resp, inquiry_data, sizeof inquiry_data);
+		if (product)
+			for (uint8_t i = 0; i < 16; i++)
+				resp[16 + i] = *product ? *product++ : ' ';
+		len = sizeof inquiry_data;
+	}
+	else if (page == VPD_SUPPORTED_PAGES)
+	{
+		memcpy(&resp[4], vpd_pages, sizeof vpd_pages);
+		len = 4 + sizeof vpd_pages;
+	}
+	else if (page == VPD_BLOCK_LIMITS)
+	{
+		if (CAN_UNMAP(m))
+		{
+			putBE32(&resp[20], UINT32_MAX);	// max. unmap LBA count - no limit
+			putBE32(&resp[24], MSC_UNMAP_DESCRIPTORS);
+			putBE32(&resp[28], MSC_ERASE_BLOCKS);	// optimal unmap granularity
+		}
+		len = 64;
+	}
+	else if (page == VPD_LB_PROVISIONING)
+	{
+		if (CAN_UNMAP(m))
+		{
+			resp[5] = VPD_LBPU;
+			resp[6] = VPD_PROV_THIN;
+		}
+		len = 8;
+	}
+	else
+	{
+		scsi_fail(usbd, SKEY_ILLEGAL_REQUEST, ASC_INVALID_FIELD_IN_CDB);
+		return;
+	}
+	if (bsdata.cbw.CB[1] & 1)
+	{
+		resp[1] = page;
+		resp[3] = len - 4;
+	}
+	scsi_resp_xfer(usbd, resp, alloc < len ? alloc : len);
+}
+
+// READ CAPACITY(10) - last LBA, block size (32-bit BE)
+static void scsi_read_capacity(const struct usbdevice_ *usbd)
+{
+	static uint8_t resp[8];
+	const struct msc_media_ *m = &msc_media[bsdata.cbw.bLUN];
+
+	putBE32(resp, m->nblocks - 1);
+	putBE32(resp + 4, m->blksize);
+	scsi_resp_xfer(usbd, resp, sizeof resp);
+}
+
+// READ CAPACITY(16) - 64-bit last LBA, block size, provisioning enabled if the LUN supports UNMAP
+static void scsi_read_capacity16(const struct usbdevice_ *usbd)
+{
+	static uint8_t resp[32];
+	const struct msc_media_ *m = &msc_media[bsdata.cbw.bLUN];
+	uint32_t alloc = getBE32(&bsdata.cbw.CB[10]);
+
+	memset(resp, 0, sizeof(resp));
+	putBE32(resp + 4, m->nblocks - 1);
+	putBE32(resp + 8, m->blksize);
+	if (CAN_UNMAP(m))
+		resp[14] = RC16_LBPME;
+	scsi_resp_xfer(usbd, resp, alloc < sizeof(resp) ? alloc : sizeof(resp));
+}
+
+// UNMAP - parameter list received into unmapbuf; anchored unmap not supported
+static void scsi_unmap(const struct usbdevice_ *usbd)
+{
+	const struct msc_media_ *m = &msc_media[bsdata.cbw.bLUN];
+	uint16_t plen = getBE16(&bsdata.cbw.CB[7]);
+
+	if (!m->Discard || bsdata.cbw.bmFlags.DirIn || plen != bsdata.cbw.dDataTransferLength)
+		scsi_bad_command(usbd);
+	else if (m->readonly)
+		scsi_fail(usbd, SKEY_DATA_PROTECT, ASC_WRITE_PROTECTED);
+	else if (bsdata.cbw.CB[1] & 1)
+		scsi_fail(usbd, SKEY_ILLEGAL_REQUEST, ASC_INVALID_FIELD_IN_CDB);
+	else if (plen == 0)
+		bot_send_csw(usbd);
+	else if (plen < 8)
+		scsi_fail(usbd, SKEY_ILLEGAL_REQUEST, ASC_PARAMETER_LIST_LENGTH_ERROR);
+	else if (plen > sizeof unmapbuf)
+		scsi_fail(usbd, SKEY_ILLEGAL_REQUEST, ASC_INVALID_FIELD_IN_CDB);	// more than MSC_UNMAP_DESCRIPTORS
+	else
+	{
+		bsdata.state = BS_UNMAPOUT;
+		USBdev_ReceiveData(usbd, MSC_BOT_OUT_EP, unmapbuf, plen);
+	}
+}
+
+// UNMAP parameter list received - check all descriptors before anything is discarded,
+// drop cached writes of unmapped blocks and pass the list to media interrupt level
+static void scsi_unmap_list(const struct usbdevice_ *usbd, uint16_t len)
+{
+	const struct msc_media_ *m = &msc_media[bsdata.cbw.bLUN];
+	uint16_t bdlen = getBE16(&unmapbuf[2]);
+	uint8_t asc = ASC_NO_SENSE;
+
+	bsdata.csw.dDataResidue = bsdata.cbw.dDataTransferLength - len;
+	if (len != bsdata.cbw.dDataTransferLength)
+		asc = ASC_PARAMETER_LIST_LENGTH_ERROR;
+	else
+	{
+		if (bdlen > len - 8)
+			bdlen = len - 8;
+		unmap_count = bdlen / 16;	// truncated descriptor ignored
+		for (uint8_t i = 0; i < unmap_count; i++)
+		{
+			const uint8_t *d = &unmapbuf[8 + 16 * i];
+			uint32_t lba = getBE32(d + 4);
+			if (getBE32(d) || lba > m->nblocks || getBE32(d + 8) > m->nblocks - lba)
+				asc = ASC_LBA_OUT_OF_RANGE;
+		}
+	}
+	if (asc != ASC_NO_SENSE)
+	{
+		scsi_error(SKEY_ILLEGAL_REQUEST, asc);
+		bsdata.csw.bStatus = BOT_CMD_FAILED;
+		bot_send_csw(usbd);
+		return;
+	}
+
+	struct msc_wcache_ *wc = &bsdata.wc;
+	for (uint8_t i = 0; i < MSC_WRITE_CACHE; i++)
+	{
+		struct msc_cacheline_ *cl = &wc->line[i];
+		for (uint8_t k = 0; k < unmap_count && cl->state == MSC_CL_DIRTY && cl->lun == bsdata.cbw.bLUN; k++)
+		{
+			uint32_t lba = getBE32(&unmapbuf[8 + 16 * k + 4]);
+			if (cl->lba - lba < getBE32(&unmapbuf[8 + 16 * k + 8]))
+			{
+				cl->state = MSC_CL_FREE;
+				++wc->nfree;
+			}
+		}
+	}
+	bsdata.state = BS_UNMAP;
+	msc_media_request();
+}
 
 void msc_bot_out(const struct usbdevice_ *usbd, uint8_t epn, uint16_t len)
 {
@@ -359,11 +818,11 @@ void msc_bot_out(const struct usbdevice_ *usbd, uint8_t epn, uint16_t len)
 			bsdata.csw.dDataResidue = 0;
 
 			uint8_t CBlun = bsdata.cbw.CB[1] >> 5;	// LUN from CB
-			// check if CBW meaningful
+			// check if CBW meaningful; CB LUN field is set by SCSI-2 hosts only
 			if ((bsdata.cbw.bmFlags.b0_6) == 0
-				&& bsdata.cbw.bLUN < nLUNs
+				&& bsdata.cbw.bLUN < MSC_LUNS
 				&& bsdata.cbw.bCBLength > 0 && bsdata.cbw.bCBLength <= 16
-				&& bsdata.cbw.bLUN == CBlun)
+				&& (CBlun == 0 || bsdata.cbw.bLUN == CBlun))
 			{
 				// CBW meaningful
 				msc_log(A_RQ, bsdata.cbw.CB[0]);
@@ -390,29 +849,19 @@ void msc_bot_out(const struct usbdevice_ *usbd, uint8_t epn, uint16_t len)
 					bsdata.devTransferLength = bsdata.cbw.CB[4];
 					if (bsdata.devTransferLength > 18)
 						bsdata.devTransferLength = 18;
-					scsi_resp_xfer(usbd, (const uint8_t *)&sense_data, sizeof sense_data);
-					sense_data.sense_key = SKEY_NO_SENSE;
-					sense_data.asc = ASC_NO_SENSE;
+					scsi_resp_xfer(usbd, (const uint8_t *)&sense_data[bsdata.cbw.bLUN], sizeof(struct sense_data_));
+					sense_data[bsdata.cbw.bLUN].sense_key = SKEY_NO_SENSE;
+					sense_data[bsdata.cbw.bLUN].asc = ASC_NO_SENSE;
 					break;
 
-				case SCSI_INQUIRY:	// return 36 B of Inq info
-					if (bsdata.cbw.CB[1] & 1)
-					{
-						// Evpd bit set - should return Page00
-						scsi_bad_command(usbd);
-					}
-					else
-					{
-						scsi_resp_xfer(usbd, inquiry_data, sizeof inquiry_data);
-					}
+				case SCSI_INQUIRY:	// return 36 B of Inq info or VPD page
+					scsi_inquiry(usbd);
 					break;
 
-#ifdef IMPLEMENT_MODE_SENSE6
-				case SCSI_MODE_SENSE6:	// not required according to https://docs.silabs.com/protocol-usb/1.2.0/protocol-usb-msc-scsi/
-					// FDMP support required - not implemented
-					scsi_resp_xfer(usbd, (const uint8_t *)&MSC_Mode_Sense6_data, sizeof MSC_Mode_Sense6_data);
+				case SCSI_MODE_SENSE6:
+				case SCSI_MODE_SENSE10:
+					scsi_mode_sense(usbd, bsdata.cbw.CB[0] == SCSI_MODE_SENSE10);
 					break;
-#endif
 
 				case SCSI_ALLOW_MEDIUM_REMOVAL:
 					if (bsdata.cbw.dDataTransferLength == 0)
@@ -431,16 +880,25 @@ void msc_bot_out(const struct usbdevice_ *usbd, uint8_t epn, uint16_t len)
 //					break;
 
 				case SCSI_READ_CAPACITY10:	// return 8 B: lastLBA, block size (32-bit BE)
-					scsi_resp_xfer(usbd, read_capacity_data, sizeof read_capacity_data);
+					scsi_read_capacity(usbd);
+					break;
+
+				case SCSI_READ_CAPACITY16:
+					if ((bsdata.cbw.CB[1] & 0x1f) == SAI_READ_CAPACITY16)
+					{
+						scsi_read_capacity16(usbd);
+					}
+					else
+					{
+						scsi_bad_command(usbd);
+					}
 					break;
 
 				case SCSI_READ10:
 					if (bsdata.cbw.bmFlags.DirIn && getparm10())
 					{
 						// command ok
-						bsdata.dbidx = 0;
-						scsi_read_xfer(usbd);
-						bsdata.state = BS_DATAIN;
+						scsi_read_start(usbd);
 					}
 					else
 					{
@@ -452,9 +910,17 @@ void msc_bot_out(const struct usbdevice_ *usbd, uint8_t epn, uint16_t len)
 				case SCSI_WRITE10:
 					if (!bsdata.cbw.bmFlags.DirIn && getparm10())
 					{
-						// command ok
-						bsdata.state = BS_DATAOUT;
-						enable_out_ep(usbd);
+						if (msc_media[bsdata.cbw.bLUN].readonly)
+						{
+							scsi_fail(usbd, SKEY_DATA_PROTECT, ASC_WRITE_PROTECTED);
+						}
+						else
+						{
+							// command ok
+							bsdata.state = BS_DATAOUT;
+							enable_block_out(usbd);
+							msc_media_request();	// flush if the cache is full
+						}
 					}
 					else
 					{
@@ -463,15 +929,25 @@ void msc_bot_out(const struct usbdevice_ *usbd, uint8_t epn, uint16_t len)
 					}
 					break;
 
-#if 0
-				case SCSI_MODE_SENSE10:
-					// not required according to https://docs.silabs.com/protocol-usb/1.2.0/protocol-usb-msc-scsi/
-					// not used by Win11
-					// FDMP support required - not implemented
-					scsi_resp_xfer(usbd, (const uint8_t *)&MSC_Mode_Sense10_data,
-							bsdata.cbw.CB[4] < sizeof MSC_Mode_Sense10_data ? bsdata.cbw.CB[4] : sizeof MSC_Mode_Sense10_data);
+				case SCSI_SYNCHRONIZE_CACHE10:	// whole cache flushed, CSW sent when done unless IMMED
+					if (bsdata.cbw.dDataTransferLength == 0)
+					{
+						bsdata.wc.flushall = 1;
+						if (bsdata.cbw.CB[1] & 2)
+							bot_send_csw(usbd);
+						else
+							bsdata.state = BS_SYNC;
+						msc_media_request();
+					}
+					else
+					{
+						scsi_bad_command(usbd);
+					}
+					break;
+
+				case SCSI_UNMAP:	// blocks discarded at media interrupt level, CSW sent when done
+					scsi_unmap(usbd);
 					break;
-#endif
 
 				default:
 					if (bsdata.cbw.dDataTransferLength == 0)
@@ -504,36 +980,34 @@ void msc_bot_out(const struct usbdevice_ *usbd, uint8_t epn, uint16_t len)
 		break;
 
 	case BS_DATAOUT:	// data to be written to a device
-		switch (len)
+		if (len == BLK_SIZE)
 		{
-		case MSC_BOT_EP_SIZE: // full packet, process write
-			memcpy(&bsdata.databuf[bsdata.dbidx], bsdata.outbuf, MSC_BOT_EP_SIZE);
-			if ((bsdata.dbidx += MSC_BOT_EP_SIZE) == MSC_DATA_BUF_SIZE)
+			// complete block received into the cache, written later at media interrupt level
+			scsi_write_block();
+			++bsdata.scsi_blkaddr;
+			bsdata.csw.dDataResidue -= BLK_SIZE;
+			if (--bsdata.scsi_nblocks == 0)
 			{
-				bsdata.dbidx = 0;
-				media_write(bsdata.cbw.bLUN, bsdata.scsi_blkaddr, bsdata.databuf);
-				++bsdata.scsi_blkaddr;
-				if (--bsdata.scsi_nblocks == 0)
-				{
-					bot_send_csw(usbd);
-				}
-				else
-				{
-					enable_out_ep(usbd);
-				}
+				bot_send_csw(usbd);
 			}
 			else
 			{
-				enable_out_ep(usbd);
+				enable_block_out(usbd);
 			}
-			break;
-
-		default:	// zlp or incomplete packet
+			msc_media_request();
+		}
+		else
+		{
+			// transfer terminated by zlp or short packet
+			msc_cache_rx_cancel();
 			bsdata.state = BS_CSW;
-			break;
 		}
 		break;
 
+	case BS_UNMAPOUT:
+		scsi_unmap_list(usbd, len);
+		break;
+
 	default:	// phase error
 		bsdata.csw.bStatus = BOT_PHASE_ERROR;
 		bot_send_csw(usbd);
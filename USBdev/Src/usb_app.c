@@ -29,6 +29,7 @@
 #include "usb_desc_gen.h"	// includes class-specific headers
 #include "usb_log.h"
 #include "usb_app.h"
+#include "vcom_uart.h"
 
 #include "usbdev_binding.h"
 
@@ -36,25 +37,24 @@
 #define EVTREC(a)	usbstat = usbstat << 4 | a
 
 // forward def
-#define SINGLE_CDC (USBD_CDC_CHANNELS == 1 && (USBD_MSC + USBD_PRINTER + USBD_HID == 0))
+#define SINGLE_CDC (USBD_CDC_CHANNELS == 1 && (USBD_MSC + USBD_PRINTER + USBD_HID + USBD_NCM == 0))
 #if SINGLE_CDC
 static const struct cfgdesc_cdc_ ConfigDesc;
 #else
 static const struct cfgdesc_msc_ncdc_prn_ ConfigDesc;
 #endif
+const struct usbdevice_ usbdev;
 
 #define SIGNON_DELAY	50u
 
 #ifndef SIGNON0
 #define SIGNON0	"\r\nVCOM0 ready\r\n"
 #endif
-#define SIGNON1	"\r\nVCOM1 ready\r\n"
-#define SIGNON2	"\r\nVCOM2 ready\r\n"
 #ifndef PROMPT
 #define PROMPT	">"
 #endif
 
-#define TX_TOUT	2u	// Tx timeout when buffer not empty in ms
+#define TX_TOUT	2u	// default VCOM_TX_TIMED latency in ms
 
 void LED_Toggle(void);	// in main.c
 //========================================================================
@@ -62,14 +62,8 @@ void LED_Toggle(void);	// in main.c
 
 #if defined(USBD_CDC_CHANNELS) && USBD_CDC_CHANNELS
 // define in usb_app.c
-static struct cdc_data_ cdc_data[USBD_CDC_CHANNELS] = {
-	[0] = {.LineCoding = {.dwDTERate = 115200, .bDataBits = 8}},
-#if USBD_CDC_CHANNELS > 1
-	[1] = {.LineCoding = {.dwDTERate = 115200, .bDataBits = 8}},
-#if USBD_CDC_CHANNELS > 2
-	[2] = {.LineCoding = {.dwDTERate = 115200, .bDataBits = 8}},
-#endif	// USBD_CDC_CHANNELS > 2
-#endif	// USBD_CDC_CHANNELS > 1
+static struct cdc_data_ cdc_data[VCOM_CHANNELS] = {	// CDC channels followed by mux logical channels
+	[0 ... VCOM_CHANNELS - 1] = {.LineCoding = {.dwDTERate = 115200, .bDataBits = 8}},
 };
 #endif	// USBD_CDC_CHANNELS
 
@@ -114,84 +108,204 @@ static void HIDsetLEDs(const struct usbdevice_ *usbd)
 // endpoint data =========================================================
 static _Alignas(USB_SetupPacket) uint8_t ep0outpkt[USBD_CTRL_EP_SIZE];	// Control EP Rx buffer
 
+// per channel entries, generated with USBD_REPEAT(); Out of CDC notification ep pairs unused
+#define CDC_OUT_EPDATA(ch)	[CDC_DATA_OUT_EP(ch)] = {.ptr = cdc_data[ch].RxData, .count = 0},
+
 static struct epdata_ out_epdata[USBD_NUM_EPPAIRS] = {
-	{.ptr = ep0outpkt, .count = 0},	// control
+	[CTRL_OUT_EP] = {.ptr = ep0outpkt, .count = 0},	// control
 #if USBD_MSC
-	{.ptr = bsdata.outbuf, .count = 0},
+	[MSC_BOT_OUT_EP] = {.ptr = bsdata.outbuf, .count = 0},
 #endif
 #if USBD_CDC_CHANNELS
-	{.ptr = 0, .count = 0},	// unused
-	{.ptr = cdc_data[0].RxData, .count = 0},
-#if USBD_CDC_CHANNELS > 1
-#ifndef USE_COMMON_CDC_INT_IN_EP
-	{.ptr = 0, .count = 0},	// unused
-#endif
-	{.ptr = cdc_data[1].RxData, .count = 0},
-#if USBD_CDC_CHANNELS > 2
-#ifndef USE_COMMON_CDC_INT_IN_EP
-	{.ptr = 0, .count = 0},	// unused
-#endif
-	{.ptr = cdc_data[2].RxData, .count = 0},
-#endif	// USBD_CDC_CHANNELS > 2
-#endif	// USBD_CDC_CHANNELS > 1
-#endif	// USBD_CDC_CHANNELS
+	USBD_REPEAT(USBD_CDC_CHANNELS, CDC_OUT_EPDATA)
+#endif
 #if USBD_PRINTER
-	{.ptr = prn_data.RxData, .count = 0},
+	[PRN_DATA_OUT_EP] = {.ptr = prn_data.RxData, .count = 0},
 #endif
 #ifdef USBD_HID_OUT_EP
-	{.ptr = hid_data.OutReport}
+	[HID_OUT_EP] = {.ptr = hid_data.OutReport}
 #endif
 };
 
 static struct epdata_ in_epdata[USBD_NUM_EPPAIRS]; // no need to init
+static struct epstats_ out_epstats[USBD_NUM_EPPAIRS], in_epstats[USBD_NUM_EPPAIRS];
 //========================================================================
 
 #if USBD_CDC_CHANNELS
-struct vcomcfg_ {
-	uint8_t rx_irqn, tx_irqn;
-	const char *signon, *prompt;
-};
+// VCOM_rx_IRQn and VCOM_tx_IRQn serve all channels; a channel is serviced if its request flag is set
+static void vcom_rx_request(uint8_t ch)
+{
+	cdc_data[ch].session.RxRq = 1;
+	NVIC_SetPendingIRQ(VCOM_rx_IRQn);
+}
 
-const struct vcomcfg_ vcomcfg[USBD_CDC_CHANNELS] = {
-	{VCOM0_rx_IRQn, VCOM0_tx_IRQn, SIGNON0, ">"},
-#if USBD_CDC_CHANNELS > 1
-	{VCOM1_rx_IRQn, VCOM1_tx_IRQn, SIGNON1},
-#if USBD_CDC_CHANNELS > 2
-	{VCOM2_rx_IRQn, VCOM2_tx_IRQn, SIGNON2},
-#endif	// USBD_CDC_CHANNELS > 2
-#endif	// USBD_CDC_CHANNELS > 1
-};
+static void vcom_tx_request(uint8_t ch)
+{
+	cdc_data[ch].session.TxRq = 1;
+	NVIC_SetPendingIRQ(VCOM_tx_IRQn);
+}
 
-//
-void vcom_write(uint8_t ch, const char *buf, uint16_t size)
+#define RX_MASK	(CDC_RX_BUF_SIZE - 1u)
+#define TX_MASK	(CDC_TX_BUF_SIZE - 1u)
+
+#define VCOM_IS_UART(ch)	((ch) < USBD_CDC_CHANNELS && (VCOM_UART_BRIDGE >> (ch) & 1u))
+
+// channels available to the application - mux carrier and UART bridges pass data without it
+#if VCOM_MUX_CHANNELS
+#define VCOM_APP_CHANNEL(ch)	((ch) < VCOM_CHANNELS && (ch) != VCOM_MUX_CARRIER && !VCOM_IS_UART(ch))
+#else
+#define VCOM_APP_CHANNEL(ch)	((ch) < USBD_CDC_CHANNELS && !VCOM_IS_UART(ch))
+#endif
+
+// arm Out endpoint at Rx ring head if there is room for a full packet, otherwise leave it NAKing
+// called from USB interrupt or with interrupts disabled
+static void cdc_rx_arm(uint8_t ch)
+{
+	struct cdc_data_ *cdp = &cdc_data[ch];
+	struct cdc_session_ *cds = &cdp->session;
+	uint8_t epn = ConfigDesc.cdc[ch].cdcdesc.cdcout.bEndpointAddress;
+
+	if (CDC_RX_BUF_SIZE - (uint16_t)(cds->RxHead - cds->RxTail) >= CDC_DATA_EP_SIZE)
+	{
+		cds->RxWait = 0;
+		USBdev_ReceiveData(&usbdev, epn, &cdp->RxData[cds->RxHead & RX_MASK], 0);
+	}
+	else
+	{
+		cds->RxWait = 1;	// rearmed by vcom_read()
+		++USBdev_EPStats(&usbdev, epn)->busy;
+	}
+}
+
+// no. of bytes received and not read yet
+uint16_t vcom_rx_count(uint8_t ch)
+{
+	struct cdc_session_ *cds = &cdc_data[ch].session;
+	return VCOM_APP_CHANNEL(ch) ? (uint16_t)(cds->RxHead - cds->RxTail) : 0;
+}
+
+// read up to size bytes from Rx ring of a channel, return no. of bytes read
+// space freed is reported to the host - Out endpoint rearmed or, for mux channel, credit sent
+static uint16_t vcom_ring_read(uint8_t ch, void *buf, uint16_t size)
+{
+	struct cdc_data_ *cdp = &cdc_data[ch];
+	struct cdc_session_ *cds = &cdp->session;
+	uint16_t tail = cds->RxTail;
+
+	uint16_t count = MIN((uint16_t)(cds->RxHead - tail), size);
+	uint16_t off = tail & RX_MASK;
+	uint16_t n1 = MIN(count, CDC_RX_BUF_SIZE - off);
+	memcpy(buf, &cdp->RxData[off], n1);
+	memcpy((uint8_t *)buf + n1, cdp->RxData, count - n1);
+	__disable_irq();
+	cds->RxTail = tail + count;
+	if (ch >= USBD_CDC_CHANNELS)
+	{
+		cds->RxGrant += count;
+		if (count)
+			vcom_tx_request(ch);
+	}
+	else if (cds->RxWait)
+		cdc_rx_arm(ch);
+	__enable_irq();
+	return count;
+}
+
+// read up to size bytes from Rx ring, return no. of bytes read
+uint16_t vcom_try_read(uint8_t ch, void *buf, uint16_t size)
+{
+	return VCOM_APP_CHANNEL(ch) ? vcom_ring_read(ch, buf, size) : 0;
+}
+
+// read up to size bytes from Rx ring, wait if it is empty, return no. of bytes read - 0 if disconnected
+uint16_t vcom_read(uint8_t ch, void *buf, uint16_t size)
+{
+	if (VCOM_APP_CHANNEL(ch) && size)
+		while (vcom_rx_count(ch) == 0 && cdc_data[ch].session.connected) ;	// ring empty -> wait
+	return vcom_try_read(ch, buf, size);
+}
+
+// set Tx coalescing policy, latency in ms for VCOM_TX_TIMED, 0 - default TX_TOUT
+void vcom_set_txmode(uint8_t ch, enum vcom_txmode_ mode, uint8_t latency)
 {
 	if (ch < USBD_CDC_CHANNELS)
+	{
+		cdc_data[ch].TxMode = mode;
+		cdc_data[ch].TxLatency = latency ? latency : TX_TOUT;
+	}
+}
+
+// send all data buffered, including partial packet, as soon as the endpoint is free
+void vcom_flush(uint8_t ch)
+{
+	if (VCOM_APP_CHANNEL(ch))
+	{
+		__disable_irq();
+		cdc_data[ch].session.TxFlush = 1;
+		vcom_tx_request(ch);
+		__enable_irq();
+	}
+}
+
+// copy as much data as fits to Tx ring, return no. of bytes accepted, 0 if not connected
+// if not all data was accepted, VCP_Writable() is called when space is freed
+// VCOM_TX_ADAPTIVE - data is sent at once if the endpoint is free, otherwise with any data written
+// in the meantime on transfer completion; VCOM_TX_TIMED - whole packets are sent at once,
+// partial packet at most TxLatency ms after it was written
+uint16_t vcom_try_write(uint8_t ch, const void *buf, uint16_t size)
+{
+	uint16_t count = 0;
+
+	if (VCOM_APP_CHANNEL(ch))
 	{
 		struct cdc_data_ *cdp = &cdc_data[ch];
 		struct cdc_session_ *cds = &cdp->session;
+		bool full = 0;
 
-		while (cds->connected && size)
+		// space freed while copying is used at once, so the ring is full when TxBlocked is set
+		while (cds->connected && count < size && !full)
 		{
-			while (cds->connected && cds->TxLength == CDC_DATA_EP_SIZE) ;	// buffer full -> wait
-
-			if (cds->connected)
+			uint16_t head = cds->TxHead;
+			uint16_t off = head & TX_MASK;
+			uint16_t chunksize = MIN(MIN((uint16_t)(size - count), CDC_TX_BUF_SIZE - (uint16_t)(head - cds->TxTail)),
+				CDC_TX_BUF_SIZE - off);
+			memcpy(&cdp->TxData[off], (const uint8_t *)buf + count, chunksize);
+			count += chunksize;
+			head += chunksize;
+			__disable_irq();
+			cds->TxHead = head;
+			full = (uint16_t)(head - cds->TxTail) == CDC_TX_BUF_SIZE;
+			cds->TxBlocked = full && count < size;
+			__enable_irq();
+		}
+		if (count)
+		{
+			__disable_irq();
+			if (cdp->TxMode == VCOM_TX_ADAPTIVE)
 			{
-				__disable_irq();
-				uint16_t bfree = CDC_DATA_EP_SIZE - cds->TxLength;
-				uint16_t chunksize = size < bfree ? size : bfree;
-				memcpy(&cdp->TxData[cds->TxLength], buf, chunksize);
-				buf += chunksize;
-				size -= chunksize;
-				cds->TxLength += chunksize;
-				if (cds->TxLength == CDC_DATA_EP_SIZE)
-				{
-					cds->TxTout = 0;
-					NVIC_SetPendingIRQ(vcomcfg[ch].tx_irqn);
-				}
-				else
-					cds->TxTout = TX_TOUT;
-				__enable_irq();
+				cds->TxFlush = 1;
+				vcom_tx_request(ch);	// held until completion if busy
 			}
+			else if ((uint16_t)(cds->TxHead - cds->TxTail - cds->TxSent) >= CDC_DATA_EP_SIZE)
+				vcom_tx_request(ch);
+			else if (cds->TxTout == 0)
+				cds->TxTout = cdp->TxLatency;
+			__enable_irq();
+		}
+	}
+	return count;
+}
+
+// copy data to Tx ring, wait while the ring is full
+void vcom_write(uint8_t ch, const char *buf, uint16_t size)
+{
+	if (VCOM_APP_CHANNEL(ch))
+	{
+		while (cdc_data[ch].session.connected && size)
+		{
+			uint16_t sent = vcom_try_write(ch, buf, size);
+			buf += sent;
+			size -= sent;
 		}
 	}
 }
@@ -218,72 +332,393 @@ void vcom0_putstring(const char *s)
 	vcom_putstring(0, s);
 }
 
-#if USBD_CDC_CHANNELS > 1
-void vcom1_putc(uint8_t c)
+// Serial state notification scheduler ===================================
+// notifications of channels sharing an endpoint (USE_COMMON_CDC_INT_IN_EP) are sent one at a time,
+// channels served round robin; state changes made while a channel waits are coalesced,
+// transient bits are ORed, carriers reported as last set
+#ifdef USE_COMMON_CDC_INT_IN_EP
+#define CDC_NOTIF_EPS	1u
+#define CDC_NOTIF_IDX(ch)	0u
+#else
+#define CDC_NOTIF_EPS	USBD_CDC_CHANNELS
+#define CDC_NOTIF_IDX(ch)	(ch)
+#endif
+
+#define CDC_SERIAL_STATE_CARRIERS	(CDC_SERIAL_STATE_TX_CARRIER | CDC_SERIAL_STATE_RX_CARRIER)
+
+static struct cdc_notif_ {
+	struct cdc_SerialStateNotif_ msg;	// notification being sent
+	uint8_t last;	// channel served last
+} cdc_notif[CDC_NOTIF_EPS];
+
+// send the next pending notification on the endpoint of channel ch unless it is busy -
+// called again from DataSentHandler() on completion and from usbdev_tick();
+// call from USB interrupt or with interrupts disabled
+static void cdc_notif_send(uint8_t ch)
+{
+	struct cdc_notif_ *np = &cdc_notif[CDC_NOTIF_IDX(ch)];
+	uint8_t epaddr = CDC_INT_IN_EP(ch);
+
+	if (usbdev.inep[epaddr & EPNUMMSK].busy)
+		return;
+	for (uint8_t i = 1; i <= USBD_CDC_CHANNELS; i++)
+	{
+		uint8_t c = (np->last + i) % USBD_CDC_CHANNELS;
+		struct cdc_data_ *cdp = &cdc_data[c];
+
+		if (CDC_NOTIF_IDX(c) == CDC_NOTIF_IDX(ch) && cdp->SerialState != cdp->SerialStateSent)
+		{
+			np->msg = (struct cdc_SerialStateNotif_) {
+				.bmRequestType = {.Recipient = USB_RQREC_INTERFACE, .Type = USB_RQTYPE_CLASS, .DirIn = 1},
+				.bNotification = CDC_NOTIFICATION_SERIAL_STATE,
+				.wIndex = IFNUM_CDC_CONTROL(c),	// interface
+				.wLength = 2,	// size of wSerialState
+				.wSerialState = cdp->SerialState
+			};
+			if (USBdev_SendData(&usbdev, epaddr, (const uint8_t *)&np->msg, sizeof(np->msg), 0) == 0)
+			{
+				np->last = c;
+				cdp->SerialStateSent = np->msg.wSerialState & CDC_SERIAL_STATE_CARRIERS;	// clear all transient flags
+				cdp->SerialState ^= np->msg.wSerialState & ~CDC_SERIAL_STATE_CARRIERS;	// clear transient flags sent
+			}
+			return;
+		}
+	}
+}
+
+// set serial state reported to the host - carrier bits replace the current ones,
+// transient bits (break, ring, errors) are reported once
+void vcom_set_serial_state(uint8_t ch, uint16_t state)
 {
-	vcom_putchar(1, c);
+	if (ch < USBD_CDC_CHANNELS)
+	{
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		cdc_data[ch].SerialState = (cdc_data[ch].SerialState & ~CDC_SERIAL_STATE_CARRIERS) | state;
+		cdc_notif_send(ch);
+		__set_PRIMASK(primask);
+	}
 }
 
-void vcom1_putstring(const char *s)
+//========================================================================
+// overwrite for any real-world use - this is just echo for demo application
+// called from VCOM_rx_IRQHandler() when data is available, or with no data after AUTONUL_TOUT
+// if requested with PIRET_AUTONUL; read data with vcom_try_read(), called again while some data is left
+// return PIRET_ flags
+__attribute__ ((weak)) uint8_t vcom_process_rx(uint8_t ch)
 {
-	vcom_putstring(1, s);
+	uint8_t buf[CDC_DATA_EP_SIZE];
+
+	vcom_write(ch, (const char *)buf, vcom_try_read(ch, buf, sizeof(buf)));	// echo to the same channel
+	return 0;
 }
 
-#if USBD_CDC_CHANNELS > 2
-void vcom2_putc(uint8_t c)
+__attribute__ ((weak)) void VCP_ConnStatus(uint8_t ch, bool on)
 {
-	vcom_putchar(2, c);
+	// define to control board's LED for VCP connection status signaling
 }
 
-void vcom2_putstring(const char *s)
+// called from USB interrupt when data was received, to be read with vcom_try_read()
+__attribute__ ((weak)) void VCP_Readable(uint8_t ch)
 {
-	vcom_putstring(2, s);
 }
 
-#endif	// USBD_CDC_CHANNELS > 2
-#endif	// USBD_CDC_CHANNELS > 1
+// called from USB interrupt when Tx ring space was freed after vcom_try_write() accepted less than requested
+__attribute__ ((weak)) void VCP_Writable(uint8_t ch)
+{
+}
 
-// Serial state notification =============================================
-struct cdc_SerialStateNotif_  ssnotif = {
-	.bmRequestType = {.Recipient = USB_RQREC_INTERFACE, .Type = USB_RQTYPE_CLASS, .DirIn = 1},
-	.bNotification = CDC_NOTIFICATION_SERIAL_STATE,
-	.wIndex = 0,	// interface
-	.wLength = 2,	// size of wSerialState
-	.wSerialState = 0
-};
+#if VCOM_MUX_CHANNELS
+// VCOM multiplexer ======================================================
+// logical channels use the rings and session of their cdc_data entries; frames are put into
+// the carrier Tx ring by mux_tx_service() at VCOM_tx_IRQn, one data frame per channel in turn,
+// limited by credit granted by the host; received frames are parsed by mux_rx_service() at VCOM_rx_IRQn
+_Static_assert(VCOM_MUX_CARRIER < USBD_CDC_CHANNELS, "VCOM_MUX_CARRIER must be a CDC channel");
+_Static_assert(VCOM_MUX_CHANNELS <= VCOM_MUX_CHMSK + 1, "Too many mux channels");
 
-// forward declaration
-const struct usbdevice_ usbdev;
+#ifndef VCOM_MUX_FRAME_MAX
+#define VCOM_MUX_FRAME_MAX	(CDC_DATA_EP_SIZE - VCOM_MUX_HDR_SIZE)	// data bytes per frame
+#endif
+#define VCOM_MUX_GRANT_MIN	CDC_DATA_EP_SIZE	// credit returned in chunks or when Rx ring is empty
+
+static struct mux_rx_ {
+	uint8_t hdr[VCOM_MUX_HDR_SIZE];
+	uint8_t hcount;	// header bytes collected
+	uint8_t idx;	// logical channel of data frame
+	uint16_t left;	// data bytes left in frame
+} mux_rx;
+
+// free space in carrier Tx ring
+static inline uint16_t mux_tx_room(void)
+{
+	struct cdc_session_ *cas = &cdc_data[VCOM_MUX_CARRIER].session;
+	return CDC_TX_BUF_SIZE - (uint16_t)(cas->TxHead - cas->TxTail);
+}
+
+// append to carrier Tx ring, room checked by caller
+static void mux_tx_put(const uint8_t *data, uint16_t len)
+{
+	struct cdc_data_ *car = &cdc_data[VCOM_MUX_CARRIER];
+	uint16_t off = car->session.TxHead & TX_MASK;
+	uint16_t n1 = MIN(len, CDC_TX_BUF_SIZE - off);
+
+	memcpy(&car->TxData[off], data, n1);
+	memcpy(car->TxData, data + n1, len - n1);
+	car->session.TxHead += len;
+}
+
+static void mux_tx_hdr(uint8_t hdr, uint16_t value)
+{
+	const uint8_t h[VCOM_MUX_HDR_SIZE] = {hdr, value & 0xff, value >> 8};
+	mux_tx_put(h, sizeof(h));
+}
+
+// send pending credit and a data frame of a logical channel, called from VCOM_tx_IRQHandler();
+// requested again while there is more to send, on credit from the host and on carrier transfer completion
+static void mux_tx_service(uint8_t ch)
+{
+	struct cdc_data_ *cdp = &cdc_data[ch];
+	struct cdc_session_ *cds = &cdp->session;
+	uint8_t idx = ch - VCOM_MUX_CH(0);
+	bool sent = 0;
+
+	cds->TxFlush = 0;	// frames are always sent at once
+	if (!cds->connected)
+		return;
+	if (cds->RxGrant && (cds->RxGrant >= VCOM_MUX_GRANT_MIN || cds->RxHead == cds->RxTail)
+		&& mux_tx_room() >= VCOM_MUX_HDR_SIZE)
+	{
+		mux_tx_hdr(VCOM_MUX_CREDIT | idx, cds->RxGrant);
+		cds->RxGrant = 0;
+		sent = 1;
+	}
+	uint16_t tail = cds->TxTail;
+	uint16_t room = mux_tx_room();
+	uint16_t len = MIN(MIN((uint16_t)(cds->TxHead - tail), cds->TxCredit), VCOM_MUX_FRAME_MAX);
+	len = room > VCOM_MUX_HDR_SIZE ? MIN(len, room - VCOM_MUX_HDR_SIZE) : 0;
+	if (len)
+	{
+		uint16_t off = tail & TX_MASK;
+		uint16_t n1 = MIN(len, CDC_TX_BUF_SIZE - off);
+		mux_tx_hdr(idx, len);
+		mux_tx_put(&cdp->TxData[off], n1);
+		mux_tx_put(cdp->TxData, len - n1);
+		cds->TxTail = tail + len;
+		cds->TxCredit -= len;
+		sent = 1;
+		if (cds->TxHead != cds->TxTail && cds->TxCredit)
+			vcom_tx_request(ch);	// next frame after other channels
+		if (cds->TxBlocked)
+		{
+			cds->TxBlocked = 0;
+			VCP_Writable(ch);
+		}
+	}
+	if (sent)
+	{
+		cdc_data[VCOM_MUX_CARRIER].session.TxFlush = 1;
+		vcom_tx_request(VCOM_MUX_CARRIER);
+	}
+}
 
-// inline only to avoid not used warning
-static inline void send_serialstate_notif(uint8_t ch)
+// carrier transfer completed - resume channels waiting for room in carrier Tx ring
+static void mux_tx_kick(void)
 {
-	ssnotif.wIndex = ConfigDesc.cdc[ch].cdcdesc.cdccomifdesc.bInterfaceNumber;	// interface
-	ssnotif.wSerialState = cdc_data[ch].SerialState;
-	if (USBdev_SendData(&usbdev, ConfigDesc.cdc[ch].cdcdesc.cdcnotif.bEndpointAddress,
-		(const uint8_t *)&ssnotif, sizeof(ssnotif), 0) == 0)
+	for (uint8_t ch = VCOM_MUX_CH(0); ch < VCOM_CHANNELS; ch++)
 	{
-		cdc_data[ch].SerialStateSent = ssnotif.wSerialState & (CDC_SERIAL_STATE_TX_CARRIER | CDC_SERIAL_STATE_RX_CARRIER);	// clear all transient flags
-		cdc_data[ch].SerialState ^= ssnotif.wSerialState & ~(CDC_SERIAL_STATE_TX_CARRIER | CDC_SERIAL_STATE_RX_CARRIER);	// clear transient flags sent
+		struct cdc_session_ *cds = &cdc_data[ch].session;
+		if (cds->connected && ((cds->TxHead != cds->TxTail && cds->TxCredit) || cds->RxGrant))
+			vcom_tx_request(ch);
 	}
 }
 
-//========================================================================
-// overwrite for any real-world use - this is just echo for demo application
-// return 1 if prompt requested
-__attribute__ ((weak)) uint8_t vcom_process_input(uint8_t ch, uint8_t c)
+// carrier connected - open logical channels, grant their Rx rings to the host
+static void mux_start(void)
 {
-#if USBD_CDC_CHANNELS
-	vcom_putchar(ch, c);	// echo to the same channel
-#endif
-	return 0;
+	for (uint8_t ch = VCOM_MUX_CH(0); ch < VCOM_CHANNELS; ch++)
+	{
+		struct cdc_session_ *cds = &cdc_data[ch].session;
+		if (cds->connected)
+			continue;	// DTR set again
+		__disable_irq();
+		cds->RxGrant = CDC_RX_BUF_SIZE - (uint16_t)(cds->RxHead - cds->RxTail);
+		cds->connected = 1;
+		cds->signon_rq = 1;
+		vcom_tx_request(ch);
+		__enable_irq();
+		VCP_ConnStatus(ch, 1);
+		vcom_rx_request(ch);
+	}
 }
 
-__attribute__ ((weak)) void VCP_ConnStatus(uint8_t ch, bool on)
+// carrier disconnected or bus reset - close logical channels, drop their data and credit
+static void mux_stop(void)
 {
-	// define to control board's LED for VCP connection status signaling
+	mux_rx = (struct mux_rx_) {0};
+	for (uint8_t ch = VCOM_MUX_CH(0); ch < VCOM_CHANNELS; ch++)
+	{
+		cdc_data[ch].session = (struct cdc_session_) {0};
+		VCP_ConnStatus(ch, 0);
+	}
 }
 
+// store data frame contents in logical channel Rx ring; data exceeding credit granted is dropped
+static void mux_rx_put(uint8_t ch, const uint8_t *data, uint16_t len)
+{
+	struct cdc_data_ *cdp = &cdc_data[ch];
+	struct cdc_session_ *cds = &cdp->session;
+	uint16_t head = cds->RxHead;
+
+	len = MIN(len, CDC_RX_BUF_SIZE - (uint16_t)(head - cds->RxTail));
+	if (len && cds->connected)
+	{
+		uint16_t off = head & RX_MASK;
+		uint16_t n1 = MIN(len, CDC_RX_BUF_SIZE - off);
+		memcpy(&cdp->RxData[off], data, n1);
+		memcpy(cdp->RxData, data + n1, len - n1);
+		cds->RxHead = head + len;
+		vcom_rx_request(ch);
+		VCP_Readable(ch);
+	}
+}
+
+// parse frames received on the carrier, called from VCOM_rx_IRQHandler()
+static void mux_rx_service(void)
+{
+	struct mux_rx_ *mr = &mux_rx;
+	struct cdc_session_ *cas = &cdc_data[VCOM_MUX_CARRIER].session;
+	uint8_t buf[CDC_DATA_EP_SIZE];
+	uint16_t n;
+
+	if (cas->signon_rq)
+	{
+		cas->signon_rq = 0;
+		mux_start();
+	}
+	while ((n = vcom_ring_read(VCOM_MUX_CARRIER, buf, sizeof(buf))))
+	{
+		for (uint16_t i = 0; i < n; )
+		{
+			if (mr->left)
+			{
+				uint16_t len = MIN(mr->left, n - i);
+				if (mr->idx < VCOM_MUX_CHANNELS)
+					mux_rx_put(VCOM_MUX_CH(mr->idx), &buf[i], len);
+				mr->left -= len;
+				i += len;
+				continue;
+			}
+			mr->hdr[mr->hcount++] = buf[i++];
+			if (mr->hcount < VCOM_MUX_HDR_SIZE)
+				continue;
+			mr->hcount = 0;
+			uint8_t idx = mr->hdr[0] & VCOM_MUX_CHMSK;
+			uint16_t value = mr->hdr[1] | mr->hdr[2] << 8;
+			if (~mr->hdr[0] & VCOM_MUX_CREDIT)
+			{
+				mr->idx = idx;
+				mr->left = value;
+			}
+			else if (idx < VCOM_MUX_CHANNELS)
+			{
+				__disable_irq();
+				cdc_data[VCOM_MUX_CH(idx)].session.TxCredit += value;
+				vcom_tx_request(VCOM_MUX_CH(idx));
+				__enable_irq();
+			}
+		}
+	}
+}
+#endif	// VCOM_MUX_CHANNELS
+
+#if VCOM_UART_BRIDGE
+// CDC-UART bridge =======================================================
+// UART Rx DMA writes circularly into the Tx ring, the ring head follows DMA position;
+// USB Out data is sent by UART Tx DMA from the Rx ring, the Out endpoint is rearmed on completion
+// UART Rx DMA progress, also polled from usbdev_tick(); data overwritten before it was sent is reported as overrun
+void vcom_uart_rx_event(uint8_t ch)
+{
+	struct cdc_data_ *cdp = &cdc_data[ch];
+	struct cdc_session_ *cds = &cdp->session;
+	uint16_t head = cds->TxHead + ((vcom_uart_hw.RxPos(ch) - cds->TxHead) & TX_MASK);
+
+	if (head == cds->TxHead)
+		return;
+	if ((uint16_t)(head - cds->TxTail) >= CDC_TX_BUF_SIZE)
+	{
+		head = cds->TxTail + CDC_TX_BUF_SIZE;
+		vcom_uart_error(ch, CDC_SERIAL_STATE_OVERRUN);
+	}
+	cds->TxHead = head;
+	cds->TxFlush = 1;
+	vcom_tx_request(ch);	// held until completion if busy
+}
+
+// send received data up to Rx ring end, at most half the ring so that the other half is refilled meanwhile
+static void vcom_uart_out(uint8_t ch)
+{
+	struct cdc_data_ *cdp = &cdc_data[ch];
+	struct cdc_session_ *cds = &cdp->session;
+	uint16_t off = cds->RxTail & RX_MASK;
+	uint16_t len = MIN(MIN((uint16_t)(cds->RxHead - cds->RxTail), CDC_RX_BUF_SIZE - off), CDC_RX_BUF_SIZE / 2);
+
+	if (len && !cds->UartTxLen && !cds->BreakTimer)
+	{
+		cds->UartTxLen = len;
+		vcom_uart_hw.TxStart(ch, &cdp->RxData[off], len);
+	}
+}
+
+void vcom_uart_tx_done(uint8_t ch)
+{
+	struct cdc_session_ *cds = &cdc_data[ch].session;
+
+	cds->RxTail += cds->UartTxLen;
+	cds->UartTxLen = 0;
+	if (cds->RxWait)
+		cdc_rx_arm(ch);
+	vcom_uart_out(ch);
+}
+
+// UART receive errors and break, reported with SERIAL_STATE notification
+void vcom_uart_error(uint8_t ch, uint16_t serialstate)
+{
+	cdc_data[ch].SerialState |= serialstate;
+	cdc_notif_send(ch);
+}
+
+// (re)start UART of bridged channels, called on session init
+static void vcom_uart_start(void)
+{
+	for (uint8_t ch = 0; ch < USBD_CDC_CHANNELS; ch++)
+		if (VCOM_IS_UART(ch))
+		{
+			vcom_uart_hw.SetBreak(ch, 0);
+			vcom_uart_hw.Start(ch, cdc_data[ch].TxData, CDC_TX_BUF_SIZE);
+		}
+}
+
+static void cdc_LineCodingHandler(const struct usbdevice_ *usbd, uint8_t ch)
+{
+	if (VCOM_IS_UART(ch))
+	{
+		vcom_uart_hw.SetLineCoding(ch, &cdc_data[ch].LineCoding);
+		cdc_data[ch].LineCodingChanged = 0;
+	}
+}
+
+static void cdc_SendBreakHandler(const struct usbdevice_ *usbd, uint8_t ch, uint16_t duration)
+{
+	if (VCOM_IS_UART(ch))
+	{
+		cdc_data[ch].session.BreakTimer = duration;
+		vcom_uart_hw.SetBreak(ch, duration != 0);
+		if (duration == 0)
+			vcom_uart_out(ch);	// transmission held during break
+	}
+}
+#endif	// VCOM_UART_BRIDGE
+
 #endif	// USBD_CDC_CHANNELS
 
 #if USBD_CDC_CHANNELS || USBD_PRINTER
@@ -301,7 +736,10 @@ static void allow_rx(uint8_t epn)
 
 __attribute__ ((weak)) uint8_t prn_process_input(uint8_t c)
 {
-	return vcom_process_input(0, c);	// same handling as vcom0
+#if USBD_CDC_CHANNELS
+	vcom_putchar(0, c);	// display on vcom0
+#endif
+	return 0;
 }
 
 void PRN_rx_IRQHandler(void)
@@ -334,15 +772,31 @@ static void usbdev_session_init(void)
 	for (uint8_t ch = 0; ch < USBD_CDC_CHANNELS; ch++)
 	{
 		struct cdc_data_ *cdcp = &cdc_data[ch];
+		bool rxwait = cdcp->session.RxWait;
 		cdcp->session = (struct cdc_session_) {0};
+		USBdev_SetRxBuf(&usbdev, ConfigDesc.cdc[ch].cdcdesc.cdcout.bEndpointAddress, cdcp->RxData);
+		if (rxwait && usbdev.devdata->devstate == USBD_STATE_CONFIGURED)
+			cdc_rx_arm(ch);
 		VCP_ConnStatus(ch, 0);
 	}
+#if VCOM_MUX_CHANNELS
+	mux_stop();
+#endif
+#if VCOM_UART_BRIDGE
+	vcom_uart_start();
+#endif
+#endif
+#if USBD_MSC
+	msc_bot_flush();
 #endif
 }
 
 static void usbdev_reset(void)
 {
 	usbdev_session_init();
+#if USBD_NCM
+	ncm_reset();
+#endif
 #if USBD_CDC_CHANNELS
 	for (uint8_t ch = 0; ch < USBD_CDC_CHANNELS; ch++)
 	{
@@ -387,10 +841,10 @@ void usbdev_tick(void)
 	if ((++dt & 0x3ff) == 0)
 	{
 		cdc_data[0].SerialState = dt >> 10 & 3;
-		//send_serialstate_notif(0);
+		//cdc_notif_send(0);
 	}
 #endif
-	for (uint8_t ch = 0; ch < USBD_CDC_CHANNELS; ch++)
+	for (uint8_t ch = 0; ch < VCOM_CHANNELS; ch++)	// timers of mux channels too
 	{
 		struct cdc_data_ *cdcp = &cdc_data[ch];
 		struct cdc_session_ *cds = &cdcp->session;
@@ -400,20 +854,31 @@ void usbdev_tick(void)
 			cds->connected = 1;
 			VCP_ConnStatus(ch, 1);
 			cds->signon_rq = 1;
-			NVIC_SetPendingIRQ(vcomcfg[ch].rx_irqn);
-			NVIC_EnableIRQ(vcomcfg[ch].tx_irqn);
+			vcom_rx_request(ch);
 		}
 		if (cds->autonul_timer && --cds->autonul_timer == 0)
 		{
 			cds->autonul = 1;
-			NVIC_SetPendingIRQ(vcomcfg[ch].rx_irqn);
+			vcom_rx_request(ch);
 		}
 		if (cds->TxTout && --cds->TxTout == 0)
 		{
-			NVIC_SetPendingIRQ(vcomcfg[ch].tx_irqn);
+			cds->TxFlush = 1;
+			vcom_tx_request(ch);
 		}
-		if (cdcp->SerialState != cdcp->SerialStateSent)
-			send_serialstate_notif(ch);
+		if (ch < USBD_CDC_CHANNELS && cdcp->SerialState != cdcp->SerialStateSent)
+			cdc_notif_send(ch);	// retry if the endpoint was not configured; mux channels have no notifications
+#if VCOM_UART_BRIDGE
+		if (VCOM_IS_UART(ch))
+		{
+			vcom_uart_rx_event(ch);	// latency bound if UART idle detection is not used
+			if (cds->BreakTimer && cds->BreakTimer != 0xffffu && --cds->BreakTimer == 0)
+			{
+				vcom_uart_hw.SetBreak(ch, 0);
+				vcom_uart_out(ch);
+			}
+		}
+#endif
 	}
 #endif	// USBD_CDC_CHANNELS
 #if USBD_HID
@@ -438,25 +903,36 @@ void usbdev_tick(void)
 	}
 
 #endif	// USBD_HID
+#if USBD_MSC
+	msc_bot_tick();
+#endif
 }
 
 #if USBD_CDC_CHANNELS
 void cdc_LineStateHandler(const struct usbdevice_ *usbd, uint8_t ch)
 {
 	// called from USB interrupt, overwrites the default handler in usb_class.c
+#if VCOM_UART_BRIDGE
+	if (VCOM_IS_UART(ch) && vcom_uart_hw.SetControlLines)
+		vcom_uart_hw.SetControlLines(ch, cdc_data[ch].ControlLineState);
+#endif
 	if ((cdc_data[ch].ControlLineState & (CDC_CTL_DTR | CDC_CTL_RTS)) == (CDC_CTL_DTR | CDC_CTL_RTS))
 	{
 		// Note: Br@y Terminal sends DTR & RTS only when DTR goes active while RTS _is_ active
-		cdc_data[ch].SerialState |= CDC_SERIAL_STATE_TX_CARRIER | CDC_SERIAL_STATE_RX_CARRIER;
+		cdc_data[ch].SerialState |= CDC_SERIAL_STATE_CARRIERS;
+		cdc_notif_send(ch);
 		cdc_data[ch].session.connstart_timer = SIGNON_DELAY;	// display prompt after 50 ms
 	}
 	else
 	{
-		//NVIC_DisableIRQ(VCOM0_tx_IRQn);
 		// should reset the state
 		cdc_data[ch].session.connstart_timer = 0;	// possible hazard w/USB interrupt
 		cdc_data[ch].session.connected = 0;
 		VCP_ConnStatus(ch, 0);
+#if VCOM_MUX_CHANNELS
+		if (ch == VCOM_MUX_CARRIER)
+			mux_stop();
+#endif
 	}
 	cdc_data[ch].ControlLineStateChanged = 0;
 }
@@ -465,17 +941,30 @@ void cdc_LineStateHandler(const struct usbdevice_ *usbd, uint8_t ch)
 void vcom_prompt_request(uint8_t ch)
 {
 	cdc_data[ch].session.prompt_rq = 1;
-	NVIC_SetPendingIRQ(vcomcfg[ch].rx_irqn);
+	vcom_rx_request(ch);
 }
 
-// signon/prompt display, may be customized
+// signon/prompt display, may be customized; prompt on VCOM0 only
 __attribute__ ((weak)) void vcom_prompt(uint8_t ch, bool signon)
 {
-	vcom_putstring(ch, signon ? vcomcfg[ch].signon : vcomcfg[ch].prompt);
+	if (!signon)
+		vcom_putstring(ch, ch == 0 ? PROMPT : 0);
+	else if (ch == 0)
+		vcom_putstring(ch, SIGNON0);
+	else
+	{
+		char s[20] = "\r\nVCOM";
+		uint8_t n = 6;
+		if (ch >= 10)
+			s[n++] = '0' + ch / 10;
+		s[n++] = '0' + ch % 10;
+		strcpy(&s[n], " ready\r\n");
+		vcom_putstring(ch, s);
+	}
 }
 
-// data reception and state change handler, priority lower than USB hw interrupt
-void VCOM_rx_IRQHandler(uint8_t ch)
+// data reception and state change service of a channel
+static void vcom_rx_service(uint8_t ch)
 {
 	if (cdc_data[ch].LineCodingChanged)
 	{
@@ -486,101 +975,140 @@ void VCOM_rx_IRQHandler(uint8_t ch)
 	{
 		// handle if not handled by LineStateHandler
 	}
-	if (cdc_data[ch].session.RxLength)
+	struct cdc_session_ *cds = &cdc_data[ch].session;
+	if (vcom_rx_count(ch))
 	{
-		cdc_data[ch].session.connected = 1;
+		cds->connected = 1;
 		VCP_ConnStatus(ch, 1);
-		uint8_t pival = 0;
-		while (cdc_data[ch].session.RxIdx < cdc_data[ch].session.RxLength && NVIC_GetEnableIRQ(vcomcfg[ch].rx_irqn))
-		{
-			pival = vcom_process_input(ch, cdc_data[ch].RxData[cdc_data[ch].session.RxIdx++]);
-			cdc_data[ch].session.prompt_rq |= pival & PIRET_PROMPTRQ;
-		}
-		if (cdc_data[ch].session.RxIdx == cdc_data[ch].session.RxLength)
-		{
-			cdc_data[ch].session.RxLength = 0;
-			cdc_data[ch].session.autonul = 0;
-			cdc_data[ch].session.autonul_timer = (pival & PIRET_AUTONUL) ? AUTONUL_TOUT : 0;
-			allow_rx(ConfigDesc.cdc[ch].cdcdesc.cdcout.bEndpointAddress);
-		}
+		uint8_t pival = vcom_process_rx(ch);
+		cds->prompt_rq |= pival & PIRET_PROMPTRQ;
+		cds->autonul = 0;
+		if (vcom_rx_count(ch) == 0)
+			cds->autonul_timer = (pival & PIRET_AUTONUL) ? AUTONUL_TOUT : 0;
 		else
-		{
-			NVIC_SetPendingIRQ(vcomcfg[ch].rx_irqn);
-		}
+			vcom_rx_request(ch);	// data left, continue when enabled
 	}
-	else if (cdc_data[ch].session.autonul && NVIC_GetEnableIRQ(vcomcfg[ch].rx_irqn))
+	else if (cds->autonul && NVIC_GetEnableIRQ(VCOM_rx_IRQn))
 	{
-		cdc_data[ch].session.autonul = 0;
-		cdc_data[ch].session.prompt_rq |= vcom_process_input(ch, 0) & PIRET_PROMPTRQ;
+		cds->autonul = 0;
+		cds->prompt_rq |= vcom_process_rx(ch) & PIRET_PROMPTRQ;
 	}
 
-	if (cdc_data[ch].session.RxLength == 0)
+	if (vcom_rx_count(ch) == 0)
 	{
-		if (cdc_data[ch].session.signon_rq)
+		if (cds->signon_rq)
 		{
-			cdc_data[ch].session.signon_rq = 0;
+			cds->signon_rq = 0;
 			vcom_prompt(ch, 1);
-			cdc_data[ch].session.prompt_rq = 1;
+			cds->prompt_rq = 1;
 		}
-		if (cdc_data[ch].session.prompt_rq)
+		if (cds->prompt_rq)
 		{
-			cdc_data[ch].session.prompt_rq = 0;
+			cds->prompt_rq = 0;
 			vcom_prompt(ch, 0);
 		}
 	}
 }
 
-void VCOM0_rx_IRQHandler(void)
+// data reception and state change handler for all channels, priority lower than USB hw interrupt
+void VCOM_rx_IRQHandler(void)
 {
-	VCOM_rx_IRQHandler(0);
+	for (uint8_t ch = 0; ch < VCOM_CHANNELS; ch++)
+	{
+		if (cdc_data[ch].session.RxRq)
+		{
+			cdc_data[ch].session.RxRq = 0;
+#if VCOM_MUX_CHANNELS
+			if (ch == VCOM_MUX_CARRIER)
+				mux_rx_service();
+			else
+#endif
+				vcom_rx_service(ch);
+		}
+	}
 }
 
-// transmit handler, must have the same priority as USB hw interrupt
-void VCOM_tx_IRQHandler(uint8_t ch)
+// start transfer of a channel if there is data to send
+// sends all whole packets in the ring as a single transfer, or all the data after Tx timeout;
+// a transfer ending with a full packet is followed by another transfer or a ZLP
+static void vcom_tx_start(uint8_t ch)
 {
+	static struct usbiov_ txiov[USBD_CDC_CHANNELS][2];
 	struct cdc_data_ *cdp = &cdc_data[ch];
-
-	NVIC_DisableIRQ(vcomcfg[ch].tx_irqn);
-//	if (cdp->TxLength)
+	struct cdc_session_ *cds = &cdp->session;
+	uint8_t epaddr = ConfigDesc.cdc[ch].cdcdesc.cdcin.bEndpointAddress;
+
+	uint16_t tail = cds->TxTail;
+	uint16_t len = cds->TxHead - tail;
+	bool flush = cds->TxFlush;
+	cds->TxFlush = 0;
+	if (!flush)
+		len -= len % CDC_DATA_EP_SIZE;
+	if (len)
 	{
-		if (cdp->session.TxLength == CDC_DATA_EP_SIZE)
-			NVIC_SetPendingIRQ(vcomcfg[ch].tx_irqn);	// another packet must follow, data or ZLP
-		USBdev_SendData(&usbdev, ConfigDesc.cdc[ch].cdcdesc.cdcin.bEndpointAddress,
-			cdp->TxData, cdp->session.TxLength, 0);
-		cdp->session.TxLength = 0;	// clear counter
+		uint16_t off = tail & TX_MASK;
+		uint16_t len1 = MIN(len, CDC_TX_BUF_SIZE - off);
+		txiov[ch][0] = (struct usbiov_){&cdp->TxData[off], len1};
+		txiov[ch][1] = (struct usbiov_){cdp->TxData, len - len1};
+		if (USBdev_SendDataV(&usbdev, epaddr, txiov[ch], 2, flush) == 0)
+		{
+			cds->TxBusy = 1;
+			cds->TxSent = len;
+			cds->TxZlp = !flush;
+			if (!flush)
+				cds->TxTout = cdp->TxLatency;	// terminate transfer if no more data arrives
+		}
+	}
+	else if (flush && cds->TxZlp)
+	{
+		if (USBdev_SendData(&usbdev, epaddr, 0, 0, 0) == 0)
+		{
+			cds->TxBusy = 1;
+			cds->TxZlp = 0;
+		}
 	}
 }
 
-void VCOM0_tx_IRQHandler(void)
-{
-	VCOM_tx_IRQHandler(0);
-}
-
-#if USBD_CDC_CHANNELS > 1
-void VCOM1_rx_IRQHandler(void)
-{
-	VCOM_rx_IRQHandler(1);
-}
-
-// transmit handler, must have the same priority as USB hw interrupt
-void VCOM1_tx_IRQHandler(void)
-{
-	VCOM_tx_IRQHandler(1);
-}
-
-#if USBD_CDC_CHANNELS > 2
-void VCOM2_rx_IRQHandler(void)
+// transmit handler for all channels, must have the same priority as USB hw interrupt
+// requests of busy channels are held until transfer completion
+void VCOM_tx_IRQHandler(void)
 {
-	VCOM_rx_IRQHandler(2);
+	for (uint8_t ch = 0; ch < VCOM_CHANNELS; ch++)
+	{
+		struct cdc_session_ *cds = &cdc_data[ch].session;
+		if (cds->TxRq && !cds->TxBusy)
+		{
+			cds->TxRq = 0;
+#if VCOM_MUX_CHANNELS
+			if (ch >= USBD_CDC_CHANNELS)
+				mux_tx_service(ch);
+			else
+#endif
+				vcom_tx_start(ch);
+		}
+	}
 }
 
-// transmit handler, must have the same priority as USB hw interrupt
-void VCOM2_tx_IRQHandler(void)
+// transfer completed - free the data sent
+static void vcom_tx_done(uint8_t ch)
 {
-	VCOM_tx_IRQHandler(2);
+	struct cdc_session_ *cds = &cdc_data[ch].session;
+
+	cds->TxTail += cds->TxSent;
+	cds->TxSent = 0;
+	cds->TxBusy = 0;
+	if ((uint16_t)(cds->TxHead - cds->TxTail) >= CDC_DATA_EP_SIZE || cds->TxRq)
+		vcom_tx_request(ch);
+	if (cds->TxBlocked)
+	{
+		cds->TxBlocked = 0;
+		VCP_Writable(ch);
+	}
+#if VCOM_MUX_CHANNELS
+	if (ch == VCOM_MUX_CARRIER)
+		mux_tx_kick();
+#endif
 }
-#endif	// USBD_CDC_CHANNELS > 2
-#endif	// USBD_CDC_CHANNELS > 1
 #endif	// USBD_CDC_CHANNELS
 
 #if USBD_HID
@@ -654,11 +1182,39 @@ static void HIDoutHandler(const struct usbdevice_ *usbd, uint8_t epn)
 
 // Application routines ==================================================
 #if USBD_CDC_CHANNELS
-static void cdc_rxhandler(uint8_t ch, uint16_t length)
+// channel of CDC data endpoint
+#ifdef USE_COMMON_CDC_INT_IN_EP
+#define CDC_EP_CHANNEL(epn)	(((epn) & EPNUMMSK) - (CDC_FIRST_OUT_EP + 1))
+#define CDC_EP_IS_INT(epn)	(((epn) & EPNUMMSK) == CDC_FIRST_OUT_EP)
+#define CDC_INT_EP_CHANNEL(epn)	0u
+#else
+#define CDC_EP_CHANNEL(epn)	((((epn) & EPNUMMSK) - CDC_FIRST_OUT_EP) / 2)
+#define CDC_EP_IS_INT(epn)	((((epn) & EPNUMMSK) - CDC_FIRST_OUT_EP) % 2 == 0)
+#define CDC_INT_EP_CHANNEL(epn)	CDC_EP_CHANNEL(epn)
+#endif
+
+// packet received at Rx ring head - move the part past the ring end to its start,
+// rearm endpoint if there is room for the next packet, notify VCOM_rx_IRQHandler()
+static void cdc_rxhandler(const struct usbdevice_ *usbd, uint8_t ch, uint8_t epn)
 {
-	cdc_data[ch].session.RxLength = length;
-	cdc_data[ch].session.RxIdx = 0;
-	NVIC_SetPendingIRQ(vcomcfg[ch].rx_irqn);
+	struct cdc_data_ *cdp = &cdc_data[ch];
+	struct cdc_session_ *cds = &cdp->session;
+	uint16_t length = usbd->outep[epn].count;
+	uint16_t end = (cds->RxHead & RX_MASK) + length;
+
+	if (end > CDC_RX_BUF_SIZE)
+		memcpy(cdp->RxData, &cdp->RxData[CDC_RX_BUF_SIZE], end - CDC_RX_BUF_SIZE);
+	cds->RxHead += length;
+	cdc_rx_arm(ch);
+#if VCOM_UART_BRIDGE
+	if (VCOM_IS_UART(ch))
+	{
+		vcom_uart_out(ch);
+		return;
+	}
+#endif
+	vcom_rx_request(ch);
+	VCP_Readable(ch);
 }
 #endif
 
@@ -669,11 +1225,12 @@ void DataReceivedHandler(const struct usbdevice_ *usbd, uint8_t epn)
 	if (length)
 	{
 #ifdef xUSBLOG
-		if (epn == CDC0_DATA_OUT_EP && *cdc0RxData == 'l')
+		if (epn == CDC_DATA_OUT_EP(0) && *usbd->outep[epn].ptr == 'l')
 		{
-			char s[80];
-			length = USBlog_get(s);
-			USBdev_SendData(usbd, CDC0_DATA_IN_EP, (const uint8_t *)s, length, 1);
+			// binary trace dump, decode with Tools/usblog_decode
+			static uint8_t trace[CDC_DATA_EP_SIZE * 4];
+			length = USBlog_drain(trace, sizeof(trace));
+			USBdev_SendData(usbd, CDC_DATA_IN_EP(0), trace, length, 1);
 		}
 		else
 #endif
@@ -686,26 +1243,21 @@ void DataReceivedHandler(const struct usbdevice_ *usbd, uint8_t epn)
 				break;
 #endif
 #if USBD_CDC_CHANNELS
-			case CDC0_DATA_OUT_EP:
-				cdc_rxhandler(0, length);
-				break;
-#if USBD_CDC_CHANNELS > 1
-			case CDC1_DATA_OUT_EP:
-				cdc_rxhandler(1, length);
+			case CDC_FIRST_OUT_EP ... CDC_LAST_OUT_EP:
+				cdc_rxhandler(usbd, CDC_EP_CHANNEL(epn), epn);
 				break;
-#if USBD_CDC_CHANNELS > 2
-			case CDC2_DATA_OUT_EP:
-				cdc_rxhandler(2, length);
-				break;
-#endif	// USBD_CDC_CHANNELS > 2
-#endif	// USBD_CDC_CHANNELS > 1
-#endif	// USBD_CDC_CHANNELS
+#endif
 #if USBD_PRINTER
 			case PRN_DATA_OUT_EP:
 				prn_data.RxLength = length;
 				prn_data.RxIdx = 0;
 				NVIC_SetPendingIRQ(PRN_rx_IRQn);
 				break;
+#endif
+#if USBD_NCM
+			case NCM_DATA_OUT_EP:
+				ncm_out(usbd, epn);
+				break;
 #endif
 			}
 		}
@@ -725,20 +1277,19 @@ void DataSentHandler(const struct usbdevice_ *usbd, uint8_t epn)
 		break;
 #endif
 #if USBD_CDC_CHANNELS
-	case CDC0_DATA_IN_EP:
-		NVIC_EnableIRQ(VCOM0_tx_IRQn);
-		break;
-#if USBD_CDC_CHANNELS > 1
-	case CDC1_DATA_IN_EP:
-		NVIC_EnableIRQ(VCOM1_tx_IRQn);
+	case CDC_FIRST_IN_EP ... CDC_LAST_IN_EP:
+		if (CDC_EP_IS_INT(epn))
+			cdc_notif_send(CDC_INT_EP_CHANNEL(epn));	// next pending notification
+		else
+			vcom_tx_done(CDC_EP_CHANNEL(epn));
 		break;
-#if USBD_CDC_CHANNELS > 2
-	case CDC2_DATA_IN_EP:
-		NVIC_EnableIRQ(VCOM2_tx_IRQn);
+#endif
+#if USBD_NCM
+	case NCM_NOTIF_IN_EP:
+	case NCM_DATA_IN_EP:
+		ncm_in(usbd, epn);
 		break;
-#endif	// USBD_CDC_CHANNELS > 2
-#endif	// USBD_CDC_CHANNELS > 1
-#endif	// USBD_CDC_CHANNELS
+#endif
 	default:
 
 	}
@@ -754,10 +1305,8 @@ STRINGDESC(sdSerial, u"0001");
 STRINGDESC(sdMSC, u"MassStorage");
 #endif
 #if USBD_CDC_CHANNELS
-STRINGDESC(sdVcom0, u"VCOM0");
-#if USBD_CDC_CHANNELS > 1
-STRINGDESC(sdVcom1, u"VCOM1");
-#endif
+#define CDC_STRINGDESC(ch)	STRINGDESC(sdVcom##ch, u"VCOM" #ch)
+USBD_REPEAT(USBD_CDC_CHANNELS, CDC_STRINGDESC)
 #endif
 #if USBD_PRINTER
 STRINGDESC(sdPrinter, u"gbmPrinter");
@@ -765,6 +1314,10 @@ STRINGDESC(sdPrinter, u"gbmPrinter");
 #if USBD_HID
 STRINGDESC(sdHID, u"gbmHID");
 #endif
+#if USBD_NCM
+STRINGDESC(sdNCM, u"gbmNet");
+STRINGDESC(sdNCMmac, NCM_MAC_STRING);
+#endif
 
 // string descriptor numbering - must match the order in string desc table
 enum usbd_sidx_ {
@@ -774,16 +1327,17 @@ enum usbd_sidx_ {
 	USBD_SIDX_FUN_MSC,
 #endif
 #if USBD_CDC_CHANNELS
-	USBD_SIDX_FUN_VCOM0,
-#if USBD_CDC_CHANNELS > 1
-	USBD_SIDX_FUN_VCOM1,
-#endif
+	USBD_SIDX_FUN_VCOM_FIRST,	// one per channel
+	USBD_SIDX_FUN_VCOM_LAST = USBD_SIDX_FUN_VCOM_FIRST + USBD_CDC_CHANNELS - 1,
 #endif
 #if USBD_PRINTER
 	USBD_SIDX_PRINTER,
 #endif
 #if USBD_HID
 	USBD_SIDX_HID,
+#endif
+#if USBD_NCM
+	USBD_SIDX_NCM, USBD_SIDX_NCM_MAC,
 #endif
 	USBD_NSTRINGDESCS	// the last value - must be here
 };
@@ -798,10 +1352,8 @@ static const uint8_t * const strdescv[USBD_NSTRINGDESCS] = {
 	&sdMSC.bLength,
 #endif
 #if USBD_CDC_CHANNELS
-	&sdVcom0.bLength,
-#if USBD_CDC_CHANNELS > 1
-	&sdVcom1.bLength,
-#endif
+#define CDC_STRDESCP(ch)	&sdVcom##ch.bLength,
+	USBD_REPEAT(USBD_CDC_CHANNELS, CDC_STRDESCP)
 #endif
 #if USBD_PRINTER
 	&sdPrinter.bLength,
@@ -809,13 +1361,21 @@ static const uint8_t * const strdescv[USBD_NSTRINGDESCS] = {
 #if USBD_HID
 	&sdHID.bLength,
 #endif
+#if USBD_NCM
+	&sdNCM.bLength,
+	&sdNCMmac.bLength,
+#endif
 };
 
 #ifndef USBD_SUPPLY_CURRENT_mA
 #define USBD_SUPPLY_CURRENT_mA	100u
 #endif
 
-#define SINGLE_CDC (USBD_CDC_CHANNELS == 1 && (USBD_MSC + USBD_PRINTER + USBD_HID == 0))
+#define SINGLE_CDC (USBD_CDC_CHANNELS == 1 && (USBD_MSC + USBD_PRINTER + USBD_HID + USBD_NCM == 0))
+
+// ACM capabilities, Send_Break supported by UART bridge channels
+#define CDC_ACM_CAPS(ch)	(CDCACM_FDCAP_LC_LS | (VCOM_IS_UART(ch) ? CDCACM_FDCAP_SENDBREAK : 0))
+
 #if SINGLE_CDC
 // device descriptor for single function CDC ACM
 static const struct USBdesc_device_ DevDesc = {
@@ -849,7 +1409,7 @@ static const struct cfgdesc_cdc_ ConfigDesc = {
 	},
 	.cdc = {
 		[0] = {
-			.cdcdesc = CDCVCOMDESC(IFNUM_CDC0_CONTROL, CDC0_INT_IN_EP, CDC0_DATA_IN_EP, CDC0_DATA_OUT_EP, CDCACM_FDCAP_LC_LS)
+			.cdcdesc = CDCVCOMDESC(IFNUM_CDC_CONTROL(0), CDC_INT_IN_EP(0), CDC_DATA_IN_EP(0), CDC_DATA_OUT_EP(0), CDC_ACM_CAPS(0))
 		}
 	}
 };
@@ -888,22 +1448,11 @@ static const struct cfgdesc_msc_ncdc_prn_ ConfigDesc = {
 #endif
 #if USBD_CDC_CHANNELS
 	.cdc = {
-		[0] = {
-			.cdciad = CDCVCOMIAD(IFNUM_CDC0_CONTROL, USBD_SIDX_FUN_VCOM0),
-			.cdcdesc = CDCVCOMDESC(IFNUM_CDC0_CONTROL, CDC0_INT_IN_EP, CDC0_DATA_IN_EP, CDC0_DATA_OUT_EP, CDCACM_FDCAP_LC_LS)
-		},
-#if USBD_CDC_CHANNELS > 1
-		[1] = {
-			.cdciad = CDCVCOMIAD(IFNUM_CDC1_CONTROL, USBD_SIDX_FUN_VCOM1),
-			.cdcdesc = CDCVCOMDESC(IFNUM_CDC1_CONTROL, CDC1_INT_IN_EP, CDC1_DATA_IN_EP, CDC1_DATA_OUT_EP, CDCACM_FDCAP_LC_LS)
-		},
-#if USBD_CDC_CHANNELS > 2
-		[2] = {
-			.cdciad = CDCVCOMIAD(IFNUM_CDC2_CONTROL, USBD_SIDX_FUN_VCOM2),
-			.cdcdesc = CDCVCOMDESC(IFNUM_CDC2_CONTROL, CDC2_INT_IN_EP, CDC2_DATA_IN_EP, CDC2_DATA_OUT_EP, CDCACM_FDCAP_LC_LS)
+#define CDC_FUNDESC(ch)	[ch] = { \
+			.cdciad = CDCVCOMIAD(IFNUM_CDC_CONTROL(ch), USBD_SIDX_FUN_VCOM_FIRST + ch), \
+			.cdcdesc = CDCVCOMDESC(IFNUM_CDC_CONTROL(ch), CDC_INT_IN_EP(ch), CDC_DATA_IN_EP(ch), CDC_DATA_OUT_EP(ch), CDC_ACM_CAPS(ch)) \
 		},
-#endif	// USBD_CDC_CHANNELS > 2
-#endif	// USBD_CDC_CHANNELS > 1
+		USBD_REPEAT(USBD_CDC_CHANNELS, CDC_FUNDESC)
 	},
 #endif	// USBD_CDC_CHANNELS
 #if USBD_PRINTER
@@ -928,64 +1477,61 @@ static const struct cfgdesc_msc_ncdc_prn_ ConfigDesc = {
 		.hidin = EPDESC(HID_IN_EP, USBD_EP_TYPE_INTR, HID_IN_EP_SIZE, HID_POLLING_INTERVAL),
 	},
 #endif
+#if USBD_NCM
+	.ncm = CDCNCMDESC(IFNUM_NCM_CONTROL, NCM_NOTIF_IN_EP, NCM_DATA_IN_EP, NCM_DATA_OUT_EP, USBD_SIDX_NCM_MAC, USBD_SIDX_NCM),
+#endif
 };
 #endif
 
 // endpoint configuration - constant =====================================
+// per channel entries, generated with USBD_REPEAT(); the shared notification In belongs to channel 0
+#define CDC_OUTCFG(ch)	[CDC_DATA_OUT_EP(ch)] = {.ifidx = IFNUM_CDC_DATA(ch), .handler = DataReceivedHandler},
+#ifdef USE_COMMON_CDC_INT_IN_EP
+#define CDC_INT_INCFG(ch)
+#else
+#define CDC_INT_INCFG(ch)	[CDC_INT_IN_EP(ch) & EPNUMMSK] = {.ifidx = IFNUM_CDC_CONTROL(ch), .handler = DataSentHandler},
+#endif
+#define CDC_INCFG(ch)	CDC_INT_INCFG(ch) \
+	[CDC_DATA_IN_EP(ch) & EPNUMMSK] = {.ifidx = IFNUM_CDC_DATA(ch), .handler = DataSentHandler},
+
 static const struct epcfg_ outcfg[USBD_NUM_EPPAIRS] = {
-	{.ifidx = 0, .handler = 0},
+	[CTRL_OUT_EP] = {.ifidx = 0, .handler = 0},
 #if USBD_MSC
-	{.ifidx = IFNUM_MSC, .handler = DataReceivedHandler},	// unused
+	[MSC_BOT_OUT_EP] = {.ifidx = IFNUM_MSC, .handler = DataReceivedHandler},	// unused
 #endif
 #if USBD_CDC_CHANNELS
-	{.ifidx = IFNUM_CDC0_CONTROL, .handler = 0},	// unused
-	{.ifidx = IFNUM_CDC0_DATA, .handler = DataReceivedHandler},
-#if USBD_CDC_CHANNELS > 1
-#ifndef USE_COMMON_CDC_INT_IN_EP
-	{.ifidx = IFNUM_CDC1_CONTROL, .handler = 0},	// unused
+	USBD_REPEAT(USBD_CDC_CHANNELS, CDC_OUTCFG)
 #endif
-	{.ifidx = IFNUM_CDC1_DATA, .handler = DataReceivedHandler},
-#if USBD_CDC_CHANNELS > 2
-#ifndef USE_COMMON_CDC_INT_IN_EP
-	{.ifidx = IFNUM_CDC2_CONTROL, .handler = 0},	// unused
-#endif
-	{.ifidx = IFNUM_CDC2_DATA, .handler = DataReceivedHandler},
-#endif
-#endif	// >1 CDC
-#endif	// any CDC
 #if USBD_PRINTER
-	{.ifidx = IFNUM_PRN, .handler = DataReceivedHandler},
+	[PRN_DATA_OUT_EP] = {.ifidx = IFNUM_PRN, .handler = DataReceivedHandler, .dblbuf = 1},	// unidirectional
 #endif
 #if USBD_HID
-	{.ifidx = IFNUM_HID, .handler = HIDoutHandler},	// HID out ep, not used
+	[HID_OUT_EP] = {.ifidx = IFNUM_HID, .handler = HIDoutHandler},	// HID out ep, not used
+#endif
+#if USBD_NCM
+	[NCM_DATA_OUT_EP] = {.ifidx = IFNUM_NCM_DATA, .handler = DataReceivedHandler},
 #endif
 };
 static const struct epcfg_ incfg[USBD_NUM_EPPAIRS] = {
-	{.ifidx = 0, .handler = 0},
+	[CTRL_IN_EP & EPNUMMSK] = {.ifidx = 0, .handler = 0},
 #if USBD_MSC
-	{.ifidx = IFNUM_MSC, .handler = DataSentHandler},
+	[MSC_BOT_IN_EP & EPNUMMSK] = {.ifidx = IFNUM_MSC, .handler = DataSentHandler},
 #endif
 #if USBD_CDC_CHANNELS
-	{.ifidx = IFNUM_CDC0_CONTROL, .handler = 0},
-	{.ifidx = IFNUM_CDC0_DATA, .handler = DataSentHandler},
-#if USBD_CDC_CHANNELS > 1
-#ifndef USE_COMMON_CDC_INT_IN_EP
-	{.ifidx = IFNUM_CDC1_CONTROL, .handler = 0},
-#endif
-	{.ifidx = IFNUM_CDC1_DATA, .handler = DataSentHandler},
-#if USBD_CDC_CHANNELS > 2
-#ifndef USE_COMMON_CDC_INT_IN_EP
-	{.ifidx = IFNUM_CDC2_CONTROL, .handler = 0},
-#endif
-	{.ifidx = IFNUM_CDC2_DATA, .handler = DataSentHandler},
-#endif	// USBD_CDC_CHANNELS > 2
-#endif	// USBD_CDC_CHANNELS > 1
-#endif	// USBD_CDC_CHANNELS
+#ifdef USE_COMMON_CDC_INT_IN_EP
+	[CDC_INT_IN_EP(0) & EPNUMMSK] = {.ifidx = IFNUM_CDC_CONTROL(0), .handler = DataSentHandler},
+#endif
+	USBD_REPEAT(USBD_CDC_CHANNELS, CDC_INCFG)
+#endif
 #if USBD_PRINTER
-	{.ifidx = IFNUM_PRN, .handler = DataSentHandler},
+	[PRN_DATA_IN_EP & EPNUMMSK] = {.ifidx = IFNUM_PRN, .handler = DataSentHandler},
 #endif
 #if USBD_HID
-	{.ifidx = IFNUM_HID, },
+	[HID_IN_EP & EPNUMMSK] = {.ifidx = IFNUM_HID, },
+#endif
+#if USBD_NCM
+	[NCM_NOTIF_IN_EP & EPNUMMSK] = {.ifidx = IFNUM_NCM_CONTROL, .handler = DataSentHandler},
+	[NCM_DATA_IN_EP & EPNUMMSK] = {.ifidx = IFNUM_NCM_DATA, .handler = DataSentHandler},
 #endif
 };
 
@@ -995,16 +1541,9 @@ const struct ifassoc_ if2fun[USBD_NUM_INTERFACES] = {
 	[IFNUM_MSC] = {.classid = USB_CLASS_STORAGE, .funidx = 0},
 #endif
 #if USBD_CDC_CHANNELS
-	[IFNUM_CDC0_CONTROL] = {.classid = USB_CLASS_COMMUNICATIONS, .funidx = 0},
-	[IFNUM_CDC0_DATA] = {.classid = USB_CLASS_COMMUNICATIONS, .funidx = 0},
-#if USBD_CDC_CHANNELS > 1
-	[IFNUM_CDC1_CONTROL] = {.classid = USB_CLASS_COMMUNICATIONS, .funidx = 1},
-	[IFNUM_CDC1_DATA] = {.classid = USB_CLASS_COMMUNICATIONS, .funidx = 1},
-#if USBD_CDC_CHANNELS > 2
-	[IFNUM_CDC2_CONTROL] = {.classid = USB_CLASS_COMMUNICATIONS, .funidx = 2},
-	[IFNUM_CDC2_DATA] = {.classid = USB_CLASS_COMMUNICATIONS, .funidx = 2},
-#endif	// USBD_CDC_CHANNELS > 2
-#endif	// USBD_CDC_CHANNELS > 1
+#define CDC_IFASSOC(ch)	[IFNUM_CDC_CONTROL(ch)] = {.classid = USB_CLASS_COMMUNICATIONS, .funidx = ch}, \
+	[IFNUM_CDC_DATA(ch)] = {.classid = USB_CLASS_COMMUNICATIONS, .funidx = ch},
+	USBD_REPEAT(USBD_CDC_CHANNELS, CDC_IFASSOC)
 #endif	// USBD_CDC_CHANNELS
 #if USBD_PRINTER
 	[IFNUM_PRN] = {.classid = USB_CLASS_PRINTER, .funidx = 0},
@@ -1012,9 +1551,17 @@ const struct ifassoc_ if2fun[USBD_NUM_INTERFACES] = {
 #if USBD_HID
 	[IFNUM_HID] = {.classid = USB_CLASS_HID, .funidx = 0},
 #endif
+#if USBD_NCM
+	[IFNUM_NCM_CONTROL] = {.classid = USB_CLASS_COMMUNICATIONS, .funidx = 0},
+	[IFNUM_NCM_DATA] = {.classid = USB_CLASS_COMMUNICATIONS, .funidx = 0},
+#endif
 };
 
 // device config options and descriptors - constant ======================
+#if USBD_CTRL_OUT_BUF_SIZE
+static uint8_t ctrloutbuf[USBD_CTRL_OUT_BUF_SIZE];	// control Out data stage longer than one packet
+#endif
+
 static const struct usbdcfg_ usbdcfg = {
 	.irqn = USB_IRQn,
 	.irqpri = USB_IRQ_PRI,
@@ -1029,7 +1576,11 @@ static const struct usbdcfg_ usbdcfg = {
 	.strdesc = (const uint8_t **)strdescv,
 #if USBD_HID
 	.hidrepdescsize = sizeof(hid_report_desc),
-	.hidrepdesc = hid_report_desc
+	.hidrepdesc = hid_report_desc,
+#endif
+#if USBD_CTRL_OUT_BUF_SIZE
+	.ctrlbuf = ctrloutbuf,
+	.ctrlbufsize = sizeof(ctrloutbuf),
 #endif
 };
 
@@ -1038,7 +1589,10 @@ static struct usbdevdata_ uddata;	// device data and status
 #if USBD_CDC_CHANNELS
 
 static const struct cdc_services_ cdc_service = {
-	.SetLineCoding = 0,
+#if VCOM_UART_BRIDGE
+	.SetLineCoding = cdc_LineCodingHandler,
+	.SendBreak = cdc_SendBreakHandler,
+#endif
 	.SetControlLineState = cdc_LineStateHandler,
 	// todo: add get status call when implementing notifications
 };
@@ -1066,6 +1620,8 @@ const struct usbdevice_ usbdev = {
 	.devdata = &uddata,
 	.outep = out_epdata,
 	.inep = in_epdata,
+	.outstats = out_epstats,
+	.instats = in_epstats,
 	.Reset_Handler = usbdev_reset,
 	.Suspend_Handler = usbdev_session_init,
 	.Resume_Handler = usbdev_resume,
@@ -1090,15 +1646,25 @@ void USBapp_Init(void)
 {
 #if USBD_MSC
 	msc_bot_init(&usbdev);
+#ifdef MSC_media_IRQn
+	NVIC_SetPriority(MSC_media_IRQn, USB_IRQ_PRI + 1);
+	NVIC_EnableIRQ(MSC_media_IRQn);
+#endif
+#endif
+#if USBD_NCM
+	ncm_init(&usbdev);
 #endif
 #if USBD_CDC_CHANNELS
-	// Tx interrupts are enabled when the device is connected
-	for (uint8_t i = 0; i < USBD_CDC_CHANNELS; i++)
-	{
-		NVIC_SetPriority(vcomcfg[i].tx_irqn, USB_IRQ_PRI);
-		NVIC_SetPriority(vcomcfg[i].rx_irqn, USB_IRQ_PRI + 1);
-		NVIC_EnableIRQ(vcomcfg[i].rx_irqn);
-	}
+	// one Rx and one Tx interrupt for all channels
+	NVIC_SetPriority(VCOM_tx_IRQn, USB_IRQ_PRI);
+	NVIC_SetPriority(VCOM_rx_IRQn, USB_IRQ_PRI + 1);
+	NVIC_EnableIRQ(VCOM_tx_IRQn);
+	NVIC_EnableIRQ(VCOM_rx_IRQn);
+#if VCOM_UART_BRIDGE
+	for (uint8_t ch = 0; ch < USBD_CDC_CHANNELS; ch++)
+		if (VCOM_IS_UART(ch))
+			vcom_uart_hw.SetLineCoding(ch, &cdc_data[ch].LineCoding);
+#endif
 #endif	// USBD_CDC_CHANNELS
 
 #if USBD_PRINTER
@@ -1114,16 +1680,12 @@ void USBapp_Init(void)
 void USBapp_DeInit(void)
 {
 #if USBD_CDC_CHANNELS
-	// Tx interrupts are enabled when the device is connected
-	NVIC_DisableIRQ(VCOM0_rx_IRQn);
-#if USBD_CDC_CHANNELS > 1
-	NVIC_DisableIRQ(VCOM1_rx_IRQn);
-#if USBD_CDC_CHANNELS > 2
-	NVIC_DisableIRQ(VCOM2_rx_IRQn);
-#endif	// USBD_CDC_CHANNELS > 2
-#endif	// USBD_CDC_CHANNELS > 1
-	for (uint8_t i = 0; i < USBD_CDC_CHANNELS; i++)
+	NVIC_DisableIRQ(VCOM_rx_IRQn);
+	NVIC_DisableIRQ(VCOM_tx_IRQn);
+	for (uint8_t i = 0; i < VCOM_CHANNELS; i++)
 	{
+		if (VCOM_IS_UART(i))
+			vcom_uart_hw.Start(i, 0, 0);
 		cdc_data[i] = (struct cdc_data_){.LineCoding = {.dwDTERate = 115200, .bDataBits = 8}};
 	}
 #endif	// USBD_CDC_CHANNELS
@@ -63,6 +63,7 @@ static struct epdata_ out_epdata[USBD_NUM_EPPAIRS] = {
 };
 
 static struct epdata_ in_epdata[USBD_NUM_EPPAIRS]; // no need to init
+static struct epstats_ out_epstats[USBD_NUM_EPPAIRS], in_epstats[USBD_NUM_EPPAIRS];
 //========================================================================
 
 #if USBD_CDC_CHANNELS
@@ -72,7 +73,7 @@ struct vcomcfg_ {
 };
 
 static const struct vcomcfg_ vcomcfg[USBD_CDC_CHANNELS] = {
-	{VCOM0_rx_IRQn, VCOM0_tx_IRQn, SIGNON0, PROMPT0},
+	{VCOM_rx_IRQn, VCOM_tx_IRQn, SIGNON0, PROMPT0},
 };
 
 // put character into sendbuf, generate send packet request event
@@ -224,7 +225,7 @@ void cdc_LineStateHandler(const struct usbdevice_ *usbd, uint8_t ch)
 	}
 	else
 	{
-		//NVIC_DisableIRQ(VCOM0_tx_IRQn);
+		//NVIC_DisableIRQ(VCOM_tx_IRQn);
 		// should reset the state
 		cdc_data[ch].connstart_timer = 0;	// possible hazard w USB interrupt
 		cdc_data[ch].connected = 0;
@@ -233,7 +234,7 @@ void cdc_LineStateHandler(const struct usbdevice_ *usbd, uint8_t ch)
 }
 
 // data reception and state change handler, priority lower than USB hw interrupt
-void VCOM_rx_IRQHandler(uint8_t ch)
+static void vcom_rx_service(uint8_t ch)
 {
 	bool prompt_rq = 0;
 
@@ -269,13 +270,13 @@ void VCOM_rx_IRQHandler(uint8_t ch)
 	}
 }
 
-void VCOM0_rx_IRQHandler(void)
+void VCOM_rx_IRQHandler(void)
 {
-	VCOM_rx_IRQHandler(0);
+	vcom_rx_service(0);
 }
 
 // transmit handler, must have the same priority as USB hw interrupt
-void VCOM_tx_IRQHandler(uint8_t ch)
+static void vcom_tx_start(uint8_t ch)
 {
 	struct cdc_data_ *cdp = &cdc_data[ch];
 
@@ -290,9 +291,9 @@ void VCOM_tx_IRQHandler(uint8_t ch)
 	}
 }
 
-void VCOM0_tx_IRQHandler(void)
+void VCOM_tx_IRQHandler(void)
 {
-	VCOM_tx_IRQHandler(0);
+	vcom_tx_start(0);
 }
 
 #endif	// USBD_CDC_CHANNELS
@@ -310,11 +311,11 @@ void DataReceivedHandler(const struct usbdevice_ *usbd, uint8_t epn)
 			switch (epn)
 			{
 #if USBD_CDC_CHANNELS
-			case CDC0_DATA_OUT_EP:
+			case CDC_DATA_OUT_EP(0):
 				cdc_data[0].RxIdx = 0;	// for polled only
 				cdc_data[0].RxLength = length;
 #ifndef POLL
-				NVIC_SetPendingIRQ(VCOM0_rx_IRQn);
+				NVIC_SetPendingIRQ(VCOM_rx_IRQn);
 #endif	// POLL
 				break;
 #endif	// USBD_CDC_CHANNELS
@@ -332,8 +333,8 @@ void DataSentHandler(const struct usbdevice_ *usbd, uint8_t epn)
 	switch (epn)
 	{
 #if USBD_CDC_CHANNELS
-	case CDC0_DATA_IN_EP:
-		NVIC_EnableIRQ(VCOM0_tx_IRQn);
+	case CDC_DATA_IN_EP(0):
+		NVIC_EnableIRQ(VCOM_tx_IRQn);
 		break;
 #endif	// USBD_CDC_CHANNELS
 	default:
@@ -356,7 +357,7 @@ enum usbd_sidx_ {
 	USBD_SIDX_LANGID,
 	USBD_SIDX_MFG, USBD_SIDX_PRODUCT, USBD_SIDX_SERIALNUM,
 #if USBD_CDC_CHANNELS
-	USBD_SIDX_FUN_VCOM0,
+	USBD_SIDX_FUN_VCOM,
 #endif
 	USBD_NSTRINGDESCS	// the last value - must be here
 };
@@ -404,7 +405,7 @@ static const struct cfgdesc_cdc_ ConfigDesc = {
 	},
 	.cdc = {
 		[0] = {
-			.cdcdesc = CDCVCOMDESC(IFNUM_CDC0_CONTROL, CDC0_INT_IN_EP, CDC0_DATA_IN_EP, CDC0_DATA_OUT_EP, CDCACM_FDCAP_LC_LS)
+			.cdcdesc = CDCVCOMDESC(IFNUM_CDC_CONTROL(0), CDC_INT_IN_EP(0), CDC_DATA_IN_EP(0), CDC_DATA_OUT_EP(0), CDCACM_FDCAP_LC_LS)
 		},
 	}
 };
@@ -412,23 +413,23 @@ static const struct cfgdesc_cdc_ ConfigDesc = {
 // endpoint configuration - constant =====================================
 static const struct epcfg_ outcfg[USBD_NUM_EPPAIRS] = {
 	{.ifidx = 0, .handler = 0},
-	{.ifidx = IFNUM_CDC0_CONTROL, .handler = 0},	// unused
-	{.ifidx = IFNUM_CDC0_DATA, .handler = DataReceivedHandler},
+	{.ifidx = IFNUM_CDC_CONTROL(0), .handler = 0},	// unused
+	{.ifidx = IFNUM_CDC_DATA(0), .handler = DataReceivedHandler},
 };
 
 static const struct epcfg_ incfg[USBD_NUM_EPPAIRS] = {
 	{.ifidx = 0, .handler = 0},
 #if USBD_CDC_CHANNELS
-	{.ifidx = IFNUM_CDC0_CONTROL, .handler = 0},
-	{.ifidx = IFNUM_CDC0_DATA, .handler = DataSentHandler},
+	{.ifidx = IFNUM_CDC_CONTROL(0), .handler = 0},
+	{.ifidx = IFNUM_CDC_DATA(0), .handler = DataSentHandler},
 #endif	// USBD_CDC_CHANNELS
 };
 
 // class and instance index for each interface - required for handling class requests
 const struct ifassoc_ if2fun[USBD_NUM_INTERFACES] = {
 #if USBD_CDC_CHANNELS
-	[IFNUM_CDC0_CONTROL] = {.classid = USB_CLASS_COMMUNICATIONS, .funidx = 0},
-	[IFNUM_CDC0_DATA] = {.classid = USB_CLASS_COMMUNICATIONS, .funidx = 0},
+	[IFNUM_CDC_CONTROL(0)] = {.classid = USB_CLASS_COMMUNICATIONS, .funidx = 0},
+	[IFNUM_CDC_DATA(0)] = {.classid = USB_CLASS_COMMUNICATIONS, .funidx = 0},
 #endif	// USBD_CDC_CHANNELS
 };
 
@@ -463,6 +464,8 @@ const struct usbdevice_ usbdev = {
 	.devdata = &uddata,
 	.outep = out_epdata,
 	.inep = in_epdata,
+	.outstats = out_epstats,
+	.instats = in_epstats,
 	.SOF_Handler = usbdev_tick,
 	.cdc_service = &cdc_service,
 	.cdc_data = cdc_data,
@@ -473,9 +476,9 @@ void USBapp_Init(void)
 {
 #if USBD_CDC_CHANNELS
 	// Tx interrupts are enabled when the device is connected
-	NVIC_SetPriority(VCOM0_tx_IRQn, USB_IRQ_PRI);
-	NVIC_SetPriority(VCOM0_rx_IRQn, USB_IRQ_PRI + 1);
-	NVIC_EnableIRQ(VCOM0_rx_IRQn);
+	NVIC_SetPriority(VCOM_tx_IRQn, USB_IRQ_PRI);
+	NVIC_SetPriority(VCOM_rx_IRQn, USB_IRQ_PRI + 1);
+	NVIC_EnableIRQ(VCOM_rx_IRQn);
 #endif	// USBD_CDC_CHANNELS
 
 	NVIC_SetPriority((IRQn_Type)usbdev.cfg->irqn, USB_IRQ_PRI);
@@ -17,7 +17,7 @@
  */
 
 /*
- * The class module supports single instance of printer and msc class
+ * The class module supports single instance of printer, msc and CDC NCM class
  * and multiple instances of CDC ACM
  */
 
@@ -33,10 +33,11 @@
 #include "usb_class_cdc.h"
 #include "usb_class_prn.h"
 #include "usb_class_hid.h"
+#include "usb_class_ncm.h"
 
 #if USBD_MSC
 #include "usb_class_msc_scsi.h"
-uint8_t msc_max_lun = 0;
+const uint8_t msc_max_lun = MSC_LUNS - 1u;
 #endif
 
 #if USBD_PRINTER
@@ -62,6 +63,25 @@ void USBclass_ClearEPStall(const struct usbdevice_ *usbd, uint8_t epaddr)
 #endif
 }
 
+// class-specific alternate setting handlers called by usb_dev.c
+bool USBclass_SetInterface(const struct usbdevice_ *usbd, uint8_t interface, uint8_t alt)
+{
+#if USBD_NCM
+	if (interface == IFNUM_NCM_DATA)
+		return ncm_SetInterface(usbd, alt);
+#endif
+	return alt == 0;
+}
+
+uint8_t USBclass_GetInterface(const struct usbdevice_ *usbd, uint8_t interface)
+{
+#if USBD_NCM
+	if (interface == IFNUM_NCM_DATA)
+		return ncm_GetInterface();
+#endif
+	return 0;
+}
+
 void USBclass_HandleRequest(const struct usbdevice_ *usbd)
 {
 	USB_SetupPacket *req = &usbd->devdata->req;
@@ -76,6 +96,13 @@ void USBclass_HandleRequest(const struct usbdevice_ *usbd)
 		if (req->bRequest == PRNRQ_GET_DEVICE_ID && req->wIndex.b.l == 0 && req->wIndex.b.h)
 			interface = req->wIndex.b.h;
 
+#if USBD_NCM
+		if (interface == IFNUM_NCM_CONTROL)
+		{
+			ncm_HandleRequest(usbd);	// NCM requests are sent via communication interface
+			break;
+		}
+#endif
 		if (interface < USBD_NUM_INTERFACES)
 		{
 			uint8_t classid = usbd->cfg->ifassoc[interface].classid;
@@ -118,9 +145,9 @@ void USBclass_HandleRequest(const struct usbdevice_ *usbd)
 				switch (req->bRequest)
 				{
 				case CDCRQ_SET_LINE_CODING:        //0x20
-					if (memcmp(&usbd->cdc_data[funidx].LineCoding, usbd->outep[0].ptr, MIN(req->wLength, 7)))
+					if (memcmp(&usbd->cdc_data[funidx].LineCoding, usbd->devdata->ep0data, MIN(req->wLength, 7)))
 					{
-						memcpy(&usbd->cdc_data[funidx].LineCoding, usbd->outep[0].ptr, MIN(req->wLength, 7));
+						memcpy(&usbd->cdc_data[funidx].LineCoding, usbd->devdata->ep0data, MIN(req->wLength, 7));
 						usbd->cdc_data[funidx].LineCodingChanged = 1;
 						if (usbd->cdc_service->SetLineCoding)
 							usbd->cdc_service->SetLineCoding(usbd, funidx);
@@ -144,6 +171,8 @@ void USBclass_HandleRequest(const struct usbdevice_ *usbd)
 					break;
 					
 				case CDCRQ_SEND_BREAK:	// supported if bmCapabilities bit 2 set
+					if (usbd->cdc_service->SendBreak)
+						usbd->cdc_service->SendBreak(usbd, funidx, req->wValue.w);
 					USBdev_SendStatusOK(usbd);
 					break;
 
@@ -178,7 +207,7 @@ void USBclass_HandleRequest(const struct usbdevice_ *usbd)
 				case HIDRQ_SET_REPORT:
 					if (req->wValue.b.h == HID_REPORTTYPE_OUT)
 					{
-						memcpy(usbd->hid_data->OutReport, usbd->outep[0].ptr, MIN(req->wLength, HID_OUT_REPORT_SIZE));
+						memcpy(usbd->hid_data->OutReport, usbd->devdata->ep0data, MIN(req->wLength, HID_OUT_REPORT_SIZE));
 						if (usbd->hid_service->UpdateOut)
 							usbd->hid_service->UpdateOut(usbd);
 					}
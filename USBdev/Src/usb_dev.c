@@ -16,6 +16,7 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <string.h>
 #include "usb_dev_config.h"
 #include "usb_std_def.h"
 #include "usb_desc_def.h"
@@ -23,16 +24,22 @@
 #include "usb_hw_if.h"
 #include "usb_log.h"
 
-#ifndef USBLOG
-#define USBlog_storerq(p)
-#define USBlog_storeresp(r,l)
-#define USBlog_recordevt(e)
-#endif
 //========================================================================
 // default callback before clearing Ep stall - override in usb_app.c if needed (for MSC BOT)
  __attribute__ ((weak)) void USBclass_ClearEPStall(const struct usbdevice_ *usbd, uint8_t epaddr)
 {
 }
+
+// default alternate setting handlers - only setting 0 of every interface; override in usb_class.c
+__attribute__ ((weak)) bool USBclass_SetInterface(const struct usbdevice_ *usbd, uint8_t interface, uint8_t alt)
+{
+	return alt == 0;
+}
+
+__attribute__ ((weak)) uint8_t USBclass_GetInterface(const struct usbdevice_ *usbd, uint8_t interface)
+{
+	return 0;
+}
 // App interface routines ================================================
 void USBdev_SetRxBuf(const struct usbdevice_ *usbd, uint8_t epn, uint8_t *buf)
 {
@@ -40,28 +47,269 @@ void USBdev_SetRxBuf(const struct usbdevice_ *usbd, uint8_t epn, uint8_t *buf)
 		usbd->outep[epn].ptr = buf;
 }
 
-bool USBdev_SendData(const struct usbdevice_ *usbd, uint8_t epn, const uint8_t *data, uint16_t length, bool autozlp)
+// start Out transfer to buf; length 0 - single packet, like EnableRx
+// multi-packet transfer completes when length bytes or a short packet are received
+void USBdev_ReceiveData(const struct usbdevice_ *usbd, uint8_t epn, uint8_t *buf, uint16_t length)
 {
 	epn &= EPNUMMSK;
+	if (epn && epn < usbd->cfg->numeppairs)
+	{
+		struct epdata_ *epd = &usbd->outep[epn];
+		epd->ptr = buf;
+		epd->length = length;
+		epd->count = 0;
+		usbd->hwif->EnableRx(usbd, epn);
+	}
+}
+
+/*
+ * Ping-pong reception - two buffers per Out endpoint
+ * The Out completion handler (USB interrupt) calls USBdev_RxSwap() to pass the filled buffer
+ * to the consumer; the endpoint is rearmed at once with the other buffer if the consumer does not own it.
+ * The consumer gets the oldest filled buffer with USBdev_RxBuf() and returns it with USBdev_RxRelease(),
+ * which rearms the endpoint if it was waiting for a free buffer.
+ */
+// set buffer pair and return both buffers to the driver, call on init, reset and suspend
+void USBdev_SetRxBufPair(const struct usbdevice_ *usbd, uint8_t epn, uint8_t *buf0, uint8_t *buf1)
+{
+	epn &= EPNUMMSK;
+	if (epn && epn < usbd->cfg->numeppairs)
+	{
+		struct epdata_ *epd = &usbd->outep[epn];
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		bool wait = epd->rxwait;
+		epd->rxbuf[0] = buf0;
+		epd->rxbuf[1] = buf1;
+		epd->rxowned = 0;
+		epd->rxfill = 0;
+		epd->rxwait = 0;
+		epd->ptr = buf0;
+		if (wait && usbd->devdata->devstate == USBD_STATE_CONFIGURED)
+		{
+			epd->count = 0;
+			usbd->hwif->EnableRx(usbd, epn);
+		}
+		__set_PRIMASK(primask);
+	}
+}
+
+// called from Out completion handler; pass filled buffer to consumer, continue reception
+// with the other buffer if free; return the filled buffer
+uint8_t *USBdev_RxSwap(const struct usbdevice_ *usbd, uint8_t epn)
+{
+	struct epdata_ *epd = &usbd->outep[epn & EPNUMMSK];
+	uint8_t n = epd->rxfill;
+	epd->rxlen[n] = epd->count;
+	epd->rxowned |= 1u << n;
+	if (epd->rxowned & 1u << (n ^ 1))
+	{
+		epd->rxwait = 1;	// rearmed by USBdev_RxRelease()
+		++USBdev_EPStats(usbd, epn)->busy;
+	}
+	else
+	{
+		epd->rxfill = n ^ 1;
+		epd->ptr = epd->rxbuf[n ^ 1];
+		epd->count = 0;
+		usbd->hwif->EnableRx(usbd, epn);
+	}
+	return epd->rxbuf[n];
+}
+
+// index of the oldest buffer owned by consumer, -1 if none
+static int8_t rx_oldest(const struct epdata_ *epd)
+{
+	uint8_t owned = epd->rxowned;
+	if (owned == 3u)
+		return epd->rxfill ^ 1;	// both filled, rxfill is the newer one
+	return owned ? owned >> 1 : -1;
+}
+
+// called by consumer; get the oldest filled buffer, null if none
+uint8_t *USBdev_RxBuf(const struct usbdevice_ *usbd, uint8_t epn, uint16_t *length)
+{
+	struct epdata_ *epd = &usbd->outep[epn & EPNUMMSK];
+	int8_t n = rx_oldest(epd);
+	if (n < 0)
+		return 0;
+	*length = epd->rxlen[n];
+	return epd->rxbuf[n];
+}
+
+// called by consumer; return the oldest filled buffer to the driver
+void USBdev_RxRelease(const struct usbdevice_ *usbd, uint8_t epn)
+{
+	epn &= EPNUMMSK;
+	struct epdata_ *epd = &usbd->outep[epn];
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	int8_t n = rx_oldest(epd);
+	if (n >= 0)
+	{
+		epd->rxowned &= ~(1u << n);
+		if (epd->rxwait)
+		{
+			epd->rxwait = 0;
+			epd->rxfill = n;
+			epd->ptr = epd->rxbuf[n];
+			epd->count = 0;
+			usbd->hwif->EnableRx(usbd, epn);
+		}
+	}
+	__set_PRIMASK(primask);
+}
+
+// rejected sends are counted as busy
+static inline bool in_ep_unavailable(const struct usbdevice_ *usbd, uint8_t epn)
+{
+	bool unavailable = usbd->inep[epn].busy || (epn && usbd->devdata->devstate != USBD_STATE_CONFIGURED);
+	if (unavailable)
+		++usbd->instats[epn].busy;
+	return unavailable;
+}
+
+static void start_in(const struct usbdevice_ *usbd, uint8_t epn, uint16_t length, bool autozlp)
+{
 	struct epdata_ *epd = &usbd->inep[epn];
-	if (epd->busy || (epn && usbd->devdata->devstate != USBD_STATE_CONFIGURED))
+	epd->busy = 1;
+	epd->count = length;
+	epd->length = length;
+	epd->sendzlp = autozlp && length && length % usbd->hwif->GetInEPSize(usbd, epn) == 0;
+	usbd->hwif->StartTx(usbd, epn);
+}
+
+bool USBdev_SendData(const struct usbdevice_ *usbd, uint8_t epn, const uint8_t *data, uint16_t length, bool autozlp)
+{
+	epn &= EPNUMMSK;
+	if (in_ep_unavailable(usbd, epn))
 		return 1;
 
+	struct epdata_ *epd = &usbd->inep[epn];
 	if (!data)
 		length = 0;	// send ZLP if nullptr passed
-	epd->busy = 1;
-	epd->count = length;
 	epd->ptr = (uint8_t *)data;
-	epd->sendzlp = autozlp && length && length % usbd->hwif->GetInEPSize(usbd, epn) == 0;
-	usbd->hwif->StartTx(usbd, epn);
+	epd->seglen = length;
+	epd->iovcnt = 0;
+	epd->gen = 0;
+	USBcap_data(usbd, UCE_SUBMIT, epn | EP_IS_IN, data, length);
+	start_in(usbd, epn, length, autozlp);
 	return 0;
 }
 
+// scatter-gather send - packets are written to hw straight from segments
+// iov array and data must stay valid until the transfer completes
+bool USBdev_SendDataV(const struct usbdevice_ *usbd, uint8_t epn, const struct usbiov_ *iov, uint8_t iovcnt, bool autozlp)
+{
+	epn &= EPNUMMSK;
+	if (in_ep_unavailable(usbd, epn))
+		return 1;
+
+	uint32_t length = 0;
+	for (uint8_t i = 0; i < iovcnt; i++)
+		length += iov[i].length;
+	if (length > UINT16_MAX)
+		return 1;
+
+	struct epdata_ *epd = &usbd->inep[epn];
+	epd->ptr = 0;
+	epd->seglen = 0;
+	epd->iov = iov;
+	epd->iovcnt = iovcnt;
+	epd->gen = 0;
+	USBdev_NextTxSegment(epd);
+	USBcap_datav(usbd, UCE_SUBMIT, epn | EP_IS_IN, iov, iovcnt, length);
+	start_in(usbd, epn, length, autozlp);
+	return 0;
+}
+
+#if USBD_XFER_QUEUE_LEN
+// start transfer from queue head
+static void start_queued(const struct usbdevice_ *usbd, uint8_t epn)
+{
+	struct epdata_ *epd = &usbd->inep[epn];
+	const struct usbxfer_ *xf = &epd->xq[epd->xqhead];
+	if (USBdev_SendData(usbd, epn, xf->data, xf->length, xf->zlp) == 0)
+		epd->xqactive = 1;
+}
+
+// append In transfer to endpoint queue, start it if the endpoint is idle
+// data must stay valid until completion callback; return 1 if queue full or ep not configured
+bool USBdev_QueueData(const struct usbdevice_ *usbd, uint8_t epn, const struct usbxfer_ *xfer)
+{
+	epn &= EPNUMMSK;
+	if (epn == 0 || epn >= usbd->cfg->numeppairs || usbd->devdata->devstate != USBD_STATE_CONFIGURED)
+		return 1;
+
+	struct epdata_ *epd = &usbd->inep[epn];
+	bool full;
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	full = epd->xqcount == USBD_XFER_QUEUE_LEN;
+	if (full)
+		++usbd->instats[epn].busy;
+	else
+	{
+		epd->xq[(epd->xqhead + epd->xqcount++) % USBD_XFER_QUEUE_LEN] = *xfer;
+		if (!epd->busy)
+			start_queued(usbd, epn);
+	}
+	__set_PRIMASK(primask);
+	return full;
+}
+
+// remove transfer from queue head, call its completion callback
+static void complete_queued(const struct usbdevice_ *usbd, uint8_t epn, uint16_t count, enum usbxfer_status_ status)
+{
+	struct epdata_ *epd = &usbd->inep[epn];
+	const struct usbxfer_ *xf = &epd->xq[epd->xqhead];
+	void (*done)(const struct usbdevice_ *usbd, uint8_t epaddr, uint16_t count, enum usbxfer_status_ status) = xf->done;
+
+	epd->xqactive = 0;
+	epd->xqhead = (epd->xqhead + 1) % USBD_XFER_QUEUE_LEN;
+	--epd->xqcount;
+	if (done)
+		done(usbd, epn | EP_IS_IN, count, status);
+}
+#endif
+
+// report transfers queued on In endpoint as aborted, before its data is cleared;
+// callbacks should not queue new data
+static void abort_queued(const struct usbdevice_ *usbd, uint8_t epn)
+{
+#if USBD_XFER_QUEUE_LEN
+	struct epdata_ *epd = &usbd->inep[epn];
+	for (uint8_t n = epd->xqcount; n; n--)
+		complete_queued(usbd, epn,
+			epd->xqactive ? epd->xq[epd->xqhead].length - epd->count : 0, USBXFER_ABORTED);
+#endif
+}
+
+// stop In transfer in progress in hw, report queued transfers as aborted and clear endpoint data;
+// used instead of clearing endpoint data directly
+void USBdev_AbortIn(const struct usbdevice_ *usbd, uint8_t epn)
+{
+	epn &= EPNUMMSK;
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	usbd->hwif->AbortTx(usbd, epn);
+	abort_queued(usbd, epn);
+	usbd->inep[epn] = (struct epdata_){0};
+	__set_PRIMASK(primask);
+}
+
+// called by hw driver on reset, suspend and deconfiguration, before In endpoint data is cleared
+void USBdev_AbortTransfers(const struct usbdevice_ *usbd)
+{
+	for (uint8_t epn = 1; epn < usbd->cfg->numeppairs; epn++)
+		abort_queued(usbd, epn);
+}
+
 void USBdev_SendStatus(const struct usbdevice_ *usbd, const uint8_t *data, uint16_t length, bool zlp)
 {
 	usbd->devdata->ep0state = USBD_EP0_STATUS_IN;
 	USBdev_SendData(usbd, 0, data, length, zlp);
-	USBlog_storeresp(RSP_STATUS, length);
+	USBlog_event(ULE_CTRL_IN, EP_IS_IN, length, 0);
 }
 
 void USBdev_SendStatusOK(const struct usbdevice_ *usbd)
@@ -69,13 +317,54 @@ void USBdev_SendStatusOK(const struct usbdevice_ *usbd)
 	USBdev_SendStatus(usbd, 0, 0, 0);
 }
 
+// control In response produced packet by packet by fill() into a scratch buffer
+// when the hw driver writes it; length - total response length, limited here to wLength
+void USBdev_SendStatusGen(const struct usbdevice_ *usbd, uint16_t length, usbd_txfill_fn fill)
+{
+	struct epdata_ *epd = &usbd->inep[0];
+	struct usbtxgen_ *g = &usbd->devdata->ep0gen;
+	uint16_t wLength = usbd->devdata->req.wLength;
+
+	if (in_ep_unavailable(usbd, 0))
+		return;
+	g->fill = fill;
+	g->usbd = usbd;
+	g->length = MIN(length, wLength);
+	g->offset = 0;
+	epd->ptr = g->buf;	// non-null - data stage
+	epd->seglen = 0;
+	epd->iovcnt = 0;
+	epd->gen = g;
+	usbd->devdata->ep0state = USBD_EP0_STATUS_IN;
+	USBcap_data(usbd, UCE_SUBMIT, EP_IS_IN, 0, g->length);	// data not available yet
+	start_in(usbd, 0, g->length, length < wLength);
+	USBlog_event(ULE_CTRL_IN, EP_IS_IN, g->length, 0);
+}
+
+// called via USBdev_NextTxSegment() by hw driver - generate next chunk of In data
+void USBdev_TxGenerate(struct epdata_ *epd)
+{
+	struct usbtxgen_ *g = epd->gen;
+	uint16_t size = g->length - g->offset;
+	if (size > sizeof(g->buf))
+		size = sizeof(g->buf);
+	if (size)
+	{
+		g->fill(g->usbd, g->buf, g->offset, size);
+		g->offset += size;
+	}
+	epd->ptr = g->buf;
+	epd->seglen = size;
+}
+
 void USBdev_CtrlError(const struct usbdevice_ *usbd)
 {
 	// stall both control endpoints
 	usbd->devdata->ep0state = USBD_EP0_STALL;
 	usbd->hwif->SetEPStall(usbd, EP_IS_IN | 0);
 	usbd->hwif->SetEPStall(usbd, 0);
-	USBlog_storeresp(RSP_ERR, 0);
+	USBlog_event(ULE_CTRL_STALL, 0, 0, 0);
+	USBcap_data(usbd, UCE_STALL, 0, 0, 0);
 }
 
 static void USBdev_GetDescriptor(const struct usbdevice_ *usbd)
@@ -118,6 +407,8 @@ static void USBdev_GetDescriptor(const struct usbdevice_ *usbd)
 #endif
 
 	default:
+		if (USBclass_GetDescriptor(usbd))
+			return;	// handled by class or app
 		break;
 	}
 	if (ptr)
@@ -130,9 +421,57 @@ static void USBdev_GetDescriptor(const struct usbdevice_ *usbd)
 		USBdev_CtrlError(usbd);
 }
 
+// other descriptor types - redefine to answer with USBdev_SendStatus() or USBdev_SendStatusGen()
+// return 1 if the request was handled
+__attribute__ ((weak)) bool USBclass_GetDescriptor(const struct usbdevice_ *usbd)
+{
+	return 0;
+}
+
 // Moved to usb_class.c 
 void USBclass_HandleRequest(const struct usbdevice_ *usbd);
 
+// vendor requests not handled by the core, redefine to handle app-specific ones; return 1 if handled
+__attribute__ ((weak)) bool USBclass_HandleVendorRequest(const struct usbdevice_ *usbd)
+{
+	return 0;
+}
+
+// endpoint counters, Out endpoints first
+static void epstats_fill(const struct usbdevice_ *usbd, uint8_t *buf, uint16_t offset, uint16_t size)
+{
+	uint16_t outsize = usbd->cfg->numeppairs * sizeof(struct epstats_);
+	for (; size; size--, offset++)
+		*buf++ = offset < outsize ? ((const uint8_t *)usbd->outstats)[offset]
+			: ((const uint8_t *)usbd->instats)[offset - outsize];
+}
+
+// core vendor requests to device, after app-specific ones
+static void USBdev_VendorRequest(const struct usbdevice_ *usbd)
+{
+	USB_SetupPacket *req = &usbd->devdata->req;
+	uint16_t size = usbd->cfg->numeppairs * sizeof(struct epstats_);
+
+	if (USBclass_HandleVendorRequest(usbd))
+		return;
+	if (req->bmRequestType.Recipient == USB_RQREC_DEVICE)
+	{
+		if (req->bRequest == USBD_VENDOR_RQ_GET_EPSTATS && req->bmRequestType.DirIn)
+		{
+			USBdev_SendStatusGen(usbd, size * 2, epstats_fill);
+			return;
+		}
+		if (req->bRequest == USBD_VENDOR_RQ_CLEAR_EPSTATS && req->wLength == 0)
+		{
+			memset(usbd->outstats, 0, size);
+			memset(usbd->instats, 0, size);
+			USBdev_SendStatusOK(usbd);
+			return;
+		}
+	}
+	USBdev_CtrlError(usbd);	// stall on unhandled requests
+}
+
 static void USBdev_HandleRequest(const struct usbdevice_ *usbd)
 {
 	USB_SetupPacket *req = &usbd->devdata->req;
@@ -195,13 +534,33 @@ static void USBdev_HandleRequest(const struct usbdevice_ *usbd)
 			}
 			break;
 
+		case USB_STDRQ_GET_INTERFACE:
+			if (req->bmRequestType.Recipient == USB_RQREC_INTERFACE && usbd->devdata->configuration
+				&& req->wIndex.b.l < usbd->cfg->numif)
+			{
+				static uint8_t alt;
+				alt = USBclass_GetInterface(usbd, req->wIndex.b.l);
+				USBdev_SendStatus(usbd, &alt, 1, 0);
+			}
+			else
+				USBdev_CtrlError(usbd);	// stall on unhandled requests
+			break;
+
+		case USB_STDRQ_SET_INTERFACE:
+			if (req->bmRequestType.Recipient == USB_RQREC_INTERFACE && usbd->devdata->configuration
+				&& req->wIndex.b.l < usbd->cfg->numif && USBclass_SetInterface(usbd, req->wIndex.b.l, req->wValue.b.l))
+				USBdev_SendStatusOK(usbd);
+			else
+				USBdev_CtrlError(usbd);	// stall on unhandled requests
+			break;
+
 		case USB_STDRQ_CLEAR_FEATURE:
 			if (req->bmRequestType.Recipient == USB_RQREC_ENDPOINT && req->wValue.b.l == USB_FEATSEL_ENDPOINT_HALT)
 			{
 				uint8_t epaddr = req->wIndex.b.l;
 				if ((epaddr & EP_IS_IN) && (epaddr & EPNUMMSK) < USBD_NUM_EPPAIRS)
 				{
-					usbd->inep[epaddr & EPNUMMSK] = (struct epdata_){0, 0, 0, 0};
+					USBdev_AbortIn(usbd, epaddr);
 				}
 				usbd->hwif->ClrEPStall(usbd, epaddr);
 				USBclass_ClearEPStall(usbd, epaddr);
@@ -227,6 +586,9 @@ static void USBdev_HandleRequest(const struct usbdevice_ *usbd)
 	case USB_RQTYPE_CLASS:
 		USBclass_HandleRequest(usbd);
 		break;
+	case USB_RQTYPE_VENDOR:
+		USBdev_VendorRequest(usbd);
+		break;
 	default:
 		USBdev_CtrlError(usbd);// should stall on unhandled requests
 	}
@@ -238,8 +600,19 @@ void USBdev_InEPHandler(const struct usbdevice_ *usbd, uint8_t epn)
 	struct epdata_ *epd = &usbd->inep[epn];
 	
 	// In transfer completed
+	USBlog_event(ULE_IN, epn | EP_IS_IN, epd->length, 0);
+	USBcap_data(usbd, UCE_COMPLETE, epn | EP_IS_IN, 0, epd->length);
+	struct epstats_ *st = &usbd->instats[epn];
+	++st->transfers;
+	st->bytes += epd->length;
 	epd->ptr = 0;
 	epd->busy = 0;
+#if USBD_XFER_QUEUE_LEN
+	if (epd->xqactive)
+		complete_queued(usbd, epn, epd->xq[epd->xqhead].length, USBXFER_DONE);
+	if (epd->xqcount && !epd->busy)
+		start_queued(usbd, epn);	// chain next queued transfer
+#endif
 	if (epn)	// application ep
 	{
 		if (usbd->cfg->inepcfg[epn].handler)
@@ -249,18 +622,52 @@ void USBdev_InEPHandler(const struct usbdevice_ *usbd, uint8_t epn)
 	{
 		if (usbd->devdata->setaddress)
 		{
-			USBlog_recordevt(0x40);
+			USBlog_event(ULE_ADDRESS, 0, 0, usbd->devdata->setaddress);
 			usbd->devdata->setaddress = 0;
 			usbd->devdata->devstate = USBD_STATE_ADDRESSED;
 		}
+	}
+}
 
-		USBlog_recordevt(0x80);
+// select buffer for control Out data stage longer than one packet, redefine for request-specific buffers
+// default: buffer registered in device configuration, if big enough
+__attribute__ ((weak)) uint8_t *USBclass_GetCtrlOutBuf(const struct usbdevice_ *usbd, const USB_SetupPacket *req)
+{
+	return req->wLength <= usbd->cfg->ctrlbufsize ? usbd->cfg->ctrlbuf : 0;
+}
+
+// control Out data packet received; single packet data is used in place, longer data is
+// assembled in ep0data; return 1 when wLength bytes or a short packet have been received
+static bool ctrl_out_data(const struct usbdevice_ *usbd)
+{
+	struct usbdevdata_ *dd = usbd->devdata;
+	struct epdata_ *epd = &usbd->outep[0];
+	if (dd->ep0data == 0)
+	{
+		dd->ep0data = epd->ptr;
+		dd->ep0count = epd->count;
+		return 1;
+	}
+	uint16_t n = MIN(epd->count, dd->req.wLength - dd->ep0count);
+	memcpy(dd->ep0data + dd->ep0count, epd->ptr, n);
+	dd->ep0count += n;
+	if (dd->ep0count < dd->req.wLength && epd->count == usbd->cfg->devdesc->bMaxPacketSize0)
+	{
+		usbd->hwif->EnableRx(usbd, 0);	// more data packets follow
+		return 0;
 	}
+	return 1;
 }
 
 // data received on Out endpoint
 void USBdev_OutEPHandler(const struct usbdevice_ *usbd, uint8_t epn, bool setup)
 {
+	if (!setup)
+		USBlog_event(ULE_OUT, epn, usbd->outep[epn].count, 0);
+	USBcap_data(usbd, setup ? UCE_SETUP : UCE_COMPLETE, epn, usbd->outep[epn].ptr, usbd->outep[epn].count);
+	struct epstats_ *st = &usbd->outstats[epn];
+	++st->transfers;
+	st->bytes += usbd->outep[epn].count;
 	if (epn == 0)	// control endpoint
 	{
 		if (usbd->outep[0].count)
@@ -270,7 +677,7 @@ void USBdev_OutEPHandler(const struct usbdevice_ *usbd, uint8_t epn, bool setup)
 				// setup packet received - copy to setup packet buffer
 				USB_SetupPacket *req = &usbd->devdata->req;
 				*req = *(USB_SetupPacket *)usbd->outep[0].ptr;
-				USBlog_storerq(req);
+				USBlog_setup(req);
 				if (req->bmRequestType.DirIn || req->wLength == 0)
 				{
 					usbd->devdata->ep0state = USBD_EP0_SETUP;
@@ -281,6 +688,14 @@ void USBdev_OutEPHandler(const struct usbdevice_ *usbd, uint8_t epn, bool setup)
 				else
 				{
 					// non-zero length data out request
+					usbd->devdata->ep0data = 0;
+					usbd->devdata->ep0count = 0;
+					if (req->wLength > usbd->cfg->devdesc->bMaxPacketSize0
+						&& (usbd->devdata->ep0data = USBclass_GetCtrlOutBuf(usbd, req)) == 0)
+					{
+						USBdev_CtrlError(usbd);	// no buffer - refuse rather than truncate
+						return;
+					}
 					usbd->devdata->ep0state = USBD_EP0_DATA_OUT;
 					// F0 fails with this line enabled, which is probably normal - Status In fails
 					//usbd->hwif->SetEPStall(usbd, 0x80);	// disable ep 0 data in
@@ -290,7 +705,10 @@ void USBdev_OutEPHandler(const struct usbdevice_ *usbd, uint8_t epn, bool setup)
 			else // data received on control EP
 			{
 				if (usbd->devdata->ep0state == USBD_EP0_DATA_OUT)
-					USBdev_HandleRequest(usbd);	// data received
+				{
+					if (ctrl_out_data(usbd))
+						USBdev_HandleRequest(usbd);	// data stage complete
+				}
 				else	// should not happen - maybe should stall ?
 				{
 					usbd->devdata->ep0state = USBD_EP0_IDLE;
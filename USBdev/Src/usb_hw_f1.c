@@ -24,6 +24,7 @@
 #include "usb_desc_def.h"
 #include "usb_dev.h"
 #include "usb_hw_if.h"
+#include "usb_log.h"
 
 // PMA size: F103: 512 B
 // 16- or 32-bit reg access, 32-bit PMA access
@@ -62,6 +63,23 @@ typedef struct USBh_ {
 	} PMA;
 } USBh_TypeDef;	// USBh to make it different from possible mfg. additions to header files
 
+// buffer n of an endpoint: [0] - address, [1] - count; 0 - Tx, 1 - Rx
+// double-buffered endpoint uses both for a single direction
+static inline PMAreg *pmabuf(USBh_TypeDef *usb, uint8_t epn, bool n)
+{
+	return &usb->PMA.BUFDESC[epn].TxAddress + 2 * n;
+}
+
+// double-buffered bulk endpoint state
+// SW_BUF is DTOG_RX bit for In, DTOG_TX bit for Out endpoint
+struct dbstate_ {
+	bool out, in;	// ep configured as double-buffered Out or In
+	bool rxheld;	// Out: app buffer busy until Rx enabled
+	bool rxpend;	// Out: packet waiting in PMA buffer
+	bool txpre;		// In: next packet written, to be released when the current one is sent
+};
+static struct dbstate_ dbstate[USB_NEPPAIRS];
+
 //========================================================================
 // USB peripheral must be enabled before calling Init
 // initialize USB peripheral
@@ -109,6 +127,13 @@ static uint16_t USBhw_GetInEPSize(const struct usbdevice_ *usbd, uint8_t epn)
 	return bufdesc->RxAddress - bufdesc->TxAddress;
 }
 
+static uint16_t USBhw_GetFrameNum(const struct usbdevice_ *usbd)
+{
+	USBh_TypeDef *usb = (USBh_TypeDef *)usbd->usb;
+
+	return usb->FNR.v & USB_FNR_FN;
+}
+
 // USB EPR register bit masks
 #define USB_EPR_STATTX(a) ((a) << USB_EPTX_STAT_Pos)
 #define USB_EPR_STATRX(a) ((a) << USB_EPRX_STAT_Pos)
@@ -125,7 +150,15 @@ static void SetEPRState(const struct usbdevice_ *usbd, uint8_t epaddr, uint32_t
 // clear data toggle - required by unstall request
 static void USBhw_ClrEPToggle(const struct usbdevice_ *usbd, uint8_t epaddr)
 {
-	SetEPRState(usbd, epaddr, epaddr & EP_IS_IN ? USB_EP_DTOG_TX : USB_EP_DTOG_RX, 0);
+	struct dbstate_ *dbs = &dbstate[epaddr & EPNUMMSK];
+	if (dbs->out || dbs->in)
+	{
+		// reset buffer flags as well: Out SW_BUF = 1, hw receives to buffer 0
+		dbs->rxpend = dbs->txpre = 0;
+		SetEPRState(usbd, epaddr, USB_EP_DTOG_TX | USB_EP_DTOG_RX, dbs->out ? USB_EP_DTOG_TX : 0);
+	}
+	else
+		SetEPRState(usbd, epaddr, epaddr & EP_IS_IN ? USB_EP_DTOG_TX : USB_EP_DTOG_RX, 0);
 }
 
 static void USBhw_SetEPState(const struct usbdevice_ *usbd, uint8_t epaddr, enum usb_epstate_ state)
@@ -139,6 +172,7 @@ static void USBhw_SetEPState(const struct usbdevice_ *usbd, uint8_t epaddr, enum
 static void USBhw_SetEPStall(const struct usbdevice_ *usbd, uint8_t epaddr)
 {
 	USBhw_SetEPState(usbd, epaddr, USB_EPSTATE_STALL);
+	USBdev_CountStall(usbd, epaddr);
 }
 
 static void USBhw_ClrEPStall(const struct usbdevice_ *usbd, uint8_t epaddr)
@@ -159,7 +193,17 @@ static bool USBhw_IsEPStalled(const struct usbdevice_ *usbd, uint8_t epaddr)
 
 static void USBhw_EnableRx(const struct usbdevice_ *usbd, uint8_t epn)
 {
-	USBhw_SetEPState(usbd, epn & EPNUMMSK, USB_EPSTATE_VALID);
+	epn &= EPNUMMSK;
+	struct dbstate_ *dbs = &dbstate[epn];
+	if (dbs->out)
+	{
+		// double-buffered ep stays valid, packet waiting in PMA is taken by ISR
+		dbs->rxheld = 0;
+		if (dbs->rxpend)
+			NVIC_SetPendingIRQ((IRQn_Type)usbd->cfg->irqn);
+	}
+	else
+		USBhw_SetEPState(usbd, epn, USB_EPSTATE_VALID);
 }
 
 static void USBhw_EnableCtlSetup(const struct usbdevice_ *usbd)
@@ -178,6 +222,7 @@ static const uint8_t eptype[] = {USBHW_EPTYPE_CTRL, USBHW_EPTYPE_ISO, USBHW_EPTY
 
 static void reset_in_endpoints(const struct usbdevice_ *usbd)
 {
+	USBdev_AbortTransfers(usbd);
 	memset(usbd->inep, 0, sizeof(struct epdata_) * usbd->cfg->numeppairs);
 }
 
@@ -205,6 +250,7 @@ static void USBhw_Reset(const struct usbdevice_ *usbd)
     usb->CNTR.v = USB_CNTR_CTRM | USB_CNTR_RESETM | USB_CNTR_SUSPM  | USB_CNTR_WKUPM | USB_CNTR_SOFM;
 
     reset_in_endpoints(usbd);
+    memset(dbstate, 0, sizeof(dbstate));
 }
 
 // convert endpoint size to endpoint PMA buffer size
@@ -224,20 +270,33 @@ static void USBhw_SetCfg(const struct usbdevice_ *usbd)
 	struct USB_BufDesc_ *bufdesc = usb->PMA.BUFDESC;
     for (uint8_t i = 1; i < cfg->numeppairs; i++)
 	{
-		bufdesc[i].TxAddress = addr;
-		bufdesc[i].TxCount = 0;
     	const struct USBdesc_ep_ *ind = USBdev_GetEPDescriptor(usbd, i | EP_IS_IN);
 		uint16_t txsize = ind ? epbufsize(getusb16(&ind->wMaxPacketSize)) : 0;
-		addr += txsize;
-		bufdesc[i].RxAddress = addr;
     	const struct USBdesc_ep_ *outd = USBdev_GetEPDescriptor(usbd, i);
 		uint16_t rxsize = outd ? epbufsize(getusb16(&outd->wMaxPacketSize)) : 0;
-		bufdesc[i].RxCount = SetRxNumBlock(rxsize) << 10;;
-        addr += rxsize;
+		// double buffering only for bulk ep with the other direction unused
+		struct dbstate_ *dbs = &dbstate[i];
+		*dbs = (struct dbstate_){
+			.out = cfg->outepcfg[i].dblbuf && outd && !ind && outd->bmAttributes == USBD_EP_TYPE_BULK,
+			.in = cfg->inepcfg[i].dblbuf && ind && !outd && ind->bmAttributes == USBD_EP_TYPE_BULK,
+			.rxheld = !usbd->outep[i].ptr
+		};
+		uint16_t rxcount = SetRxNumBlock(rxsize) << 10;
+		bufdesc[i].TxAddress = addr;
+		bufdesc[i].TxCount = dbs->out ? rxcount : 0;	// double-buffered Out: both buffers used for reception
+		addr += dbs->out ? rxsize : txsize;
+		bufdesc[i].RxAddress = addr;
+		bufdesc[i].RxCount = dbs->in ? 0 : rxcount;	// double-buffered In: both buffers used for transmission
+        addr += dbs->in ? txsize : rxsize;
 
-        epr[i].v = i | USB_EPR_EPTYPE((ind ? ind->bmAttributes : 0) | (outd ? outd->bmAttributes : 0));
+        epr[i].v = i | USB_EPR_EPTYPE((ind ? ind->bmAttributes : 0) | (outd ? outd->bmAttributes : 0))
+			| (dbs->out || dbs->in ? USB_EP_KIND : 0);
         uint32_t epstate = (rxsize && usbd->outep[i].ptr ? USB_EPR_STATRX(USB_EPSTATE_VALID) : USB_EPR_STATRX(USB_EPSTATE_NAK))
 			| USB_EPR_STATTX(USB_EPSTATE_NAK);
+		if (dbs->out)	// always valid, unused Tx disabled, SW_BUF = 1 - hw receives to buffer 0
+			epstate = USB_EPR_STATRX(USB_EPSTATE_VALID) | USB_EPR_STATTX(USB_EPSTATE_DISABLE) | USB_EP_DTOG_TX;
+		else if (dbs->in)	// unused Rx disabled
+			epstate = USB_EPR_STATRX(USB_EPSTATE_DISABLE) | USB_EPR_STATTX(USB_EPSTATE_NAK);
 		SetEPRState(usbd, i, USB_EPRX_STAT | USB_EPTX_STAT | USB_EP_DTOG_TX | USB_EP_DTOG_RX, epstate);
 	}
 }
@@ -253,38 +312,101 @@ static void USBhw_ResetCfg(const struct usbdevice_ *usbd)
 			USB_EPR_STATRX(USB_EPSTATE_NAK) | USB_EPR_STATTX(USB_EPSTATE_NAK));
 	}
     reset_in_endpoints(usbd);
+    memset(dbstate, 0, sizeof(dbstate));
 }
 
-// write data packet to be sent
-static void USBhw_WriteTxData(const struct usbdevice_ *usbd, uint8_t epn)
+// write data packet to be sent to buffer n
+static void USBhw_WriteTxData(const struct usbdevice_ *usbd, uint8_t epn, bool n)
 {
 	USBh_TypeDef *usb = (USBh_TypeDef *)usbd->usb;
 	struct epdata_ *epd = &usbd->inep[epn];
+	PMAreg *bd = pmabuf(usb, epn, n);
 	uint16_t epsize = USBhw_GetInEPSize(usbd, epn);
 	uint16_t bcount = MIN(epd->count, epsize);
-	usb->PMA.BUFDESC[epn].TxCount = bcount;
+	bd[1] = bcount;
+	USBdev_CountPacket(usbd, epn | EP_IS_IN, bcount);
 	if (bcount)
 	{
 		epd->count -= bcount;
-		volatile uint32_t *dest = &usb->PMA.PMA[usb->PMA.BUFDESC[epn].TxAddress / 2];
-		const uint8_t *src = epd->ptr;
-		while (bcount > 1)
+		volatile uint32_t *dest = &usb->PMA.PMA[bd[0] / 2];
+		USBdev_NextTxSegment(epd);
+		if (bcount <= epd->seglen)
+		{
+			// packet within current segment
+			const uint8_t *src = epd->ptr;
+			epd->seglen -= bcount;
+			while (bcount > 1)
+			{
+				uint16_t v = *src++;
+				v |= *src++ << 8;
+				*dest++ = v;
+				bcount -= 2;
+			}
+			if (bcount)
+				*dest = *src++;
+			epd->ptr = (uint8_t *)src;
+		}
+		else
 		{
-			uint16_t v = *src++;
-			v |= *src++ << 8;
-			*dest++ = v;
-			bcount -= 2;
+			// packet straddles segment boundary
+			while (bcount > 1)
+			{
+				uint16_t v = USBdev_TxByte(epd);
+				v |= USBdev_TxByte(epd) << 8;
+				*dest++ = v;
+				bcount -= 2;
+			}
+			if (bcount)
+				*dest = USBdev_TxByte(epd);
 		}
-		if (bcount)
-			*dest = *src++;
-		epd->ptr = (uint8_t *)src;
+	}
+}
+
+// double-buffered In: write next packet to buffer n, release it after the current one is sent
+static void dbtx_prefill(const struct usbdevice_ *usbd, uint8_t epn, bool n)
+{
+	struct epdata_ *epd = &usbd->inep[epn];
+	if (epd->count || epd->sendzlp)
+	{
+		if (epd->count == 0)
+			epd->sendzlp = 0;	// ZLP
+		USBhw_WriteTxData(usbd, epn, n);
+		dbstate[epn].txpre = 1;
+	}
+}
+
+// stop In transfer in progress - packets written to PMA are not sent, pending completion dropped;
+// valid endpoint set to NAK, stall kept
+static void USBhw_AbortTx(const struct usbdevice_ *usbd, uint8_t epn)
+{
+	USBh_TypeDef *usb = (USBh_TypeDef *)usbd->usb;
+	epn &= EPNUMMSK;
+    volatile uint16_t *epr = &usb->EPR[epn].v;
+	if ((*epr & USB_EP0R_STAT_TX) == USB_EPR_STATTX(USB_EPSTATE_VALID))
+		USBhw_SetEPState(usbd, epn | EP_IS_IN, USB_EPSTATE_NAK);
+	*epr = (*epr & USB_EPR_CFG) | (USB_EPR_FLAGS & ~USB_EP_CTR_TX);	// clear CTR_TX
+	if (dbstate[epn].in)
+	{
+		// both buffers empty: SW_BUF = hw buffer, data toggle unchanged
+		dbstate[epn].txpre = 0;
+		SetEPRState(usbd, epn, USB_EP_DTOG_RX, *epr & USB_EP_DTOG_TX ? USB_EP_DTOG_RX : 0);
 	}
 }
 
 static void USBhw_StartTx(const struct usbdevice_ *usbd, uint8_t epn)
 {
+	USBh_TypeDef *usb = (USBh_TypeDef *)usbd->usb;
 	epn &= EPNUMMSK;
-    USBhw_WriteTxData(usbd, epn);
+	if (dbstate[epn].in)
+	{
+		// fill both buffers before releasing the first one
+		bool swbuf = usb->EPR[epn].v & USB_EP_DTOG_RX;
+		USBhw_WriteTxData(usbd, epn, swbuf);
+		dbtx_prefill(usbd, epn, !swbuf);
+		SetEPRState(usbd, epn, 0, USB_EP_DTOG_RX);	// toggle SW_BUF
+	}
+	else
+		USBhw_WriteTxData(usbd, epn, 0);
     if (epn == 0 && usbd->inep[0].ptr && usbd->inep[0].count == 0)
     {
     	// last data packet sent over control ep - prepare for status out
@@ -294,15 +416,29 @@ static void USBhw_StartTx(const struct usbdevice_ *usbd, uint8_t epn)
     USBhw_SetEPState(usbd, epn | 0x80, USB_EPSTATE_VALID);
 }
 
-// read received data packet
-static void USBhw_ReadRxData(const struct usbdevice_ *usbd, uint8_t epn)
+// read received data packet from buffer n, return true if the packet fills the buffer
+// multi-packet transfer: append to data received so far, discard data not fitting in buffer
+static bool USBhw_ReadRxData(const struct usbdevice_ *usbd, uint8_t epn, bool n)
 {
 	USBh_TypeDef *usb = (USBh_TypeDef *)usbd->usb;
+	struct epdata_ *epd = &usbd->outep[epn];
+	PMAreg *bd = pmabuf(usb, epn, n);
 	
-	uint16_t bcount = usb->PMA.BUFDESC[epn].RxCount & 0x3FF;
-	usbd->outep[epn].count = bcount;
-	volatile uint32_t *src = &usb->PMA.PMA[usb->PMA.BUFDESC[epn].RxAddress / 2];
-	uint8_t *dest = usbd->outep[epn].ptr;
+	uint16_t pktsize = bd[1] & 0x3FF;
+	uint16_t bcount = pktsize;
+	USBdev_CountPacket(usbd, epn, pktsize);
+	volatile uint32_t *src = &usb->PMA.PMA[bd[0] / 2];
+	uint8_t *dest = epd->ptr;
+	if (epd->length)
+	{
+		uint16_t room = epd->length - epd->count;
+		dest += epd->count;
+		if (bcount > room)
+			bcount = room;
+		epd->count += bcount;
+	}
+	else
+		epd->count = bcount;
 
 	for (; bcount > 1; bcount -= 2)
 	{
@@ -312,6 +448,27 @@ static void USBhw_ReadRxData(const struct usbdevice_ *usbd, uint8_t epn)
 	}
 	if (bcount)
 		*dest = *src & 0xff;
+	return pktsize == GetRxBufSize(bd[1] >> 10);
+}
+
+// Out packet read - continue multi-packet transfer or call the handler
+static void rx_done(const struct usbdevice_ *usbd, uint8_t epn, bool full, bool setup)
+{
+	const struct epdata_ *epd = &usbd->outep[epn];
+	if (full && epd->length > epd->count)
+		USBhw_EnableRx(usbd, epn);	// multi-packet transfer continues
+	else
+		USBdev_OutEPHandler(usbd, epn, setup);
+}
+
+// double-buffered Out: release app buffer to hw, take the one filled by hw
+static void dbrx_take(const struct usbdevice_ *usbd, uint8_t epn)
+{
+	USBh_TypeDef *usb = (USBh_TypeDef *)usbd->usb;
+	dbstate[epn].rxpend = 0;
+	dbstate[epn].rxheld = 1;
+	SetEPRState(usbd, epn, 0, USB_EP_DTOG_TX);	// toggle SW_BUF
+	rx_done(usbd, epn, USBhw_ReadRxData(usbd, epn, usb->EPR[epn].v & USB_EP_DTOG_TX), 0);
 }
 
 static void USBhw_IRQHandler(const struct usbdevice_ *usbd)
@@ -327,6 +484,7 @@ static void USBhw_IRQHandler(const struct usbdevice_ *usbd)
 			usb->CNTR.v &= ~USB_CNTR_LP_MODE;
 			usb->CNTR.v &= ~USB_CNTR_FSUSP;
 			// call the resume routine here
+			USBlog_event(ULE_RESUME, 0, 0, 0);
 			if (usbd->Resume_Handler)
 				usbd->Resume_Handler();
     	}
@@ -337,11 +495,17 @@ static void USBhw_IRQHandler(const struct usbdevice_ *usbd)
 	{
         usb->ISTR.v = (uint16_t)~USB_ISTR_RESET;
         USBhw_Reset(usbd);
+        USBlog_event(ULE_RESET, 0, 0, 0);
         if (usbd->Reset_Handler)
         	usbd->Reset_Handler();
         return;
     }
 
+    // double-buffered Out endpoints released by app with packet waiting
+    for (uint8_t epn = 1; epn < usbd->cfg->numeppairs; epn++)
+    	if (dbstate[epn].rxpend && !dbstate[epn].rxheld)
+    		dbrx_take(usbd, epn);
+
     if (istr & USB_ISTR_CTR)	// EP traffic interrupt
 	{
 		uint8_t  epn = usb->ISTR.v & USB_ISTR_EP_ID;
@@ -353,7 +517,18 @@ static void USBhw_IRQHandler(const struct usbdevice_ *usbd)
 			*epr = (eprv & USB_EPR_CFG) | (USB_EPR_FLAGS & ~USB_EP_CTR_TX);		// clear CTR_TX
 			struct epdata_ *epd = &usbd->inep[epn];
 
-			if (epd->count)	// Continue sending
+			if (dbstate[epn].in)
+			{
+				if (dbstate[epn].txpre)	// release written packet, write the next one
+				{
+					dbstate[epn].txpre = 0;
+					SetEPRState(usbd, epn, 0, USB_EP_DTOG_RX);	// toggle SW_BUF
+					dbtx_prefill(usbd, epn, *epr & USB_EP_DTOG_RX);
+				}
+				else	// In transfer completed
+					USBdev_InEPHandler(usbd, epn);
+			}
+			else if (epd->count)	// Continue sending
 			{
 				//USBlog_recordevt(0x10);
 				USBhw_StartTx(usbd, epn);
@@ -372,9 +547,20 @@ static void USBhw_IRQHandler(const struct usbdevice_ *usbd)
 		}
 		if (*epr & USB_EP0R_CTR_RX)	// data received on Out endpoint
 		{
-			USBhw_ReadRxData(usbd, epn);
-			*epr = (eprv & USB_EPR_CFG) | (USB_EPR_FLAGS & ~USB_EP_CTR_RX);		// clear CTR_RX
-			USBdev_OutEPHandler(usbd, epn, *epr & USB_EP0R_SETUP);
+			if (dbstate[epn].out)
+			{
+				*epr = (eprv & USB_EPR_CFG) | (USB_EPR_FLAGS & ~USB_EP_CTR_RX);		// clear CTR_RX
+				if (dbstate[epn].rxheld)
+					dbstate[epn].rxpend = 1;	// leave it in PMA until app enables Rx
+				else
+					dbrx_take(usbd, epn);
+			}
+			else
+			{
+				bool full = USBhw_ReadRxData(usbd, epn, 1);
+				*epr = (eprv & USB_EPR_CFG) | (USB_EPR_FLAGS & ~USB_EP_CTR_RX);		// clear CTR_RX
+				rx_done(usbd, epn, full, *epr & USB_EP0R_SETUP);
+			}
 		}
 	}
 
@@ -388,6 +574,7 @@ static void USBhw_IRQHandler(const struct usbdevice_ *usbd)
 
         usb->CNTR.v |= USB_CNTR_LP_MODE;
         reset_in_endpoints(usbd);
+        USBlog_event(ULE_SUSPEND, 0, 0, 0);
         if (usbd->Suspend_Handler)
         	usbd->Suspend_Handler();
         return;
@@ -408,6 +595,7 @@ const struct USBhw_services_ f1_fs_services = {
 	.Init = USBhw_Init,
 	.DeInit = USBhw_DeInit,
 	.GetInEPSize = USBhw_GetInEPSize,
+	.GetFrameNum = USBhw_GetFrameNum,
 
 	.SetCfg = USBhw_SetCfg,
 	.ResetCfg = USBhw_ResetCfg,
@@ -419,6 +607,7 @@ const struct USBhw_services_ f1_fs_services = {
 	.EnableCtlSetup = USBhw_EnableCtlSetup,
 	.EnableRx = USBhw_EnableRx,
 	.StartTx = USBhw_StartTx,
+	.AbortTx = USBhw_AbortTx,
 };
 
 #endif
@@ -41,6 +41,7 @@
 #include "usb_desc_def.h"
 #include "usb_dev.h"
 #include "usb_hw_if.h"
+#include "usb_log.h"
 
 #ifdef UARTMON
 #ifdef STM32H503xx
@@ -101,6 +102,23 @@ typedef struct USBh_ {
 		struct USB_BufDesc_ BUFDESC[USB_NEPPAIRS];
 	};
 } USBh_TypeDef;	// USBh to make it different from mfg. header file USB definition
+
+// buffer descriptor n of an endpoint: 0 - Tx, 1 - Rx
+// double-buffered endpoint uses both for a single direction
+static inline volatile union USB_BDesc_ *bdesc(USBh_TypeDef *usb, uint8_t epn, bool n)
+{
+	return n ? &usb->BUFDESC[epn].RxAddressCount : &usb->BUFDESC[epn].TxAddressCount;
+}
+
+// double-buffered bulk endpoint state
+// SW_BUF is DTOG_RX bit for In, DTOG_TX bit for Out endpoint
+struct dbstate_ {
+	bool out, in;	// ep configured as double-buffered Out or In
+	bool rxheld;	// Out: app buffer busy until Rx enabled
+	bool rxpend;	// Out: packet waiting in PMA buffer
+	bool txpre;		// In: next packet written, to be released when the current one is sent
+};
+static struct dbstate_ dbstate[USB_NEPPAIRS];
 //========================================================================
 // USB peripheral must be enabled before calling Init
 // G0 specific: before enabling USB, set PWR_CR2_USV; no need to setup USB pins
@@ -154,6 +172,13 @@ static uint16_t USBhw_GetInEPSize(const struct usbdevice_ *usbd, uint8_t epn)
 	return bufdesc->RxAddressCount.addr - bufdesc->TxAddressCount.addr;
 }
 
+static uint16_t USBhw_GetFrameNum(const struct usbdevice_ *usbd)
+{
+	USBh_TypeDef *usb = (USBh_TypeDef *)usbd->usb;
+
+	return usb->FNR & USB_FNR_FN;
+}
+
 #if 0
 static uint16_t USBhw_ReadEPSize(const struct usbdevice_ *usbd, uint8_t epaddr)
 {
@@ -191,7 +216,15 @@ static void SetEPRState(const struct usbdevice_ *usbd, uint8_t epaddr, uint32_t
 // clear data toggle - required by unstall request
 static void USBhw_ClrEPToggle(const struct usbdevice_ *usbd, uint8_t epaddr)
 {
-	SetEPRState(usbd, epaddr, epaddr & EP_IS_IN ? USB_EP_DTOG_TX : USB_EP_DTOG_RX, 0);
+	struct dbstate_ *dbs = &dbstate[epaddr & EPNUMMSK];
+	if (dbs->out || dbs->in)
+	{
+		// reset buffer flags as well: Out SW_BUF = 1, hw receives to buffer 0
+		dbs->rxpend = dbs->txpre = 0;
+		SetEPRState(usbd, epaddr, USB_EP_DTOG_TX | USB_EP_DTOG_RX, dbs->out ? USB_EP_DTOG_TX : 0);
+	}
+	else
+		SetEPRState(usbd, epaddr, epaddr & EP_IS_IN ? USB_EP_DTOG_TX : USB_EP_DTOG_RX, 0);
 }
 
 static void USBhw_SetEPState(const struct usbdevice_ *usbd, uint8_t epaddr, enum usb_epstate_ state)
@@ -205,6 +238,7 @@ static void USBhw_SetEPState(const struct usbdevice_ *usbd, uint8_t epaddr, enum
 static void USBhw_SetEPStall(const struct usbdevice_ *usbd, uint8_t epaddr)
 {
 	USBhw_SetEPState(usbd, epaddr, USB_EPSTATE_STALL);
+	USBdev_CountStall(usbd, epaddr);
 }
 
 static void USBhw_ClrEPStall(const struct usbdevice_ *usbd, uint8_t epaddr)
@@ -225,7 +259,17 @@ static bool USBhw_IsEPStalled(const struct usbdevice_ *usbd, uint8_t epaddr)
 
 static void USBhw_EnableRx(const struct usbdevice_ *usbd, uint8_t epn)
 {
-	USBhw_SetEPState(usbd, epn & EPNUMMSK, USB_EPSTATE_VALID);
+	epn &= EPNUMMSK;
+	struct dbstate_ *dbs = &dbstate[epn];
+	if (dbs->out)
+	{
+		// double-buffered ep stays valid, packet waiting in PMA is taken by ISR
+		dbs->rxheld = 0;
+		if (dbs->rxpend)
+			NVIC_SetPendingIRQ((IRQn_Type)usbd->cfg->irqn);
+	}
+	else
+		USBhw_SetEPState(usbd, epn, USB_EPSTATE_VALID);
 }
 
 static void USBhw_EnableCtlSetup(const struct usbdevice_ *usbd)
@@ -244,6 +288,7 @@ static const uint8_t eptype[] = {USBHW_EPTYPE_CTRL, USBHW_EPTYPE_ISO, USBHW_EPTY
 
 static void reset_in_endpoints(const struct usbdevice_ *usbd)
 {
+	USBdev_AbortTransfers(usbd);
 	memset(usbd->inep, 0, sizeof(struct epdata_) * usbd->cfg->numeppairs);
 }
 
@@ -269,6 +314,7 @@ static void USBhw_Reset(const struct usbdevice_ *usbd)
     uint32_t epstate = USB_EPR_STATRX(USB_EPSTATE_NAK) | USB_EPR_STATTX(USB_EPSTATE_NAK);
 	SetEPRState(usbd, 0, USB_EP_RX_STRX | USB_EP_TX_STTX | USB_EP_DTOG_TX | USB_EP_DTOG_RX, epstate);
     reset_in_endpoints(usbd);
+    memset(dbstate, 0, sizeof(dbstate));
 }
 
 // convert endpoint size to endpoint buffer size
@@ -288,23 +334,56 @@ static void USBhw_SetCfg(const struct usbdevice_ *usbd)
 	struct USB_BufDesc_ *bufdesc = usb->BUFDESC;
     for (uint8_t i = 1; i < cfg->numeppairs; i++)
 	{
-		bufdesc[i].TxAddressCount.v = addr;
     	const struct USBdesc_ep_ *ind = USBdev_GetEPDescriptor(usbd, i | EP_IS_IN);
 		uint16_t txsize = ind ? epbufsize(getusb16(&ind->wMaxPacketSize)) : 0;
-		addr += txsize;
     	const struct USBdesc_ep_ *outd = USBdev_GetEPDescriptor(usbd, i);
 		uint16_t rxsize = outd ? epbufsize(getusb16(&outd->wMaxPacketSize)) : 0;
-		// do not remove .v from the line below!
-		bufdesc[i].RxAddressCount.v = (union USB_BDesc_){.num_block = SetRxNumBlock(rxsize), .addr = addr, .count = CNT_INVALID}.v;
-        addr += rxsize;
+		// double buffering only for bulk ep with the other direction unused
+		struct dbstate_ *dbs = &dbstate[i];
+		*dbs = (struct dbstate_){
+			.out = cfg->outepcfg[i].dblbuf && outd && !ind && outd->bmAttributes == USBD_EP_TYPE_BULK,
+			.in = cfg->inepcfg[i].dblbuf && ind && !outd && ind->bmAttributes == USBD_EP_TYPE_BULK,
+			.rxheld = !usbd->outep[i].ptr
+		};
+		union USB_BDesc_ rxdesc = {.num_block = SetRxNumBlock(rxsize), .count = CNT_INVALID};
+		// do not remove .v from the lines below!
+		if (dbs->out)
+		{
+			// both buffers used for reception
+			rxdesc.addr = addr;
+			bufdesc[i].TxAddressCount.v = rxdesc.v;
+			addr += rxsize;
+		}
+		else
+		{
+			bufdesc[i].TxAddressCount.v = addr;
+			addr += txsize;
+		}
+		if (dbs->in)
+		{
+			// both buffers used for transmission
+			bufdesc[i].RxAddressCount.v = addr;
+			addr += txsize;
+		}
+		else
+		{
+			rxdesc.addr = addr;
+			bufdesc[i].RxAddressCount.v = rxdesc.v;
+			addr += rxsize;
+		}
 
 //        epr[i] = i | USB_EPR_EPTYPE((ind ? ind->bmAttributes : 0) | (outd ? outd->bmAttributes : 0))
 //			| (rxsize && usbd->outep[i].ptr ? USB_EPR_STATRX(USB_EPSTATE_VALID) : USB_EPR_STATRX(USB_EPSTATE_NAK))
 //			| USB_EPR_STATTX(USB_EPSTATE_NAK);
 
-        epr[i] = i | USB_EPR_EPTYPE((ind ? ind->bmAttributes : 0) | (outd ? outd->bmAttributes : 0));
+        epr[i] = i | USB_EPR_EPTYPE((ind ? ind->bmAttributes : 0) | (outd ? outd->bmAttributes : 0))
+			| (dbs->out || dbs->in ? USB_EP_KIND : 0);
         uint32_t epstate = (rxsize && usbd->outep[i].ptr ? USB_EPR_STATRX(USB_EPSTATE_VALID) : USB_EPR_STATRX(USB_EPSTATE_NAK))
 			| USB_EPR_STATTX(USB_EPSTATE_NAK);
+		if (dbs->out)	// always valid, unused Tx disabled, SW_BUF = 1 - hw receives to buffer 0
+			epstate = USB_EPR_STATRX(USB_EPSTATE_VALID) | USB_EPR_STATTX(USB_EPSTATE_DISABLE) | USB_EP_DTOG_TX;
+		else if (dbs->in)	// unused Rx disabled
+			epstate = USB_EPR_STATRX(USB_EPSTATE_DISABLE) | USB_EPR_STATTX(USB_EPSTATE_NAK);
 		SetEPRState(usbd, i, USB_EP_RX_STRX | USB_EP_TX_STTX | USB_EP_DTOG_TX | USB_EP_DTOG_RX, epstate);
 	}
     EVTMON('C');
@@ -321,50 +400,118 @@ static void USBhw_ResetCfg(const struct usbdevice_ *usbd)
 			USB_EPR_STATRX(USB_EPSTATE_NAK) | USB_EPR_STATTX(USB_EPSTATE_NAK));
 	}
     reset_in_endpoints(usbd);
+    memset(dbstate, 0, sizeof(dbstate));
 }
 
-// write data packet to be sent
-static void USBhw_WriteTxData(const struct usbdevice_ *usbd, uint8_t epn)
+// write data packet to be sent to buffer n
+static void USBhw_WriteTxData(const struct usbdevice_ *usbd, uint8_t epn, bool n)
 {
 	USBh_TypeDef *usb = (USBh_TypeDef *)usbd->usb;
 	struct epdata_ *epd = &usbd->inep[epn];
+	volatile union USB_BDesc_ *bd = bdesc(usb, epn, n);
 	uint16_t epsize = USBhw_GetInEPSize(usbd, epn);
 	uint16_t bcount = MIN(epd->count, epsize);
-	usb->BUFDESC[epn].TxAddressCount.v = (union USB_BDesc_){.count = bcount, .addr = usb->BUFDESC[epn].TxAddressCount.addr}.v;
+	bd->v = (union USB_BDesc_){.count = bcount, .addr = bd->addr}.v;
+	USBdev_CountPacket(usbd, epn | EP_IS_IN, bcount);
 
 	if (bcount)
 	{
 		epd->count -= bcount;
-		volatile uint32_t *dest = &usb->PMA[(usb->BUFDESC[epn].TxAddressCount.v & 0xffff) / 4];
-		const uint8_t *src = epd->ptr;
-		while (bcount > 3)
-		{
-			uint32_t v = *src++;
-			v |= *src++ << 8;
-			v |= *src++ << 16;
-			v |= *src++ << 24;
-			*dest++ = v;
-			bcount -= 4;
-		}
-		if (bcount)
+		volatile uint32_t *dest = &usb->PMA[(bd->v & 0xffff) / 4];
+		USBdev_NextTxSegment(epd);
+		if (bcount <= epd->seglen)
 		{
-			uint32_t v = *src++;
-			if (--bcount)
+			// packet within current segment
+			const uint8_t *src = epd->ptr;
+			epd->seglen -= bcount;
+			while (bcount > 3)
 			{
+				uint32_t v = *src++;
 				v |= *src++ << 8;
+				v |= *src++ << 16;
+				v |= *src++ << 24;
+				*dest++ = v;
+				bcount -= 4;
+			}
+			if (bcount)
+			{
+				uint32_t v = *src++;
 				if (--bcount)
-					v |= *src++ << 16;
+				{
+					v |= *src++ << 8;
+					if (--bcount)
+						v |= *src++ << 16;
+				}
+				*dest++ = v;
+			}
+			epd->ptr = (uint8_t *)src;
+		}
+		else
+		{
+			// packet straddles segment boundary
+			uint32_t v = 0;
+			uint8_t shift = 0;
+			while (bcount--)
+			{
+				v |= (uint32_t)USBdev_TxByte(epd) << shift;
+				if ((shift += 8) == 32)
+				{
+					*dest++ = v;
+					v = 0;
+					shift = 0;
+				}
 			}
-			*dest++ = v;
+			if (shift)
+				*dest = v;
 		}
-		epd->ptr = (uint8_t *)src;
+	}
+}
+
+// double-buffered In: write next packet to buffer n, release it after the current one is sent
+static void dbtx_prefill(const struct usbdevice_ *usbd, uint8_t epn, bool n)
+{
+	struct epdata_ *epd = &usbd->inep[epn];
+	if (epd->count || epd->sendzlp)
+	{
+		if (epd->count == 0)
+			epd->sendzlp = 0;	// ZLP
+		USBhw_WriteTxData(usbd, epn, n);
+		dbstate[epn].txpre = 1;
+	}
+}
+
+// stop In transfer in progress - packets written to PMA are not sent, pending completion dropped;
+// valid endpoint set to NAK, stall kept
+static void USBhw_AbortTx(const struct usbdevice_ *usbd, uint8_t epn)
+{
+	USBh_TypeDef *usb = (USBh_TypeDef *)usbd->usb;
+	epn &= EPNUMMSK;
+    volatile uint32_t *epr = &usb->EPR[epn];
+	if ((*epr & USB_CHEP_TX_STTX) == USB_EPR_STATTX(USB_EPSTATE_VALID))
+		USBhw_SetEPState(usbd, epn | EP_IS_IN, USB_EPSTATE_NAK);
+	*epr = (*epr & USB_EPR_CFG) | (USB_EPR_FLAGS & ~USB_CHEP_VTTX);	// clear CTR_TX
+	if (dbstate[epn].in)
+	{
+		// both buffers empty: SW_BUF = hw buffer, data toggle unchanged
+		dbstate[epn].txpre = 0;
+		SetEPRState(usbd, epn, USB_EP_DTOG_RX, *epr & USB_EP_DTOG_TX ? USB_EP_DTOG_RX : 0);
 	}
 }
 
 static void USBhw_StartTx(const struct usbdevice_ *usbd, uint8_t epn)
 {
+	USBh_TypeDef *usb = (USBh_TypeDef *)usbd->usb;
 	epn &= EPNUMMSK;
-    USBhw_WriteTxData(usbd, epn);
+	if (dbstate[epn].in)
+	{
+		// fill both buffers before releasing the first one
+		bool swbuf = usb->EPR[epn] & USB_EP_DTOG_RX;
+		USBhw_WriteTxData(usbd, epn, swbuf);
+		dbtx_prefill(usbd, epn, !swbuf);
+		SetEPRState(usbd, epn, 0, USB_EP_DTOG_RX);	// toggle SW_BUF
+	}
+	else
+		USBhw_WriteTxData(usbd, epn, 0);
     if (epn == 0 && usbd->inep[0].ptr && usbd->inep[0].count == 0)
     {
     	// last data packet sent over control ep - prepare for status out
@@ -375,19 +522,33 @@ static void USBhw_StartTx(const struct usbdevice_ *usbd, uint8_t epn)
     USBhw_SetEPState(usbd, epn | 0x80, USB_EPSTATE_VALID);
 }
 
-// read received data packet
-static void USBhw_ReadRxData(const struct usbdevice_ *usbd, uint8_t epn)
+// read received data packet from buffer n, return true if the packet fills the buffer
+// multi-packet transfer: append to data received so far, discard data not fitting in buffer
+static bool USBhw_ReadRxData(const struct usbdevice_ *usbd, uint8_t epn, bool n)
 {
 	USBh_TypeDef *usb = (USBh_TypeDef *)usbd->usb;
+	struct epdata_ *epd = &usbd->outep[epn];
+	volatile union USB_BDesc_ *bd = bdesc(usb, epn, n);
 	
 	// count field in EP descriptor is updated with some delay (H503 errata), so do something else first
-	uint8_t *dst = usbd->outep[epn].ptr;
-	const uint8_t *src = (const uint8_t *)usb->PMA + usb->BUFDESC[epn].RxAddressCount.addr;
+	uint8_t *dst = epd->ptr;
+	const uint8_t *src = (const uint8_t *)usb->PMA + bd->addr;
 	const volatile uint32_t *srcw = (const volatile uint32_t *)src;
-	uint16_t bcount;
+	uint16_t pktsize, bcount;
 	// "wait for descriptor update"
-	while ((bcount = usb->BUFDESC[epn].RxAddressCount.count) == CNT_INVALID) ;
-	usbd->outep[epn].count = bcount;
+	while ((pktsize = bd->count) == CNT_INVALID) ;
+	USBdev_CountPacket(usbd, epn, pktsize);
+	bcount = pktsize;
+	if (epd->length)
+	{
+		uint16_t room = epd->length - epd->count;
+		dst += epd->count;
+		if (bcount > room)
+			bcount = room;
+		epd->count += bcount;
+	}
+	else
+		epd->count = bcount;
 	while (bcount)
 	{
 		uint32_t w = *srcw++;
@@ -406,7 +567,28 @@ static void USBhw_ReadRxData(const struct usbdevice_ *usbd, uint8_t epn)
 			}
 		}
 	}
-	usb->BUFDESC[epn].RxAddressCount.count = CNT_INVALID;
+	bd->count = CNT_INVALID;
+	return pktsize == GetRxBufSize(bd->num_block);
+}
+
+// Out packet read - continue multi-packet transfer or call the handler
+static void rx_done(const struct usbdevice_ *usbd, uint8_t epn, bool full, bool setup)
+{
+	const struct epdata_ *epd = &usbd->outep[epn];
+	if (full && epd->length > epd->count)
+		USBhw_EnableRx(usbd, epn);	// multi-packet transfer continues
+	else
+		USBdev_OutEPHandler(usbd, epn, setup);
+}
+
+// double-buffered Out: release app buffer to hw, take the one filled by hw
+static void dbrx_take(const struct usbdevice_ *usbd, uint8_t epn)
+{
+	USBh_TypeDef *usb = (USBh_TypeDef *)usbd->usb;
+	dbstate[epn].rxpend = 0;
+	dbstate[epn].rxheld = 1;
+	SetEPRState(usbd, epn, 0, USB_EP_DTOG_TX);	// toggle SW_BUF
+	rx_done(usbd, epn, USBhw_ReadRxData(usbd, epn, usb->EPR[epn] & USB_EP_DTOG_TX), 0);
 }
 
 void USBhw_IRQHandler(const struct usbdevice_ *usbd)
@@ -426,6 +608,7 @@ void USBhw_IRQHandler(const struct usbdevice_ *usbd)
             {
             	// resume (not reset)
                 // callback...
+                USBlog_event(ULE_RESUME, 0, 0, 0);
                 if (usbd->Resume_Handler)
                 	usbd->Resume_Handler();
                 EVTMON('W');
@@ -437,11 +620,16 @@ void USBhw_IRQHandler(const struct usbdevice_ *usbd)
 	{
         usb->ISTR = ~USB_ISTR_RESET;
         USBhw_Reset(usbd);
+        USBlog_event(ULE_RESET, 0, 0, 0);
         if (usbd->Reset_Handler)
         	usbd->Reset_Handler();
         EVTMON('R');
         return;
     }
+    // double-buffered Out endpoints released by app with packet waiting
+    for (uint8_t epn = 1; epn < usbd->cfg->numeppairs; epn++)
+    	if (dbstate[epn].rxpend && !dbstate[epn].rxheld)
+    		dbrx_take(usbd, epn);
     if (istr & USB_ISTR_CTR)	// EP traffic interrupt
 	{
 		uint8_t  epn = usb->ISTR & USB_ISTR_IDN;
@@ -452,7 +640,18 @@ void USBhw_IRQHandler(const struct usbdevice_ *usbd)
 			*epr = (eprv & USB_EPR_CFG) | (USB_EPR_FLAGS & ~USB_CHEP_VTTX);	// clear CTR_TX
 			struct epdata_ *epd = &usbd->inep[epn];
 
-			if (epd->count)	// Continue sending
+			if (dbstate[epn].in)
+			{
+				if (dbstate[epn].txpre)	// release written packet, write the next one
+				{
+					dbstate[epn].txpre = 0;
+					SetEPRState(usbd, epn, 0, USB_EP_DTOG_RX);	// toggle SW_BUF
+					dbtx_prefill(usbd, epn, *epr & USB_EP_DTOG_RX);
+				}
+				else	// In transfer completed
+					USBdev_InEPHandler(usbd, epn);
+			}
+			else if (epd->count)	// Continue sending
 			{
 				//USBlog_recordevt(0x10);
 				USBhw_StartTx(usbd, epn);
@@ -474,9 +673,20 @@ void USBhw_IRQHandler(const struct usbdevice_ *usbd)
 		}
 		if (eprv & USB_CHEP_VTRX)	// data received on Out endpoint
 		{
-			USBhw_ReadRxData(usbd, epn);
-			*epr = (eprv & USB_EPR_CFG) | (USB_EPR_FLAGS & ~USB_CHEP_VTRX);		// clear CTR_RX
-			USBdev_OutEPHandler(usbd, epn, eprv & USB_EP_SETUP);
+			if (dbstate[epn].out)
+			{
+				*epr = (eprv & USB_EPR_CFG) | (USB_EPR_FLAGS & ~USB_CHEP_VTRX);		// clear CTR_RX
+				if (dbstate[epn].rxheld)
+					dbstate[epn].rxpend = 1;	// leave it in PMA until app enables Rx
+				else
+					dbrx_take(usbd, epn);
+			}
+			else
+			{
+				bool full = USBhw_ReadRxData(usbd, epn, 1);
+				*epr = (eprv & USB_EPR_CFG) | (USB_EPR_FLAGS & ~USB_CHEP_VTRX);		// clear CTR_RX
+				rx_done(usbd, epn, full, eprv & USB_EP_SETUP);
+			}
 		}
 	}
     if (istr & USB_ISTR_SUSP)	// suspend
@@ -491,6 +701,7 @@ void USBhw_IRQHandler(const struct usbdevice_ *usbd)
         reset_in_endpoints(usbd);
         // suspend callback should go here
         // callback...
+        USBlog_event(ULE_SUSPEND, 0, 0, 0);
         if (usbd->Suspend_Handler)
         	usbd->Suspend_Handler();
         EVTMON('S');
@@ -510,6 +721,7 @@ const struct USBhw_services_ g0_fs_services = {
 	.Init = USBhw_Init,
 	.DeInit = USBhw_DeInit,
 	.GetInEPSize = USBhw_GetInEPSize,
+	.GetFrameNum = USBhw_GetFrameNum,
 
 	.SetCfg = USBhw_SetCfg,
 	.ResetCfg = USBhw_ResetCfg,
@@ -521,6 +733,7 @@ const struct USBhw_services_ g0_fs_services = {
 	.EnableCtlSetup = USBhw_EnableCtlSetup,
 	.EnableRx = USBhw_EnableRx,
 	.StartTx = USBhw_StartTx,
+	.AbortTx = USBhw_AbortTx,
 };
 
 #endif
@@ -40,6 +40,7 @@
 #include "usb_desc_def.h"
 #include "usb_dev.h"
 #include "usb_hw_if.h"
+#include "usb_log.h"
 
 // verified on STM32F072, L552
 // USB registers are 16-bit and may be accessed as 16- or 32-bit
@@ -86,6 +87,23 @@ typedef struct USBh_ {
 	} PMA;
 } USBh_TypeDef;	// USBh to make it different from possible mfg. additions to header files
 
+// buffer n of an endpoint: [0] - address, [1] - count; 0 - Tx, 1 - Rx
+// double-buffered endpoint uses both for a single direction
+static inline PMAreg *pmabuf(USBh_TypeDef *usb, uint8_t epn, bool n)
+{
+	return &usb->PMA.BUFDESC[epn].TxAddress + 2 * n;
+}
+
+// double-buffered bulk endpoint state
+// SW_BUF is DTOG_RX bit for In, DTOG_TX bit for Out endpoint
+struct dbstate_ {
+	bool out, in;	// ep configured as double-buffered Out or In
+	bool rxheld;	// Out: app buffer busy until Rx enabled
+	bool rxpend;	// Out: packet waiting in PMA buffer
+	bool txpre;		// In: next packet written, to be released when the current one is sent
+};
+static struct dbstate_ dbstate[USB_NEPPAIRS];
+
 // Private functions =====================================================
 static inline uint16_t GetRxBufSize(uint8_t block)
 {
@@ -119,7 +137,15 @@ static void SetEPRState(const struct usbdevice_ *usbd, uint8_t epaddr, uint32_t
 // clear data toggle - required by unstall request
 static void USBhw_ClrEPToggle(const struct usbdevice_ *usbd, uint8_t epaddr)
 {
-	SetEPRState(usbd, epaddr, epaddr & EP_IS_IN ? USB_EP_DTOG_TX : USB_EP_DTOG_RX, 0);
+	struct dbstate_ *dbs = &dbstate[epaddr & EPNUMMSK];
+	if (dbs->out || dbs->in)
+	{
+		// reset buffer flags as well: Out SW_BUF = 1, hw receives to buffer 0
+		dbs->rxpend = dbs->txpre = 0;
+		SetEPRState(usbd, epaddr, USB_EP_DTOG_TX | USB_EP_DTOG_RX, dbs->out ? USB_EP_DTOG_TX : 0);
+	}
+	else
+		SetEPRState(usbd, epaddr, epaddr & EP_IS_IN ? USB_EP_DTOG_TX : USB_EP_DTOG_RX, 0);
 }
 
 static void USBhw_SetEPState(const struct usbdevice_ *usbd, uint8_t epaddr, enum usb_epstate_ state)
@@ -133,6 +159,7 @@ static void USBhw_SetEPState(const struct usbdevice_ *usbd, uint8_t epaddr, enum
 static void USBhw_SetEPStall(const struct usbdevice_ *usbd, uint8_t epaddr)
 {
 	USBhw_SetEPState(usbd, epaddr, USB_EPSTATE_STALL);
+	USBdev_CountStall(usbd, epaddr);
 }
 
 static void USBhw_ClrEPStall(const struct usbdevice_ *usbd, uint8_t epaddr)
@@ -153,7 +180,17 @@ static bool USBhw_IsEPStalled(const struct usbdevice_ *usbd, uint8_t epaddr)
 
 void USBhw_EnableRx(const struct usbdevice_ *usbd, uint8_t epn)
 {
-	USBhw_SetEPState(usbd, epn & EPNUMMSK, USB_EPSTATE_VALID);
+	epn &= EPNUMMSK;
+	struct dbstate_ *dbs = &dbstate[epn];
+	if (dbs->out)
+	{
+		// double-buffered ep stays valid, packet waiting in PMA is taken by ISR
+		dbs->rxheld = 0;
+		if (dbs->rxpend)
+			NVIC_SetPendingIRQ((IRQn_Type)usbd->cfg->irqn);
+	}
+	else
+		USBhw_SetEPState(usbd, epn, USB_EPSTATE_VALID);
 }
 
 static void USBhw_EnableCtlSetup(const struct usbdevice_ *usbd)
@@ -173,6 +210,7 @@ static const uint8_t eptype[] = {USBHW_EPTYPE_CTRL, USBHW_EPTYPE_ISO, USBHW_EPTY
 
 static void reset_in_endpoints(const struct usbdevice_ *usbd)
 {
+	USBdev_AbortTransfers(usbd);
 	memset(usbd->inep, 0, sizeof(struct epdata_) * usbd->cfg->numeppairs);
 }
 
@@ -200,6 +238,7 @@ static void USBhw_Reset(const struct usbdevice_ *usbd)
     uint32_t epstate = USB_EPR_STATRX(USB_EPSTATE_NAK) | USB_EPR_STATTX(USB_EPSTATE_NAK);
 	SetEPRState(usbd, 0, USB_EPRX_STAT | USB_EPTX_STAT | USB_EP_DTOG_TX | USB_EP_DTOG_RX, epstate);
     reset_in_endpoints(usbd);
+    memset(dbstate, 0, sizeof(dbstate));
 }
 
 // convert endpoint size to endpoint buffer size
@@ -219,24 +258,37 @@ static void USBhw_SetCfg(const struct usbdevice_ *usbd)
 	struct USB_BufDesc_ *bufdesc = usb->PMA.BUFDESC;
     for (uint8_t i = 1; i < cfg->numeppairs; i++)
 	{
-		bufdesc[i].TxAddress = addr;
-		bufdesc[i].TxCount = 0;
     	const struct USBdesc_ep_ *ind = USBdev_GetEPDescriptor(usbd, i | EP_IS_IN);
 		uint16_t txsize = ind ? epbufsize(getusb16(&ind->wMaxPacketSize)) : 0;
-		addr += txsize;
     	const struct USBdesc_ep_ *outd = USBdev_GetEPDescriptor(usbd, i);
 		uint16_t rxsize = outd ? epbufsize(getusb16(&outd->wMaxPacketSize)) : 0;
+		// double buffering only for bulk ep with the other direction unused
+		struct dbstate_ *dbs = &dbstate[i];
+		*dbs = (struct dbstate_){
+			.out = cfg->outepcfg[i].dblbuf && outd && !ind && outd->bmAttributes == USBD_EP_TYPE_BULK,
+			.in = cfg->inepcfg[i].dblbuf && ind && !outd && ind->bmAttributes == USBD_EP_TYPE_BULK,
+			.rxheld = !usbd->outep[i].ptr
+		};
+		uint16_t rxcount = (union rxcount_){.num_block = SetRxNumBlock(rxsize), .count = CNT_INVALID}.v;
+		bufdesc[i].TxAddress = addr;
+		bufdesc[i].TxCount = dbs->out ? rxcount : 0;	// double-buffered Out: both buffers used for reception
+		addr += dbs->out ? rxsize : txsize;
 		bufdesc[i].RxAddress = addr;
-		bufdesc[i].RxCount.v = (union rxcount_){.num_block = SetRxNumBlock(rxsize), .count = CNT_INVALID}.v;
-        addr += rxsize;
+		bufdesc[i].RxCount.v = dbs->in ? 0 : rxcount;	// double-buffered In: both buffers used for transmission
+		addr += dbs->in ? txsize : rxsize;
 
 //        epr[i] = i | USB_EPR_EPTYPE((ind ? ind->bmAttributes : 0) | (outd ? outd->bmAttributes : 0))
 //			| (rxsize && usbd->outep[i].ptr ? USB_EPR_STATRX(USB_EPSTATE_VALID) : USB_EPR_STATRX(USB_EPSTATE_NAK))
 //			| USB_EPR_STATTX(USB_EPSTATE_NAK);
 
-        epr[i] = i | USB_EPR_EPTYPE((ind ? ind->bmAttributes : 0) | (outd ? outd->bmAttributes : 0));
+        epr[i] = i | USB_EPR_EPTYPE((ind ? ind->bmAttributes : 0) | (outd ? outd->bmAttributes : 0))
+			| (dbs->out || dbs->in ? USB_EP_KIND : 0);
         uint32_t epstate = (rxsize && usbd->outep[i].ptr ? USB_EPR_STATRX(USB_EPSTATE_VALID) : USB_EPR_STATRX(USB_EPSTATE_NAK))
 			| USB_EPR_STATTX(USB_EPSTATE_NAK);
+		if (dbs->out)	// always valid, unused Tx disabled, SW_BUF = 1 - hw receives to buffer 0
+			epstate = USB_EPR_STATRX(USB_EPSTATE_VALID) | USB_EPR_STATTX(USB_EPSTATE_DISABLE) | USB_EP_DTOG_TX;
+		else if (dbs->in)	// unused Rx disabled
+			epstate = USB_EPR_STATRX(USB_EPSTATE_DISABLE) | USB_EPR_STATTX(USB_EPSTATE_NAK);
 		SetEPRState(usbd, i, USB_EPRX_STAT | USB_EPTX_STAT | USB_EP_DTOG_TX | USB_EP_DTOG_RX, epstate);
 	}
 }
@@ -252,6 +304,7 @@ void USBhw_ResetCfg(const struct usbdevice_ *usbd)
 			USB_EPR_STATRX(USB_EPSTATE_NAK) | USB_EPR_STATTX(USB_EPSTATE_NAK));
 	}
     reset_in_endpoints(usbd);
+    memset(dbstate, 0, sizeof(dbstate));
 }
 
 // Driver functions called from other modules ============================
@@ -291,38 +344,108 @@ static uint16_t USBhw_GetInEPSize(const struct usbdevice_ *usbd, uint8_t epn)
 	return bufdesc->RxAddress - bufdesc->TxAddress;
 }
 
-// write data packet to be sent
-static void USBhw_WriteTxData(const struct usbdevice_ *usbd, uint8_t epn)
+static uint16_t USBhw_GetFrameNum(const struct usbdevice_ *usbd)
+{
+	USBh_TypeDef *usb = (USBh_TypeDef *)usbd->usb;
+
+	return usb->FNR & USB_FNR_FN;
+}
+
+// write data packet to be sent to buffer n
+static void USBhw_WriteTxData(const struct usbdevice_ *usbd, uint8_t epn, bool n)
 {
 	USBh_TypeDef *usb = (USBh_TypeDef *)usbd->usb;
 	struct epdata_ *epd = &usbd->inep[epn];
+	PMAreg *bd = pmabuf(usb, epn, n);
 	uint16_t epsize = usbd->hwif->GetInEPSize(usbd, epn);
 	uint16_t bcount = MIN(epd->count, epsize);
-	usb->PMA.BUFDESC[epn].TxCount = bcount;
+	bd[1] = bcount;
+	USBdev_CountPacket(usbd, epn | EP_IS_IN, bcount);
 
 	if (bcount)
 	{
 		epd->count -= bcount;
-		volatile uint16_t *dest = &usb->PMA.PMA[(usb->PMA.BUFDESC[epn].TxAddress) / 2];
-		const uint8_t *src = epd->ptr;
-		while (bcount)
+		volatile uint16_t *dest = &usb->PMA.PMA[bd[0] / 2];
+		USBdev_NextTxSegment(epd);
+		if (bcount <= epd->seglen)
 		{
-			uint16_t v = *src++;
-			if (--bcount)
+			// packet within current segment
+			const uint8_t *src = epd->ptr;
+			epd->seglen -= bcount;
+			while (bcount)
 			{
-				v |= *src++ << 8;
-				--bcount;
+				uint16_t v = *src++;
+				if (--bcount)
+				{
+					v |= *src++ << 8;
+					--bcount;
+				}
+				*dest++ = v;
 			}
-			*dest++ = v;
+			epd->ptr = (uint8_t *)src;
 		}
-		epd->ptr = (uint8_t *)src;
+		else
+		{
+			// packet straddles segment boundary
+			while (bcount)
+			{
+				uint16_t v = USBdev_TxByte(epd);
+				if (--bcount)
+				{
+					v |= USBdev_TxByte(epd) << 8;
+					--bcount;
+				}
+				*dest++ = v;
+			}
+		}
+	}
+}
+
+// double-buffered In: write next packet to buffer n, release it after the current one is sent
+static void dbtx_prefill(const struct usbdevice_ *usbd, uint8_t epn, bool n)
+{
+	struct epdata_ *epd = &usbd->inep[epn];
+	if (epd->count || epd->sendzlp)
+	{
+		if (epd->count == 0)
+			epd->sendzlp = 0;	// ZLP
+		USBhw_WriteTxData(usbd, epn, n);
+		dbstate[epn].txpre = 1;
+	}
+}
+
+// stop In transfer in progress - packets written to PMA are not sent, pending completion dropped;
+// valid endpoint set to NAK, stall kept
+static void USBhw_AbortTx(const struct usbdevice_ *usbd, uint8_t epn)
+{
+	USBh_TypeDef *usb = (USBh_TypeDef *)usbd->usb;
+	epn &= EPNUMMSK;
+    volatile uint32_t *epr = &usb->EPR[epn];
+	if ((*epr & USB_EPTX_STAT) == USB_EPR_STATTX(USB_EPSTATE_VALID))
+		USBhw_SetEPState(usbd, epn | EP_IS_IN, USB_EPSTATE_NAK);
+	*epr = (*epr & USB_EPR_CFG) | (USB_EPR_FLAGS & ~USB_EP_CTR_TX);	// clear CTR_TX
+	if (dbstate[epn].in)
+	{
+		// both buffers empty: SW_BUF = hw buffer, data toggle unchanged
+		dbstate[epn].txpre = 0;
+		SetEPRState(usbd, epn, USB_EP_DTOG_RX, *epr & USB_EP_DTOG_TX ? USB_EP_DTOG_RX : 0);
 	}
 }
 
 static void USBhw_StartTx(const struct usbdevice_ *usbd, uint8_t epn)
 {
+	USBh_TypeDef *usb = (USBh_TypeDef *)usbd->usb;
 	epn &= EPNUMMSK;
-    USBhw_WriteTxData(usbd, epn);
+	if (dbstate[epn].in)
+	{
+		// fill both buffers before releasing the first one
+		bool swbuf = usb->EPR[epn] & USB_EP_DTOG_RX;
+		USBhw_WriteTxData(usbd, epn, swbuf);
+		dbtx_prefill(usbd, epn, !swbuf);
+		SetEPRState(usbd, epn, 0, USB_EP_DTOG_RX);	// toggle SW_BUF
+	}
+	else
+		USBhw_WriteTxData(usbd, epn, 0);
     if (epn == 0 && usbd->inep[0].ptr && usbd->inep[0].count == 0)
     {
     	// last data packet sent over control ep - prepare for status out
@@ -334,22 +457,58 @@ static void USBhw_StartTx(const struct usbdevice_ *usbd, uint8_t epn)
 
 // USB ISR and related private functions =================================
 
-// read received data packet
-static void USBhw_ReadRxData(const struct usbdevice_ *usbd, uint8_t epn)
+// read received data packet from buffer n, return true if the packet fills the buffer
+// multi-packet transfer: append to data received so far, discard data not fitting in buffer
+static bool USBhw_ReadRxData(const struct usbdevice_ *usbd, uint8_t epn, bool n)
 {
 	USBh_TypeDef *usb = (USBh_TypeDef *)usbd->usb;
+	struct epdata_ *epd = &usbd->outep[epn];
+	PMAreg *bd = pmabuf(usb, epn, n);
+	volatile union rxcount_ *rxcount = (volatile union rxcount_ *)&bd[1];
 	
 	// count field in EP descriptor is updated with some delay (H503 errata), so do something else first
-	uint8_t *dst = usbd->outep[epn].ptr;
-	const volatile uint8_t *src = (const volatile uint8_t *)usb->PMA.PMA + usb->PMA.BUFDESC[epn].RxAddress;
-	uint16_t bcount;
+	uint8_t *dst = epd->ptr;
+	const volatile uint8_t *src = (const volatile uint8_t *)usb->PMA.PMA + bd[0];
+	uint16_t pktsize, bcount;
 	// "wait for descriptor update"
-	while ((bcount = usb->PMA.BUFDESC[epn].RxCount.count) == CNT_INVALID) ;
-	usbd->outep[epn].count = bcount;
-	//memcpy(usbd->outep[epn].ptr, src, bcount);
+	while ((pktsize = rxcount->count) == CNT_INVALID) ;
+	USBdev_CountPacket(usbd, epn, pktsize);
+	bcount = pktsize;
+	if (epd->length)
+	{
+		uint16_t room = epd->length - epd->count;
+		dst += epd->count;
+		if (bcount > room)
+			bcount = room;
+		epd->count += bcount;
+	}
+	else
+		epd->count = bcount;
+	//memcpy(dst, src, bcount);
 	for (uint16_t i = 0; i < bcount; i++)
 		*dst++ = *src++;
-	usb->PMA.BUFDESC[epn].RxCount.count = CNT_INVALID;
+	rxcount->count = CNT_INVALID;
+	return pktsize == GetRxBufSize(rxcount->num_block);
+}
+
+// Out packet read - continue multi-packet transfer or call the handler
+static void rx_done(const struct usbdevice_ *usbd, uint8_t epn, bool full, bool setup)
+{
+	const struct epdata_ *epd = &usbd->outep[epn];
+	if (full && epd->length > epd->count)
+		USBhw_EnableRx(usbd, epn);	// multi-packet transfer continues
+	else
+		USBdev_OutEPHandler(usbd, epn, setup);
+}
+
+// double-buffered Out: release app buffer to hw, take the one filled by hw
+static void dbrx_take(const struct usbdevice_ *usbd, uint8_t epn)
+{
+	USBh_TypeDef *usb = (USBh_TypeDef *)usbd->usb;
+	dbstate[epn].rxpend = 0;
+	dbstate[epn].rxheld = 1;
+	SetEPRState(usbd, epn, 0, USB_EP_DTOG_TX);	// toggle SW_BUF
+	rx_done(usbd, epn, USBhw_ReadRxData(usbd, epn, usb->EPR[epn] & USB_EP_DTOG_TX), 0);
 }
 
 static void USBhw_IRQHandler(const struct usbdevice_ *usbd)
@@ -369,6 +528,7 @@ static void USBhw_IRQHandler(const struct usbdevice_ *usbd)
             {
             	// resume (not reset)
                 // callback...
+                USBlog_event(ULE_RESUME, 0, 0, 0);
                 if (usbd->Resume_Handler)
                 	usbd->Resume_Handler();
             }
@@ -379,10 +539,15 @@ static void USBhw_IRQHandler(const struct usbdevice_ *usbd)
 	{
         usb->ISTR = ~USB_ISTR_RESET;
         USBhw_Reset(usbd);
+        USBlog_event(ULE_RESET, 0, 0, 0);
         if (usbd->Reset_Handler)
         	usbd->Reset_Handler();
         return;
     }
+    // double-buffered Out endpoints released by app with packet waiting
+    for (uint8_t epn = 1; epn < usbd->cfg->numeppairs; epn++)
+    	if (dbstate[epn].rxpend && !dbstate[epn].rxheld)
+    		dbrx_take(usbd, epn);
     if (istr & USB_ISTR_CTR)	// EP traffic interrupt
 	{
 		uint8_t  epn = usb->ISTR & USB_ISTR_EP_ID;
@@ -394,7 +559,18 @@ static void USBhw_IRQHandler(const struct usbdevice_ *usbd)
 			*epr = (eprv & USB_EPR_CFG) | (USB_EPR_FLAGS & ~USB_EP_CTR_TX);		// clear CTR_TX
 			struct epdata_ *epd = &usbd->inep[epn];
 
-			if (epd->count)	// Continue sending
+			if (dbstate[epn].in)
+			{
+				if (dbstate[epn].txpre)	// release written packet, write the next one
+				{
+					dbstate[epn].txpre = 0;
+					SetEPRState(usbd, epn, 0, USB_EP_DTOG_RX);	// toggle SW_BUF
+					dbtx_prefill(usbd, epn, *epr & USB_EP_DTOG_RX);
+				}
+				else	// In transfer completed
+					USBdev_InEPHandler(usbd, epn);
+			}
+			else if (epd->count)	// Continue sending
 			{
 				//USBlog_recordevt(0x10);
 				USBhw_StartTx(usbd, epn);
@@ -413,9 +589,20 @@ static void USBhw_IRQHandler(const struct usbdevice_ *usbd)
 		}
 		if (eprv & USB_EP_CTR_RX)	// data received on Out endpoint
 		{
-			USBhw_ReadRxData(usbd, epn);
-			*epr = (eprv & USB_EPR_CFG) | (USB_EPR_FLAGS & ~USB_EP_CTR_RX);		// clear CTR_RX
-			USBdev_OutEPHandler(usbd, epn, eprv & USB_EP_SETUP);
+			if (dbstate[epn].out)
+			{
+				*epr = (eprv & USB_EPR_CFG) | (USB_EPR_FLAGS & ~USB_EP_CTR_RX);		// clear CTR_RX
+				if (dbstate[epn].rxheld)
+					dbstate[epn].rxpend = 1;	// leave it in PMA until app enables Rx
+				else
+					dbrx_take(usbd, epn);
+			}
+			else
+			{
+				bool full = USBhw_ReadRxData(usbd, epn, 1);
+				*epr = (eprv & USB_EPR_CFG) | (USB_EPR_FLAGS & ~USB_EP_CTR_RX);		// clear CTR_RX
+				rx_done(usbd, epn, full, eprv & USB_EP_SETUP);
+			}
 		}
 	}
     if (istr & USB_ISTR_SUSP)	// suspend
@@ -427,6 +614,7 @@ static void USBhw_IRQHandler(const struct usbdevice_ *usbd)
         reset_in_endpoints(usbd);
 
         // callback...
+        USBlog_event(ULE_SUSPEND, 0, 0, 0);
         if (usbd->Suspend_Handler)
         	usbd->Suspend_Handler();
        return;
@@ -447,6 +635,7 @@ const struct USBhw_services_ l0_fs_services = {
 	.Init = USBhw_Init,
 	.DeInit = USBhw_DeInit,
 	.GetInEPSize = USBhw_GetInEPSize,
+	.GetFrameNum = USBhw_GetFrameNum,
 
 	.SetCfg = USBhw_SetCfg,
 	.ResetCfg = USBhw_ResetCfg,
@@ -458,6 +647,7 @@ const struct USBhw_services_ l0_fs_services = {
 	.EnableCtlSetup = USBhw_EnableCtlSetup,
 	.EnableRx = USBhw_EnableRx,
 	.StartTx = USBhw_StartTx,
+	.AbortTx = USBhw_AbortTx,
 };
 
 #endif
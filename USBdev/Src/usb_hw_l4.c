@@ -31,11 +31,34 @@
 #include "usb_desc_def.h"
 #include "usb_dev.h"
 #include "usb_hw_if.h"
+#include "usb_log.h"
 
 #define STUPCNT0	(3u << USB_OTG_DOEPTSIZ_STUPCNT_Pos)	// to be used for DOEPTSIZ0
 
+#ifdef RCC_AHB2ENR1_OTGHSPHYEN
+#define FIFO_WORDS	1024u	// U5 OTG HS
+#else
 #define FIFO_WORDS	320u	// total FIFO memory size in 32-bit words
-// 1024 words for U5 OTG HS
+#endif
+
+// Multi-packet In transfers on app endpoints - whole transfer programmed at once,
+// Tx FIFO refilled on TxFIFO empty interrupt, single XFRC at the end
+#ifndef OTG_MULTIPACKET_IN
+#define OTG_MULTIPACKET_IN	1
+#endif
+#define OTG_BULK_TXFIFO_PKTS	4u	// max. Tx FIFO size of bulk In endpoint in packets
+#define OTG_MAX_PKTCNT	1023u	// DIEPTSIZ PKTCNT field limit
+
+// In traffic statistics - packets written to FIFO and In interrupts per endpoint
+// define OTG_TXSTAT to measure packets per interrupt
+#ifdef OTG_TXSTAT
+struct otg_txstat_ {
+	uint32_t packets, irqs;
+} otg_txstat[USB_NEPPAIRS];
+#define TXSTAT_INC(epn, field)	(++otg_txstat[epn].field)
+#else
+#define TXSTAT_INC(epn, field)
+#endif
 
 #define USB_OTG_CORE_ID_300A          0x4F54300AU
 #define USB_OTG_CORE_ID_310A          0x4F54310AU	// L476
@@ -102,8 +125,13 @@ static void USBhw_Init(const struct usbdevice_ *usbd)
 	usbg->GCCFG |= USB_OTG_GCCFG_NOVBUSSENS;	// disable VBUS sense
     usbg->GOTGCTL |= USB_OTG_GOTGCTL_BSVLD;
 #endif
+#if OTG_MULTIPACKET_IN
+	// TxFIFO empty int when completely empty - half-empty level would retrigger continuously
+	// on single-packet FIFO with no room for the next packet
+	usbg->GAHBCFG = USB_OTG_GAHBCFG_GINT | USB_OTG_GAHBCFG_TXFELVL;
+#else
 	usbg->GAHBCFG = USB_OTG_GAHBCFG_GINT;
-//	usbg->GAHBCFG = USB_OTG_GAHBCFG_GINT | USB_OTG_GAHBCFG_TXFELVL;
+#endif
 
 	usbg->GINTSTS = 0xBFFFFFFFU;
 	// RM 47.16.3
@@ -157,6 +185,13 @@ static uint16_t USBhw_GetInEPSize(const struct usbdevice_ *usbd, uint8_t epn)
 	return epn ? inepsize : 64 >> (inepsize & 3);	// EP size = 8
 }
 
+static uint16_t USBhw_GetFrameNum(const struct usbdevice_ *usbd)
+{
+	USB_OTG_TypeDef *usb = (USB_OTG_TypeDef *)usbd->usb;
+
+	return (usb->Device.DSTS & USB_OTG_DSTS_FNSOF) >> USB_OTG_DSTS_FNSOF_Pos;
+}
+
 // not exactly correct rework needed
 static void USBhw_SetEPStall(const struct usbdevice_ *usbd, uint8_t epaddr)
 {
@@ -169,6 +204,7 @@ static void USBhw_SetEPStall(const struct usbdevice_ *usbd, uint8_t epaddr)
 	{
 		usb->OutEP[epaddr & EPNUMMSK].DOEPCTL |= USB_OTG_DOEPCTL_USBAEP | USB_OTG_DOEPCTL_STALL;
 	}
+	USBdev_CountStall(usbd, epaddr);
 }
 
 // clear data toggle - required by unstall request
@@ -198,14 +234,29 @@ static bool USBhw_IsEPStalled(const struct usbdevice_ *usbd, uint8_t epaddr)
 /*
  * Endpoint deactivates itself when packet count is decremented to 0 or setup phase is done.
  * Reception of setup packet sets NAK.
+ * Multi-packet transfer (outep length set) is programmed for the number of packets needed
+ * to receive the remaining length; short packet terminates the transfer.
  */
 static void USBhw_EnableRx(const struct usbdevice_ *usbd, uint8_t epn)
 {
 	USB_OTG_TypeDef *usb = (USB_OTG_TypeDef *)usbd->usb;
-	USB_OTG_OUTEndpointTypeDef *outep = &usb->OutEP[epn & EPNUMMSK];
-	outep->DOEPTSIZ = epn
-		? 1u << USB_OTG_DOEPTSIZ_PKTCNT_Pos | (outep->DOEPCTL & USB_OTG_DOEPCTL_MPSIZ_Msk)	// 1 packet, max. size
-		: STUPCNT0 | 1u << USB_OTG_DOEPTSIZ_PKTCNT_Pos
+	epn &= EPNUMMSK;
+	USB_OTG_OUTEndpointTypeDef *outep = &usb->OutEP[epn];
+	if (epn)
+	{
+		const struct epdata_ *epd = &usbd->outep[epn];
+		uint32_t epsize = outep->DOEPCTL & USB_OTG_DOEPCTL_MPSIZ_Msk;
+		uint32_t npackets = 1;	// 1 packet, max. size
+		if (epd->length > epd->count)
+		{
+			npackets = (epd->length - epd->count + epsize - 1) / epsize;
+			if (npackets > OTG_MAX_PKTCNT)
+				npackets = OTG_MAX_PKTCNT;
+		}
+		outep->DOEPTSIZ = npackets << USB_OTG_DOEPTSIZ_PKTCNT_Pos | npackets * epsize;
+	}
+	else
+		outep->DOEPTSIZ = STUPCNT0 | 1u << USB_OTG_DOEPTSIZ_PKTCNT_Pos
 			| usbd->cfg->devdesc->bMaxPacketSize0;	// 1 data packet, get ready for setup as well
 	outep->DOEPCTL |= USB_OTG_DOEPCTL_EPENA | USB_OTG_DOEPCTL_CNAK;
 }
@@ -238,6 +289,9 @@ static uint8_t ep0siz_enc(uint8_t s)
 
 static void reset_in_endpoints(const struct usbdevice_ *usbd)
 {
+	USB_OTG_TypeDef *usb = (USB_OTG_TypeDef *)usbd->usb;
+	usb->Device.DIEPEMPMSK = 0;
+	USBdev_AbortTransfers(usbd);
 	memset(usbd->inep, 0, sizeof(struct epdata_) * usbd->cfg->numeppairs);
 }
 
@@ -291,6 +345,13 @@ static void USBhw_EnumDone(const struct usbdevice_ *usbd)
 		| USB_OTG_DOEPINT_OTEPDIS | USB_OTG_DOEPINT_STUP \
 		| USB_OTG_DOEPINT_EPDISD | USB_OTG_DOEPINT_XFRC)
 
+// convert endpoint size to endpoint buffer size in 32-bit words
+static uint16_t txfifo_size(uint16_t epsize)
+{
+	uint16_t fifosize = (epsize + 3) / 4;
+	return fifosize < 16 ? 16 : fifosize;
+}
+
 // setup and enable app endpoints on set configuration request
 static void USBhw_SetCfg(const struct usbdevice_ *usbd)
 {
@@ -302,6 +363,18 @@ static void USBhw_SetCfg(const struct usbdevice_ *usbd)
 	const struct usbdcfg_ *cfg = usbd->cfg;
     uint16_t addr = (usbg->DIEPTXF0_HNPTXFSIZ & USB_OTG_DIEPTXF_INEPTXSA_Msk)
     	+ ((usbg->DIEPTXF0_HNPTXFSIZ & USB_OTG_DIEPTXF_INEPTXFD_Msk) >> USB_OTG_DIEPTXF_INEPTXFD_Pos);
+#if OTG_MULTIPACKET_IN
+	// FIFO memory left after minimum allocation is shared by bulk In endpoints;
+	// none if the minimum allocation does not fit
+	int32_t minwords = addr;
+    for (uint8_t i = 1; i < cfg->numeppairs; i++)
+    {
+    	const struct USBdesc_ep_ *inepdesc = USBdev_GetEPDescriptor(usbd, i | EP_IS_IN);
+    	if (inepdesc)
+    		minwords += txfifo_size(getusb16(&inepdesc->wMaxPacketSize));
+    }
+	uint16_t spare = minwords < (int32_t)FIFO_WORDS ? FIFO_WORDS - minwords : 0;
+#endif
 
 	// enable app endpoints
     for (uint8_t i = 1; i < cfg->numeppairs; i++)
@@ -310,12 +383,19 @@ static void USBhw_SetCfg(const struct usbdevice_ *usbd)
 
     	const struct USBdesc_ep_ *inepdesc = USBdev_GetEPDescriptor(usbd, i | EP_IS_IN);
 		uint16_t txsize = inepdesc ? getusb16(&inepdesc->wMaxPacketSize) : 0;
-		// convert endpoint size to endpoint buffer size in 32-bit words
-		uint16_t fifosize = (txsize + 3) / 4;
-		if (fifosize < 16)
-			fifosize = 16;
+		uint16_t fifosize = txfifo_size(txsize);
 		if (txsize)	// in bytes
 		{
+#if OTG_MULTIPACKET_IN
+			if ((inepdesc->bmAttributes & 3) == USBD_EP_TYPE_BULK)
+			{
+				// room for more packets, so that the bus is not idle while FIFO is refilled
+				uint16_t pktwords = (txsize + 3) / 4;
+				uint16_t extra = MIN(spare / pktwords, OTG_BULK_TXFIFO_PKTS - 1) * pktwords;
+				spare -= extra;
+				fifosize += extra;
+			}
+#endif
 			usbg->DIEPTXF[i - 1] = fifosize << USB_OTG_DIEPTXF_INEPTXFD_Pos | addr;	// set also for unused EP
 			usbg->GRSTCTL = i << USB_OTG_GRSTCTL_TXFNUM_Pos | USB_OTG_GRSTCTL_TXFFLSH;
 			InEP[i].DIEPCTL = USB_OTG_DIEPCTL_SD0PID_SEVNFRM | i << USB_OTG_DIEPCTL_TXFNUM_Pos
@@ -366,29 +446,98 @@ static void USBhw_WriteTxFIFO(const struct usbdevice_ *usbd, uint8_t epn, uint16
 	if (bcount)
 	{
 		struct epdata_ *epd = &usbd->inep[epn];
-		const uint8_t *src = epd->ptr;
 		volatile uint32_t *dest = usb->FIFO[epn];
+		USBdev_CountPacket(usbd, epn | EP_IS_IN, bcount);
 		epd->count -= bcount;
-		while (bcount)
+		USBdev_NextTxSegment(epd);
+		if (bcount <= epd->seglen)
 		{
-			uint32_t v = *src++;
-			if (--bcount)
+			// packet within current segment
+			const uint8_t *src = epd->ptr;
+			epd->seglen -= bcount;
+			while (bcount)
 			{
-				v |= *src++ << 8;
+				uint32_t v = *src++;
 				if (--bcount)
 				{
-					v |= *src++ << 16;
+					v |= *src++ << 8;
 					if (--bcount)
 					{
-						v |= *src++ << 24;
-						--bcount;
+						v |= *src++ << 16;
+						if (--bcount)
+						{
+							v |= *src++ << 24;
+							--bcount;
+						}
 					}
 				}
+				*dest = v;
+			}
+			epd->ptr = (uint8_t *)src;	// update src pointer
+		}
+		else
+		{
+			// packet straddles segment boundary
+			uint32_t v = 0;
+			uint8_t shift = 0;
+			while (bcount--)
+			{
+				v |= (uint32_t)USBdev_TxByte(epd) << shift;
+				if ((shift += 8) == 32)
+				{
+					*dest = v;
+					v = 0;
+					shift = 0;
+				}
 			}
-			*dest = v;
+			if (shift)
+				*dest = v;
 		}
-		epd->ptr = (uint8_t *)src;	// update src pointer
+		TXSTAT_INC(epn, packets);
+	}
+}
+
+#if OTG_MULTIPACKET_IN
+// write as many packets as Tx FIFO can hold, disable FIFO empty int when all data is written
+static void USBhw_FillTxFIFO(const struct usbdevice_ *usbd, uint8_t epn)
+{
+	USB_OTG_TypeDef *usb = (USB_OTG_TypeDef *)usbd->usb;
+	USB_OTG_INEndpointTypeDef *inep = &usb->InEP[epn];
+	struct epdata_ *epd = &usbd->inep[epn];
+	uint16_t epsize = USBhw_GetInEPSize(usbd, epn);
+	uint16_t bcount;
+
+	while ((bcount = MIN(epd->count, epsize))
+		&& (inep->DTXFSTS & USB_OTG_DTXFSTS_INEPTFSAV) >= (bcount + 3) / 4u)
+		USBhw_WriteTxFIFO(usbd, epn, bcount);
+	if (epd->count)
+		usb->Device.DIEPEMPMSK |= 1u << epn;
+	else
+		usb->Device.DIEPEMPMSK &= ~(1u << epn);
+}
+#endif
+
+// stop In transfer in progress: disable endpoint, flush its Tx FIFO, drop pending completion;
+// endpoint left NAKing, stall kept
+static void USBhw_AbortTx(const struct usbdevice_ *usbd, uint8_t epn)
+{
+	USB_OTG_TypeDef *usb = (USB_OTG_TypeDef *)usbd->usb;
+	USB_OTG_GlobalTypeDef *usbg = (USB_OTG_GlobalTypeDef *)usbd->usb;
+	epn &= EPNUMMSK;
+	USB_OTG_INEndpointTypeDef *inep = &usb->InEP[epn];
+
+	usb->Device.DIEPEMPMSK &= ~(1u << epn);
+	inep->DIEPCTL |= USB_OTG_DIEPCTL_SNAK;
+	if (inep->DIEPCTL & USB_OTG_DIEPCTL_EPENA)
+	{
+		while (~inep->DIEPINT & USB_OTG_DIEPINT_INEPNE) ;	// NAK effective
+		inep->DIEPCTL |= USB_OTG_DIEPCTL_EPDIS | USB_OTG_DIEPCTL_SNAK;
+		while (~inep->DIEPINT & USB_OTG_DIEPINT_EPDISD) ;
 	}
+	while (usbg->GRSTCTL & USB_OTG_GRSTCTL_TXFFLSH) ;
+	usbg->GRSTCTL = USB_OTG_GRSTCTL_TXFFLSH | epn << USB_OTG_GRSTCTL_TXFNUM_Pos;
+	while (usbg->GRSTCTL & USB_OTG_GRSTCTL_TXFFLSH) ;
+	inep->DIEPINT = USB_OTG_DIEPINT_INEPNE | USB_OTG_DIEPINT_EPDISD | USB_OTG_DIEPINT_XFRC;
 }
 
 static void USBhw_StartTx(const struct usbdevice_ *usbd, uint8_t epn)
@@ -424,6 +573,22 @@ static void USBhw_StartTx(const struct usbdevice_ *usbd, uint8_t epn)
 				USBhw_EnableRx(usbd, 0);	// prepare for status out and next setup
 	    	}
 	    }
+#if OTG_MULTIPACKET_IN
+	    else
+	    {
+	    	uint16_t npackets = epd->count ? (epd->count + epsize - 1) / epsize : 1;
+	    	if (npackets <= OTG_MAX_PKTCNT)	// otherwise single packets until the rest fits
+	    	{
+	    		// whole transfer, FIFO refilled on TxFIFO empty int
+	    		inep->DIEPTSIZ = npackets << USB_OTG_DIEPTSIZ_PKTCNT_Pos | epd->count;
+	    		if (epd->count == 0)
+	    			USBdev_CountPacket(usbd, epn | EP_IS_IN, 0);	// ZLP, no FIFO write
+	    		inep->DIEPCTL = (inep->DIEPCTL & ~USB_OTG_DIEPCTL_STALL) | USB_OTG_DIEPCTL_EPENA | USB_OTG_DIEPCTL_CNAK;
+	    		USBhw_FillTxFIFO(usbd, epn);
+	    		return;
+	    	}
+	    }
+#endif
 		inep->DIEPTSIZ = 1u << USB_OTG_DIEPTSIZ_PKTCNT_Pos | bcount;	// single packet
 		inep->DIEPCTL = (inep->DIEPCTL & ~USB_OTG_DIEPCTL_STALL) | USB_OTG_DIEPCTL_EPENA | USB_OTG_DIEPCTL_CNAK;
 		if (bcount)
@@ -448,18 +613,33 @@ static void USBhw_StartTx(const struct usbdevice_ *usbd, uint8_t epn)
 #endif
 
 		}
-	//	if (epd->count)
-	//		usb->Device.DIEPEMPMSK |= 1u << epn;
+		else
+			USBdev_CountPacket(usbd, epn | EP_IS_IN, 0);	// ZLP
 	}
 }
 
 // read received data packet
+// multi-packet transfer: append to data received so far, discard data not fitting in buffer
 static void USBhw_ReadRxData(const struct usbdevice_ *usbd, uint8_t epn, uint16_t bcount)
 {
 	USB_OTG_TypeDef *usb = (USB_OTG_TypeDef *)usbd->usb;
 	volatile uint32_t *fifo = usb->FIFO[0];
-	usbd->outep[epn].count = bcount;
-	uint8_t *dest = usbd->outep[epn].ptr;
+	struct epdata_ *epd = &usbd->outep[epn];
+	uint8_t *dest = epd->ptr;
+	uint32_t wcount = (bcount + 3) / 4;
+
+	USBdev_CountPacket(usbd, epn, bcount);
+
+	if (epd->length)
+	{
+		uint16_t room = epd->length - epd->count;
+		dest += epd->count;
+		if (bcount > room)
+			bcount = room;
+		epd->count += bcount;
+	}
+	else
+		epd->count = bcount;
 
 	if (dest)
 	{
@@ -467,6 +647,7 @@ static void USBhw_ReadRxData(const struct usbdevice_ *usbd, uint8_t epn, uint16_
 		while (bcount)
 		{
 			uint32_t data = *fifo;
+			--wcount;
 			*dest++ = data & 0xff;
 			if (--bcount)
 			{
@@ -483,13 +664,9 @@ static void USBhw_ReadRxData(const struct usbdevice_ *usbd, uint8_t epn, uint16_
 			}
 		}
 	}
-	else
-	{
-		// just empty the fifo
-		uint32_t wcount = (bcount + 3) / 4;
-		while (wcount--)
-			*fifo;
-	}
+	// empty the rest of fifo
+	while (wcount--)
+		*fifo;
 }
 
 static void USBhw_IRQHandler(const struct usbdevice_ *usbd)
@@ -502,6 +679,7 @@ static void USBhw_IRQHandler(const struct usbdevice_ *usbd)
     if (gintsts & USB_OTG_GINTSTS_USBRST) // Reset
 	{
         USBhw_Reset(usbd);
+        USBlog_event(ULE_RESET, 0, 0, 0);
         if (usbd->Reset_Handler)
         	usbd->Reset_Handler();
     	usbg->GINTSTS = USB_OTG_GINTSTS_USBRST;
@@ -520,6 +698,7 @@ static void USBhw_IRQHandler(const struct usbdevice_ *usbd)
     if (gintsts & USB_OTG_GINTSTS_USBSUSP)
     {
         reset_in_endpoints(usbd);
+        USBlog_event(ULE_SUSPEND, 0, 0, 0);
         if (usbd->Suspend_Handler)
         	usbd->Suspend_Handler();
     	usbg->GINTSTS = USB_OTG_GINTSTS_USBSUSP;
@@ -527,6 +706,7 @@ static void USBhw_IRQHandler(const struct usbdevice_ *usbd)
     if (gintsts & USB_OTG_GINTSTS_WKUINT)
     {
     	usbg->GINTSTS = USB_OTG_GINTSTS_WKUINT;
+        USBlog_event(ULE_RESUME, 0, 0, 0);
         if (usbd->Resume_Handler)
         	usbd->Resume_Handler();
     }
@@ -564,21 +744,21 @@ static void USBhw_IRQHandler(const struct usbdevice_ *usbd)
     			{
     				*doepint = USB_OTG_DOEPINT_XFRC;
 #ifdef NEW_OTG
-    				if (usbg->GSNPSID == USB_OTG_CORE_ID_310A)
+    				if (usbg->GSNPSID == USB_OTG_CORE_ID_310A && (doepintv & USB_OTG_DOEPINT_STPKTRX))
+						*doepint = USB_OTG_DOEPINT_STPKTRX;
+    				else
+#endif
     				{
-    					if (doepintv & USB_OTG_DOEPINT_STPKTRX)
-							*doepint = USB_OTG_DOEPINT_STPKTRX;
+#ifdef NEW_OTG
+    					if (usbg->GSNPSID == USB_OTG_CORE_ID_310A && (doepintv & USB_OTG_DOEPINT_OTEPSPR))
+    						*doepint = USB_OTG_DOEPINT_OTEPSPR;
+#endif
+    					if (epn && usbd->outep[epn].length > usbd->outep[epn].count
+    						&& (usb->OutEP[epn].DOEPTSIZ & USB_OTG_DOEPTSIZ_XFRSIZ) == 0)
+    						USBhw_EnableRx(usbd, epn);	// packet count limit reached, no short packet yet
     					else
-    					{
-    						if (doepintv & USB_OTG_DOEPINT_OTEPSPR)
-    							*doepint = USB_OTG_DOEPINT_OTEPSPR;
-
-        					USBdev_OutEPHandler(usbd, epn, 0);
-    					}
+    						USBdev_OutEPHandler(usbd, epn, 0);
     				}
-    				else
-#endif
-    					USBdev_OutEPHandler(usbd, epn, 0);
     			}
 
     			if (doepintv & USB_OTG_DOEPINT_STUP)
@@ -620,6 +800,7 @@ static void USBhw_IRQHandler(const struct usbdevice_ *usbd)
     		{
     			volatile uint32_t *diepint = &usb->InEP[epn].DIEPINT;
     			uint32_t diepintv = *diepint;
+    			TXSTAT_INC(epn, irqs);
     			// handle XFR, TXFE and EP disable ints
     			if (diepintv & USB_OTG_DIEPINT_XFRC)
     			{
@@ -639,10 +820,10 @@ static void USBhw_IRQHandler(const struct usbdevice_ *usbd)
 					else	// In transfer completed
 						USBdev_InEPHandler(usbd, epn);
 				}
-#if 0
+#if OTG_MULTIPACKET_IN
 				if ((diepintv & USB_OTG_DIEPINT_TXFE) && (usb->Device.DIEPEMPMSK >> epn & 1))
 				{
-					USBhw_WriteTxFIFO(usbd, epn);
+					USBhw_FillTxFIFO(usbd, epn);	// TXFE is read-only, cleared by writing to FIFO
 				}
 #endif
     			if (diepintv & USB_OTG_DIEPINT_EPDISD)
@@ -661,6 +842,7 @@ const struct USBhw_services_ l4_otgfs_services = {
 	.Init = USBhw_Init,
 	.DeInit = USBhw_DeInit,
 	.GetInEPSize = USBhw_GetInEPSize,
+	.GetFrameNum = USBhw_GetFrameNum,
 
 	.SetCfg = USBhw_SetCfg,
 	.ResetCfg = USBhw_ResetCfg,
@@ -672,6 +854,7 @@ const struct USBhw_services_ l4_otgfs_services = {
 	.EnableCtlSetup = USBhw_EnableCtlSetup,
 	.EnableRx = USBhw_EnableRx,
 	.StartTx = USBhw_StartTx,
+	.AbortTx = USBhw_AbortTx,
 };
 
 #endif
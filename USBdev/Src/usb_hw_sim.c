@@ -0,0 +1,626 @@
+/*
+ * lightweight USB device stack by gbm
+ * usb_hw_sim.c - simulated USB device controller and NVIC for running the stack on a workstation
+ * Copyright (c) 2024 gbm
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef USBD_SIM
+
+#include <string.h>	// memset(), memcpy()
+#include "usb_dev_config.h"
+#include "usb_desc_def.h"
+#include "usb_dev.h"
+#include "usb_hw_if.h"
+#include "usb_log.h"
+#include "usb_hw_sim.h"
+
+//========================================================================
+// NVIC emulation
+// lower value - higher priority, thread level has priority below any interrupt
+
+#define THREAD_PRI	256u
+
+static void Default_Handler(void)
+{
+}
+
+void SIM_USB_IRQHandler(void) __attribute__ ((weak, alias("Default_Handler")));
+void SIM_SW0_IRQHandler(void) __attribute__ ((weak, alias("Default_Handler")));
+void SIM_SW1_IRQHandler(void) __attribute__ ((weak, alias("Default_Handler")));
+void SIM_SW2_IRQHandler(void) __attribute__ ((weak, alias("Default_Handler")));
+void SIM_SW3_IRQHandler(void) __attribute__ ((weak, alias("Default_Handler")));
+void SIM_SW4_IRQHandler(void) __attribute__ ((weak, alias("Default_Handler")));
+void SIM_SW5_IRQHandler(void) __attribute__ ((weak, alias("Default_Handler")));
+void SIM_SW6_IRQHandler(void) __attribute__ ((weak, alias("Default_Handler")));
+void SIM_SW7_IRQHandler(void) __attribute__ ((weak, alias("Default_Handler")));
+
+static void (* const vectors[SIM_NUM_IRQS])(void) = {
+	SIM_USB_IRQHandler,
+	SIM_SW0_IRQHandler, SIM_SW1_IRQHandler, SIM_SW2_IRQHandler, SIM_SW3_IRQHandler,
+	SIM_SW4_IRQHandler, SIM_SW5_IRQHandler, SIM_SW6_IRQHandler, SIM_SW7_IRQHandler,
+};
+
+static struct nvic_ {
+	bool enabled[SIM_NUM_IRQS];
+	bool pending[SIM_NUM_IRQS];
+	uint8_t priority[SIM_NUM_IRQS];
+	bool primask;
+	uint16_t execpri;	// priority of code being executed
+} nvic = {.execpri = THREAD_PRI};
+
+// run pending interrupts with priority higher than the current one, highest first
+static void nvic_dispatch(void)
+{
+	while (!nvic.primask)
+	{
+		int8_t irq = -1;
+		for (uint8_t i = 0; i < SIM_NUM_IRQS; i++)
+			if (nvic.pending[i] && nvic.enabled[i] && nvic.priority[i] < nvic.execpri
+				&& (irq < 0 || nvic.priority[i] < nvic.priority[irq]))
+				irq = i;
+		if (irq < 0)
+			break;
+		uint16_t prevpri = nvic.execpri;
+		nvic.pending[irq] = 0;
+		nvic.execpri = nvic.priority[irq];
+		vectors[irq]();
+		nvic.execpri = prevpri;
+	}
+}
+
+void NVIC_EnableIRQ(IRQn_Type irqn)
+{
+	nvic.enabled[irqn] = 1;
+	nvic_dispatch();
+}
+
+void NVIC_DisableIRQ(IRQn_Type irqn)
+{
+	nvic.enabled[irqn] = 0;
+}
+
+uint32_t NVIC_GetEnableIRQ(IRQn_Type irqn)
+{
+	return nvic.enabled[irqn];
+}
+
+void NVIC_SetPendingIRQ(IRQn_Type irqn)
+{
+	nvic.pending[irqn] = 1;
+	nvic_dispatch();
+}
+
+void NVIC_ClearPendingIRQ(IRQn_Type irqn)
+{
+	nvic.pending[irqn] = 0;
+}
+
+uint32_t NVIC_GetPendingIRQ(IRQn_Type irqn)
+{
+	return nvic.pending[irqn];
+}
+
+void NVIC_SetPriority(IRQn_Type irqn, uint32_t priority)
+{
+	nvic.priority[irqn] = priority;
+	nvic_dispatch();
+}
+
+void __disable_irq(void)
+{
+	nvic.primask = 1;
+}
+
+void __enable_irq(void)
+{
+	nvic.primask = 0;
+	nvic_dispatch();
+}
+
+uint32_t __get_PRIMASK(void)
+{
+	return nvic.primask;
+}
+
+void __set_PRIMASK(uint32_t primask)
+{
+	nvic.primask = primask & 1;
+	nvic_dispatch();
+}
+
+//========================================================================
+// simulated FS device controller
+// single-buffered endpoints with FS-like handshake rules:
+// packet transfer sets ep state to NAK, setup is always accepted
+// data toggles are not modeled
+
+#define SIM_PKT_SIZE	64u
+
+struct simep_ {
+	uint8_t rxstate, txstate;	// enum usb_epstate_
+	uint16_t rxsize, txsize;	// max packet size
+	uint16_t rxcount, txcount;	// size of packet in buffer
+	uint8_t rxtype, txtype;	// transfer type, for capture only
+	bool ctr_rx, ctr_tx, setup;	// transfer complete flags
+	uint8_t rxbuf[SIM_PKT_SIZE], txbuf[SIM_PKT_SIZE];
+};
+
+struct usbsim_periph_ {
+	bool pullup;
+	uint8_t addr;
+	bool reset, suspend, resume, sof;	// bus event flags
+	uint16_t frame;	// frame number of last SOF
+	struct simep_ ep[USB_NEPPAIRS];
+};
+
+struct usbsim_periph_ usbsim_periph;
+
+static void USBhw_Init(const struct usbdevice_ *usbd)
+{
+	struct usbsim_periph_ *usb = (struct usbsim_periph_ *)usbd->usb;
+
+	memset(usb, 0, sizeof(struct usbsim_periph_));
+	usb->pullup = 1;
+	NVIC_EnableIRQ((IRQn_Type)usbd->cfg->irqn);
+}
+
+static void USBhw_DeInit(const struct usbdevice_ *usbd)
+{
+	struct usbsim_periph_ *usb = (struct usbsim_periph_ *)usbd->usb;
+
+	NVIC_DisableIRQ((IRQn_Type)usbd->cfg->irqn);
+	usb->pullup = 0;
+}
+
+static uint16_t USBhw_GetInEPSize(const struct usbdevice_ *usbd, uint8_t epn)
+{
+	struct usbsim_periph_ *usb = (struct usbsim_periph_ *)usbd->usb;
+
+	return usb->ep[epn & EPNUMMSK].txsize;
+}
+
+static uint16_t USBhw_GetFrameNum(const struct usbdevice_ *usbd)
+{
+	struct usbsim_periph_ *usb = (struct usbsim_periph_ *)usbd->usb;
+
+	return usb->frame;
+}
+
+static void USBhw_SetEPState(const struct usbdevice_ *usbd, uint8_t epaddr, enum usb_epstate_ state)
+{
+	struct usbsim_periph_ *usb = (struct usbsim_periph_ *)usbd->usb;
+	struct simep_ *ep = &usb->ep[epaddr & EPNUMMSK];
+
+	if (epaddr & EP_IS_IN)
+		ep->txstate = state;
+	else
+		ep->rxstate = state;
+}
+
+static void USBhw_SetEPStall(const struct usbdevice_ *usbd, uint8_t epaddr)
+{
+	USBhw_SetEPState(usbd, epaddr, USB_EPSTATE_STALL);
+	USBdev_CountStall(usbd, epaddr);
+}
+
+static void USBhw_ClrEPStall(const struct usbdevice_ *usbd, uint8_t epaddr)
+{
+	USBhw_SetEPState(usbd, epaddr, epaddr & EP_IS_IN ? USB_EPSTATE_NAK : USB_EPSTATE_VALID);
+}
+
+static bool USBhw_IsEPStalled(const struct usbdevice_ *usbd, uint8_t epaddr)
+{
+	struct usbsim_periph_ *usb = (struct usbsim_periph_ *)usbd->usb;
+	struct simep_ *ep = &usb->ep[epaddr & EPNUMMSK];
+
+	return (epaddr & EP_IS_IN ? ep->txstate : ep->rxstate) == USB_EPSTATE_STALL;
+}
+
+static void USBhw_EnableRx(const struct usbdevice_ *usbd, uint8_t epn)
+{
+	USBhw_SetEPState(usbd, epn & EPNUMMSK, USB_EPSTATE_VALID);
+}
+
+static void USBhw_EnableCtlSetup(const struct usbdevice_ *usbd)
+{
+}
+
+static void reset_in_endpoints(const struct usbdevice_ *usbd)
+{
+	USBdev_AbortTransfers(usbd);
+	memset(usbd->inep, 0, sizeof(struct epdata_) * usbd->cfg->numeppairs);
+}
+
+// reset request - setup EP0
+static void USBhw_Reset(const struct usbdevice_ *usbd)
+{
+	struct usbsim_periph_ *usb = (struct usbsim_periph_ *)usbd->usb;
+	uint8_t ep0size = usbd->cfg->devdesc->bMaxPacketSize0;
+
+	usb->addr = 0;
+	memset(usb->ep, 0, sizeof(usb->ep));
+	usb->ep[0] = (struct simep_){.rxstate = USB_EPSTATE_NAK, .txstate = USB_EPSTATE_NAK,
+		.rxsize = ep0size, .txsize = ep0size};
+	reset_in_endpoints(usbd);
+}
+
+// setup and enable app endpoints on set configuration request
+static void USBhw_SetCfg(const struct usbdevice_ *usbd)
+{
+	struct usbsim_periph_ *usb = (struct usbsim_periph_ *)usbd->usb;
+	const struct usbdcfg_ *cfg = usbd->cfg;
+
+	for (uint8_t i = 1; i < cfg->numeppairs; i++)
+	{
+		const struct USBdesc_ep_ *ind = USBdev_GetEPDescriptor(usbd, i | EP_IS_IN);
+		const struct USBdesc_ep_ *outd = USBdev_GetEPDescriptor(usbd, i);
+		struct simep_ *ep = &usb->ep[i];
+
+		*ep = (struct simep_){
+			.txsize = ind ? getusb16(&ind->wMaxPacketSize) : 0,
+			.rxsize = outd ? getusb16(&outd->wMaxPacketSize) : 0,
+			.txtype = ind ? ind->bmAttributes & 3 : 0,
+			.rxtype = outd ? outd->bmAttributes & 3 : 0,
+			.txstate = ind ? USB_EPSTATE_NAK : USB_EPSTATE_DISABLE,
+			.rxstate = outd ? (usbd->outep[i].ptr ? USB_EPSTATE_VALID : USB_EPSTATE_NAK) : USB_EPSTATE_DISABLE
+		};
+	}
+}
+
+// disable app endpoints on set configuration 0 request
+static void USBhw_ResetCfg(const struct usbdevice_ *usbd)
+{
+	struct usbsim_periph_ *usb = (struct usbsim_periph_ *)usbd->usb;
+
+	for (uint8_t i = 1; i < usbd->cfg->numeppairs; i++)
+	{
+		usb->ep[i].rxstate = USB_EPSTATE_NAK;
+		usb->ep[i].txstate = USB_EPSTATE_NAK;
+	}
+	reset_in_endpoints(usbd);
+}
+
+// write data packet to be sent to ep buffer
+static void USBhw_WriteTxData(const struct usbdevice_ *usbd, uint8_t epn)
+{
+	struct usbsim_periph_ *usb = (struct usbsim_periph_ *)usbd->usb;
+	struct simep_ *ep = &usb->ep[epn];
+	struct epdata_ *epd = &usbd->inep[epn];
+	uint16_t bcount = MIN(epd->count, ep->txsize);
+
+	ep->txcount = bcount;
+	USBdev_CountPacket(usbd, epn | EP_IS_IN, bcount);
+	if (bcount)
+	{
+		epd->count -= bcount;
+		USBdev_NextTxSegment(epd);
+		if (bcount <= epd->seglen)
+		{
+			// packet within current segment
+			memcpy(ep->txbuf, epd->ptr, bcount);
+			epd->ptr += bcount;
+			epd->seglen -= bcount;
+		}
+		else
+		{
+			// packet straddles segment boundary
+			for (uint16_t i = 0; i < bcount; i++)
+				ep->txbuf[i] = USBdev_TxByte(epd);
+		}
+	}
+}
+
+static void USBhw_StartTx(const struct usbdevice_ *usbd, uint8_t epn)
+{
+	epn &= EPNUMMSK;
+	USBhw_WriteTxData(usbd, epn);
+	if (epn == 0 && usbd->inep[0].ptr && usbd->inep[0].count == 0)
+	{
+		// last data packet sent over control ep - prepare for status out
+		usbd->devdata->ep0state = USBD_EP0_STATUS_OUT;
+		USBhw_SetEPState(usbd, 0, USB_EPSTATE_VALID);
+	}
+	USBhw_SetEPState(usbd, epn | EP_IS_IN, USB_EPSTATE_VALID);
+}
+
+// stop In transfer in progress - drop packet in buffer and pending completion;
+// valid endpoint set to NAK, stall kept
+static void USBhw_AbortTx(const struct usbdevice_ *usbd, uint8_t epn)
+{
+	struct usbsim_periph_ *usb = (struct usbsim_periph_ *)usbd->usb;
+	struct simep_ *ep = &usb->ep[epn & EPNUMMSK];
+
+	ep->ctr_tx = 0;
+	ep->txcount = 0;
+	if (ep->txstate == USB_EPSTATE_VALID)
+		ep->txstate = USB_EPSTATE_NAK;
+}
+
+// read received data packet, return true if the packet fills the buffer
+// multi-packet transfer: append to data received so far, discard data not fitting in buffer
+static bool USBhw_ReadRxData(const struct usbdevice_ *usbd, uint8_t epn)
+{
+	struct usbsim_periph_ *usb = (struct usbsim_periph_ *)usbd->usb;
+	struct simep_ *ep = &usb->ep[epn];
+	struct epdata_ *epd = &usbd->outep[epn];
+	uint8_t *dst = epd->ptr;
+	uint16_t bcount = ep->rxcount;
+
+	USBdev_CountPacket(usbd, epn, bcount);
+	if (epd->length)
+	{
+		uint16_t room = epd->length - epd->count;
+		dst += epd->count;
+		if (bcount > room)
+			bcount = room;
+		epd->count += bcount;
+	}
+	else
+		epd->count = bcount;
+	memcpy(dst, ep->rxbuf, bcount);
+	return ep->rxcount == ep->rxsize;
+}
+
+// Out packet read - continue multi-packet transfer or call the handler
+static void rx_done(const struct usbdevice_ *usbd, uint8_t epn, bool full, bool setup)
+{
+	const struct epdata_ *epd = &usbd->outep[epn];
+	if (full && epd->length > epd->count)
+		USBhw_EnableRx(usbd, epn);	// multi-packet transfer continues
+	else
+		USBdev_OutEPHandler(usbd, epn, setup);
+}
+
+static void USBhw_IRQHandler(const struct usbdevice_ *usbd)
+{
+	struct usbsim_periph_ *usb = (struct usbsim_periph_ *)usbd->usb;
+
+	if (usb->resume)
+	{
+		usb->resume = 0;
+		USBlog_event(ULE_RESUME, 0, 0, 0);
+		if (usbd->Resume_Handler)
+			usbd->Resume_Handler();
+	}
+	if (usb->reset)
+	{
+		usb->reset = 0;
+		USBhw_Reset(usbd);
+		USBlog_event(ULE_RESET, 0, 0, 0);
+		if (usbd->Reset_Handler)
+			usbd->Reset_Handler();
+		return;
+	}
+	for (uint8_t epn = 0; epn < usbd->cfg->numeppairs; epn++)
+	{
+		struct simep_ *ep = &usb->ep[epn];
+		if (ep->ctr_tx)	// data sent on In endpoint
+		{
+			ep->ctr_tx = 0;
+			struct epdata_ *epd = &usbd->inep[epn];
+
+			if (epd->count)	// Continue sending
+				USBhw_StartTx(usbd, epn);
+			else if (epd->sendzlp)	// send a ZLP
+			{
+				epd->sendzlp = 0;
+				USBhw_StartTx(usbd, epn);
+			}
+			else	// In transfer completed
+			{
+				if (epn == 0 && usbd->devdata->setaddress)
+					usb->addr = usbd->devdata->setaddress;
+				USBdev_InEPHandler(usbd, epn);
+			}
+		}
+		if (ep->ctr_rx)	// data received on Out endpoint
+		{
+			bool setup = ep->setup;
+			bool full = USBhw_ReadRxData(usbd, epn);
+			ep->ctr_rx = ep->setup = 0;
+			rx_done(usbd, epn, full, setup);
+		}
+	}
+	if (usb->suspend)
+	{
+		usb->suspend = 0;
+		reset_in_endpoints(usbd);
+		USBlog_event(ULE_SUSPEND, 0, 0, 0);
+		if (usbd->Suspend_Handler)
+			usbd->Suspend_Handler();
+		return;
+	}
+	if (usb->sof)
+	{
+		usb->sof = 0;
+		if (usbd->SOF_Handler)
+			usbd->SOF_Handler();
+	}
+}
+// =======================================================================
+const struct USBhw_services_ sim_services = {
+	.IRQHandler = USBhw_IRQHandler,
+
+	.Init = USBhw_Init,
+	.DeInit = USBhw_DeInit,
+	.GetInEPSize = USBhw_GetInEPSize,
+	.GetFrameNum = USBhw_GetFrameNum,
+
+	.SetCfg = USBhw_SetCfg,
+	.ResetCfg = USBhw_ResetCfg,
+
+	.SetEPStall = USBhw_SetEPStall,
+	.ClrEPStall = USBhw_ClrEPStall,
+	.IsEPStalled = USBhw_IsEPStalled,
+
+	.EnableCtlSetup = USBhw_EnableCtlSetup,
+	.EnableRx = USBhw_EnableRx,
+	.StartTx = USBhw_StartTx,
+	.AbortTx = USBhw_AbortTx,
+};
+
+//========================================================================
+// virtual host side - bus signalling and transactions
+// each call completes with the device interrupt processed, unless it is masked or disabled
+
+static void raise_irq(void)
+{
+	NVIC_SetPendingIRQ(SIM_USB_IRQn);
+}
+
+// transaction capture - records as in usb_log.h, timestamps in us
+#define CAPTURE_SLOT_US	50u	// approx. duration of 64-byte FS transaction
+#define CAPTURE_SLOTS	(1000u / CAPTURE_SLOT_US)
+
+static struct {
+	FILE *f;
+	uint32_t frames;	// no. of SOFs sent
+	uint8_t slot;	// transaction no. in current frame
+} capture;
+
+void usbsim_capture(FILE *f)
+{
+	capture.f = f;
+}
+
+static enum usbsim_hs_ capture_trans(uint8_t addr, uint8_t ep, uint8_t evt, const uint8_t *data, uint16_t length, enum usbsim_hs_ hs)
+{
+	if (capture.f)
+	{
+		const struct simep_ *sep = &usbsim_periph.ep[ep & EPNUMMSK];
+		struct usbcap_rec_ r = {
+			.ts = capture.frames * 1000u + capture.slot * CAPTURE_SLOT_US,
+			.frame = usbsim_periph.frame, .len = length, .caplen = length,
+			.ep = ep, .evt = evt, .xfer = ep & EP_IS_IN ? sep->txtype : sep->rxtype,
+			.addr = addr, .status = hs
+		};
+		static const uint8_t pad[3];
+		fwrite(&r, sizeof(r), 1, capture.f);
+		if (length)
+			fwrite(data, 1, length, capture.f);
+		fwrite(pad, 1, -length & 3u, capture.f);
+	}
+	if (capture.slot < CAPTURE_SLOTS - 1)
+		++capture.slot;
+	return hs;
+}
+
+bool usbsim_attached(void)
+{
+	return usbsim_periph.pullup;
+}
+
+void usbsim_bus_reset(void)
+{
+	usbsim_periph.reset = 1;
+	raise_irq();
+}
+
+void usbsim_sof(void)
+{
+	++capture.frames;
+	capture.slot = 0;
+	usbsim_periph.frame = (usbsim_periph.frame + 1) & 0x7ff;
+	usbsim_periph.sof = 1;
+	raise_irq();
+}
+
+void usbsim_suspend(void)
+{
+	usbsim_periph.suspend = 1;
+	raise_irq();
+}
+
+void usbsim_resume(void)
+{
+	usbsim_periph.resume = 1;
+	raise_irq();
+}
+
+static struct simep_ *addressed_ep(uint8_t addr, uint8_t epn)
+{
+	return usbsim_periph.pullup && addr == usbsim_periph.addr && epn < USB_NEPPAIRS
+		? &usbsim_periph.ep[epn] : 0;
+}
+
+// setup is accepted in any ep0 state, a pending data stage is cancelled
+static enum usbsim_hs_ setup_trans(uint8_t addr, const uint8_t *pkt)
+{
+	struct simep_ *ep = addressed_ep(addr, 0);
+
+	if (!ep || ep->rxsize == 0)
+		return USBSIM_NORESP;
+	memcpy(ep->rxbuf, pkt, 8);
+	ep->rxcount = 8;
+	ep->setup = ep->ctr_rx = 1;
+	ep->rxstate = ep->txstate = USB_EPSTATE_NAK;
+	raise_irq();
+	return USBSIM_ACK;
+}
+
+static enum usbsim_hs_ out_trans(uint8_t addr, uint8_t epn, const uint8_t *data, uint16_t length)
+{
+	struct simep_ *ep = addressed_ep(addr, epn);
+
+	if (!ep || ep->rxstate == USB_EPSTATE_DISABLE || length > ep->rxsize)
+		return USBSIM_NORESP;
+	if (ep->rxstate == USB_EPSTATE_STALL)
+		return USBSIM_STALL;
+	if (ep->rxstate == USB_EPSTATE_NAK || ep->ctr_rx)
+		return USBSIM_NAK;
+	if (length)
+		memcpy(ep->rxbuf, data, length);
+	ep->rxcount = length;
+	ep->ctr_rx = 1;
+	ep->rxstate = USB_EPSTATE_NAK;
+	raise_irq();
+	return USBSIM_ACK;
+}
+
+static enum usbsim_hs_ in_trans(uint8_t addr, uint8_t epn, uint8_t *data, uint16_t *length)
+{
+	struct simep_ *ep = addressed_ep(addr, epn);
+
+	*length = 0;
+	if (!ep || ep->txstate == USB_EPSTATE_DISABLE)
+		return USBSIM_NORESP;
+	if (ep->txstate == USB_EPSTATE_STALL)
+		return USBSIM_STALL;
+	if (ep->txstate == USB_EPSTATE_NAK || ep->ctr_tx)
+		return USBSIM_NAK;
+	memcpy(data, ep->txbuf, ep->txcount);
+	*length = ep->txcount;
+	ep->ctr_tx = 1;
+	ep->txstate = USB_EPSTATE_NAK;
+	raise_irq();
+	return USBSIM_ACK;
+}
+
+enum usbsim_hs_ usbsim_setup(uint8_t addr, const uint8_t *pkt)
+{
+	return capture_trans(addr, 0, UCE_SETUP, pkt, 8, setup_trans(addr, pkt));
+}
+
+enum usbsim_hs_ usbsim_out(uint8_t addr, uint8_t epn, const uint8_t *data, uint16_t length)
+{
+	return capture_trans(addr, epn, UCE_TRANSACTION, data, length, out_trans(addr, epn, data, length));
+}
+
+enum usbsim_hs_ usbsim_in(uint8_t addr, uint8_t epn, uint8_t *data, uint16_t *length)
+{
+	enum usbsim_hs_ hs = in_trans(addr, epn, data, length);
+	return capture_trans(addr, epn | EP_IS_IN, UCE_TRANSACTION, data, *length, hs);
+}
+
+#endif
@@ -1,83 +1,217 @@
-/* 
+/*
  * lightweight USB device stack by gbm
- * usb_log.c - request log for USB device debugging
+ * usb_log.c - binary event trace for USB device debugging
  * Copyright (c) 2022 gbm
- * 
- * This program is free software: you can redistribute it and/or modify  
- * it under the terms of the GNU General Public License as published by  
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
  * the Free Software Foundation, version 3.
  *
- * This program is distributed in the hope that it will be useful, but 
- * WITHOUT ANY WARRANTY; without even the implied warranty of 
- * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
  * General Public License for more details.
  *
- * You should have received a copy of the GNU General Public License 
+ * You should have received a copy of the GNU General Public License
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <string.h>
 #include "usb_std_def.h"
+#include "usb_desc_def.h"
 #include "usb_dev.h"
 #include "usb_hw_if.h"
 #include "usb_log.h"
 
 #ifdef USBLOG
 // Log ===================================================================
-#include <stdio.h>
-extern uint32_t usbdev_msec;	// defined in usb_app.c
+// head written by USB interrupt, tail and lost by drain
+static struct usblog_ {
+	struct usblog_entry_ ring[USBLOG_SIZE];
+	uint32_t head, tail;
+	uint32_t lost;	// no. of entries overwritten, not reported yet
+} usblog;
+
+// reserve next entry; the entry is published by commit()
+static inline struct usblog_entry_ *append(uint8_t evt, uint8_t ep, uint16_t len)
+{
+	struct usblog_entry_ *e = &usblog.ring[usblog.head & (USBLOG_SIZE - 1)];
+	e->ts = USBLOG_TIMESTAMP();
+	e->evt = evt;
+	e->ep = ep;
+	e->len = len;
+	return e;
+}
+
+static inline void commit(void)
+{
+	__atomic_store_n(&usblog.head, usblog.head + 1, __ATOMIC_RELEASE);
+}
+
+void USBlog_event(uint8_t evt, uint8_t ep, uint16_t len, uint32_t arg)
+{
+	struct usblog_entry_ *e = append(evt, ep, len);
+	e->arg[0] = arg;
+	e->arg[1] = 0;
+	commit();
+}
+
+void USBlog_setup(const USB_SetupPacket *req)
+{
+	struct usblog_entry_ *e = append(ULE_SETUP, 0, req->wLength);
+	e->req = *req;
+	commit();
+}
+
+// copy entries not drained yet to buf, oldest first; entries lost to overwriting are reported
+// as a single ULE_LOST entry; return no. of bytes stored - a multiple of entry size
+uint16_t USBlog_drain(uint8_t *buf, uint16_t size)
+{
+	uint16_t count = 0;
+	struct usblog_entry_ e;
+
+	for (;;)
+	{
+		uint32_t head = __atomic_load_n(&usblog.head, __ATOMIC_ACQUIRE);
+		if (head - usblog.tail > USBLOG_SIZE)
+		{
+			usblog.lost += head - USBLOG_SIZE - usblog.tail;
+			usblog.tail = head - USBLOG_SIZE;
+		}
+		if (usblog.tail == head || size - count < (int)sizeof(e) * (usblog.lost ? 2 : 1))
+			break;
+		e = usblog.ring[usblog.tail & (USBLOG_SIZE - 1)];
+		// writer may have overwritten the entry while it was copied
+		if (__atomic_load_n(&usblog.head, __ATOMIC_ACQUIRE) - usblog.tail > USBLOG_SIZE)
+			continue;
+		if (usblog.lost)
+		{
+			struct usblog_entry_ le = {.ts = e.ts, .evt = ULE_LOST, .arg = {usblog.lost}};
+			memcpy(buf + count, &le, sizeof(le));
+			count += sizeof(le);
+			usblog.lost = 0;
+		}
+		memcpy(buf + count, &e, sizeof(e));
+		count += sizeof(e);
+		++usblog.tail;
+	}
+	return count;
+}
+#endif
 
-#define USBLOGSIZE	50
+#ifdef USBCAP
+// Packet capture ========================================================
+// head and dropped written with interrupts disabled, tail by drain
+static struct usbcap_ {
+	uint8_t ring[USBCAP_SIZE];
+	uint32_t head, tail;
+	uint16_t dropped;	// no. of records dropped, not reported yet
+	uint8_t xfer[2][EPNUMMSK + 1];	// transfer type cache, bit 7 set if valid
+} usbcap;
 
-struct logentry_ {
-	uint16_t msec;
-	USB_SetupPacket pkt;
-	enum stp_rsp_ resp;
-	uint8_t resplen;
-};
+#define CAP_PAD(n)	(((n) + 3u) & ~3u)
 
-extern struct logentry_ usblog[USBLOGSIZE];
-extern uint16_t logidx;
+// copy to/from ring at offset, wrapping around
+static void cap_put(uint32_t pos, const void *src, uint16_t n)
+{
+	uint32_t off = pos & (USBCAP_SIZE - 1);
+	uint16_t n1 = MIN(n, USBCAP_SIZE - off);
+	memcpy(&usbcap.ring[off], src, n1);
+	memcpy(usbcap.ring, (const uint8_t *)src + n1, n - n1);
+}
 
-struct logentry_ usblog[USBLOGSIZE];
-uint16_t logidx;
+static void cap_get(uint32_t pos, void *dst, uint16_t n)
+{
+	uint32_t off = pos & (USBCAP_SIZE - 1);
+	uint16_t n1 = MIN(n, USBCAP_SIZE - off);
+	memcpy(dst, &usbcap.ring[off], n1);
+	memcpy((uint8_t *)dst + n1, usbcap.ring, n - n1);
+}
 
-void USBlog_storerq(USB_SetupPacket *pkt)
+// transfer type from endpoint descriptor, looked up once per endpoint
+static uint8_t cap_xfer(const struct usbdevice_ *usbd, uint8_t ep)
 {
-	if (logidx < USBLOGSIZE - 1)
-		++logidx;
-	usblog[logidx].msec = usbdev_msec;
-	usblog[logidx].pkt = *pkt;
+	uint8_t *t = &usbcap.xfer[ep >> 7][ep & EPNUMMSK];
+	if ((ep & EPNUMMSK) == 0)
+		return USBD_EP_TYPE_CTRL;
+	if (~*t & 0x80)
+	{
+		const struct USBdesc_ep_ *epd = USBdev_GetEPDescriptor(usbd, ep);
+		*t = 0x80 | (epd ? epd->bmAttributes & 3 : USBD_EP_TYPE_BULK);
+	}
+	return *t & 3;
 }
 
-void USBlog_storeresp(enum stp_rsp_ resp, uint8_t resplen)
+// append record with data segments, len - transfer length, data captured up to USBCAP_SNAPLEN
+void USBcap_datav(const struct usbdevice_ *usbd, uint8_t evt, uint8_t ep, const struct usbiov_ *iov, uint8_t iovcnt, uint16_t len)
 {
-	usblog[logidx].resp |= resp;
-	usblog[logidx].resplen = resplen;
+	uint32_t datalen = 0;
+	for (uint8_t i = 0; i < iovcnt; i++)
+		datalen += iov[i].data ? iov[i].length : 0;
+	uint16_t caplen = MIN(datalen, USBCAP_SNAPLEN);
+
+	struct usbcap_rec_ r = {.frame = usbd->hwif->GetFrameNum(usbd), .len = len, .caplen = caplen,
+		.ep = ep, .evt = evt, .xfer = cap_xfer(usbd, ep), .addr = USBCAP_ADDR_UNKNOWN};
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	r.ts = USBCAP_TIMESTAMP();
+	uint32_t head = usbcap.head;
+	uint32_t need = sizeof(r) * (usbcap.dropped ? 2 : 1) + CAP_PAD(caplen);
+	if (USBCAP_SIZE - (head - __atomic_load_n(&usbcap.tail, __ATOMIC_ACQUIRE)) < need)
+	{
+		if (usbcap.dropped < UINT16_MAX)
+			++usbcap.dropped;
+	}
+	else
+	{
+		if (usbcap.dropped)
+		{
+			struct usbcap_rec_ d = {.ts = r.ts, .frame = r.frame, .len = usbcap.dropped, .evt = UCE_DROP,
+				.addr = USBCAP_ADDR_UNKNOWN};
+			cap_put(head, &d, sizeof(d));
+			head += sizeof(d);
+			usbcap.dropped = 0;
+		}
+		cap_put(head, &r, sizeof(r));
+		head += sizeof(r);
+		for (uint8_t i = 0; i < iovcnt && caplen; i++)
+		{
+			if (iov[i].data == 0)
+				continue;
+			uint16_t n = MIN(iov[i].length, caplen);
+			cap_put(head, iov[i].data, n);
+			head += n;
+			caplen -= n;
+		}
+		__atomic_store_n(&usbcap.head, CAP_PAD(head), __ATOMIC_RELEASE);
+	}
+	__set_PRIMASK(primask);
 }
 
-uint16_t logrdidx;
-size_t USBlog_get(char *s)
+void USBcap_data(const struct usbdevice_ *usbd, uint8_t evt, uint8_t ep, const void *data, uint16_t len)
 {
-	size_t len = sprintf(s, "%5d: %02x %02x %04x %04x %04x, %02x %d\r\n",
-		usblog[logrdidx].msec,
-		*(uint8_t *)&usblog[logrdidx].pkt.bmRequestType,
-		usblog[logrdidx].pkt.bRequest,
-		usblog[logrdidx].pkt.wValue.w,
-		usblog[logrdidx].pkt.wIndex.w,
-		usblog[logrdidx].pkt.wLength,
-		usblog[logrdidx].resp,
-		usblog[logrdidx].resplen);
-	++logrdidx;
-	logrdidx %= USBLOGSIZE;
-	return len;
+	USBcap_datav(usbd, evt, ep, &(struct usbiov_){.data = data, .length = len}, 1, len);
 }
 
-void USBlog_recordevt(uint8_t ef)
+// copy complete records not drained yet to buf; return no. of bytes stored
+uint16_t USBcap_drain(uint8_t *buf, uint16_t size)
 {
-	usblog[logidx].resp += ef;
+	uint16_t count = 0;
+	uint32_t head = __atomic_load_n(&usbcap.head, __ATOMIC_ACQUIRE);
+	uint32_t tail = usbcap.tail;
+
+	while (tail != head)
+	{
+		struct usbcap_rec_ r;
+		cap_get(tail, &r, sizeof(r));
+		uint16_t n = sizeof(r) + CAP_PAD(r.caplen);
+		if (size - count < n)
+			break;
+		cap_get(tail, buf + count, n);
+		count += n;
+		tail += n;
+	}
+	__atomic_store_n(&usbcap.tail, tail, __ATOMIC_RELEASE);
+	return count;
 }
-#else
-#define USBlog_storerq(p)
-#define USBlog_storeresp(r,l)
-#define USBlog_recordevt(e)
 #endif